@@ -9,6 +9,7 @@
 #define FUSE_USE_VERSION 26
 #include <fuse/fuse_lowlevel.h>
 
+#include <climits>
 #include <iostream>
 #include <string>
 #include <unistd.h>
@@ -63,54 +64,66 @@ chfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
   }
 }
 
+/**
+ * The reply of a readdir, filled up to the size the kernel asks for.
+ * The entries sharing a cookie are replied together, since the listing
+ * resumes after the cookie of the last one.
+ */
 struct DirectoryBuf {
-  char *p;
-  size_t size;
-
-  DirectoryBuf() : p(nullptr), size(0) {}
-
-  auto add(fuse_req_t req, const char *name, fuse_ino_t ino) -> void {
-    // it will fail, anyway
-    auto sz = fuse_add_direntry(req, nullptr, 0, name, nullptr, size);
-    auto oldsize = size;
-    size += sz;
-    p = (char *)realloc(p, size);
-    memset(p + oldsize, 0, size - oldsize);
-
+  std::vector<char> buf;
+  size_t used;
+  // where the entries of the last cookie start
+  size_t group_begin;
+  u64 last_cookie;
+
+  explicit DirectoryBuf(size_t size)
+      : buf(size), used(0), group_begin(0), last_cookie(0) {}
+
+  // @return false if the buffer is full
+  auto add(fuse_req_t req, const char *name, fuse_ino_t ino, u64 cookie)
+      -> bool {
     struct stat stbuf = {};
     stbuf.st_ino = ino;
 
-    fuse_add_direntry(req, p + oldsize, size - oldsize, name, &stbuf, size);
+    auto sz = fuse_add_direntry(req, buf.data() + used, buf.size() - used,
+                                name, &stbuf, cookie);
+    if (sz > buf.size() - used) {
+      // drop the entries of the same cookie, unless they're all we have
+      if (cookie == last_cookie && group_begin > 0)
+        used = group_begin;
+      return false;
+    }
+    if (cookie != last_cookie) {
+      group_begin = used;
+      last_cookie = cookie;
+    }
+    used += sz;
+    return true;
   }
 
-  auto reply_buf_limited(fuse_req_t req, off_t off, size_t maxsize) -> int {
-    if ((size_t)off < this->size)
-      return fuse_reply_buf(req, this->p + off,
-                            std::min(this->size - off, maxsize));
-    else
-      return fuse_reply_buf(req, nullptr, 0);
+  auto reply(fuse_req_t req) -> int {
+    return fuse_reply_buf(req, buf.data(), used);
   }
-
-  ~DirectoryBuf() { free(p); }
 };
 
 void chfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                   struct fuse_file_info *fi) {
   ChfsClient *fs = reinterpret_cast<ChfsClient *>(fuse_req_userdata(req));
 
-  auto readdir_res = fs->readdir(ino);
+  // `off` is the cookie of the last entry listed, or 0 at first.
+  // An entry takes at least 32 bytes of the reply.
+  auto readdir_res = fs->readdir(ino, off, size / 32 + 1);
   if (readdir_res.is_err()) {
     fuse_reply_err(req, ENOTDIR);
     return;
   }
 
-  auto list = readdir_res.unwrap();
-
-  DirectoryBuf buf;
-  for (auto &[name, id] : list) {
-    buf.add(req, name.c_str(), id);
+  DirectoryBuf buf(size);
+  for (auto &[name, id, cookie] : readdir_res.unwrap()) {
+    if (!buf.add(req, name.c_str(), id, cookie))
+      break;
   }
-  buf.reply_buf_limited(req, off, size);
+  buf.reply(req);
 }
 
 void chfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
@@ -322,7 +335,28 @@ void chfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
 // both path and newpath are fs-relative
 void chfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
                  fuse_ino_t newparent, const char *newname) {
-  UNIMPLEMENTED();
+  ChfsClient *fs = reinterpret_cast<ChfsClient *>(fuse_req_userdata(req));
+
+  auto res =
+      fs->rename(parent, std::string(name), newparent, std::string(newname));
+  if (res.is_err()) {
+    switch (res.unwrap_error()) {
+    case ErrorType::NotExist:
+      fuse_reply_err(req, ENOENT);
+      break;
+    case ErrorType::NotEmpty:
+      fuse_reply_err(req, ENOTEMPTY);
+      break;
+    case ErrorType::INVALID_ARG:
+      fuse_reply_err(req, EINVAL);
+      break;
+    default:
+      fuse_reply_err(req, ENOSYS);
+    }
+    return;
+  } else {
+    fuse_reply_err(req, 0);
+  }
 }
 
 /** Create a hard link to a file */
@@ -371,7 +405,29 @@ void chfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
  * Replaced 'struct statfs' parameter with 'struct statvfs' in
  * version 2.5
  */
-void chfs_statfs(fuse_req_t req, fuse_ino_t ino) { UNIMPLEMENTED(); }
+void chfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+  ChfsClient *fs = reinterpret_cast<ChfsClient *>(fuse_req_userdata(req));
+
+  auto res = fs->statfs();
+  if (res.is_err()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  auto [block_size, total_blocks, free_blocks, total_inodes, free_inodes] =
+      res.unwrap();
+
+  struct statvfs st = {};
+  st.f_bsize = block_size;
+  st.f_frsize = block_size;
+  st.f_blocks = total_blocks;
+  st.f_bfree = free_blocks;
+  st.f_bavail = free_blocks;
+  st.f_files = total_inodes;
+  st.f_ffree = free_inodes;
+  st.f_favail = free_inodes;
+  st.f_namemax = NAME_MAX;
+  fuse_reply_statfs(req, &st);
+}
 
 /** Possibly flush cached data
  *
@@ -9,12 +9,17 @@
 #define FUSE_USE_VERSION 26
 #include <fuse/fuse_lowlevel.h>
 
+#include <climits>
+#include <fcntl.h>
 #include <iostream>
 #include <string>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
 #include "./consts.h"
 #include "filesystem/directory_op.h"
+#include "filesystem/readahead.h"
+#include "filesystem/write_buffer.h"
 
 #include "argparse/argparse.hpp"
 
@@ -25,6 +30,9 @@ namespace chfs {
 
 Logger logger("chfs.log"); // Definition of the global logger instance
 
+// The writes are buffered per file and flushed on fsync, flush and release
+WriteBuffer *write_buffer = nullptr;
+
 auto getattr_helper(InodeType type, const FileAttr &attr) -> struct stat {
   struct stat st;
   st.st_nlink = 1;
@@ -61,41 +69,54 @@ chfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
   } else {
     auto type_attr = attr.unwrap();
     auto attr = std::get<1>(type_attr);
+    // the file may be longer with the buffered writes
+    attr.size = std::max(attr.size, write_buffer->buffered_end(ino));
     auto st = getattr_helper(std::get<0>(type_attr), attr);
 
     fuse_reply_attr(req, &st, 0);
   }
 }
 
+/**
+ * The reply of a readdir, filled up to the size the kernel asks for.
+ * The entries sharing a cookie are replied together, since the listing
+ * resumes after the cookie of the last one.
+ */
 struct DirectoryBuf {
-  char *p;
-  size_t size;
-
-  DirectoryBuf() : p(nullptr), size(0) {}
-
-  auto add(fuse_req_t req, const char *name, fuse_ino_t ino) -> void {
-    // it will fail, anyway
-    auto sz = fuse_add_direntry(req, nullptr, 0, name, nullptr, size);
-    auto oldsize = size;
-    size += sz;
-    p = (char *)realloc(p, size);
-    memset(p + oldsize, 0, size - oldsize);
-
+  std::vector<char> buf;
+  size_t used;
+  // where the entries of the last cookie start
+  size_t group_begin;
+  u64 last_cookie;
+
+  explicit DirectoryBuf(size_t size)
+      : buf(size), used(0), group_begin(0), last_cookie(0) {}
+
+  // @return false if the buffer is full
+  auto add(fuse_req_t req, const char *name, fuse_ino_t ino, u64 cookie)
+      -> bool {
     struct stat stbuf = {};
     stbuf.st_ino = ino;
 
-    fuse_add_direntry(req, p + oldsize, size - oldsize, name, &stbuf, size);
+    auto sz = fuse_add_direntry(req, buf.data() + used, buf.size() - used,
+                                name, &stbuf, cookie);
+    if (sz > buf.size() - used) {
+      // drop the entries of the same cookie, unless they're all we have
+      if (cookie == last_cookie && group_begin > 0)
+        used = group_begin;
+      return false;
+    }
+    if (cookie != last_cookie) {
+      group_begin = used;
+      last_cookie = cookie;
+    }
+    used += sz;
+    return true;
   }
 
-  auto reply_buf_limited(fuse_req_t req, off_t off, size_t maxsize) -> int {
-    if ((size_t)off < this->size)
-      return fuse_reply_buf(req, this->p + off,
-                            std::min(this->size - off, maxsize));
-    else
-      return fuse_reply_buf(req, nullptr, 0);
+  auto reply(fuse_req_t req) -> int {
+    return fuse_reply_buf(req, buf.data(), used);
   }
-
-  ~DirectoryBuf() { free(p); }
 };
 
 void chfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
@@ -108,20 +129,21 @@ void chfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
     return;
   }
 
-  std::list<DirectoryEntry> list;
-  {
-    auto res = read_directory(fs, ino, list);
-    if (res.is_err()) {
-      fuse_reply_err(req, -1);
-      return;
-    }
+  // `off` is the cookie of the last entry listed, or 0 at first.
+  // An entry takes at least 32 bytes of the reply.
+  auto res = fs->readdir(ino, off, size / 32 + 1);
+  if (res.is_err()) {
+    fuse_reply_err(req, -1);
+    return;
   }
 
-  DirectoryBuf buf;
-  for (auto &entry : list) {
-    buf.add(req, entry.name.c_str(), entry.id);
+  DirectoryBuf buf(size);
+  for (auto &entry : res.unwrap()) {
+    if (!buf.add(req, entry.name.c_str(), entry.id, entry.cookie)) {
+      break;
+    }
   }
-  buf.reply_buf_limited(req, off, size);
+  buf.reply(req);
 }
 
 void chfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
@@ -129,6 +151,12 @@ void chfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
 
+  // read the buffered writes back
+  if (write_buffer->flush(ino).is_err()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
   auto attr_res = fs->get_type_attr(ino);
   if (attr_res.is_err()) {
     fuse_reply_err(req, -1);
@@ -154,15 +182,34 @@ void chfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
   // {Your code here}
   // UNIMPLEMENTED();
 
-  auto res = fs->read_file_w_off(ino, read_size, off);
+  // prefetch the blocks after a sequential read
+  if (fi != nullptr && fi->fh != 0) {
+    auto ra = reinterpret_cast<Readahead *>(fi->fh);
+    auto [first, cnt] = ra->on_read(off, read_size, st.st_size);
+    if (cnt != 0) {
+      fs->prefetch(ino, first, cnt);
+    }
+  }
+
+  // reply with the memory of the block manager, without copying it
+  std::vector<ReadSegment> segments;
+  auto res = fs->read_file_segments(ino, read_size, off, segments);
   if (res.is_err()) {
     fuse_reply_err(req, -1);
     return;
   }
 
-  auto res_data = res.unwrap();
-  fuse_reply_buf(req, reinterpret_cast<const char *>(res_data.data()),
-                 read_size);
+  std::vector<u8> bufv_mem(sizeof(fuse_bufvec) +
+                           segments.size() * sizeof(fuse_buf));
+  auto bufv = reinterpret_cast<fuse_bufvec *>(bufv_mem.data());
+  *bufv = FUSE_BUFVEC_INIT(0);
+  bufv->count = segments.size();
+  for (usize i = 0; i < segments.size(); ++i) {
+    bufv->buf[i] = bufv->buf[0];
+    bufv->buf[i].mem = const_cast<u8 *>(segments[i].data);
+    bufv->buf[i].size = segments[i].len;
+  }
+  fuse_reply_data(req, bufv, FUSE_BUF_NO_SPLICE);
 }
 
 /** Read the target of a symbolic link
@@ -272,6 +319,11 @@ void chfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 /** Remove a file */
 void chfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+  auto lookup_res = fs->lookup(parent, name);
+  if (lookup_res.is_ok()) {
+    write_buffer->discard(lookup_res.unwrap());
+  }
+
   auto res = fs->unlink(parent, name);
   if (res.is_err()) {
     switch (res.unwrap_error()) {
@@ -323,6 +375,10 @@ void chfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
 
   // FIXME: currently we only deal with the resize case in the `setattr`
+  if (write_buffer->flush(ino).is_err()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
   auto res = fs->resize(ino, attr->st_size);
 
   if (res.is_err()) {
@@ -346,7 +402,34 @@ void chfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
 // both path and newpath are fs-relative
 void chfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
                  fuse_ino_t newparent, const char *newname) {
-  UNIMPLEMENTED();
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+  auto src_res = fs->lookup(parent, name);
+  auto target_res = fs->lookup(newparent, newname);
+
+  auto res = fs->rename(parent, name, newparent, newname);
+  if (res.is_err()) {
+    switch (res.unwrap_error()) {
+    case ErrorType::NotExist:
+      fuse_reply_err(req, ENOENT);
+      break;
+    case ErrorType::NotEmpty:
+      fuse_reply_err(req, ENOTEMPTY);
+      break;
+    case ErrorType::INVALID_ARG:
+      fuse_reply_err(req, EINVAL);
+      break;
+    default:
+      fuse_reply_err(req, ENOSYS);
+    }
+    return;
+  }
+
+  // the buffered writes of the replaced file are dropped with it
+  if (src_res.is_ok() && target_res.is_ok() &&
+      src_res.unwrap() != target_res.unwrap()) {
+    write_buffer->discard(target_res.unwrap());
+  }
+  fuse_reply_err(req, 0);
 }
 
 /** Create a hard link to a file */
@@ -366,7 +449,9 @@ void chfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
  * Changed in version 2.2
  */
 void chfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-  // we adopt a simplified implementation
+  // we adopt a simplified implementation,
+  // the file handle only tracks the access pattern for readahead
+  fi->fh = reinterpret_cast<uint64_t>(new Readahead(KBlockSize));
   fuse_reply_open(req, fi);
 }
 
@@ -379,20 +464,20 @@ void chfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
   //          << " and off: {" << off << "}.";
 
   FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
-  auto res = fs->write_file_w_off(ino, buf, size, off);
+  auto res = write_buffer->write(ino, reinterpret_cast<const u8 *>(buf), size,
+                                 off);
   if (res.is_err()) {
     auto error_code = res.unwrap_error();
     switch (error_code) {
     case ErrorType::OUT_OF_RESOURCE:
       std::cerr << "OUT_OF_RESOURCE, free blocks left: "
                 << fs->get_free_blocks_num().unwrap() << std::endl;
+      fuse_reply_err(req, ENOSPC);
       break;
     default:
-      UNIMPLEMENTED();
+      fuse_reply_err(req, EIO);
       break;
     }
-
-    fuse_reply_err(req, ENOSYS);
   } else {
     size_t bytes_written = static_cast<size_t>(res.unwrap());
     fuse_reply_write(req, static_cast<size_t>(bytes_written));
@@ -406,7 +491,29 @@ void chfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
  * Replaced 'struct statfs' parameter with 'struct statvfs' in
  * version 2.5
  */
-void chfs_statfs(fuse_req_t req, fuse_ino_t ino) { UNIMPLEMENTED(); }
+void chfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+
+  // the counters are maintained on allocation and free, no bitmap scan here
+  auto free_blocks = fs->get_free_blocks_num();
+  auto free_inodes = fs->get_free_inode_num();
+  if (free_blocks.is_err() || free_inodes.is_err()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  struct statvfs st = {};
+  st.f_bsize = KBlockSize;
+  st.f_frsize = KBlockSize;
+  st.f_blocks = fs->get_total_blocks_num();
+  st.f_bfree = free_blocks.unwrap();
+  st.f_bavail = free_blocks.unwrap();
+  st.f_files = fs->get_total_inode_num();
+  st.f_ffree = free_inodes.unwrap();
+  st.f_favail = free_inodes.unwrap();
+  st.f_namemax = NAME_MAX;
+  fuse_reply_statfs(req, &st);
+}
 
 /** Possibly flush cached data
  *
@@ -431,9 +538,10 @@ void chfs_statfs(fuse_req_t req, fuse_ino_t ino) { UNIMPLEMENTED(); }
  *
  * Changed in version 2.2
  */
-// this is a no-op in BBFS.  It just logs the call and returns success
 void chfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-  UNIMPLEMENTED();
+  // write the buffered content back, so close() reports the errors
+  auto res = write_buffer->flush(ino);
+  fuse_reply_err(req, res.is_err() ? EIO : 0);
 }
 
 /** Release an open file
@@ -451,7 +559,26 @@ void chfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
  * Changed in version 2.2
  */
 void chfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-  UNIMPLEMENTED();
+  write_buffer->flush(ino);
+
+  // report the readahead hit rate of the file and all files so far
+  static ReadaheadStats total;
+  if (fi->fh != 0) {
+    auto ra = reinterpret_cast<Readahead *>(fi->fh);
+    const auto &stats = ra->get_stats();
+    total.reads += stats.reads;
+    total.hits += stats.hits;
+    total.prefetched_blocks += stats.prefetched_blocks;
+    if (stats.reads != 0) {
+      logger << "readahead: ino " + std::to_string(ino) + " reads " +
+                    std::to_string(stats.reads) + " hit rate " +
+                    std::to_string(stats.hit_rate()) + ", total hit rate " +
+                    std::to_string(total.hit_rate());
+    }
+    delete ra;
+    fi->fh = 0;
+  }
+  fuse_reply_err(req, 0);
 }
 
 /** Synchronize file contents
@@ -463,7 +590,22 @@ void chfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
  */
 void chfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
                 struct fuse_file_info *fi) {
-  UNIMPLEMENTED();
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+
+  if (write_buffer->flush(ino).is_err()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  // the data is written through now, only the deferred timestamps are left
+  if (!datasync) {
+    auto res = fs->sync_inode(ino);
+    if (res.is_err()) {
+      fuse_reply_err(req, EIO);
+      return;
+    }
+  }
+  fuse_reply_err(req, 0);
 }
 
 /** Open directory
@@ -498,6 +640,98 @@ void chfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
   UNIMPLEMENTED();
 }
 
+/**
+ * Allocate requested space. If this function returns success then
+ * subsequent writes to the specified range shall not fail due to the lack
+ * of free space on the file system storage media.
+ *
+ * Introduced in version 2.9
+ */
+void chfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                    off_t length, struct fuse_file_info *fi) {
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+
+  // punching holes and the like are not supported
+  if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0) {
+    fuse_reply_err(req, EOPNOTSUPP);
+    return;
+  }
+  if (offset < 0 || length <= 0) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+
+  // the buffered writes land in the preallocated blocks when they're flushed
+  auto res = fs->preallocate(ino, offset, length,
+                             (mode & FALLOC_FL_KEEP_SIZE) != 0);
+  if (res.is_err()) {
+    switch (res.unwrap_error()) {
+    case ErrorType::INVALID_ARG:
+      fuse_reply_err(req, EINVAL);
+      break;
+    case ErrorType::OUT_OF_RESOURCE:
+      fuse_reply_err(req, ENOSPC);
+      break;
+    default:
+      fuse_reply_err(req, EIO);
+      break;
+    }
+    return;
+  }
+  fuse_reply_err(req, 0);
+}
+
+/**
+ * Make the file a copy-on-write clone of another file, whose inode number
+ * is the argument. The kernel doesn't pass FICLONE to FUSE, so it's our own
+ * command, e.g.,
+ *
+ *   uint64_t src = st.st_ino;
+ *   ioctl(dst_fd, CHFS_IOC_CLONE, &src);
+ */
+#define CHFS_IOC_CLONE _IOW('C', 1, uint64_t)
+
+void chfs_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                struct fuse_file_info *fi, unsigned flags, const void *in_buf,
+                size_t in_bufsz, size_t out_bufsz) {
+  FileOperation *fs = reinterpret_cast<FileOperation *>(fuse_req_userdata(req));
+
+  if (static_cast<unsigned>(cmd) != CHFS_IOC_CLONE) {
+    fuse_reply_err(req, ENOTTY);
+    return;
+  }
+  if (in_bufsz < sizeof(uint64_t)) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  auto src = *reinterpret_cast<const uint64_t *>(in_buf);
+
+  // the clone sees the buffered writes of the source, and overrides
+  // those of the destination
+  if (write_buffer->flush(src).is_err()) {
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  write_buffer->discard(ino);
+
+  auto res = fs->clone_file(src, ino);
+  if (res.is_err()) {
+    switch (res.unwrap_error()) {
+    case ErrorType::INVALID_ARG:
+      fuse_reply_err(req, EINVAL);
+      break;
+    case ErrorType::OUT_OF_RESOURCE:
+      fuse_reply_err(req, ENOSPC);
+      break;
+    default:
+      fuse_reply_err(req, EIO);
+      break;
+    }
+    return;
+  }
+  fuse_reply_ioctl(req, 0, nullptr, 0);
+}
+
 static struct fuse_lowlevel_ops fuseserver_oper;
 
 void usage() {
@@ -551,7 +785,9 @@ auto bootstrap_fuse(int argc, char **argv) -> int {
   // 2. prepare the filesystem handler
   auto bm = std::shared_ptr<BlockManager>(
       new BlockManager(kDiskSize / KBlockSize, KBlockSize));
-  auto fs = new FileOperation(bm, KMaxInodeNum);
+  auto fs = new FileOperation(bm, KMaxInodeNum, KInodeExtentFlag);
+  // timestamp-only updates are written back on fsync or unmount
+  fs->set_lazytime(true).unwrap();
   {
     // pre-initialize
     auto res = fs->alloc_inode(InodeType::Directory);
@@ -561,6 +797,7 @@ auto bootstrap_fuse(int argc, char **argv) -> int {
     }
     CHFS_ASSERT(res.unwrap() == 1, "The allocated inode number is incorrect ");
   }
+  write_buffer = new WriteBuffer(fs);
 
   auto se =
       fuse_lowlevel_new(&args, &fuseserver_oper, sizeof(fuseserver_oper), fs);
@@ -575,6 +812,8 @@ auto bootstrap_fuse(int argc, char **argv) -> int {
   fuse_session_destroy(se);
   fuse_unmount(argv[1], ch);
 
+  write_buffer->flush_all();
+  delete write_buffer;
   delete fs;
   return err;
 }
@@ -590,43 +829,35 @@ void chfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
   e.entry_timeout = 0.0;
   e.generation = 0;
 
-  // lookup
-  std::list<DirectoryEntry> list;
-
-  {
-    auto res = read_directory(fs, parent, list);
-    if (res.is_err()) {
+  // lookup, only the blocks on the hash path of the name are read
+  auto lookup_res = fs->lookup(parent, name);
+  if (lookup_res.is_err()) {
+    if (lookup_res.unwrap_error() == ErrorType::NotExist) {
+      fuse_reply_err(req, ENOENT);
+    } else {
       // FIXME: the error type is incorrect
       fuse_reply_err(req, -1);
-      return;
     }
+    return;
   }
 
-  // search the list of the given name
-  for (const auto &entry : list) {
-    if (entry.name == name) {
-      // found
-      e.ino = entry.id;
-      // get attr
-      {
-        auto attr_res = fs->get_type_attr(e.ino);
-        if (attr_res.is_err()) {
-          fuse_reply_err(req, -1);
-          return;
-        }
-
-        auto type_attr = attr_res.unwrap();
-        auto attr = std::get<1>(type_attr);
-        auto st = getattr_helper(std::get<0>(type_attr), attr);
-        memcpy(&e.attr, &st, sizeof(struct stat));
-      }
-
-      fuse_reply_entry(req, &e);
+  // found
+  e.ino = lookup_res.unwrap();
+  // get attr
+  {
+    auto attr_res = fs->get_type_attr(e.ino);
+    if (attr_res.is_err()) {
+      fuse_reply_err(req, -1);
       return;
     }
+
+    auto type_attr = attr_res.unwrap();
+    auto attr = std::get<1>(type_attr);
+    auto st = getattr_helper(std::get<0>(type_attr), attr);
+    memcpy(&e.attr, &st, sizeof(struct stat));
   }
 
-  fuse_reply_err(req, ENOENT);
+  fuse_reply_entry(req, &e);
 }
 
 } // namespace chfs
@@ -656,9 +887,11 @@ auto main(int argc, char **argv) -> int {
   fuseserver_oper.write = chfs_write;
   fuseserver_oper.setattr = chfs_setattr;
   fuseserver_oper.statfs = chfs_statfs;
-  // fuseserver_oper.flush = chfs_flush;
-  // fuseserver_oper.release = chfs_release;
-  // fuseserver_oper.fsync = chfs_fsync;
+  fuseserver_oper.flush = chfs_flush;
+  fuseserver_oper.release = chfs_release;
+  fuseserver_oper.fsync = chfs_fsync;
+  fuseserver_oper.ioctl = chfs_ioctl;
+  fuseserver_oper.fallocate = chfs_fallocate;
   // fuseserver_oper.opendir = chfs_opendir;
   // fuseserver_oper.releasedir = chfs_releasedir;
   // fuseserver_oper.fsyncdir = chfs_fsyncdir;
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "block/allocator.h"
 #include "common/bitmap.h"
 
@@ -8,8 +10,10 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager)
 
 // Your implementation
 BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
-                               usize bitmap_block_id, bool will_initialize)
-    : bm(std::move(block_manager)), bitmap_block_id(bitmap_block_id) {
+                               usize bitmap_block_id, bool will_initialize,
+                               std::shared_ptr<GroupInitFlags> init_flags)
+    : bm(std::move(block_manager)), bitmap_block_id(bitmap_block_id),
+      init_flags(std::move(init_flags)) {
   // calculate the total blocks required
   const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
   auto total_bitmap_block = this->bm->total_blocks() / total_bits_per_block;
@@ -22,6 +26,7 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
               "not available blocks to store the bitmap");
 
   this->bitmap_block_cnt = total_bitmap_block;
+  this->groups = std::make_shared<AllocGroups>(this->bitmap_block_cnt);
   if (this->bitmap_block_cnt * total_bits_per_block ==
       this->bm->total_blocks()) {
     this->last_block_num = total_bits_per_block;
@@ -32,12 +37,24 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
               "last block num should be less than total bits per block");
 
   if (!will_initialize) {
+    if (this->init_flags) {
+      this->init_flags->load().unwrap();
+    }
     return;
   }
 
-  // zeroing
-  for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
-    this->bm->zero_block(i + this->bitmap_block_id);
+  // The bitmap blocks covering the reserved blocks are written below.
+  // Zero the others now, or mark them uninitialized for lazy init.
+  auto reserved_groups =
+      (this->bitmap_block_cnt + this->bitmap_block_id - 1) /
+          total_bits_per_block +
+      1;
+  if (this->init_flags) {
+    this->init_flags->format(this->bitmap_block_cnt).unwrap();
+  } else {
+    for (block_id_t i = reserved_groups; i < this->bitmap_block_cnt; i++) {
+      this->bm->zero_block(i + this->bitmap_block_id);
+    }
   }
 
   block_id_t cur_block_id = this->bitmap_block_id;
@@ -64,14 +81,41 @@ BlockAllocator::BlockAllocator(std::shared_ptr<BlockManager> block_manager,
   }
 
   bm->write_block(cur_block_id, buffer.data());
+
+  if (this->init_flags) {
+    for (block_id_t i = 0; i < reserved_groups; i++) {
+      this->init_flags->set_initialized(i).unwrap();
+    }
+  }
+
+  // all blocks except the reserved ones and the bitmap are free
+  this->groups->set_free_cnt(this->bm->total_blocks() -
+                             this->bitmap_block_id - this->bitmap_block_cnt);
 }
 
 // Fixme: currently we don't consider errors in this implementation
 auto BlockAllocator::free_block_cnt() const -> usize {
+  if (auto cnt = this->groups->get_free_cnt(); cnt) {
+    return cnt.value();
+  }
+
+  // No one can allocate or deallocate while we are counting
+  auto locks = this->groups->lock_all();
+  if (auto cnt = this->groups->get_free_cnt(); cnt) {
+    return cnt.value();
+  }
+
   usize total_free_blocks = 0;
   std::vector<u8> buffer(bm->block_size());
 
   for (block_id_t i = 0; i < this->bitmap_block_cnt; i++) {
+    if (!this->is_group_initialized(i)) {
+      // all free
+      total_free_blocks += i == this->bitmap_block_cnt - 1
+                               ? this->last_block_num
+                               : bm->block_size() * KBitsPerByte;
+      continue;
+    }
     bm->read_block(i + this->bitmap_block_id, buffer.data()).unwrap();
 
     usize n_free_blocks = 0;
@@ -87,51 +131,192 @@ auto BlockAllocator::free_block_cnt() const -> usize {
     //           << std::endl;
     total_free_blocks += n_free_blocks;
   }
+  this->groups->set_free_cnt(total_free_blocks);
   return total_free_blocks;
 }
 
-auto BlockAllocator::allocate() -> ChfsResult<block_id_t> {
+auto BlockAllocator::allocate_in_group(usize i)
+    -> ChfsResult<std::optional<block_id_t>> {
   std::vector<u8> buffer(bm->block_size());
 
-  for (uint i = 0; i < this->bitmap_block_cnt; i++) {
-    bm->read_block(i + this->bitmap_block_id, buffer.data());
+  // The index of the allocated bit inside current bitmap block.
+  std::optional<block_id_t> res = std::nullopt;
+  auto bitmap = Bitmap(buffer.data(), bm->block_size());
 
-    // The index of the allocated bit inside current bitmap block.
-    std::optional<block_id_t> res = std::nullopt;
-    auto bitmap = Bitmap(buffer.data(), bm->block_size());
+  // An uninitialized bitmap block is all free,
+  // it will be initialized when we write it back.
+  if (this->is_group_initialized(i)) {
+    auto read_res = bm->read_block(i + this->bitmap_block_id, buffer.data());
+    if (read_res.is_err()) {
+      return ChfsResult<std::optional<block_id_t>>(read_res.unwrap_error());
+    }
+  } else {
+    bitmap.zeroed();
+  }
 
-    if (i == this->bitmap_block_cnt - 1) {
-      // If current block is the last block of the bitmap.
+  if (i == this->bitmap_block_cnt - 1) {
+    // If current block is the last block of the bitmap.
 
-      // Find the first free bit of current bitmap block
-      // and store it in `res`.
-      res = bitmap.find_first_free_w_bound(this->last_block_num);
-    } else {
+    // Find the first free bit of current bitmap block
+    // and store it in `res`.
+    res = bitmap.find_first_free_w_bound(this->last_block_num);
+  } else {
 
-      // Find the first free bit of current bitmap block
-      // and store it in `res`.
-      res = bitmap.find_first_free();
-    }
+    // Find the first free bit of current bitmap block
+    // and store it in `res`.
+    res = bitmap.find_first_free();
+  }
 
-    // If we find one free bit inside current bitmap block.
-    if (res) {
-      // The block id of the allocated block.
-      block_id_t retval = static_cast<block_id_t>(0);
+  if (!res) {
+    return ChfsResult<std::optional<block_id_t>>(std::nullopt);
+  }
 
-      // Set the free bit we found to 1 in the bitmap.
-      bitmap.set(res.value());
+  // Set the free bit we found to 1 in the bitmap.
+  bitmap.set(res.value());
 
-      // Flush the changed bitmap block back to the block manager.
-      bm->write_block(i + this->bitmap_block_id, buffer.data());
+  // Flush the changed bitmap block back to the block manager.
+  auto write_res = bm->write_block(i + this->bitmap_block_id, buffer.data());
+  if (write_res.is_err()) {
+    return ChfsResult<std::optional<block_id_t>>(write_res.unwrap_error());
+  }
+  if (!this->is_group_initialized(i)) {
+    auto flag_res = this->init_flags->set_initialized(i);
+    if (flag_res.is_err()) {
+      return ChfsResult<std::optional<block_id_t>>(flag_res.unwrap_error());
+    }
+  }
+  this->groups->add_free_cnt(-1);
+
+  // The block id of the allocated block.
+  return ChfsResult<std::optional<block_id_t>>(
+      i * bm->block_size() * KBitsPerByte + res.value());
+}
 
-      // Calculate the value of `retval`.
-      retval = i * bm->block_size() * KBitsPerByte + res.value();
-      return ChfsResult<block_id_t>(retval);
+auto BlockAllocator::allocate() -> ChfsResult<block_id_t> {
+  const auto ngroups = this->groups->size();
+  const auto start = this->groups->get_hint();
+
+  // First skip the groups locked by others, so concurrent allocators spread
+  // across the groups. Then wait for the skipped ones.
+  bool skipped = false;
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1 && !skipped) {
+      break;
+    }
+    for (usize k = 0; k < ngroups; ++k) {
+      auto i = (start + k) % ngroups;
+      auto lock = pass == 0 ? this->groups->try_lock(i) : this->groups->lock(i);
+      if (!lock.owns_lock()) {
+        skipped = true;
+        continue;
+      }
+
+      auto res = this->allocate_in_group(i);
+      if (res.is_err()) {
+        return ChfsResult<block_id_t>(res.unwrap_error());
+      }
+      auto bid = res.unwrap();
+      if (bid) {
+        return ChfsResult<block_id_t>(bid.value());
+      }
+      this->groups->mark_full(i);
     }
   }
   return ChfsResult<block_id_t>(ErrorType::OUT_OF_RESOURCE);
 }
 
+auto BlockAllocator::allocate_run_in_group(usize i, usize cnt, usize min_len)
+    -> ChfsResult<std::pair<block_id_t, usize>> {
+  using Run = std::pair<block_id_t, usize>;
+  std::vector<u8> buffer(bm->block_size());
+  auto bitmap = Bitmap(buffer.data(), bm->block_size());
+  const auto total_bits_per_block = bm->block_size() * KBitsPerByte;
+
+  if (this->is_group_initialized(i)) {
+    auto read_res = bm->read_block(i + this->bitmap_block_id, buffer.data());
+    if (read_res.is_err()) {
+      return ChfsResult<Run>(read_res.unwrap_error());
+    }
+  } else {
+    bitmap.zeroed();
+  }
+
+  auto bound = i == this->bitmap_block_cnt - 1 ? this->last_block_num
+                                               : total_bits_per_block;
+  auto [start, len] = bitmap.find_free_run_w_bound(bound, cnt);
+  len = std::min(len, cnt);
+  Run run = {i * total_bits_per_block + start, len};
+  if (len == 0 || len < min_len) {
+    return ChfsResult<Run>(run);
+  }
+
+  for (usize k = 0; k < len; ++k) {
+    bitmap.set(start + k);
+  }
+  auto write_res = bm->write_block(i + this->bitmap_block_id, buffer.data());
+  if (write_res.is_err()) {
+    return ChfsResult<Run>(write_res.unwrap_error());
+  }
+  if (!this->is_group_initialized(i)) {
+    auto flag_res = this->init_flags->set_initialized(i);
+    if (flag_res.is_err()) {
+      return ChfsResult<Run>(flag_res.unwrap_error());
+    }
+  }
+  this->groups->add_free_cnt(-static_cast<i32>(len));
+  return ChfsResult<Run>(run);
+}
+
+auto BlockAllocator::allocate_contiguous(usize cnt)
+    -> ChfsResult<std::pair<block_id_t, usize>> {
+  using Run = std::pair<block_id_t, usize>;
+  if (cnt == 0) {
+    return ChfsResult<Run>(ErrorType::INVALID_ARG);
+  }
+
+  const auto ngroups = this->groups->size();
+  const auto start = this->groups->get_hint();
+
+  // Take the first run that is long enough,
+  // otherwise remember the group with the longest one
+  usize best_group = 0, best_len = 0;
+  for (usize k = 0; k < ngroups; ++k) {
+    auto i = (start + k) % ngroups;
+    auto lock = this->groups->lock(i);
+    auto res = this->allocate_run_in_group(i, cnt, cnt);
+    if (res.is_err()) {
+      return res;
+    }
+    auto len = res.unwrap().second;
+    if (len == cnt) {
+      return res;
+    }
+    if (len == 0) {
+      this->groups->mark_full(i);
+    } else if (len > best_len) {
+      best_group = i;
+      best_len = len;
+    }
+  }
+  if (best_len == 0) {
+    return ChfsResult<Run>(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  // the group may have changed since we scanned it
+  {
+    auto lock = this->groups->lock(best_group);
+    auto res = this->allocate_run_in_group(best_group, cnt, 1);
+    if (res.is_err() || res.unwrap().second > 0) {
+      return res;
+    }
+  }
+  auto res = this->allocate();
+  if (res.is_err()) {
+    return ChfsResult<Run>(res.unwrap_error());
+  }
+  return ChfsResult<Run>(Run{res.unwrap(), 1});
+}
+
 auto BlockAllocator::deallocate(block_id_t block_id) -> ChfsNullResult {
   if (block_id >= this->bm->total_blocks()) {
     return ChfsNullResult(ErrorType::INVALID_ARG);
@@ -144,6 +329,11 @@ auto BlockAllocator::deallocate(block_id_t block_id) -> ChfsNullResult {
   const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
   auto bitmap_block_idx = block_id / total_bits_per_block;
   auto bitmap_block_offset = block_id % total_bits_per_block;
+  auto lock = this->groups->lock(bitmap_block_idx);
+  if (!this->is_group_initialized(bitmap_block_idx)) {
+    // never allocated
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
   bm->read_block(bitmap_block_idx + this->bitmap_block_id, buffer.data());
   auto bitmap = Bitmap(buffer.data(), bm->block_size());
 
@@ -157,7 +347,81 @@ auto BlockAllocator::deallocate(block_id_t block_id) -> ChfsNullResult {
 
   // Flush the changed bitmap block back to the block manager.
   bm->write_block(bitmap_block_idx + this->bitmap_block_id, buffer.data());
-  
+  this->groups->add_free_cnt(1);
+  this->groups->mark_free(bitmap_block_idx);
+
+  return KNullOk;
+}
+
+auto BlockAllocator::deallocate(std::vector<block_id_t> block_ids)
+    -> ChfsNullResult {
+  const auto total_bits_per_block = this->bm->block_size() * KBitsPerByte;
+
+  // the blocks of the same group are adjacent after sorting
+  std::sort(block_ids.begin(), block_ids.end());
+  if (block_ids.empty()) {
+    return KNullOk;
+  }
+  if (block_ids.back() >= this->bm->total_blocks() ||
+      block_ids.front() < this->bitmap_block_id + this->bitmap_block_cnt ||
+      std::adjacent_find(block_ids.begin(), block_ids.end()) !=
+          block_ids.end()) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  // 1. lock the groups in order and check every block before freeing any,
+  // so an invalid block leaves the bitmap untouched
+  std::vector<usize> groups;
+  std::vector<usize> group_begins;
+  std::vector<std::unique_lock<std::mutex>> locks;
+  std::vector<std::vector<u8>> buffers;
+  for (usize begin = 0; begin < block_ids.size();) {
+    auto bitmap_block_idx = block_ids[begin] / total_bits_per_block;
+    auto end = begin;
+    while (end < block_ids.size() &&
+           block_ids[end] / total_bits_per_block == bitmap_block_idx) {
+      end++;
+    }
+
+    locks.push_back(this->groups->lock(bitmap_block_idx));
+    if (!this->is_group_initialized(bitmap_block_idx)) {
+      return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    buffers.emplace_back(this->bm->block_size());
+    auto res = bm->read_block(bitmap_block_idx + this->bitmap_block_id,
+                              buffers.back().data());
+    if (res.is_err()) {
+      return res;
+    }
+
+    auto bitmap = Bitmap(buffers.back().data(), bm->block_size());
+    for (auto i = begin; i < end; i++) {
+      if (!bitmap.check(block_ids[i] % total_bits_per_block)) {
+        return ChfsNullResult(ErrorType::INVALID_ARG);
+      }
+    }
+    groups.push_back(bitmap_block_idx);
+    group_begins.push_back(begin);
+    begin = end;
+  }
+  group_begins.push_back(block_ids.size());
+
+  // 2. free the blocks, one bitmap block write per group
+  for (usize g = 0; g < groups.size(); g++) {
+    auto bitmap = Bitmap(buffers[g].data(), bm->block_size());
+    for (auto i = group_begins[g]; i < group_begins[g + 1]; i++) {
+      bitmap.clear(block_ids[i] % total_bits_per_block);
+    }
+
+    auto res = bm->write_block(groups[g] + this->bitmap_block_id,
+                               buffers[g].data());
+    if (res.is_err()) {
+      return res;
+    }
+    this->groups->add_free_cnt(
+        static_cast<i32>(group_begins[g + 1] - group_begins[g]));
+    this->groups->mark_free(groups[g]);
+  }
   return KNullOk;
 }
 
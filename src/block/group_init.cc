@@ -0,0 +1,61 @@
+#include "block/group_init.h"
+
+namespace chfs {
+
+GroupInitFlags::GroupInitFlags(std::shared_ptr<BlockManager> bm,
+                               block_id_t block_id, usize offset,
+                               usize capacity)
+    : bm(std::move(bm)), block_id(block_id), offset(offset),
+      capacity(capacity), flags(capacity, 0) {
+  CHFS_VERIFY(offset + capacity <= this->bm->block_size(),
+              "group flags out of the block");
+}
+
+auto GroupInitFlags::format(usize ngroups) -> ChfsNullResult {
+  CHFS_VERIFY(ngroups <= this->max_groups(), "too many groups");
+
+  auto bitmap = Bitmap(this->flags.data(), this->capacity);
+  bitmap.zeroed();
+  for (usize i = 0; i < ngroups; ++i) {
+    bitmap.set(i);
+  }
+  return bm->write_partial_block(block_id, this->flags.data(), offset,
+                                 capacity);
+}
+
+auto GroupInitFlags::load() -> ChfsNullResult {
+  std::vector<u8> buffer(bm->block_size());
+  auto res = bm->read_block(block_id, buffer.data());
+  if (res.is_err()) {
+    return res;
+  }
+  memcpy(this->flags.data(), buffer.data() + offset, capacity);
+  return KNullOk;
+}
+
+auto GroupInitFlags::is_initialized(usize group) const -> bool {
+  if (group >= this->max_groups()) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return !Bitmap(const_cast<u8 *>(this->flags.data()), this->capacity)
+              .check(group);
+}
+
+auto GroupInitFlags::set_initialized(usize group) -> ChfsNullResult {
+  if (group >= this->max_groups()) {
+    return KNullOk;
+  }
+  std::lock_guard<std::mutex> lock(this->mutex);
+  auto bitmap = Bitmap(this->flags.data(), this->capacity);
+  if (!bitmap.check(group)) {
+    return KNullOk;
+  }
+
+  bitmap.clear(group);
+  auto byte_idx = group / KBitsPerByte;
+  return bm->write_partial_block(block_id, this->flags.data() + byte_idx,
+                                 offset + byte_idx, 1);
+}
+
+} // namespace chfs
@@ -106,30 +106,30 @@ BlockManager::BlockManager(const std::string &file, usize block_cnt, bool is_log
   if (is_log_enabled) {
     CHFS_ASSERT(this->block_cnt > kLogBlockCnt,
                 "not available blocks to store the log");
+    // the log is kept for recovery, see `CommitLog`
     this->block_cnt -= kLogBlockCnt;
-    memset(this->block_data + this->block_cnt * this->block_sz, 0,
-           this->block_sz * kLogBlockCnt);
   }
 }
 
-auto BlockManager::write_block(block_id_t block_id, const u8 *data)
-    -> ChfsNullResult {
-  if (block_id >= this->block_cnt)
-    return ChfsNullResult(ErrorType::INVALID_ARG);
-
+auto BlockManager::current_block(block_id_t block_id) const -> const u8 * {
   if (write_to_log) {
     for (auto &op : log_ops) {
       if (op->block_id_ == block_id) {
-        memcpy(op->new_block_state_.data(), data, this->block_sz);
-        return KNullOk;
+        return op->new_block_state_.data();
       }
     }
-    std::vector<u8> buffer(this->block_sz);
-    memcpy(buffer.data(), data, this->block_sz);
-    log_ops.push_back(std::make_shared<BlockOperation>(block_id, buffer));
-    return KNullOk;
   }
+  if (!staged_blocks.empty()) {
+    auto it = staged_blocks.find(block_id);
+    if (it != staged_blocks.end()) {
+      return it->second->new_block_state_.data();
+    }
+  }
+  return this->block_data + block_id * this->block_sz;
+}
 
+auto BlockManager::write_in_place(block_id_t block_id, const u8 *data,
+                                  usize offset, usize len) -> ChfsNullResult {
   if (this->maybe_failed && block_id < this->block_cnt) {
     if (this->write_fail_cnt >= 3) {
       this->write_fail_cnt = 0;
@@ -137,70 +137,106 @@ auto BlockManager::write_block(block_id_t block_id, const u8 *data)
     }
   }
 
-  memcpy(this->block_data + block_id * this->block_sz, data, this->block_sz);
+  memcpy(this->block_data + block_id * this->block_sz + offset, data, len);
 
   this->write_fail_cnt++;
   return KNullOk;
 }
 
-auto BlockManager::write_partial_block(block_id_t block_id, const u8 *data,
-                                       usize offset, usize len)
+auto BlockManager::write_staged(block_id_t block_id, const u8 *data,
+                                usize offset, usize len) -> ChfsNullResult {
+  // the log of the block isn't durable yet, so the staged content is
+  // updated instead, and written with it
+  if (!staged_blocks.empty()) {
+    auto it = staged_blocks.find(block_id);
+    if (it != staged_blocks.end()) {
+      memcpy(it->second->new_block_state_.data() + offset, data, len);
+      return KNullOk;
+    }
+  }
+  return write_in_place(block_id, data, offset, len);
+}
+
+auto BlockManager::write_block(block_id_t block_id, const u8 *data)
     -> ChfsNullResult {
   if (block_id >= this->block_cnt)
     return ChfsNullResult(ErrorType::INVALID_ARG);
-  if (offset + len > this->block_sz)
-    return ChfsNullResult(ErrorType::INVALID_ARG);
 
   if (write_to_log) {
     for (auto &op : log_ops) {
       if (op->block_id_ == block_id) {
-        memcpy(op->new_block_state_.data() + offset, data, len);
+        memcpy(op->new_block_state_.data(), data, this->block_sz);
         return KNullOk;
       }
     }
     std::vector<u8> buffer(this->block_sz);
-    memcpy(buffer.data(), this->block_data + block_id * this->block_sz,
-           this->block_sz);
-    memcpy(buffer.data() + offset, data, len);
-    log_ops.push_back(std::make_shared<BlockOperation>(block_id, buffer));
+    memcpy(buffer.data(), data, this->block_sz);
+    log_ops.push_back(std::make_shared<BlockOperation>(
+        block_id, buffer, current_block(block_id)));
     return KNullOk;
   }
 
-  if (this->maybe_failed && block_id < this->block_cnt) {
-    if (this->write_fail_cnt >= 3) {
-      this->write_fail_cnt = 0;
-      return ErrorType::INVALID;
-    }
-  }
-
-  memcpy(this->block_data + block_id * this->block_sz + offset, data, len);
-
-  this->write_fail_cnt++;
-  return KNullOk;
+  return write_staged(block_id, data, 0, this->block_sz);
 }
 
-auto BlockManager::read_block(block_id_t block_id, u8 *data) -> ChfsNullResult {
+auto BlockManager::write_partial_block(block_id_t block_id, const u8 *data,
+                                       usize offset, usize len)
+    -> ChfsNullResult {
   if (block_id >= this->block_cnt)
     return ChfsNullResult(ErrorType::INVALID_ARG);
+  if (offset + len > this->block_sz)
+    return ChfsNullResult(ErrorType::INVALID_ARG);
 
   if (write_to_log) {
     for (auto &op : log_ops) {
       if (op->block_id_ == block_id) {
-        memcpy(data, op->new_block_state_.data(), this->block_sz);
+        memcpy(op->new_block_state_.data() + offset, data, len);
         return KNullOk;
       }
     }
+    auto old_state = current_block(block_id);
+    std::vector<u8> buffer(old_state, old_state + this->block_sz);
+    memcpy(buffer.data() + offset, data, len);
+    log_ops.push_back(
+        std::make_shared<BlockOperation>(block_id, buffer, old_state));
+    return KNullOk;
   }
 
-  memcpy(data, this->block_data + block_id * this->block_sz, this->block_sz);
+  return write_staged(block_id, data, offset, len);
+}
+
+auto BlockManager::read_block(block_id_t block_id, u8 *data) -> ChfsNullResult {
+  if (block_id >= this->block_cnt)
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+
+  memcpy(data, current_block(block_id), this->block_sz);
 
   return KNullOk;
 }
 
+auto BlockManager::unsafe_get_block_ptr(block_id_t block_id) const
+    -> ChfsResult<const u8 *> {
+  if (block_id >= this->block_cnt)
+    return ChfsResult<const u8 *>(ErrorType::INVALID_ARG);
+
+  return ChfsResult<const u8 *>(current_block(block_id));
+}
+
 auto BlockManager::zero_block(block_id_t block_id) -> ChfsNullResult {
   if (block_id >= this->block_cnt)
     return ChfsNullResult(ErrorType::INVALID_ARG);
 
+  // logged like other writes, the log records only the bytes changed
+  if (write_to_log) {
+    std::vector<u8> buffer(this->block_sz, 0);
+    return write_block(block_id, buffer.data());
+  }
+
+  auto it = staged_blocks.find(block_id);
+  if (it != staged_blocks.end()) {
+    memset(it->second->new_block_state_.data(), 0, this->block_sz);
+    return KNullOk;
+  }
   memset(this->block_data + block_id * this->block_sz, 0, this->block_sz);
 
   return KNullOk;
@@ -218,6 +254,26 @@ auto BlockManager::sync(block_id_t block_id) -> ChfsNullResult {
   return KNullOk;
 }
 
+auto BlockManager::prefetch(block_id_t block_id, usize cnt)
+    -> ChfsNullResult {
+  if (block_id + cnt > this->block_cnt) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (this->in_memory || cnt == 0) {
+    return KNullOk;
+  }
+
+  // madvise requires a page-aligned address
+  static const u64 page_sz = sysconf(_SC_PAGESIZE);
+  auto begin = static_cast<u64>(block_id) * this->block_sz;
+  auto aligned = begin / page_sz * page_sz;
+  auto res = madvise(this->block_data + aligned,
+                     begin + cnt * this->block_sz - aligned, MADV_WILLNEED);
+  if (res != 0)
+    return ChfsNullResult(ErrorType::INVALID);
+  return KNullOk;
+}
+
 auto BlockManager::flush() -> ChfsNullResult {
   auto res = msync(this->block_data, this->block_sz * this->block_cnt, MS_SYNC | MS_INVALIDATE);
   if (res != 0)
@@ -241,6 +297,39 @@ auto BlockManager::set_write_to_log(bool is_write_to_log)
   return old_ops;
 }
 
+auto BlockManager::stage_log(txn_id_t txn_id,
+                             std::vector<std::shared_ptr<BlockOperation>> ops)
+    -> void {
+  for (auto &op : ops)
+    staged_blocks[op->block_id_] = op;
+  staged_txns.emplace_back(txn_id, std::move(ops));
+}
+
+auto BlockManager::apply_log(txn_id_t txn_id) -> ChfsNullResult {
+  while (!staged_txns.empty() && staged_txns.front().first <= txn_id) {
+    auto ops = std::move(staged_txns.front().second);
+    staged_txns.pop_front();
+    for (auto &op : ops) {
+      // unless a later transaction has staged the block again
+      auto it = staged_blocks.find(op->block_id_);
+      if (it != staged_blocks.end() && it->second == op)
+        staged_blocks.erase(it);
+
+      auto write_res = write_in_place(op->block_id_,
+                                      op->new_block_state_.data(), 0,
+                                      this->block_sz);
+      if (write_res.is_err())
+        return write_res;
+    }
+  }
+  return KNullOk;
+}
+
+auto BlockManager::discard_staged() -> void {
+  staged_txns.clear();
+  staged_blocks.clear();
+}
+
 BlockManager::~BlockManager() {
   if (!this->in_memory) {
     munmap(this->block_data, this->total_storage_sz());
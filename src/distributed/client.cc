@@ -51,6 +51,19 @@ auto ChfsClient::unlink(inode_id_t parent, std::string const &name)
   return KNullOk;
 }
 
+auto ChfsClient::rename(inode_id_t parent, const std::string &name,
+                        inode_id_t newparent, const std::string &newname)
+    -> ChfsNullResult {
+  auto rename_res =
+      metadata_server_->call("rename", parent, name, newparent, newname);
+  if (rename_res.is_err())
+    return rename_res.unwrap_error();
+  auto err = static_cast<ErrorType>(rename_res.unwrap()->as<u8>());
+  if (err != ErrorType::DONE)
+    return err;
+  return KNullOk;
+}
+
 // {Your code here}
 auto ChfsClient::lookup(inode_id_t parent, const std::string &name)
     -> ChfsResult<inode_id_t> {
@@ -71,6 +84,16 @@ auto ChfsClient::readdir(inode_id_t id)
   return ChfsResult<ret_type>(readdir_res.unwrap()->as<ret_type>());
 }
 
+auto ChfsClient::readdir(inode_id_t id, u64 cookie, usize max_entries)
+    -> ChfsResult<std::vector<std::tuple<std::string, inode_id_t, u64>>> {
+  auto readdir_res =
+      metadata_server_->call("readdir_from", id, cookie, max_entries);
+  if (readdir_res.is_err())
+    return readdir_res.unwrap_error();
+  using ret_type = std::vector<std::tuple<std::string, inode_id_t, u64>>;
+  return ChfsResult<ret_type>(readdir_res.unwrap()->as<ret_type>());
+}
+
 // {Your code here}
 auto ChfsClient::get_type_attr(inode_id_t id)
     -> ChfsResult<std::pair<InodeType, FileAttr>> {
@@ -161,14 +184,15 @@ auto ChfsClient::write_file(inode_id_t id, usize offset, std::vector<u8> data)
     return block_map_res.unwrap_error();
   auto block_map = block_map_res.unwrap()->as<std::vector<BlockInfo>>();
 
-  for (int i = block_map.size(); i <= end_block_idx; i++) {
-    auto allocate_res = metadata_server_->call("alloc_block", id);
+  // allocate all the missing blocks with one rpc
+  if (block_map.size() <= end_block_idx) {
+    usize cnt = end_block_idx + 1 - block_map.size();
+    auto allocate_res = metadata_server_->call("alloc_blocks", id, cnt);
     if (allocate_res.is_err())
       return allocate_res.unwrap_error();
-    auto block_info = allocate_res.unwrap()->as<BlockInfo>();
-    auto [block_id, mac_id, version] = block_info;
-    if (block_id == KInvalidBlockID) return ErrorType::DONE;
-    block_map.push_back(block_info);
+    auto blocks = allocate_res.unwrap()->as<std::vector<BlockInfo>>();
+    if (blocks.size() < cnt) return ErrorType::DONE;
+    block_map.insert(block_map.end(), blocks.begin(), blocks.end());
   }
 
   usize data_offset = 0;
@@ -217,4 +241,14 @@ auto ChfsClient::free_file_block(inode_id_t id, block_id_t block_id,
   return KNullOk;
 }
 
+auto ChfsClient::statfs() -> ChfsResult<std::tuple<u64, u64, u64, u64, u64>> {
+  auto statfs_res = metadata_server_->call("statfs");
+  if (statfs_res.is_err())
+    return statfs_res.unwrap_error();
+  auto res = statfs_res.unwrap()->as<std::tuple<u64, u64, u64, u64, u64>>();
+  if (std::get<0>(res) == 0)
+    return ErrorType::DONE;
+  return res;
+}
+
 } // namespace chfs
\ No newline at end of file
@@ -1,6 +1,10 @@
 #include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common/bitmap.h"
+#include "common/crc32c.h"
 #include "distributed/commit_log.h"
 #include "distributed/metadata_server.h"
 #include "filesystem/directory_op.h"
@@ -8,24 +12,97 @@
 #include <chrono>
 
 namespace chfs {
+
+namespace {
+
+/**
+ * Find the byte ranges changed from @old_state to @new_state, as
+ * (offset, len). The ranges closer than a record header are merged.
+ */
+auto diff_block(const u8 *old_state, const u8 *new_state, usize len)
+    -> std::vector<std::pair<usize, usize>> {
+  std::vector<std::pair<usize, usize>> ranges;
+  usize i = 0;
+  while (i < len) {
+    if (old_state[i] == new_state[i]) {
+      i++;
+      continue;
+    }
+
+    auto begin = i;
+    auto end = i + 1; // after the last byte changed
+    for (i = end; i < len && i < end + sizeof(LogRecord); i++) {
+      if (old_state[i] != new_state[i])
+        end = i + 1;
+    }
+    ranges.push_back({begin, end - begin});
+    i = end;
+  }
+  return ranges;
+}
+
+} // namespace
+
 /**
  * `CommitLog` part
  */
 // {Your code here}
 CommitLog::CommitLog(std::shared_ptr<BlockManager> bm,
-                     bool is_checkpoint_enabled)
+                     bool is_checkpoint_enabled,
+                     const std::string &journal_path)
     : is_checkpoint_enabled_(is_checkpoint_enabled), bm_(bm) {
   const auto block_size = bm->block_size();
-  auto begin_ptr = bm->unsafe_get_block_ptr() +
-                   (bm->total_blocks() - kLogBlockCnt) * block_size;
-  this->log_data = reinterpret_cast<LogEntry *>(begin_ptr);
-  this->max_log_entry_num = kLogBlockCnt * block_size / sizeof(LogEntry);
-  this->log_entry_num = 0;
+  u8 *begin_ptr = nullptr;
+  if (journal_path.empty()) {
+    // the log region is reserved after the data blocks
+    begin_ptr = bm->unsafe_get_block_ptr() + bm->total_blocks() * block_size;
+  } else {
+    this->journal_fd_ = open(journal_path.c_str(), O_RDWR | O_CREAT | O_DSYNC,
+                             S_IRUSR | S_IWUSR);
+    CHFS_ASSERT(this->journal_fd_ != -1, "Failed to open the journal");
+    // a new or short journal reads as zeros
+    this->journal_.resize(kLogBlockCnt * block_size);
+    auto read_sz =
+        pread(this->journal_fd_, this->journal_.data(), this->journal_.size(), 0);
+    CHFS_ASSERT(read_sz >= 0, "Failed to read the journal");
+    begin_ptr = this->journal_.data();
+  }
+  this->header_ = reinterpret_cast<LogHeader *>(begin_ptr);
+  this->log_data = begin_ptr + block_size;
+  this->log_capacity = (kLogBlockCnt - 1) * block_size;
+  if (this->header_->magic != kLogMagic) {
+    this->header_->magic = kLogMagic;
+    this->header_->tail = 0;
+  }
+  this->tail_ = this->header_->tail;
+
+  // the head is after the last valid frame
+  this->head_ = this->tail_;
+  TxnHeader txn;
+  std::vector<u8> records;
+  while (read_txn(this->head_, this->tail_ + this->log_capacity, txn,
+                  records))
+    this->head_ += sizeof(TxnHeader) + txn.len + sizeof(TxnCommit);
+  this->durable_lsn_ = this->head_;
+  this->applied_lsn_ = this->head_;
+  this->applied_txn_id_ = 0;
   this->begin_txn_id = 0;
   this->last_txn_id = 0;
+
+  this->checkpointer_ = std::thread([this]() { this->run_checkpointer(); });
 }
 
-CommitLog::~CommitLog() {}
+CommitLog::~CommitLog() {
+  {
+    std::unique_lock<std::mutex> lock(this->mutex_);
+    stopping_ = true;
+  }
+  checkpoint_cv_.notify_one();
+  if (checkpointer_.joinable())
+    checkpointer_.join();
+  if (journal_fd_ != -1)
+    close(journal_fd_);
+}
 
 // {Your code here}
 auto CommitLog::get_log_entry_num() -> usize { 
@@ -34,26 +111,125 @@ auto CommitLog::get_log_entry_num() -> usize {
 
 auto CommitLog::gen_txn_id() -> txn_id_t { return this->last_txn_id + 1; }
 
+auto CommitLog::write_bytes(u64 lsn, const u8 *src, usize len) -> void {
+  auto off = lsn % log_capacity;
+  auto first = std::min<u64>(len, log_capacity - off);
+  memcpy(log_data + off, src, first);
+  memcpy(log_data, src + first, len - first);
+}
+
+auto CommitLog::read_bytes(u64 lsn, u8 *dst, usize len) -> void {
+  auto off = lsn % log_capacity;
+  auto first = std::min<u64>(len, log_capacity - off);
+  memcpy(dst, log_data + off, first);
+  memcpy(dst + first, log_data, len - first);
+}
+
+auto CommitLog::flush_bytes(u64 from, u64 to) -> void {
+  if (journal_fd_ == -1) {
+    auto flush_res = bm_->flush_log();
+    CHFS_ASSERT(flush_res.is_ok(), "Failed to flush log");
+    return;
+  }
+
+  // the frames follow the header block, wrapping around
+  const auto base = log_data - journal_.data();
+  while (from < to) {
+    auto off = from % log_capacity;
+    auto len = std::min<u64>(to - from, log_capacity - off);
+    auto write_sz = pwrite(journal_fd_, log_data + off, len, base + off);
+    CHFS_ASSERT(write_sz == static_cast<ssize_t>(len),
+                "Failed to write the journal");
+    from += len;
+  }
+}
+
+auto CommitLog::flush_header() -> void {
+  if (journal_fd_ == -1) {
+    auto flush_res = bm_->flush_log();
+    CHFS_ASSERT(flush_res.is_ok(), "Failed to flush log");
+    return;
+  }
+
+  auto write_sz = pwrite(journal_fd_, header_, sizeof(LogHeader), 0);
+  CHFS_ASSERT(write_sz == static_cast<ssize_t>(sizeof(LogHeader)),
+              "Failed to write the journal");
+}
+
 // {Your code here}
 auto CommitLog::append_log(txn_id_t txn_id,
                            std::vector<std::shared_ptr<BlockOperation>> ops)
     -> void {
   std::unique_lock<std::mutex> lock(this->mutex_);
 
-  CHFS_ASSERT(this->log_entry_num + ops.size() <= this->max_log_entry_num,
-              "Log full!");
-  
+  // Encode the frame first, the byte ranges changed of each block or its
+  // full image.
+  const auto block_size = bm_->block_size();
+  std::vector<u8> frame(sizeof(TxnHeader));
   for (auto &op : ops) {
-    auto &entry = this->log_data[this->log_entry_num];
-    entry.txn_id = txn_id;
-    entry.block_id = op->block_id_;
-    memcpy(entry.block_state, op->new_block_state_.data(), bm_->block_size());
-    this->log_entry_num++;
+    std::vector<std::pair<usize, usize>> ranges;
+    if (!op->old_block_state_.empty()) {
+      ranges = diff_block(op->old_block_state_.data(),
+                          op->new_block_state_.data(), block_size);
+      usize delta_size = 0;
+      for (auto &range : ranges)
+        delta_size += sizeof(LogRecord) + range.second;
+      if (delta_size > kLogDeltaLimit)
+        ranges = {{0, block_size}};
+    } else {
+      ranges = {{0, block_size}};
+    }
+
+    for (auto &[offset, len] : ranges) {
+      LogRecord record{op->block_id_, static_cast<u16>(offset),
+                       static_cast<u16>(len)};
+      auto record_ptr = reinterpret_cast<const u8 *>(&record);
+      frame.insert(frame.end(), record_ptr, record_ptr + sizeof(record));
+      frame.insert(frame.end(), op->new_block_state_.data() + offset,
+                   op->new_block_state_.data() + offset + len);
+    }
   }
 
-  auto flush_res = bm_->flush_log();
-  CHFS_ASSERT(flush_res.is_ok(), "Failed to flush log");
+  const u64 len = frame.size() + sizeof(TxnCommit);
+  CHFS_ASSERT(len <= log_capacity, "Transaction too large for the log");
 
+  // Wait for the checkpointer if the log is full. It needs the earlier txns
+  // in place, but their threads wait for the caller's lock to apply them,
+  // so they are flushed and applied here. The ones failed are checkpointed
+  // as they are.
+  while (head_ + len - tail_ > log_capacity) {
+    if (!pending_txns_.empty()) {
+      auto last_id = pending_txns_.rbegin()->first;
+      lock.unlock();
+      sync(last_id);
+      lock.lock();
+      if (bm_->apply_log(last_id).is_err())
+        bm_->discard_staged();
+    }
+    for (auto &[id, end_lsn] : pending_txns_) {
+      applied_lsn_ = std::max(applied_lsn_, end_lsn);
+      applied_txn_id_ = std::max(applied_txn_id_, id);
+    }
+    pending_txns_.clear();
+    waiting_space_ = true;
+    checkpoint_cv_.notify_one();
+    space_cv_.wait(lock);
+  }
+  waiting_space_ = false;
+
+  TxnHeader txn{txn_id, head_,
+                static_cast<u32>(frame.size() - sizeof(TxnHeader))};
+  memcpy(frame.data(), &txn, sizeof(txn));
+  TxnCommit commit{kTxnCommitMagic, crc32c(frame.data(), frame.size())};
+  auto commit_ptr = reinterpret_cast<const u8 *>(&commit);
+  frame.insert(frame.end(), commit_ptr, commit_ptr + sizeof(commit));
+
+  write_bytes(head_, frame.data(), len);
+  head_ += len;
+  log_bytes_ += len;
+
+  // flushed by `sync` with the others
+  pending_txns_[txn_id] = head_;
   this->last_txn_id = txn_id;
 }
 
@@ -61,48 +237,236 @@ auto CommitLog::append_log(txn_id_t txn_id,
 auto CommitLog::commit_log(txn_id_t txn_id) -> void {
   std::unique_lock<std::mutex> lock(this->mutex_);
 
-  for (int i = 0; i < log_entry_num; i++) {
-    if (log_data[i].txn_id == txn_id) {
-      log_data[i].block_id = KInvalidBlockID;
-    }
+  // the blocks of the txn and the failed ones before are applied
+  auto it = pending_txns_.find(txn_id);
+  if (it != pending_txns_.end()) {
+    applied_lsn_ = std::max(applied_lsn_, it->second);
+    applied_txn_id_ = std::max(applied_txn_id_, txn_id);
+    pending_txns_.erase(pending_txns_.begin(), std::next(it));
   }
 
-  auto flush_res = bm_->flush_log();
-  CHFS_ASSERT(flush_res.is_ok(), "Failed to flush log");
+  if (need_checkpoint())
+    checkpoint_cv_.notify_one();
+}
 
-  if (is_checkpoint_enabled_ && get_log_entry_num() >= kMaxLogSize) {
-    checkpoint();
-    this->begin_txn_id = txn_id + 1;
-  }
+auto CommitLog::read_txn(u64 lsn, u64 limit, TxnHeader &header,
+                         std::vector<u8> &records) -> bool {
+  if (lsn + sizeof(TxnHeader) + sizeof(TxnCommit) > limit)
+    return false;
+  read_bytes(lsn, reinterpret_cast<u8 *>(&header), sizeof(header));
+  if (header.lsn != lsn ||
+      lsn + sizeof(TxnHeader) + header.len + sizeof(TxnCommit) > limit)
+    return false;
+
+  records.resize(header.len);
+  read_bytes(lsn + sizeof(TxnHeader), records.data(), header.len);
+  TxnCommit commit;
+  read_bytes(lsn + sizeof(TxnHeader) + header.len,
+             reinterpret_cast<u8 *>(&commit), sizeof(commit));
+  if (commit.magic != kTxnCommitMagic)
+    return false;
+
+  auto crc = crc32c(reinterpret_cast<const u8 *>(&header), sizeof(header));
+  return crc32c(records.data(), records.size(), crc) == commit.crc;
+}
+
+auto CommitLog::need_checkpoint() -> bool {
+  if (checkpointing_ || applied_lsn_ <= tail_)
+    return false;
+  return waiting_space_ ||
+         (is_checkpoint_enabled_ && get_log_entry_num() >= kMaxLogSize);
 }
 
 // {Your code here}
 auto CommitLog::checkpoint() -> void {
-  std::vector<LogEntry> new_log_data;
-  for (int i = 0; i < log_entry_num; i++) {
-    if (log_data[i].block_id != KInvalidBlockID) {
-      new_log_data.push_back(log_data[i]);
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  space_cv_.wait(lock, [this]() { return !checkpointing_; });
+  checkpointing_ = true;
+  auto lsn = applied_lsn_;
+  auto txn_id = applied_txn_id_;
+
+  // the blocks of the txns before `lsn` are durable after the flush
+  lock.unlock();
+  auto flush_res = bm_->flush();
+  CHFS_ASSERT(flush_res.is_ok(), "Failed to flush blocks");
+  lock.lock();
+
+  auto advance = lsn > tail_;
+  if (advance)
+    header_->tail = lsn;
+
+  lock.unlock();
+  flush_header();
+  lock.lock();
+
+  // `append_log` reuses the space before the tail, so the tail moves only
+  // once the new one is durable. Otherwise a crash before the flush would
+  // recover from the old tail, whose frames are overwritten.
+  if (advance) {
+    tail_ = lsn;
+    begin_txn_id = std::max(begin_txn_id, txn_id);
+  }
+
+  checkpointing_ = false;
+  checkpoint_num_ += 1;
+  space_cv_.notify_all();
+}
+
+auto CommitLog::run_checkpointer() -> void {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  while (true) {
+    checkpoint_cv_.wait(lock,
+                        [this]() { return stopping_ || need_checkpoint(); });
+    if (stopping_)
+      return;
+
+    lock.unlock();
+    checkpoint();
+    lock.lock();
+  }
+}
+
+auto CommitLog::get_log_bytes() -> u64 {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  return log_bytes_;
+}
+
+auto CommitLog::get_checkpoint_num() -> usize {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  return checkpoint_num_;
+}
+
+auto CommitLog::sync(txn_id_t txn_id) -> void {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  if (durable_txn_id_ >= txn_id)
+    return;
+
+  waiting_num_ += 1;
+  last_waiting_txn_id_ = std::max(last_waiting_txn_id_, txn_id);
+  sync_cv_.notify_all();
+
+  while (durable_txn_id_ < txn_id) {
+    if (flushing_) {
+      sync_cv_.wait(lock);
+      continue;
     }
+
+    // Lead the flush. Wait for the txns appended but not waiting yet, they
+    // are on the way.
+    flushing_ = true;
+    sync_cv_.wait_for(lock, max_delay_, [this]() {
+      return waiting_num_ >= max_batch_ || last_waiting_txn_id_ >= last_txn_id;
+    });
+    auto target = last_txn_id;
+    auto from = std::max(durable_lsn_, tail_);
+    auto to = head_;
+    waiting_num_ = 0;
+
+    // the txns arriving during the flush form the next batch
+    lock.unlock();
+    if (flush_hook_)
+      flush_hook_();
+    flush_bytes(from, to);
+    lock.lock();
+
+    durable_txn_id_ = std::max(durable_txn_id_, target);
+    durable_lsn_ = std::max(durable_lsn_, to);
+    flushing_ = false;
+    flush_num_ += 1;
+    sync_cv_.notify_all();
   }
+}
 
-  memset(log_data, 0, log_entry_num * sizeof(LogEntry));
-  std::copy(new_log_data.begin(), new_log_data.end(), log_data);
-  log_entry_num = new_log_data.size();
+auto CommitLog::set_group_commit(usize max_batch,
+                                 std::chrono::microseconds max_delay) -> void {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  max_batch_ = std::max<usize>(max_batch, 1);
+  max_delay_ = max_delay;
+}
 
-  auto flush_res = bm_->flush_log();
-  CHFS_ASSERT(flush_res.is_ok(), "Failed to flush log");
+auto CommitLog::set_flush_hook(std::function<void()> hook) -> void {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  flush_hook_ = std::move(hook);
+}
+
+auto CommitLog::get_flush_num() -> usize {
+  std::unique_lock<std::mutex> lock(this->mutex_);
+  return flush_num_;
 }
 
 // {Your code here}
-auto CommitLog::recover() -> void {
+auto CommitLog::recover() -> RecoveryStats {
   std::unique_lock<std::mutex> lock(this->mutex_);
+  auto start = std::chrono::steady_clock::now();
+  RecoveryStats stats;
 
-  for (int i = 0; i < log_entry_num; i++) {
-    if (log_data[i].block_id == KInvalidBlockID)
-      continue;
-    auto write_res =
-        bm_->write_block(log_data[i].block_id, log_data[i].block_state);
-    CHFS_ASSERT(write_res.is_ok(), "Failed to recover block");
+  // Build the final image of each block from the transactions in order, so
+  // a block is written once however many transactions edit it.
+  const auto block_size = bm_->block_size();
+  std::unordered_map<block_id_t, std::vector<u8>> images;
+  TxnHeader txn;
+  std::vector<u8> records;
+  auto lsn = tail_;
+  while (read_txn(lsn, head_, txn, records)) {
+    lsn += sizeof(TxnHeader) + txn.len + sizeof(TxnCommit);
+    stats.txn_num += 1;
+
+    usize off = 0;
+    while (off < records.size()) {
+      LogRecord record;
+      memcpy(&record, records.data() + off, sizeof(record));
+      off += sizeof(record);
+
+      block_id_t block_id = record.block_id;
+      auto it = images.find(block_id);
+      if (it == images.end()) {
+        it = images.emplace(block_id, std::vector<u8>(block_size)).first;
+        // a full image needs no base
+        if (record.len != block_size) {
+          auto read_res = bm_->read_block(block_id, it->second.data());
+          CHFS_ASSERT(read_res.is_ok(), "Failed to recover block");
+        }
+      }
+      memcpy(it->second.data() + record.offset, records.data() + off,
+             record.len);
+      off += record.len;
+    }
   }
+  stats.log_bytes = lsn - tail_;
+
+  // Write the blocks in parallel, they are distinct.
+  std::vector<std::pair<block_id_t, const u8 *>> blocks;
+  for (auto &[block_id, image] : images)
+    blocks.push_back({block_id, image.data()});
+  auto thread_num = std::min<usize>(kRecoverThreadNum, blocks.size());
+  std::vector<std::thread> threads;
+  for (usize t = 0; t < thread_num; t++) {
+    threads.emplace_back([&, t]() {
+      for (auto i = t; i < blocks.size(); i += thread_num) {
+        auto write_res = bm_->write_block(blocks[i].first, blocks[i].second);
+        CHFS_ASSERT(write_res.is_ok(), "Failed to recover block");
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  stats.block_num = blocks.size();
+  stats.bytes = static_cast<u64>(blocks.size()) * block_size;
+
+  // One flush makes them durable, and the log before is no longer needed.
+  if (!blocks.empty()) {
+    auto flush_res = bm_->flush();
+    CHFS_ASSERT(flush_res.is_ok(), "Failed to flush blocks");
+  }
+  tail_ = std::max(tail_, lsn);
+  header_->tail = tail_;
+  applied_lsn_ = std::max(applied_lsn_, lsn);
+  pending_txns_.clear();
+  begin_txn_id = last_txn_id;
+  flush_header();
+
+  stats.time = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  return stats;
 }
 }; // namespace chfs
\ No newline at end of file
@@ -1,8 +1,38 @@
+#include <algorithm>
+
 #include "distributed/dataserver.h"
 #include "common/util.h"
 
 namespace chfs {
 
+namespace {
+
+/**
+ * Write back the versions at the sorted `offsets` of a version block whose
+ * content is in `buffer`. Only these versions are written, as the other ones
+ * may be changed concurrently by other workers.
+ */
+auto write_versions(BlockManager &bm, block_id_t version_block_id,
+                    const u8 *buffer, const std::vector<usize> &offsets)
+    -> bool {
+  for (usize begin = 0; begin < offsets.size();) {
+    // adjacent versions are written together
+    auto end = begin + 1;
+    while (end < offsets.size() && offsets[end] == offsets[end - 1] + 1) {
+      end++;
+    }
+    auto res = bm.write_partial_block(
+        version_block_id, buffer + offsets[begin] * sizeof(version_t),
+        offsets[begin] * sizeof(version_t), (end - begin) * sizeof(version_t));
+    if (res.is_err())
+      return false;
+    begin = end;
+  }
+  return true;
+}
+
+} // namespace
+
 auto DataServer::initialize(std::string const &data_path) {
   /**
    * At first check whether the file exists or not.
@@ -21,16 +51,22 @@ auto DataServer::initialize(std::string const &data_path) {
     n_version_blocks += 1;
   }
 
+  // The versions of the reserved blocks are never used, so we record the
+  // uninitialized bitmap blocks at the beginning of the first version block.
+  // The bitmap is then initialized lazily.
+  auto init_flags = std::make_shared<GroupInitFlags>(
+      bm, 0, 0,
+      std::min<usize>(n_version_blocks * sizeof(version_t), bm->block_size()));
+
   if (is_initialized) {
-    block_allocator_ =
-        std::make_shared<BlockAllocator>(bm, n_version_blocks, false);
+    block_allocator_ = std::make_shared<BlockAllocator>(bm, n_version_blocks,
+                                                        false, init_flags);
   } else {
-    // We need to reserve some blocks for storing the version of each block
+    // We need to reserve some blocks for storing the version of each block.
+    // They are not zeroed: a version only needs to change on allocation and
+    // free, so any initial value works.
     block_allocator_ = std::shared_ptr<BlockAllocator>(
-        new BlockAllocator(bm, n_version_blocks, true));
-
-    for (int i = 0; i < n_version_blocks; i++)
-      block_allocator_->bm->zero_block(i);
+        new BlockAllocator(bm, n_version_blocks, true, init_flags));
   }
 
   // Initialize the RPC server and bind all handlers
@@ -43,9 +79,15 @@ auto DataServer::initialize(std::string const &data_path) {
     return this->write_data(block_id, offset, buffer);
   });
   server_->bind("alloc_block", [this]() { return this->alloc_block(); });
+  server_->bind("alloc_blocks",
+                [this](usize cnt) { return this->alloc_blocks(cnt); });
   server_->bind("free_block", [this](block_id_t block_id) {
     return this->free_block(block_id);
   });
+  server_->bind("free_blocks", [this](std::vector<block_id_t> block_ids) {
+    return this->free_blocks(block_ids);
+  });
+  server_->bind("usage", [this]() { return this->usage(); });
 
   // Launch the rpc server to listen for requests
   server_->run(true, num_worker_threads);
@@ -132,6 +174,51 @@ auto DataServer::alloc_block() -> std::pair<block_id_t, version_t> {
   return {block_id, new_version};
 }
 
+auto DataServer::alloc_blocks(usize cnt)
+    -> std::vector<std::pair<block_id_t, version_t>> {
+  std::vector<std::pair<block_id_t, version_t>> blocks;
+  while (blocks.size() < cnt) {
+    auto res = block_allocator_->allocate_contiguous(cnt - blocks.size());
+    if (res.is_err())
+      break;
+    auto [first, len] = res.unwrap();
+    for (usize i = 0; i < len; i++)
+      blocks.push_back({first + i, 0});
+  }
+
+  // bump the versions, one version block at a time
+  const auto block_size = block_allocator_->bm->block_size();
+  const auto version_per_block = block_size / sizeof(version_t);
+  std::sort(blocks.begin(), blocks.end());
+
+  std::vector<u8> buffer(block_size);
+  auto version_p = reinterpret_cast<version_t *>(buffer.data());
+  for (usize begin = 0; begin < blocks.size();) {
+    auto version_block_id = blocks[begin].first / version_per_block;
+    auto block_res =
+        block_allocator_->bm->read_block(version_block_id, buffer.data());
+    if (block_res.is_err())
+      break;
+
+    std::vector<usize> offsets;
+    auto end = begin;
+    for (; end < blocks.size() &&
+           blocks[end].first / version_per_block == version_block_id;
+         end++) {
+      auto offset = blocks[end].first % version_per_block;
+      version_p[offset] += 1;
+      blocks[end].second = version_p[offset];
+      offsets.push_back(offset);
+    }
+
+    if (!write_versions(*block_allocator_->bm, version_block_id,
+                        buffer.data(), offsets))
+      break;
+    begin = end;
+  }
+  return blocks;
+}
+
 // {Your code here}
 auto DataServer::free_block(block_id_t block_id) -> bool {
   auto res = block_allocator_->deallocate(block_id);
@@ -160,4 +247,46 @@ auto DataServer::free_block(block_id_t block_id) -> bool {
     return false;
   return true;
 }
+
+auto DataServer::free_blocks(std::vector<block_id_t> block_ids) -> bool {
+  auto res = block_allocator_->deallocate(block_ids);
+  if (res.is_err())
+    return false;
+
+  // bump the versions, one version block at a time
+  const auto block_size = block_allocator_->bm->block_size();
+  const auto version_per_block = block_size / sizeof(version_t);
+  std::sort(block_ids.begin(), block_ids.end());
+
+  std::vector<u8> buffer(block_size);
+  auto version_p = reinterpret_cast<version_t *>(buffer.data());
+  for (usize begin = 0; begin < block_ids.size();) {
+    auto version_block_id = block_ids[begin] / version_per_block;
+    auto block_res =
+        block_allocator_->bm->read_block(version_block_id, buffer.data());
+    if (block_res.is_err())
+      return false;
+
+    std::vector<usize> offsets;
+    auto end = begin;
+    for (; end < block_ids.size() &&
+           block_ids[end] / version_per_block == version_block_id;
+         end++) {
+      auto offset = block_ids[end] % version_per_block;
+      version_p[offset] += 1;
+      offsets.push_back(offset);
+    }
+
+    if (!write_versions(*block_allocator_->bm, version_block_id,
+                        buffer.data(), offsets))
+      return false;
+    begin = end;
+  }
+  return true;
+}
+
+auto DataServer::usage() -> std::pair<u64, u64> {
+  return {block_allocator_->bm->total_blocks(),
+          block_allocator_->free_block_cnt()};
+}
 } // namespace chfs
\ No newline at end of file
@@ -13,6 +13,11 @@ inline auto MetadataServer::bind_handlers() {
   server_->bind("unlink", [this](inode_id_t parent, std::string const &name) {
     return this->unlink(parent, name);
   });
+  server_->bind("rename",
+                [this](inode_id_t parent, std::string const &name,
+                       inode_id_t newparent, std::string const &newname) {
+                  return this->rename(parent, name, newparent, newname);
+                });
   server_->bind("lookup", [this](inode_id_t parent, std::string const &name) {
     return this->lookup(parent, name);
   });
@@ -20,13 +25,21 @@ inline auto MetadataServer::bind_handlers() {
                 [this](inode_id_t id) { return this->get_block_map(id); });
   server_->bind("alloc_block",
                 [this](inode_id_t id) { return this->allocate_block(id); });
+  server_->bind("alloc_blocks", [this](inode_id_t id, usize cnt) {
+    return this->allocate_blocks(id, cnt);
+  });
   server_->bind("free_block",
                 [this](inode_id_t id, block_id_t block, mac_id_t machine_id) {
                   return this->free_block(id, block, machine_id);
                 });
   server_->bind("readdir", [this](inode_id_t id) { return this->readdir(id); });
+  server_->bind("readdir_from",
+                [this](inode_id_t id, u64 cookie, usize max_entries) {
+                  return this->readdir(id, cookie, max_entries);
+                });
   server_->bind("get_type_attr",
                 [this](inode_id_t id) { return this->get_type_attr(id); });
+  server_->bind("statfs", [this]() { return this->statfs(); });
 }
 
 inline auto MetadataServer::init_fs(const std::string &data_path) {
@@ -37,7 +50,8 @@ inline auto MetadataServer::init_fs(const std::string &data_path) {
   bool is_initialed = is_file_exist(data_path);
 
   auto block_manager = std::shared_ptr<BlockManager>(nullptr);
-  if (is_log_enabled_) {
+  // the log region is reserved only if there's no journal file
+  if (is_log_enabled_ && log_path_.empty()) {
     block_manager =
         std::make_shared<BlockManager>(data_path, KDefaultBlockCnt, true);
   } else {
@@ -80,8 +94,8 @@ inline auto MetadataServer::init_fs(const std::string &data_path) {
   if (is_log_enabled_) {
     if (may_failed_)
       operation_->block_manager_->set_may_fail(true);
-    commit_log = std::make_shared<CommitLog>(operation_->block_manager_,
-                                             is_checkpoint_enabled_);
+    commit_log = std::make_shared<CommitLog>(
+        operation_->block_manager_, is_checkpoint_enabled_, log_path_);
   }
 
   bind_handlers();
@@ -92,31 +106,34 @@ inline auto MetadataServer::init_fs(const std::string &data_path) {
    */
 }
 
+// The commit log is created by `init_fs`
 MetadataServer::MetadataServer(u16 port, const std::string &data_path,
                                bool is_log_enabled, bool is_checkpoint_enabled,
-                               bool may_failed)
+                               bool may_failed, const std::string &log_path)
     : is_log_enabled_(is_log_enabled), may_failed_(may_failed),
-      is_checkpoint_enabled_(is_checkpoint_enabled) {
+      is_checkpoint_enabled_(is_checkpoint_enabled), log_path_(log_path) {
   server_ = std::make_unique<RpcServer>(port);
   init_fs(data_path);
-  if (is_log_enabled_) {
-    commit_log = std::make_shared<CommitLog>(operation_->block_manager_,
-                                             is_checkpoint_enabled);
-  }
 }
 
 MetadataServer::MetadataServer(std::string const &address, u16 port,
                                const std::string &data_path,
                                bool is_log_enabled, bool is_checkpoint_enabled,
-                               bool may_failed)
+                               bool may_failed, const std::string &log_path)
     : is_log_enabled_(is_log_enabled), may_failed_(may_failed),
-      is_checkpoint_enabled_(is_checkpoint_enabled) {
+      is_checkpoint_enabled_(is_checkpoint_enabled), log_path_(log_path) {
   server_ = std::make_unique<RpcServer>(address, port);
   init_fs(data_path);
-  if (is_log_enabled_) {
-    commit_log = std::make_shared<CommitLog>(operation_->block_manager_,
-                                             is_checkpoint_enabled);
+}
+
+MetadataServer::~MetadataServer() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
   }
+  reclaim_cv_.notify_one();
+  if (reclaimer_.joinable())
+    reclaimer_.join();
 }
 
 // {Your code here}
@@ -135,23 +152,17 @@ auto MetadataServer::mknode(u8 type, inode_id_t parent, const std::string &name)
   }
 
   auto res = operation_->mk_helper(parent, name.c_str(), inode_type);
-  if (res.is_err())
+  if (res.is_err()) {
+    abort_txn();
     return KInvalidInodeID;
+  }
 
   if (!is_log_enabled_) {
     return res.unwrap();
   }
 
-  auto log_ops = operation_->block_manager_->set_write_to_log(false);
-  auto txn_id = commit_log->gen_txn_id();
-  commit_log->append_log(txn_id, log_ops);
-  for (auto &op : log_ops) {
-    auto write_res = operation_->block_manager_->write_block(
-        op->block_id_, op->new_block_state_.data());
-    if (write_res.is_err())
-      return KInvalidInodeID;
-  }
-  commit_log->commit_log(txn_id);
+  if (!commit_txn(lock))
+    return KInvalidInodeID;
 
   return res.unwrap();
 }
@@ -166,101 +177,259 @@ auto MetadataServer::unlink(inode_id_t parent, const std::string &name)
   }
 
   auto lookup_res = operation_->lookup(parent, name.c_str());
-  if (lookup_res.is_err())
+  if (lookup_res.is_err()) {
+    abort_txn();
     return false;
+  }
   auto inode_id = lookup_res.unwrap();
 
   auto type_res = operation_->inode_manager_->get_type(inode_id);
-  if (type_res.is_err())
+  if (type_res.is_err()) {
+    abort_txn();
     return false;
+  }
   auto type = type_res.unwrap();
 
   if (type == InodeType::Directory) {
     auto unlink_res = operation_->unlink(parent, name.c_str());
-    if (unlink_res.is_err())
+    if (unlink_res.is_err()) {
+      abort_txn();
       return false;
+    }
 
     if (!is_log_enabled_) {
       return true;
     }
 
-    auto log_ops = operation_->block_manager_->set_write_to_log(false);
-    auto txn_id = commit_log->gen_txn_id();
-    commit_log->append_log(txn_id, log_ops);
-    for (auto &op : log_ops) {
-      auto write_res = operation_->block_manager_->write_block(
-          op->block_id_, op->new_block_state_.data());
-      if (write_res.is_err())
-        return false;
-    }
-    commit_log->commit_log(txn_id);
-
-    return true;
-  } else if (type == InodeType::FILE) {
-    auto block_map = get_block_map(inode_id);
-
-    auto inode_res = operation_->inode_manager_->get(inode_id);
-    if (inode_res.is_err())
-       return false;
-    auto inode_block_id = inode_res.unwrap();
-    auto free_inode_res = operation_->inode_manager_->free_inode(inode_id);
-    if (free_inode_res.is_err())
-      return false;
-    auto free_block_res =
-        operation_->block_allocator_->deallocate(inode_block_id);
-    if (free_block_res.is_err())
-      return false;
-    
-    for (auto &block : block_map) {
-      auto [block_id, mac_id, version_id] = block;
-      auto it = clients_.find(mac_id);
-      if (it == clients_.end())
-        return false;
-      auto cli = it->second;
-
-      auto free_res = cli->call("free_block", block_id);
-      if (free_res.is_err())
-        return false;
-      
-      auto ok = free_res.unwrap()->as<bool>();
-      if (!ok)
-        return false;
-    }
+    return commit_txn(lock);
   }
-  
-  std::list<DirectoryEntry> list;
-  auto read_res = read_directory(operation_.get(), parent, list);
-  if (read_res.is_err())
-    return false;
-  auto dir_str = dir_list_to_string(list);
-  auto new_dir_str = rm_from_directory(dir_str, name);
 
-  std::vector<u8> content(new_dir_str.begin(), new_dir_str.end());
-  auto write_res = operation_->write_file(parent, content);
-  if (write_res.is_err())
+  // the entry goes first, so nothing is freed if it can't be removed
+  auto rm_res = dir_remove_entry(operation_.get(), parent, name);
+  if (rm_res.is_err()) {
+    abort_txn();
     return false;
-
-  if (!is_log_enabled_) {
-    return true;
   }
+  if (type == InodeType::FILE && !free_file(inode_id)) {
+    abort_txn();
+    return false;
+  }
+
+  if (is_log_enabled_ && !commit_txn(lock))
+    return false;
+  if (type == InodeType::FILE)
+    reclaim_cv_.notify_one();
+  return true;
+}
 
-  auto log_ops = operation_->block_manager_->set_write_to_log(false);
+auto MetadataServer::commit_txn(std::unique_lock<std::mutex> &lock) -> bool {
+  auto bm = operation_->block_manager_;
+  auto log_ops = bm->set_write_to_log(false);
   auto txn_id = commit_log->gen_txn_id();
   commit_log->append_log(txn_id, log_ops);
-  for (auto &op : log_ops) {
-    auto write_res = operation_->block_manager_->write_block(
-        op->block_id_, op->new_block_state_.data());
-    if (write_res.is_err())
-      return false;
+  // the blocks are read from memory until the log is durable
+  bm->stage_log(txn_id, std::move(log_ops));
+  // the lookups without the lock see the entries only now
+  operation_->dentries_.publish();
+
+  // wait for the flush without the lock, so others join the batch
+  lock.unlock();
+  commit_log->sync(txn_id);
+  lock.lock();
+
+  // the earlier ones are applied first, if their threads haven't yet
+  auto apply_res = bm->apply_log(txn_id);
+  if (apply_res.is_err()) {
+    // the log is durable, so the recovery redoes the staged ones
+    bm->discard_staged();
+    operation_->reload_super_block();
+    operation_->dentries_.clear();
+    return false;
   }
   commit_log->commit_log(txn_id);
-  
   return true;
 }
 
+auto MetadataServer::abort_txn() -> void {
+  if (!is_log_enabled_)
+    return;
+  operation_->block_manager_->set_write_to_log(false);
+  // the counters and group flags may be changed with the blocks
+  operation_->reload_super_block();
+  operation_->dentries_.discard();
+}
+
+auto MetadataServer::free_file(inode_id_t id) -> bool {
+  auto inode_res = operation_->inode_manager_->get(id);
+  if (inode_res.is_err())
+    return false;
+  auto inode_block_id = inode_res.unwrap();
+
+  // collect the blocks from the inode, the data servers aren't asked
+  const auto block_size = operation_->block_manager_->block_size();
+  std::vector<u8> buffer(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(buffer.data());
+  auto inode_read_res =
+      operation_->block_manager_->read_block(inode_block_id, buffer.data());
+  if (inode_read_res.is_err())
+    return false;
+
+  std::vector<OrphanBlock> orphans;
+  for (int i = 0; i < inode_p->get_nblocks(); i += 2) {
+    if (inode_p->blocks[i] == KInvalidBlockID)
+      break;
+    orphans.push_back({inode_p->blocks[i],
+                       static_cast<mac_id_t>(inode_p->blocks[i + 1])});
+  }
+
+  auto free_inode_res = operation_->inode_manager_->free_inode(id);
+  if (free_inode_res.is_err())
+    return false;
+  operation_->dentries_.erase_dir(id);
+  auto free_block_res =
+      operation_->block_allocator_->deallocate(inode_block_id);
+  if (free_block_res.is_err())
+    return false;
+
+  // the reclaimer frees the blocks later
+  auto push_res = operation_->push_orphans(orphans);
+  if (push_res.is_err())
+    return false;
+  return true;
+}
+
+auto MetadataServer::rename(inode_id_t parent, const std::string &name,
+                            inode_id_t newparent, const std::string &newname)
+    -> u8 {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (is_log_enabled_) {
+    operation_->block_manager_->set_write_to_log(true);
+  }
+  auto fail = [this](ErrorType err) {
+    abort_txn();
+    return static_cast<u8>(err);
+  };
+
+  auto lookup_res = operation_->lookup(parent, name.c_str());
+  if (lookup_res.is_err())
+    return fail(lookup_res.unwrap_error());
+  auto inode_id = lookup_res.unwrap();
+
+  // the clients don't go through one VFS, so moving a directory into its own
+  // subtree is checked here
+  if (newparent != parent) {
+    auto move_res = operation_->check_move(inode_id, newparent);
+    if (move_res.is_err())
+      return fail(move_res.unwrap_error());
+  }
+
+  // The directories are updated first, the replaced inode is freed only after
+  // nothing else can fail. Its entry is pointed to the inode in place.
+  auto target = KInvalidInodeID;
+  auto target_type = InodeType::Unknown;
+  auto target_res = operation_->lookup(newparent, newname.c_str());
+  if (target_res.is_ok()) {
+    target = target_res.unwrap();
+    if (target == inode_id)
+      return fail(ErrorType::DONE);
+    auto check_res = operation_->check_replace(inode_id, target);
+    if (check_res.is_err())
+      return fail(check_res.unwrap_error());
+    auto type_res = operation_->inode_manager_->get_type(target);
+    if (type_res.is_err())
+      return fail(type_res.unwrap_error());
+    target_type = type_res.unwrap();
+
+    auto replace_res =
+        dir_replace_entry(operation_.get(), newparent, newname, inode_id);
+    if (replace_res.is_err())
+      return fail(replace_res.unwrap_error());
+  } else if (target_res.unwrap_error() != ErrorType::NotExist) {
+    return fail(target_res.unwrap_error());
+  } else {
+    auto add_res =
+        dir_add_entry(operation_.get(), newparent, newname, inode_id);
+    if (add_res.is_err())
+      return fail(add_res.unwrap_error());
+  }
+  auto rm_res = dir_remove_entry(operation_.get(), parent, name);
+  if (rm_res.is_err())
+    return fail(rm_res.unwrap_error());
+
+  if (target_type == InodeType::FILE) {
+    if (!free_file(target))
+      return fail(ErrorType::INVALID);
+  } else if (target != KInvalidInodeID) {
+    auto remove_res = operation_->remove_file(target);
+    if (remove_res.is_err())
+      return fail(remove_res.unwrap_error());
+  }
+
+  if (is_log_enabled_ && !commit_txn(lock))
+    return static_cast<u8>(ErrorType::INVALID);
+  if (target_type == InodeType::FILE)
+    reclaim_cv_.notify_one();
+  return static_cast<u8>(ErrorType::DONE);
+}
+
+auto MetadataServer::reclaim_orphans() -> usize {
+  std::vector<OrphanBlock> orphans;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // every transaction ends before the lock is released, so nothing is
+    // pending. Drop it anyway, the orphans of an unfinished transaction
+    // must never be read.
+    if (is_log_enabled_) {
+      operation_->block_manager_->set_write_to_log(false);
+    }
+
+    auto peek_res = operation_->peek_orphans(KReclaimBatch);
+    if (peek_res.is_err())
+      return 0;
+    orphans = peek_res.unwrap();
+    if (orphans.empty())
+      return 0;
+
+    if (is_log_enabled_) {
+      operation_->block_manager_->set_write_to_log(true);
+    }
+
+    auto pop_res = operation_->pop_orphans(orphans.size());
+    if (pop_res.is_err()) {
+      abort_txn();
+      return 0;
+    }
+    // the blocks are freed only after the pop is durable
+    if (is_log_enabled_ && !commit_txn(lock))
+      return 0;
+  }
+
+  // free them without the lock, one rpc for each data server
+  std::map<mac_id_t, std::vector<block_id_t>> batches;
+  for (const auto &orphan : orphans)
+    batches[orphan.mac_id].push_back(orphan.block_id);
+  for (auto &[mac_id, block_ids] : batches) {
+    auto it = clients_.find(mac_id);
+    if (it == clients_.end())
+      continue;
+    auto free_res = it->second->call("free_blocks", block_ids);
+    if (free_res.is_err() || !free_res.unwrap()->as<bool>())
+      std::cerr << "Cannot free " << block_ids.size()
+                << " orphan blocks on data server " << mac_id << std::endl;
+  }
+  return orphans.size();
+}
+
 // {Your code here}
 auto MetadataServer::lookup(inode_id_t parent, const std::string &name)
     -> inode_id_t {
+  // a cached result needs no lock
+  auto cached = operation_->lookup_cached(parent, name);
+  if (cached.has_value())
+    return cached.value();
+
   std::unique_lock<std::mutex> lock(mutex_);
 
   auto res = operation_->lookup(parent, name.c_str());
@@ -381,6 +550,69 @@ auto MetadataServer::allocate_block(inode_id_t id) -> BlockInfo {
   return {block_id, mac_id, version};
 }
 
+auto MetadataServer::allocate_blocks(inode_id_t id, usize cnt)
+    -> std::vector<BlockInfo> {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (id > operation_->inode_manager_->get_max_inode_supported())
+    return {};
+  if (id == KInvalidInodeID || cnt == 0)
+    return {};
+
+  auto inode_res = operation_->inode_manager_->get(id);
+  if (inode_res.is_err())
+    return {};
+  auto inode_block_id = inode_res.unwrap();
+  if (inode_block_id == KInvalidBlockID)
+    return {};
+
+  const auto block_size = operation_->block_manager_->block_size();
+  std::vector<u8> inode(block_size);
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto inode_read_res =
+      operation_->block_manager_->read_block(inode_block_id, inode.data());
+  if (inode_read_res.is_err())
+    return {};
+  if (inode_p->get_type() != InodeType::FILE)
+    return {};
+
+  int block_idx = 0;
+  while (block_idx < inode_p->get_nblocks() &&
+         inode_p->blocks[block_idx] != KInvalidBlockID)
+    block_idx += 2;
+  cnt = std::min<usize>(cnt, (inode_p->get_nblocks() - block_idx) / 2);
+  if (cnt == 0)
+    return {};
+
+  // all the blocks go to one data server, so they can be contiguous
+  auto rand_mac_idx = generator.rand(0, clients_.size() - 1);
+  auto it = clients_.begin();
+  std::advance(it, rand_mac_idx);
+  auto [mac_id, cli] = *it;
+
+  auto alloc_res = cli->call("alloc_blocks", cnt);
+  if (alloc_res.is_err())
+    return {};
+  auto blocks =
+      alloc_res.unwrap()->as<std::vector<std::pair<block_id_t, version_t>>>();
+
+  std::vector<BlockInfo> block_info;
+  for (auto [block_id, version] : blocks) {
+    inode_p->set_block_direct(block_idx, block_id);
+    inode_p->set_block_direct(block_idx + 1, mac_id);
+    inode_p->inner_attr.size += block_size;
+    block_idx += 2;
+    block_info.push_back({block_id, mac_id, version});
+  }
+
+  auto write_res =
+      operation_->block_manager_->write_block(inode_block_id, inode.data());
+  if (write_res.is_err())
+    return {};
+
+  return block_info;
+}
+
 // {Your code here}
 auto MetadataServer::free_block(inode_id_t id, block_id_t block_id,
                                 mac_id_t machine_id) -> bool {
@@ -466,6 +698,21 @@ auto MetadataServer::readdir(inode_id_t node)
   return dir_list;
 }
 
+auto MetadataServer::readdir(inode_id_t node, u64 cookie, usize max_entries)
+    -> std::vector<std::tuple<std::string, inode_id_t, u64>> {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  auto read_res = operation_->readdir(
+      node, cookie, std::min(max_entries, KReaddirMaxEntries));
+  if (read_res.is_err())
+    return {};
+
+  std::vector<std::tuple<std::string, inode_id_t, u64>> dir_list;
+  for (auto &entry : read_res.unwrap())
+    dir_list.emplace_back(std::move(entry.name), entry.id, entry.cookie);
+  return dir_list;
+}
+
 // {Your code here}
 auto MetadataServer::get_type_attr(inode_id_t id)
     -> std::tuple<u64, u64, u64, u64, u8> {
@@ -479,6 +726,30 @@ auto MetadataServer::get_type_attr(inode_id_t id)
   return {attr.size, attr.atime, attr.mtime, attr.ctime, type_u8};
 }
 
+auto MetadataServer::statfs() -> std::tuple<u64, u64, u64, u64, u64> {
+  u64 total_inodes = 0, free_inodes = 0;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    total_inodes = operation_->get_total_inode_num();
+    auto free_res = operation_->get_free_inode_num();
+    if (free_res.is_err())
+      return {0, 0, 0, 0, 0};
+    free_inodes = free_res.unwrap();
+  }
+
+  u64 total_blocks = 0, free_blocks = 0;
+  for (auto &[mac_id, cli] : clients_) {
+    auto usage_res = cli->call("usage");
+    if (usage_res.is_err())
+      return {0, 0, 0, 0, 0};
+    auto [total, free] = usage_res.unwrap()->as<std::pair<u64, u64>>();
+    total_blocks += total;
+    free_blocks += free;
+  }
+
+  return {DiskBlockSize, total_blocks, free_blocks, total_inodes, free_inodes};
+}
+
 auto MetadataServer::reg_server(const std::string &address, u16 port,
                                 bool reliable) -> bool {
   num_data_servers += 1;
@@ -495,6 +766,19 @@ auto MetadataServer::run() -> bool {
   // Currently we only support async start
   server_->run(true, num_worker_threads);
   running = true;
+
+  // the orphans left by the last run are reclaimed too
+  reclaimer_ = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      lock.unlock();
+      auto cnt = reclaim_orphans();
+      lock.lock();
+      if (cnt == 0 && !stopping_)
+        reclaim_cv_.wait_for(lock,
+                             std::chrono::milliseconds(KReclaimIntervalMs));
+    }
+  });
   return true;
 }
 
@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <ctime>
+
+#include "filesystem/operations.h"
+
+namespace chfs {
+
+// The number of extra references of a block
+using refcount_t = u32;
+
+auto FileOperation::get_refcount_inode(bool create) -> ChfsResult<inode_id_t> {
+  inode_id_t id = super_block_->get_refcount_inode();
+  if (id != KInvalidInodeID || !create) {
+    return ChfsResult<inode_id_t>(id);
+  }
+
+  // It's indexed by the block id, so it may be large,
+  // map it with an extent tree regardless of the inode flags
+  auto block_res = this->block_allocator_->allocate();
+  if (block_res.is_err()) {
+    return ChfsResult<inode_id_t>(block_res.unwrap_error());
+  }
+  auto inode_res = this->inode_manager_->allocate_inode(
+      InodeType::FILE, block_res.unwrap(), KInodeExtentFlag);
+  if (inode_res.is_err()) {
+    return ChfsResult<inode_id_t>(inode_res.unwrap_error());
+  }
+
+  super_block_->set_refcount_inode(inode_res.unwrap());
+  auto res = super_block_->flush(0);
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  res = this->flush_usage();
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  return inode_res;
+}
+
+auto FileOperation::is_shared(inode_id_t id, const Inode *inode,
+                              block_id_t bid) -> ChfsResult<bool> {
+  auto rc_inode = super_block_->get_refcount_inode();
+  if (!inode->may_share() || rc_inode == KInvalidInodeID || rc_inode == id) {
+    return ChfsResult<bool>(false);
+  }
+
+  refcount_t cnt = 0;
+  auto res = this->read_file_w_off(rc_inode, reinterpret_cast<u8 *>(&cnt),
+                                   sizeof(refcount_t),
+                                   bid * sizeof(refcount_t));
+  if (res.is_err()) {
+    return ChfsResult<bool>(res.unwrap_error());
+  }
+  return ChfsResult<bool>(cnt != 0);
+}
+
+auto FileOperation::adjust_refcounts(std::vector<block_id_t> blocks, bool inc,
+                                     std::vector<block_id_t> *freed)
+    -> ChfsNullResult {
+  if (blocks.empty()) {
+    return KNullOk;
+  }
+  auto rc_res = this->get_refcount_inode(inc);
+  if (rc_res.is_err()) {
+    return ChfsNullResult(rc_res.unwrap_error());
+  }
+  auto rc_inode = rc_res.unwrap();
+  if (rc_inode == KInvalidInodeID) {
+    // nothing is shared
+    if (freed != nullptr) {
+      freed->insert(freed->end(), blocks.begin(), blocks.end());
+    }
+    return KNullOk;
+  }
+
+  // Update the counts one block of the refcount file at a time,
+  // and write all the changed blocks together
+  const auto block_size = this->block_manager_->block_size();
+  const auto per_block = block_size / sizeof(refcount_t);
+  std::sort(blocks.begin(), blocks.end());
+
+  std::vector<std::vector<u8>> chunks;
+  std::vector<WriteRange> ranges;
+  for (usize begin = 0; begin < blocks.size();) {
+    auto chunk_idx = blocks[begin] / per_block;
+    auto end = begin;
+    while (end < blocks.size() && blocks[end] / per_block == chunk_idx) {
+      end++;
+    }
+
+    // the part after the end of the refcount file reads as zeros
+    std::vector<u8> chunk(block_size, 0);
+    auto res = this->read_file_w_off(rc_inode, chunk.data(), block_size,
+                                     chunk_idx * block_size);
+    if (res.is_err()) {
+      return ChfsNullResult(res.unwrap_error());
+    }
+
+    auto counts = reinterpret_cast<refcount_t *>(chunk.data());
+    bool dirty = false;
+    for (auto i = begin; i < end; i++) {
+      auto &cnt = counts[blocks[i] % per_block];
+      if (inc) {
+        cnt += 1;
+        dirty = true;
+      } else if (cnt == 0) {
+        // the last reference
+        if (freed != nullptr) {
+          freed->push_back(blocks[i]);
+        }
+      } else {
+        cnt -= 1;
+        dirty = true;
+      }
+    }
+
+    if (dirty) {
+      chunks.push_back(std::move(chunk));
+      ranges.push_back({chunk_idx * block_size, nullptr, block_size});
+    }
+    begin = end;
+  }
+
+  if (ranges.empty()) {
+    return KNullOk;
+  }
+  for (usize i = 0; i < ranges.size(); i++) {
+    ranges[i].data = chunks[i].data();
+  }
+  return this->write_file_ranges(rc_inode, ranges);
+}
+
+auto FileOperation::release_blocks(const std::vector<block_id_t> &blocks)
+    -> ChfsNullResult {
+  if (super_block_->get_refcount_inode() == KInvalidInodeID) {
+    return this->block_allocator_->deallocate(blocks);
+  }
+
+  std::vector<block_id_t> freed;
+  auto res = this->adjust_refcounts(blocks, false, &freed);
+  if (res.is_err()) {
+    return res;
+  }
+  return this->block_allocator_->deallocate(freed);
+}
+
+auto FileOperation::break_sharing(BlockMap &block_map, u64 idx,
+                                  block_id_t bid, bool copy)
+    -> ChfsResult<block_id_t> {
+  auto block_res = this->block_allocator_->allocate();
+  if (block_res.is_err()) {
+    return block_res;
+  }
+  auto new_bid = block_res.unwrap();
+
+  if (copy) {
+    std::vector<u8> buffer(this->block_manager_->block_size());
+    auto res = this->block_manager_->read_block(bid, buffer.data());
+    if (res.is_err()) {
+      return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+    res = this->block_manager_->write_block(new_bid, buffer.data());
+    if (res.is_err()) {
+      return ChfsResult<block_id_t>(res.unwrap_error());
+    }
+  }
+
+  auto res = block_map.set(idx, new_bid);
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  // the block is shared, so dropping our reference doesn't free it
+  res = this->adjust_refcounts({bid}, false, nullptr);
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  return ChfsResult<block_id_t>(new_bid);
+}
+
+auto FileOperation::clone_file(inode_id_t src, inode_id_t dst)
+    -> ChfsNullResult {
+  auto error_code = ErrorType::DONE;
+  const auto block_size = this->block_manager_->block_size();
+
+  std::vector<u8> src_inode(block_size);
+  std::vector<u8> dst_inode(block_size);
+  std::vector<block_id_t> shared;
+  std::vector<block_id_t> free_set;
+
+  auto src_p = reinterpret_cast<Inode *>(src_inode.data());
+  auto dst_p = reinterpret_cast<Inode *>(dst_inode.data());
+  auto src_map = BlockMap(this->block_manager_, this->block_allocator_, src_p);
+  auto dst_map = BlockMap(this->block_manager_, this->block_allocator_, dst_p);
+  u64 nblocks = 0;
+
+  if (src == dst || src == super_block_->get_refcount_inode() ||
+      dst == super_block_->get_refcount_inode()) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  auto src_res = this->inode_manager_->read_inode(src, src_inode);
+  auto dst_res = this->inode_manager_->read_inode(dst, dst_inode);
+  if (src_res.is_err()) {
+    error_code = src_res.unwrap_error();
+    goto err_ret;
+  }
+  if (dst_res.is_err()) {
+    error_code = dst_res.unwrap_error();
+    goto err_ret;
+  }
+  if (src_p->get_type() != InodeType::FILE ||
+      dst_p->get_type() != InodeType::FILE) {
+    error_code = ErrorType::INVALID_ARG;
+    goto err_ret;
+  }
+  if (src_p->get_size() > dst_p->max_file_sz_supported()) {
+    error_code = ErrorType::OUT_OF_RESOURCE;
+    goto err_ret;
+  }
+
+  // 1. drop the old content of dst
+  {
+    auto res = dst_map.truncate(0, free_set);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    res = this->release_blocks(free_set);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+  }
+
+  // 2. map the blocks of src in dst, the holes stay holes
+  nblocks = (src_p->get_size() + block_size - 1) / block_size;
+  for (u64 idx = 0; idx < nblocks; ++idx) {
+    auto bid_res = src_map.lookup(idx);
+    if (bid_res.is_err()) {
+      error_code = bid_res.unwrap_error();
+      goto err_ret;
+    }
+    if (bid_res.unwrap() == KInvalidBlockID) {
+      continue;
+    }
+    auto res = dst_map.set(idx, bid_res.unwrap());
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    shared.push_back(bid_res.unwrap());
+  }
+
+  // 3. both files reference the blocks now
+  {
+    auto res = this->adjust_refcounts(shared, true, nullptr);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+  }
+
+  // 4. write both back, their writes check the sharing from now on
+  if (!src_p->may_share()) {
+    src_p->set_may_share();
+    auto res = this->block_manager_->write_block(src_res.unwrap(),
+                                                 src_inode.data());
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+  }
+  {
+    dst_p->inner_attr.size = src_p->get_size();
+    dst_p->inner_attr.set_all_time(time(0));
+    dst_p->set_may_share();
+    auto res = dst_map.flush();
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    res = this->block_manager_->write_block(dst_res.unwrap(),
+                                            dst_inode.data());
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+    this->lazy_times_.erase(dst);
+  }
+
+  return this->flush_usage();
+
+err_ret:
+  return ChfsNullResult(error_code);
+}
+
+} // namespace chfs
@@ -4,15 +4,28 @@
 namespace chfs {
 
 FileOperation::FileOperation(std::shared_ptr<BlockManager> bm,
-                             u64 max_inode_supported)
-    : block_manager_(bm), inode_manager_(std::shared_ptr<InodeManager>(
-                              new InodeManager(bm, max_inode_supported))),
-      block_allocator_(std::shared_ptr<BlockAllocator>(
-          new BlockAllocator(bm, inode_manager_->get_reserved_blocks()))) {
+                             u64 max_inode_supported, u32 inode_flags)
+    : block_manager_(bm),
+      // the bitmaps and the inode table are initialized lazily,
+      // so formatting is cheap regardless of the device size
+      inode_manager_(std::shared_ptr<InodeManager>(
+          new InodeManager(bm, max_inode_supported,
+                           SuperBlock::inode_group_flags(bm, 0)))),
+      block_allocator_(std::shared_ptr<BlockAllocator>(new BlockAllocator(
+          bm, inode_manager_->get_reserved_blocks(), true,
+          SuperBlock::block_group_flags(bm, 0)))),
+      inode_flags_(inode_flags),
+      super_block_(std::make_shared<SuperBlock>(
+          bm, inode_manager_->get_max_inode_supported(), inode_flags)),
+      zero_block_(bm->block_size(), 0) {
   // now initialize the superblock
-  SuperBlock(bm, inode_manager_->get_max_inode_supported()).flush(0).unwrap();
+  super_block_->set_usage(block_allocator_->free_block_cnt(),
+                          inode_manager_->free_inode_cnt().unwrap());
+  super_block_->flush(0).unwrap();
 }
 
+FileOperation::~FileOperation() { this->sync_all(); }
+
 auto FileOperation::create_from_raw(std::shared_ptr<BlockManager> bm)
     -> ChfsResult<std::shared_ptr<FileOperation>> {
   // 1. get the metadata from the super block
@@ -24,18 +37,26 @@ auto FileOperation::create_from_raw(std::shared_ptr<BlockManager> bm)
 
   // 2. create the innode manager
   auto inode_manager_res = InodeManager::create_from_block_manager(
-      bm, superblock_res.unwrap()->get_ninodes());
+      bm, superblock_res.unwrap()->get_ninodes(),
+      SuperBlock::inode_group_flags(bm, 0));
   if (inode_manager_res.is_err()) {
     return ChfsResult<std::shared_ptr<FileOperation>>(
         inode_manager_res.unwrap_error());
   }
 
-  auto reserved_block_num = inode_manager_res.unwrap().get_reserved_blocks();
+  // 3. the usage counters are recorded in the super block,
+  // so we don't need to scan the bitmaps
+  auto super_block = superblock_res.unwrap();
+  auto inode_manager = InodeManager::to_shared_ptr(inode_manager_res.unwrap());
+  auto block_allocator = std::shared_ptr<BlockAllocator>(
+      new BlockAllocator(bm, inode_manager->get_reserved_blocks(), false,
+                         SuperBlock::block_group_flags(bm, 0)));
+  inode_manager->set_free_inode_cnt(super_block->get_nfree_inodes());
+  block_allocator->set_free_block_cnt(super_block->get_nfree_blocks());
+
   return ChfsResult<std::shared_ptr<FileOperation>>(
       std::shared_ptr<FileOperation>(new FileOperation(
-          bm, InodeManager::to_shared_ptr(inode_manager_res.unwrap()),
-          std::shared_ptr<BlockAllocator>(
-              new BlockAllocator(bm, reserved_block_num, false)))));
+          bm, inode_manager, block_allocator, super_block)));
 }
 
 auto FileOperation::get_free_inode_num() const -> ChfsResult<u64> {
@@ -46,6 +67,124 @@ auto FileOperation::get_free_blocks_num() const -> ChfsResult<u64> {
   return ChfsResult<u64>(block_allocator_->free_block_cnt());
 }
 
+auto FileOperation::flush_usage() -> ChfsNullResult {
+  auto nfree_inodes = inode_manager_->free_inode_cnt();
+  if (nfree_inodes.is_err()) {
+    return ChfsNullResult(nfree_inodes.unwrap_error());
+  }
+  u64 nfree_blocks = block_allocator_->free_block_cnt();
+
+  if (super_block_->get_nfree_blocks() == nfree_blocks &&
+      super_block_->get_nfree_inodes() == nfree_inodes.unwrap()) {
+    return KNullOk;
+  }
+  super_block_->set_usage(nfree_blocks, nfree_inodes.unwrap());
+  return super_block_->flush(0);
+}
+
+auto FileOperation::reload_super_block() -> ChfsNullResult {
+  auto superblock_res = SuperBlock::create_from_existing(block_manager_, 0);
+  if (superblock_res.is_err()) {
+    return ChfsNullResult(superblock_res.unwrap_error());
+  }
+  super_block_ = superblock_res.unwrap();
+  inode_manager_->set_free_inode_cnt(super_block_->get_nfree_inodes());
+  block_allocator_->set_free_block_cnt(super_block_->get_nfree_blocks());
+
+  if (inode_manager_->init_flags) {
+    auto res = inode_manager_->init_flags->load();
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  if (block_allocator_->init_flags) {
+    return block_allocator_->init_flags->load();
+  }
+  return KNullOk;
+}
+
+auto FileOperation::set_lazytime(bool enable) -> ChfsNullResult {
+  if (!enable) {
+    auto res = this->sync_all();
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  this->lazytime_ = enable;
+  return KNullOk;
+}
+
+auto FileOperation::write_back_time(inode_id_t id, u64 time)
+    -> ChfsNullResult {
+  std::vector<u8> inode(this->block_manager_->block_size());
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+  reinterpret_cast<Inode *>(inode.data())->inner_attr.set_all_time(time);
+  return this->block_manager_->write_block(inode_res.unwrap(), inode.data());
+}
+
+auto FileOperation::defer_time(inode_id_t id, u64 time) -> ChfsNullResult {
+  std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+
+  auto iter = this->lazy_times_.find(id);
+  if (iter == this->lazy_times_.end()) {
+    iter = this->lazy_times_.insert({id, LazyTime{time, time}}).first;
+  }
+  iter->second.time = time;
+
+  // expired, write it back now
+  if (time >= iter->second.dirtied_at + KLazytimeExpireSec) {
+    auto res = this->write_back_time(id, time);
+    this->lazy_times_.erase(iter);
+    return res;
+  }
+
+  // too many inodes are dirty, evict them all
+  if (this->lazy_times_.size() > KLazytimeMaxInodes) {
+    for (const auto &[ino, lazy_time] : this->lazy_times_) {
+      auto res = this->write_back_time(ino, lazy_time.time);
+      if (res.is_err()) {
+        return res;
+      }
+    }
+    this->lazy_times_.clear();
+  }
+  return KNullOk;
+}
+
+auto FileOperation::apply_lazy_time(inode_id_t id, FileAttr &attr) -> void {
+  std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+  auto iter = this->lazy_times_.find(id);
+  if (iter != this->lazy_times_.end()) {
+    attr.set_all_time(iter->second.time);
+  }
+}
+
+auto FileOperation::sync_inode(inode_id_t id) -> ChfsNullResult {
+  std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+  auto iter = this->lazy_times_.find(id);
+  if (iter == this->lazy_times_.end()) {
+    return KNullOk;
+  }
+  auto res = this->write_back_time(id, iter->second.time);
+  this->lazy_times_.erase(iter);
+  return res;
+}
+
+auto FileOperation::sync_all() -> ChfsNullResult {
+  std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+  for (const auto &[id, lazy_time] : this->lazy_times_) {
+    auto res = this->write_back_time(id, lazy_time.time);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  this->lazy_times_.clear();
+  return KNullOk;
+}
+
 auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
   auto error_code = ErrorType::DONE;
   const auto block_size = this->block_manager_->block_size();
@@ -55,6 +194,8 @@ auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
   std::vector<block_id_t> free_set;
 
   auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
   auto inode_res = this->inode_manager_->read_inode(id, inode);
   if (inode_res.is_err()) {
     error_code = inode_res.unwrap_error();
@@ -62,34 +203,23 @@ auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
     goto err_ret;
   }
 
-  for (uint i = 0; i < inode_p->get_direct_block_num(); ++i) {
-    if (inode_p->blocks[i] == KInvalidBlockID) {
-      break;
-    }
-    free_set.push_back(inode_p->blocks[i]);
-  }
-
-  if (inode_p->blocks[inode_p->get_direct_block_num()] != KInvalidBlockID) {
-    // we still need to release the indirect block
-    std::vector<u8> indirect_block;
-    auto read_res = this->block_manager_->read_block(
-        inode_p->blocks[inode_p->get_direct_block_num()],
-        indirect_block.data());
-    if (read_res.is_err()) {
-      error_code = read_res.unwrap_error();
+  // collect the data blocks,
+  // the indirect block (or the extent tree) is released by the block map
+  {
+    auto res = block_map.truncate(0, free_set);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
       goto err_ret;
     }
+  }
 
-    auto block_p = reinterpret_cast<block_id_t *>(indirect_block.data());
-    for (uint i = 0;
-         i < this->block_manager_->block_size() / sizeof(block_id_t); ++i) {
-      if (block_p[i] == KInvalidBlockID) {
-        break;
-      } else {
-        free_set.push_back(block_p[i]);
-      }
-    }
+  // the deferred timestamps are useless now
+  {
+    std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+    this->lazy_times_.erase(id);
   }
+  // the id may be reused by a new directory
+  this->dentries_.erase_dir(id);
 
   // First we free the inode
   {
@@ -102,13 +232,13 @@ auto FileOperation::remove_file(inode_id_t id) -> ChfsNullResult {
   }
 
   // now free the blocks
-  for (auto bid : free_set) {
-    auto res = this->block_allocator_->deallocate(bid);
+  {
+    auto res = this->release_blocks(free_set);
     if (res.is_err()) {
       return res;
     }
   }
-  return KNullOk;
+  return this->flush_usage();
 err_ret:
   return ChfsNullResult(error_code);
 }
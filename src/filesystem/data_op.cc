@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <ctime>
 
 #include "filesystem/operations.h"
@@ -16,7 +17,8 @@ auto FileOperation::alloc_inode(InodeType type) -> ChfsResult<inode_id_t> {
   }
 
   // Allocate an inode.
-  inode_res = this->inode_manager_->allocate_inode(type, block_res.unwrap());
+  inode_res = this->inode_manager_->allocate_inode(type, block_res.unwrap(),
+                                                   this->inode_flags_);
   if (inode_res.is_err()) {
     return ChfsResult<inode_id_t>(inode_res.unwrap_error());
   }
@@ -24,16 +26,32 @@ auto FileOperation::alloc_inode(InodeType type) -> ChfsResult<inode_id_t> {
   // Initialize the inode block
   //    and write the block back to block manager.
 
+  auto usage_res = this->flush_usage();
+  if (usage_res.is_err()) {
+    return ChfsResult<inode_id_t>(usage_res.unwrap_error());
+  }
   return inode_res;
 }
 
 auto FileOperation::getattr(inode_id_t id) -> ChfsResult<FileAttr> {
-  return this->inode_manager_->get_attr(id);
+  auto res = this->inode_manager_->get_attr(id);
+  if (res.is_err()) {
+    return res;
+  }
+  auto attr = res.unwrap();
+  this->apply_lazy_time(id, attr);
+  return ChfsResult<FileAttr>(attr);
 }
 
 auto FileOperation::get_type_attr(inode_id_t id)
     -> ChfsResult<std::pair<InodeType, FileAttr>> {
-  return this->inode_manager_->get_type_attr(id);
+  auto res = this->inode_manager_->get_type_attr(id);
+  if (res.is_err()) {
+    return res;
+  }
+  auto type_attr = res.unwrap();
+  this->apply_lazy_time(id, type_attr.second);
+  return ChfsResult<std::pair<InodeType, FileAttr>>(type_attr);
 }
 
 auto FileOperation::gettype(inode_id_t id) -> ChfsResult<InodeType> {
@@ -46,22 +64,178 @@ auto calculate_block_sz(u64 file_sz, u64 block_sz) -> u64 {
 
 auto FileOperation::write_file_w_off(inode_id_t id, const char *data, u64 sz,
                                      u64 offset) -> ChfsResult<u64> {
-  auto read_res = this->read_file(id);
-  if (read_res.is_err()) {
-    return ChfsResult<u64>(read_res.unwrap_error());
+  if (sz == 0) {
+    return ChfsResult<u64>(0);
+  }
+
+  auto res = this->write_file_ranges(
+      id, {{offset, reinterpret_cast<const u8 *>(data), sz}});
+  if (res.is_err()) {
+    return ChfsResult<u64>(res.unwrap_error());
+  }
+  return ChfsResult<u64>(sz);
+}
+
+auto FileOperation::write_file_ranges(inode_id_t id,
+                                      const std::vector<WriteRange> &ranges)
+    -> ChfsNullResult {
+  auto error_code = ErrorType::DONE;
+  const auto block_size = this->block_manager_->block_size();
+  u64 original_file_sz = 0;
+  u64 new_file_sz = 0;
+  u64 old_block_num = 0;
+  bool tail_zeroed = false;
+
+  std::vector<u8> inode(block_size);
+  std::vector<u8> original_inode;
+  std::vector<u8> buffer(block_size);
+
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
+
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    error_code = inode_res.unwrap_error();
+    goto err_ret;
   }
 
-  auto content = read_res.unwrap();
-  if (offset + sz > content.size()) {
-    content.resize(offset + sz);
+  if (this->lazytime_) {
+    original_inode = inode;
   }
-  memcpy(content.data() + offset, data, sz);
 
-  auto write_res = this->write_file(id, content);
-  if (write_res.is_err()) {
-    return ChfsResult<u64>(write_res.unwrap_error());
+  original_file_sz = inode_p->get_size();
+  new_file_sz = original_file_sz;
+  for (const auto &range : ranges) {
+    new_file_sz = std::max(new_file_sz, range.offset + range.len);
   }
-  return ChfsResult<u64>(sz);
+  if (new_file_sz > inode_p->max_file_sz_supported()) {
+    error_code = ErrorType::OUT_OF_RESOURCE;
+    goto err_ret;
+  }
+  old_block_num = calculate_block_sz(original_file_sz, block_size);
+
+  // 1. write the blocks covered by the ranges.
+  // The gap between the old end of file and the ranges is left as holes.
+  for (const auto &range : ranges) {
+    const auto offset = range.offset;
+    const auto sz = range.len;
+    const auto end_block = calculate_block_sz(offset + sz, block_size);
+
+    for (u64 idx = offset / block_size; idx < end_block; ++idx) {
+      auto block_begin = idx * block_size;
+      auto copy_begin = std::max(offset, block_begin);
+      auto copy_end = std::min(offset + sz, block_begin + block_size);
+      auto is_full = copy_begin == block_begin &&
+                     copy_end == block_begin + block_size;
+
+      auto bid_res = block_map.lookup(idx);
+      if (bid_res.is_err()) {
+        error_code = bid_res.unwrap_error();
+        goto err_ret;
+      }
+      auto bid = bid_res.unwrap();
+
+      if (bid == KInvalidBlockID) {
+        auto block_res = this->map_new_block(block_map, idx);
+        if (block_res.is_err()) {
+          error_code = block_res.unwrap_error();
+          goto err_ret;
+        }
+        bid = block_res.unwrap();
+        std::fill(buffer.begin(), buffer.end(), 0);
+      } else if (!is_full) {
+        // read-modify-write the partial block at the edges
+        auto res = this->block_manager_->read_block(bid, buffer.data());
+        if (res.is_err()) {
+          error_code = res.unwrap_error();
+          goto err_ret;
+        }
+        // the bytes after the old end of file are undefined,
+        // zero them if they become part of the file
+        if (idx == old_block_num - 1 && !tail_zeroed &&
+            original_file_sz % block_size != 0 &&
+            offset + sz > original_file_sz) {
+          auto tail = original_file_sz % block_size;
+          std::fill(buffer.begin() + tail, buffer.end(), 0);
+          tail_zeroed = true;
+        }
+      }
+      if (idx == old_block_num - 1 &&
+          (is_full || bid_res.unwrap() == KInvalidBlockID)) {
+        // the tail is overwritten, or the block is new
+        tail_zeroed = true;
+      }
+
+      // A block shared with a clone is copied on its first write,
+      // the buffer holds its content already
+      if (bid_res.unwrap() != KInvalidBlockID) {
+        auto shared_res = this->is_shared(id, inode_p, bid);
+        if (shared_res.is_err()) {
+          error_code = shared_res.unwrap_error();
+          goto err_ret;
+        }
+        if (shared_res.unwrap()) {
+          auto new_res = this->break_sharing(block_map, idx, bid, false);
+          if (new_res.is_err()) {
+            error_code = new_res.unwrap_error();
+            goto err_ret;
+          }
+          bid = new_res.unwrap();
+        }
+      }
+
+      memcpy(buffer.data() + (copy_begin - block_begin),
+             range.data + (copy_begin - offset), copy_end - copy_begin);
+      auto res = this->block_manager_->write_block(bid, buffer.data());
+      if (res.is_err()) {
+        error_code = res.unwrap_error();
+        goto err_ret;
+      }
+    }
+  }
+
+  // 2. no range wrote the old last block, but the file grows
+  if (!tail_zeroed && new_file_sz > original_file_sz) {
+    auto res = this->zero_tail(id, inode_p, block_map, original_file_sz);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+  }
+
+  // 3. update the inode once
+  {
+    inode_p->inner_attr.size = new_file_sz;
+
+    auto write_res = block_map.flush();
+    if (write_res.is_err()) {
+      error_code = write_res.unwrap_error();
+      goto err_ret;
+    }
+
+    if (this->lazytime_ && original_inode == inode) {
+      // only the timestamps change, defer them
+      write_res = this->defer_time(id, time(0));
+    } else {
+      inode_p->inner_attr.set_all_time(time(0));
+      write_res =
+          this->block_manager_->write_block(inode_res.unwrap(), inode.data());
+      if (write_res.is_ok()) {
+        std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+        this->lazy_times_.erase(id);
+      }
+    }
+    if (write_res.is_err()) {
+      error_code = write_res.unwrap_error();
+      goto err_ret;
+    }
+  }
+
+  return this->flush_usage();
+
+err_ret:
+  return ChfsNullResult(error_code);
 }
 
 // {Your code here}
@@ -75,20 +249,23 @@ auto FileOperation::write_file(inode_id_t id, const std::vector<u8> &content)
 
   // 1. read the inode
   std::vector<u8> inode(block_size);
-  std::vector<u8> indirect_block(0);
-  indirect_block.reserve(block_size);
+  std::vector<u8> original_inode;
+  std::vector<block_id_t> free_set;
 
   auto inode_p = reinterpret_cast<Inode *>(inode.data());
-  auto indirect_block_p = reinterpret_cast<block_id_t *>(indirect_block.data());
-  auto inlined_blocks_num = 0;
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
 
   auto inode_res = this->inode_manager_->read_inode(id, inode);
   if (inode_res.is_err()) {
     error_code = inode_res.unwrap_error();
     // I know goto is bad, but we have no choice
     goto err_ret;
-  } else {
-    inlined_blocks_num = inode_p->get_direct_block_num();
+  }
+
+  // keep the original inode to see whether only the timestamps change
+  if (this->lazytime_) {
+    original_inode = inode;
   }
 
   if (content.size() > inode_p->max_file_sz_supported()) {
@@ -103,124 +280,79 @@ auto FileOperation::write_file(inode_id_t id, const std::vector<u8> &content)
   old_block_num = calculate_block_sz(original_file_sz, block_size);
   new_block_num = calculate_block_sz(content.size(), block_size);
 
-  // get the indirect block if needed
-  if (old_block_num > inlined_blocks_num ||
-      new_block_num > inlined_blocks_num) {
-
-    if (new_block_num > inlined_blocks_num) {
-      indirect_block.resize((new_block_num - inlined_blocks_num) *
-                            sizeof(block_id_t));
-    }
-    
-    auto indirect_block_id_res =
-        inode_p->get_or_insert_indirect_block(this->block_allocator_);
-    if (indirect_block_id_res.is_err()) {
-      error_code = indirect_block_id_res.unwrap_error();
-      goto err_ret;
-    }
-
-    auto indirect_block_res = this->block_manager_->read_block(
-      indirect_block_id_res.unwrap(), indirect_block.data());
-    if (indirect_block_res.is_err()) {
-      error_code = indirect_block_res.unwrap_error();
-      goto err_ret;
-    }
-  }
-
   if (new_block_num > old_block_num) {
     // If we need to allocate more blocks.
     for (usize idx = old_block_num; idx < new_block_num; ++idx) {
-
-      // the case of allocating more blocks.
-      // Allocate a block.
-      auto block_res = this->block_allocator_->allocate();
+      // Fill the allocated block id to the block map,
+      // which handles the indirect block or the extent tree.
+      auto block_res = this->map_new_block(block_map, idx);
       if (block_res.is_err()) {
         error_code = block_res.unwrap_error();
         goto err_ret;
       }
-
-      // Fill the allocated block id to the inode.
-      // You should pay attention to the case of indirect block.
-      // You may use function `get_or_insert_indirect_block`
-      // in the case of indirect block.
-      if (inode_p->is_direct_block(idx)) {
-        inode_p->set_block_direct(idx, block_res.unwrap());
-      } else {
-        indirect_block_p[idx - inlined_blocks_num] = block_res.unwrap();
-      }
     }
-
-  } else {
+  } else if (new_block_num < old_block_num) {
     // We need to free the extra blocks.
-    for (usize idx = new_block_num; idx < old_block_num; ++idx) {
-      if (inode_p->is_direct_block(idx)) {
-
-        // Free the direct extra block.
-        auto res = this->block_allocator_->deallocate(inode_p->blocks[idx]);
-        if (res.is_err()) {
-          error_code = res.unwrap_error();
-          goto err_ret;
-        }
-
-      } else {
-
-        // Free the indirect extra block.
-        auto res = this->block_allocator_->deallocate(
-            indirect_block_p[idx - inlined_blocks_num]);
-        if (res.is_err()) {
-          error_code = res.unwrap_error();
-          goto err_ret;
-        }
-
-      }
+    auto res = block_map.truncate(new_block_num, free_set);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
     }
 
-    // If there are no more indirect blocks.
-    if (old_block_num > inlined_blocks_num &&
-        new_block_num <= inlined_blocks_num && true) {
-
-      auto res =
-          this->block_allocator_->deallocate(inode_p->get_indirect_block_id());
-      if (res.is_err()) {
-        error_code = res.unwrap_error();
-        goto err_ret;
-      }
-      indirect_block.clear();
-      inode_p->invalid_indirect_block_id();
+    res = this->release_blocks(free_set);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
     }
   }
 
   // 3. write the contents
-  inode_p->inner_attr.size = content.size();
-  inode_p->inner_attr.mtime = time(0);
-
   {
-    auto block_idx = 0;
+    usize block_idx = 0;
     u64 write_sz = 0;
+    std::vector<u8> buffer(block_size);
 
     while (write_sz < content.size()) {
       auto sz = ((content.size() - write_sz) > block_size)
                     ? block_size
                     : (content.size() - write_sz);
-      std::vector<u8> buffer(block_size);
       memcpy(buffer.data(), content.data() + write_sz, sz);
-      block_id_t curr_block_id;
 
-      if (inode_p->is_direct_block(block_idx)) {
-
-        // getting block id of current direct block.
-        curr_block_id = inode_p->blocks[block_idx];
+      auto bid_res = block_map.lookup(block_idx);
+      if (bid_res.is_err()) {
+        error_code = bid_res.unwrap_error();
+        goto err_ret;
+      }
 
+      // A hole is filled now
+      auto bid = bid_res.unwrap();
+      if (bid == KInvalidBlockID) {
+        auto block_res = this->map_new_block(block_map, block_idx);
+        if (block_res.is_err()) {
+          error_code = block_res.unwrap_error();
+          goto err_ret;
+        }
+        bid = block_res.unwrap();
       } else {
-
-        // getting block id of current indirect block.
-        curr_block_id = indirect_block_p[block_idx - inlined_blocks_num];
-
+        // A block shared with a clone is copied on its first write
+        auto shared_res = this->is_shared(id, inode_p, bid);
+        if (shared_res.is_err()) {
+          error_code = shared_res.unwrap_error();
+          goto err_ret;
+        }
+        if (shared_res.unwrap()) {
+          auto new_res =
+              this->break_sharing(block_map, block_idx, bid, false);
+          if (new_res.is_err()) {
+            error_code = new_res.unwrap_error();
+            goto err_ret;
+          }
+          bid = new_res.unwrap();
+        }
       }
 
       // Write to current block.
-      auto write_res =
-          this->block_manager_->write_block(curr_block_id, buffer.data());
+      auto write_res = this->block_manager_->write_block(bid, buffer.data());
       if (write_res.is_err()) {
         error_code = write_res.unwrap_error();
         goto err_ret;
@@ -233,25 +365,34 @@ auto FileOperation::write_file(inode_id_t id, const std::vector<u8> &content)
 
   // finally, update the inode
   {
-    inode_p->inner_attr.set_all_time(time(0));
+    inode_p->inner_attr.size = content.size();
 
-    auto write_res =
-        this->block_manager_->write_block(inode_res.unwrap(), inode.data());
+    auto write_res = block_map.flush();
     if (write_res.is_err()) {
       error_code = write_res.unwrap_error();
       goto err_ret;
     }
-    if (indirect_block.size() != 0) {
+
+    if (this->lazytime_ && original_inode == inode) {
+      // only the timestamps change, defer them
+      write_res = this->defer_time(id, time(0));
+    } else {
+      inode_p->inner_attr.set_all_time(time(0));
       write_res =
-          inode_p->write_indirect_block(this->block_manager_, indirect_block);
-      if (write_res.is_err()) {
-        error_code = write_res.unwrap_error();
-        goto err_ret;
+          this->block_manager_->write_block(inode_res.unwrap(), inode.data());
+      if (write_res.is_ok()) {
+        // the deferred timestamps are overwritten
+        std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+        this->lazy_times_.erase(id);
       }
     }
+    if (write_res.is_err()) {
+      error_code = write_res.unwrap_error();
+      goto err_ret;
+    }
   }
 
-  return KNullOk;
+  return this->flush_usage();
 
 err_ret:
   // std::cerr << "write file return error: " << (int)error_code << std::endl;
@@ -267,11 +408,11 @@ auto FileOperation::read_file(inode_id_t id) -> ChfsResult<std::vector<u8>> {
 
   // 1. read the inode
   std::vector<u8> inode(block_size);
-  std::vector<u8> indirect_block(0);
-  indirect_block.reserve(block_size);
+  std::vector<u8> buffer(block_size);
 
   auto inode_p = reinterpret_cast<Inode *>(inode.data());
-  auto indirect_block_p = reinterpret_cast<block_id_t *>(indirect_block.data());
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
   u64 file_sz = 0;
   u64 read_sz = 0;
 
@@ -285,44 +426,28 @@ auto FileOperation::read_file(inode_id_t id) -> ChfsResult<std::vector<u8>> {
   file_sz = inode_p->get_size();
   content.reserve(file_sz);
 
-  // get the indirect block if needed
-  if (calculate_block_sz(file_sz, block_size) >
-      inode_p->get_direct_block_num()) {
-    auto indirect_block_id_res = inode_p->get_indirect_block_id();
-    if (indirect_block_id_res == KInvalidBlockID) {
-      error_code = ErrorType::INVALID_ARG;
-      goto err_ret;
-    }
-
-    auto indirect_block_res = this->block_manager_->read_block(
-        indirect_block_id_res, indirect_block.data());
-    if (indirect_block_res.is_err()) {
-      error_code = indirect_block_res.unwrap_error();
-      goto err_ret;
-    }
-  }
-
   // Now read the file
   while (read_sz < file_sz) {
-    auto sz = ((inode_p->get_size() - read_sz) > block_size)
-                  ? block_size
-                  : (inode_p->get_size() - read_sz);
-    std::vector<u8> buffer(block_size);
-    block_id_t curr_block_id;
+    auto sz = ((file_sz - read_sz) > block_size) ? block_size
+                                                 : (file_sz - read_sz);
 
     // Get current block id.
-    if (inode_p->is_direct_block(read_sz / block_size)) {
-      // the case of direct block.
-      curr_block_id = inode_p->blocks[read_sz / block_size];
-    } else {
-      // the case of indirect block.
-      curr_block_id = indirect_block_p[read_sz / block_size -
-                                       inode_p->get_direct_block_num()];
+    auto bid_res = block_map.lookup(read_sz / block_size);
+    if (bid_res.is_err()) {
+      error_code = bid_res.unwrap_error();
+      goto err_ret;
+    }
+
+    // A hole reads as zeros
+    if (bid_res.unwrap() == KInvalidBlockID) {
+      content.insert(content.end(), sz, 0);
+      read_sz += sz;
+      continue;
     }
 
     // Read from current block and store to `content`.
     auto read_res =
-        this->block_manager_->read_block(curr_block_id, buffer.data());
+        this->block_manager_->read_block(bid_res.unwrap(), buffer.data());
     if (read_res.is_err()) {
       error_code = read_res.unwrap_error();
       goto err_ret;
@@ -341,41 +466,418 @@ err_ret:
 
 auto FileOperation::read_file_w_off(inode_id_t id, u64 sz, u64 offset)
     -> ChfsResult<std::vector<u8>> {
-  auto res = read_file(id);
+  std::vector<u8> content(sz);
+  auto res = this->read_file_w_off(id, content.data(), sz, offset);
   if (res.is_err()) {
-    return res;
+    return ChfsResult<std::vector<u8>>(res.unwrap_error());
+  }
+  content.resize(res.unwrap());
+  return ChfsResult<std::vector<u8>>(std::move(content));
+}
+
+auto FileOperation::read_file_w_off(inode_id_t id, u8 *buf, u64 sz,
+                                    u64 offset) -> ChfsResult<u64> {
+  auto error_code = ErrorType::DONE;
+  const auto block_size = this->block_manager_->block_size();
+  u64 file_sz = 0;
+  u64 end = 0;
+
+  std::vector<u8> inode(block_size);
+  std::vector<u8> buffer;
+
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
+
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    error_code = inode_res.unwrap_error();
+    goto err_ret;
   }
 
-  auto content = res.unwrap();
-  return ChfsResult<std::vector<u8>>(
-      std::vector<u8>(content.begin() + offset, content.begin() + offset + sz));
+  file_sz = inode_p->get_size();
+  if (offset >= file_sz) {
+    return ChfsResult<u64>(0);
+  }
+  end = std::min(file_sz, offset + sz);
+
+  for (u64 idx = offset / block_size; idx * block_size < end; ++idx) {
+    auto block_begin = idx * block_size;
+    auto copy_begin = std::max(offset, block_begin);
+    auto copy_end = std::min(end, block_begin + block_size);
+
+    auto bid_res = block_map.lookup(idx);
+    if (bid_res.is_err()) {
+      error_code = bid_res.unwrap_error();
+      goto err_ret;
+    }
+
+    // A hole reads as zeros
+    if (bid_res.unwrap() == KInvalidBlockID) {
+      memset(buf + (copy_begin - offset), 0, copy_end - copy_begin);
+      continue;
+    }
+
+    if (copy_end - copy_begin == block_size) {
+      // read the whole block to the caller's buffer directly
+      auto read_res = this->block_manager_->read_block(
+          bid_res.unwrap(), buf + (copy_begin - offset));
+      if (read_res.is_err()) {
+        error_code = read_res.unwrap_error();
+        goto err_ret;
+      }
+      continue;
+    }
+
+    buffer.resize(block_size);
+    auto read_res =
+        this->block_manager_->read_block(bid_res.unwrap(), buffer.data());
+    if (read_res.is_err()) {
+      error_code = read_res.unwrap_error();
+      goto err_ret;
+    }
+    memcpy(buf + (copy_begin - offset),
+           buffer.data() + (copy_begin - block_begin), copy_end - copy_begin);
+  }
+
+  return ChfsResult<u64>(end - offset);
+
+err_ret:
+  return ChfsResult<u64>(error_code);
+}
+
+auto FileOperation::read_file_segments(inode_id_t id, u64 sz, u64 offset,
+                                       std::vector<ReadSegment> &segments)
+    -> ChfsResult<u64> {
+  auto error_code = ErrorType::DONE;
+  const auto block_size = this->block_manager_->block_size();
+  u64 file_sz = 0;
+  u64 end = 0;
+
+  std::vector<u8> inode(block_size);
+
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
+
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    error_code = inode_res.unwrap_error();
+    goto err_ret;
+  }
+
+  file_sz = inode_p->get_size();
+  if (offset >= file_sz) {
+    return ChfsResult<u64>(0);
+  }
+  end = std::min(file_sz, offset + sz);
+
+  for (u64 idx = offset / block_size; idx * block_size < end; ++idx) {
+    auto block_begin = idx * block_size;
+    auto copy_begin = std::max(offset, block_begin);
+    auto copy_end = std::min(end, block_begin + block_size);
+
+    auto bid_res = block_map.lookup(idx);
+    if (bid_res.is_err()) {
+      error_code = bid_res.unwrap_error();
+      goto err_ret;
+    }
+
+    const u8 *ptr = this->zero_block_.data();
+    if (bid_res.unwrap() != KInvalidBlockID) {
+      auto ptr_res =
+          this->block_manager_->unsafe_get_block_ptr(bid_res.unwrap());
+      if (ptr_res.is_err()) {
+        error_code = ptr_res.unwrap_error();
+        goto err_ret;
+      }
+      ptr = ptr_res.unwrap();
+    }
+    ptr += copy_begin - block_begin;
+
+    if (!segments.empty() &&
+        segments.back().data + segments.back().len == ptr) {
+      segments.back().len += copy_end - copy_begin;
+    } else {
+      segments.push_back({ptr, copy_end - copy_begin});
+    }
+  }
+
+  return ChfsResult<u64>(end - offset);
+
+err_ret:
+  return ChfsResult<u64>(error_code);
+}
+
+auto FileOperation::prefetch(inode_id_t id, u64 first, u64 cnt)
+    -> ChfsNullResult {
+  const auto block_size = this->block_manager_->block_size();
+  std::vector<u8> inode(block_size);
+
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
+
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    return ChfsNullResult(inode_res.unwrap_error());
+  }
+
+  // prefetch the physically contiguous blocks together
+  block_id_t run_start = KInvalidBlockID;
+  usize run_len = 0;
+  for (u64 idx = first; idx < first + cnt; ++idx) {
+    auto bid_res = block_map.lookup(idx);
+    if (bid_res.is_err()) {
+      return ChfsNullResult(bid_res.unwrap_error());
+    }
+    auto bid = bid_res.unwrap();
+    if (run_len != 0 && bid == run_start + run_len) {
+      run_len += 1;
+      continue;
+    }
+
+    if (run_len != 0) {
+      auto res = this->block_manager_->prefetch(run_start, run_len);
+      if (res.is_err()) {
+        return res;
+      }
+    }
+    run_start = bid;
+    run_len = bid == KInvalidBlockID ? 0 : 1;
+  }
+
+  if (run_len != 0) {
+    return this->block_manager_->prefetch(run_start, run_len);
+  }
+  return KNullOk;
 }
 
 auto FileOperation::resize(inode_id_t id, u64 sz) -> ChfsResult<FileAttr> {
-  auto attr_res = this->getattr(id);
-  if (attr_res.is_err()) {
-    return ChfsResult<FileAttr>(attr_res.unwrap_error());
+  auto error_code = ErrorType::DONE;
+  const auto block_size = this->block_manager_->block_size();
+  u64 original_file_sz = 0;
+
+  std::vector<u8> inode(block_size);
+  std::vector<block_id_t> free_set;
+
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
+
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    error_code = inode_res.unwrap_error();
+    goto err_ret;
+  }
+
+  if (sz > inode_p->max_file_sz_supported()) {
+    error_code = ErrorType::OUT_OF_RESOURCE;
+    goto err_ret;
+  }
+
+  original_file_sz = inode_p->get_size();
+  if (original_file_sz == sz) {
+    return this->getattr(id);
   }
 
-  auto attr = attr_res.unwrap();
-  auto file_content = this->read_file(id);
-  if (file_content.is_err()) {
-    return ChfsResult<FileAttr>(file_content.unwrap_error());
+  if (sz < original_file_sz) {
+    // Shrink: unmap the tail blocks and free them in a batch
+    auto res = block_map.truncate(calculate_block_sz(sz, block_size), free_set);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    res = this->release_blocks(free_set);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+  } else {
+    // Extend: the new blocks are holes, only the stale bytes after the old
+    // end of file are zeroed
+    auto res = this->zero_tail(id, inode_p, block_map, original_file_sz);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
   }
 
-  auto content = file_content.unwrap();
+  {
+    inode_p->inner_attr.size = sz;
+    inode_p->inner_attr.set_all_time(time(0));
 
-  if (content.size() != sz) {
-    content.resize(sz);
+    auto res = block_map.flush();
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    res = this->block_manager_->write_block(inode_res.unwrap(), inode.data());
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+    this->lazy_times_.erase(id);
+  }
 
-    auto write_res = this->write_file(id, content);
-    if (write_res.is_err()) {
-      return ChfsResult<FileAttr>(write_res.unwrap_error());
+  {
+    auto res = this->flush_usage();
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
     }
   }
+  return ChfsResult<FileAttr>(inode_p->inner_attr);
 
-  attr.size = sz;
-  return ChfsResult<FileAttr>(attr);
+err_ret:
+  return ChfsResult<FileAttr>(error_code);
+}
+
+auto FileOperation::preallocate(inode_id_t id, u64 offset, u64 len,
+                                bool keep_size) -> ChfsNullResult {
+  auto error_code = ErrorType::DONE;
+  const auto block_size = this->block_manager_->block_size();
+  u64 original_file_sz = 0;
+  u64 first = 0, end = 0;
+  ChfsResult<u64> alloc_res = ChfsResult<u64>(0);
+
+  std::vector<u8> inode(block_size);
+
+  auto inode_p = reinterpret_cast<Inode *>(inode.data());
+  auto block_map =
+      BlockMap(this->block_manager_, this->block_allocator_, inode_p);
+
+  if (len == 0) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  auto inode_res = this->inode_manager_->read_inode(id, inode);
+  if (inode_res.is_err()) {
+    error_code = inode_res.unwrap_error();
+    goto err_ret;
+  }
+  if (inode_p->get_type() != InodeType::FILE) {
+    error_code = ErrorType::INVALID_ARG;
+    goto err_ret;
+  }
+  if (offset + len > inode_p->max_file_sz_supported()) {
+    error_code = ErrorType::OUT_OF_RESOURCE;
+    goto err_ret;
+  }
+
+  // 1. the stale bytes after the old end of file become part of it
+  original_file_sz = inode_p->get_size();
+  if (!keep_size && offset + len > original_file_sz) {
+    auto res = this->zero_tail(id, inode_p, block_map, original_file_sz);
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    inode_p->inner_attr.size = offset + len;
+  }
+
+  // 2. allocate the holes. If we run out of space, the blocks allocated so
+  // far are kept, so the inode is written anyway.
+  first = offset / block_size;
+  end = calculate_block_sz(offset + len, block_size);
+  alloc_res = block_map.preallocate(first, end - first);
+  if (alloc_res.is_err()) {
+    inode_p->inner_attr.size = original_file_sz;
+  }
+
+  // 3. write the inode
+  {
+    inode_p->inner_attr.set_all_time(time(0));
+    auto res = block_map.flush();
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    res = this->block_manager_->write_block(inode_res.unwrap(), inode.data());
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+    std::lock_guard<std::mutex> lock(this->lazytime_mutex_);
+    this->lazy_times_.erase(id);
+  }
+
+  {
+    auto res = this->flush_usage();
+    if (res.is_err()) {
+      error_code = res.unwrap_error();
+      goto err_ret;
+    }
+  }
+  if (alloc_res.is_err()) {
+    return ChfsNullResult(alloc_res.unwrap_error());
+  }
+  return KNullOk;
+
+err_ret:
+  return ChfsNullResult(error_code);
+}
+
+auto FileOperation::map_new_block(BlockMap &block_map, u64 idx)
+    -> ChfsResult<block_id_t> {
+  // the preallocated blocks of an inode without extents look written
+  auto bid_res = block_map.lookup(idx);
+  if (bid_res.is_err() || bid_res.unwrap() != KInvalidBlockID) {
+    return bid_res;
+  }
+
+  auto claim_res = block_map.claim(idx);
+  if (claim_res.is_err() || claim_res.unwrap() != KInvalidBlockID) {
+    return claim_res;
+  }
+
+  auto block_res = this->block_allocator_->allocate();
+  if (block_res.is_err()) {
+    return block_res;
+  }
+  auto res = block_map.set(idx, block_res.unwrap());
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  return block_res;
+}
+
+auto FileOperation::zero_tail(inode_id_t id, const Inode *inode,
+                              BlockMap &block_map, u64 file_sz)
+    -> ChfsNullResult {
+  const auto block_size = this->block_manager_->block_size();
+  auto tail = file_sz % block_size;
+  if (tail == 0) {
+    return KNullOk;
+  }
+
+  auto bid_res = block_map.lookup(file_sz / block_size);
+  if (bid_res.is_err()) {
+    return ChfsNullResult(bid_res.unwrap_error());
+  }
+  auto bid = bid_res.unwrap();
+  if (bid == KInvalidBlockID) {
+    return KNullOk;
+  }
+
+  // The clone still reads the bytes being zeroed, so keep its copy intact
+  auto shared_res = this->is_shared(id, inode, bid);
+  if (shared_res.is_err()) {
+    return ChfsNullResult(shared_res.unwrap_error());
+  }
+  if (shared_res.unwrap()) {
+    auto new_res = this->break_sharing(block_map, file_sz / block_size, bid,
+                                       true);
+    if (new_res.is_err()) {
+      return ChfsNullResult(new_res.unwrap_error());
+    }
+    bid = new_res.unwrap();
+  }
+
+  std::vector<u8> zeros(block_size - tail, 0);
+  return this->block_manager_->write_partial_block(bid, zeros.data(), tail,
+                                                   block_size - tail);
 }
 
 } // namespace chfs
@@ -0,0 +1,135 @@
+#include <algorithm>
+
+#include "filesystem/dentry_cache.h"
+
+namespace chfs {
+
+void DentryCache::erase_entry(EntryIter it) {
+  auto dir = dirs.find(it->parent);
+  dir->second.erase(it->name);
+  if (dir->second.empty()) {
+    dirs.erase(dir);
+  }
+  lru.erase(it);
+}
+
+auto DentryCache::get(inode_id_t parent, const std::string &name)
+    -> std::optional<inode_id_t> {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto dir = dirs.find(parent);
+  if (dir == dirs.end()) {
+    stats.misses += 1;
+    return std::nullopt;
+  }
+  auto entry = dir->second.find(name);
+  if (entry == dir->second.end()) {
+    stats.misses += 1;
+    return std::nullopt;
+  }
+
+  stats.hits += 1;
+  lru.splice(lru.begin(), lru, entry->second);
+  return entry->second->id;
+}
+
+void DentryCache::put_entry(inode_id_t parent, const std::string &name,
+                            inode_id_t id) {
+  if (capacity == 0) {
+    return;
+  }
+
+  auto &dir = dirs[parent];
+  auto entry = dir.find(name);
+  if (entry != dir.end()) {
+    entry->second->id = id;
+    lru.splice(lru.begin(), lru, entry->second);
+    return;
+  }
+
+  lru.push_front({parent, name, id});
+  dir.emplace(name, lru.begin());
+  if (lru.size() > capacity) {
+    erase_entry(std::prev(lru.end()));
+  }
+}
+
+void DentryCache::erase_name(inode_id_t parent, const std::string &name) {
+  auto dir = dirs.find(parent);
+  if (dir == dirs.end()) {
+    return;
+  }
+  auto entry = dir->second.find(name);
+  if (entry != dir->second.end()) {
+    erase_entry(entry->second);
+  }
+}
+
+void DentryCache::put(inode_id_t parent, const std::string &name,
+                      inode_id_t id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  put_entry(parent, name, id);
+}
+
+void DentryCache::erase(inode_id_t parent, const std::string &name) {
+  std::lock_guard<std::mutex> lock(mutex);
+  erase_name(parent, name);
+}
+
+void DentryCache::stage(inode_id_t parent, const std::string &name,
+                        inode_id_t id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  // the old entry must not be seen while the transaction can be aborted
+  erase_name(parent, name);
+  staged.push_back({parent, name, id});
+}
+
+void DentryCache::publish() {
+  std::lock_guard<std::mutex> lock(mutex);
+  // in order, so a later update of a name wins
+  for (const auto &entry : staged) {
+    put_entry(entry.parent, entry.name, entry.id);
+  }
+  staged.clear();
+}
+
+void DentryCache::discard() {
+  std::lock_guard<std::mutex> lock(mutex);
+  staged.clear();
+}
+
+void DentryCache::erase_dir(inode_id_t parent) {
+  std::lock_guard<std::mutex> lock(mutex);
+  staged.erase(std::remove_if(staged.begin(), staged.end(),
+                              [parent](const Entry &entry) {
+                                return entry.parent == parent;
+                              }),
+               staged.end());
+
+  auto dir = dirs.find(parent);
+  if (dir == dirs.end()) {
+    return;
+  }
+  for (auto &[name, it] : dir->second) {
+    lru.erase(it);
+  }
+  dirs.erase(dir);
+}
+
+void DentryCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.clear();
+  dirs.clear();
+  staged.clear();
+}
+
+auto DentryCache::size() -> usize {
+  std::lock_guard<std::mutex> lock(mutex);
+  return lru.size();
+}
+
+auto DentryCache::get_stats() -> DentryCacheStats {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+} // namespace chfs
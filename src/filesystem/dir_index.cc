@@ -0,0 +1,814 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <map>
+
+#include "filesystem/directory_op.h"
+
+namespace chfs {
+
+namespace {
+
+enum class DirFormat { Empty, Text, Hashed };
+
+// The blocks on the path from the root to the leaf covering a hash
+struct DirPath {
+  std::vector<u8> root;
+  usize root_pos;
+  // empty if the root points to the leaves directly
+  std::vector<u8> index;
+  u32 index_block;
+  usize index_pos;
+  std::vector<u8> leaf;
+  u32 leaf_block;
+};
+
+// FNV-1a
+auto dir_hash(const std::string &name) -> u32 {
+  u32 hash = 2166136261u;
+  for (auto ch : name) {
+    hash ^= static_cast<u8>(ch);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+auto header_of(std::vector<u8> &block) -> DirBlockHeader * {
+  return reinterpret_cast<DirBlockHeader *>(block.data());
+}
+
+auto index_of(std::vector<u8> &block) -> DirIndexEntry * {
+  return reinterpret_cast<DirIndexEntry *>(block.data() +
+                                           sizeof(DirBlockHeader));
+}
+
+auto entry_at(std::vector<u8> &block, usize off) -> DirEntryHeader * {
+  return reinterpret_cast<DirEntryHeader *>(block.data() + off);
+}
+
+// The bytes the entry needs, its slot may be larger
+auto entry_size(const DirEntryHeader *entry) -> usize {
+  return sizeof(DirEntryHeader) + entry->name_len;
+}
+
+auto is_free_slot(const DirEntryHeader *entry) -> bool {
+  return entry->id == KInvalidInodeID;
+}
+
+auto index_capacity(usize block_size) -> usize {
+  return (block_size - sizeof(DirBlockHeader)) / sizeof(DirIndexEntry);
+}
+
+// Any two entries fit in a leaf, so a leaf can always be split for a new one
+auto max_name_len(usize block_size) -> usize {
+  return (block_size - sizeof(DirBlockHeader)) / 2 - sizeof(DirEntryHeader);
+}
+
+auto init_block(std::vector<u8> &block, usize block_size, DirBlockType type) {
+  block.assign(block_size, 0);
+  auto hdr = header_of(block);
+  hdr->magic = KDirMagic;
+  hdr->type = static_cast<u16>(type);
+}
+
+// The position of the last index entry whose hash <= @hash.
+// The first entry of a block always covers its whole range.
+auto find_index(std::vector<u8> &block, u32 hash) -> usize {
+  auto entries = index_of(block);
+  usize lo = 0;
+  usize hi = header_of(block)->count;
+  while (lo + 1 < hi) {
+    auto mid = (lo + hi) / 2;
+    if (entries[mid].hash <= hash) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+auto insert_index(std::vector<u8> &block, usize pos, u32 hash, u32 id) {
+  auto hdr = header_of(block);
+  auto entries = index_of(block);
+  std::memmove(entries + pos + 1, entries + pos,
+               (hdr->count - pos) * sizeof(DirIndexEntry));
+  entries[pos] = {hash, id};
+  hdr->count += 1;
+}
+
+// The offset of the entry named @name in the leaf, or 0 if not found
+auto find_in_leaf(std::vector<u8> &leaf, const std::string &name, u32 hash)
+    -> usize {
+  auto end = sizeof(DirBlockHeader) + header_of(leaf)->used;
+  for (usize off = sizeof(DirBlockHeader); off < end;) {
+    auto entry = entry_at(leaf, off);
+    if (!is_free_slot(entry) && entry->hash == hash &&
+        entry->name_len == name.size() &&
+        std::memcmp(leaf.data() + off + sizeof(DirEntryHeader), name.data(),
+                    name.size()) == 0) {
+      return off;
+    }
+    off += entry->rec_len;
+  }
+  return 0;
+}
+
+// The offset of the first free slot of at least @len bytes, or 0 if none
+auto find_free_slot(std::vector<u8> &leaf, usize len) -> usize {
+  auto hdr = header_of(leaf);
+  if (hdr->dead < len) {
+    return 0;
+  }
+  auto end = sizeof(DirBlockHeader) + hdr->used;
+  for (usize off = sizeof(DirBlockHeader); off < end;) {
+    auto entry = entry_at(leaf, off);
+    if (is_free_slot(entry) && entry->rec_len >= len) {
+      return off;
+    }
+    off += entry->rec_len;
+  }
+  return 0;
+}
+
+// Move the entries of the leaf together, dropping the free slots
+auto compact_leaf(std::vector<u8> &leaf) {
+  auto hdr = header_of(leaf);
+  auto end = sizeof(DirBlockHeader) + hdr->used;
+  usize tail = sizeof(DirBlockHeader);
+  for (usize off = sizeof(DirBlockHeader); off < end;) {
+    auto entry = entry_at(leaf, off);
+    auto next = off + entry->rec_len;
+    if (!is_free_slot(entry)) {
+      auto len = entry_size(entry);
+      std::memmove(leaf.data() + tail, leaf.data() + off, len);
+      entry_at(leaf, tail)->rec_len = len;
+      tail += len;
+    }
+    off = next;
+  }
+  std::memset(leaf.data() + tail, 0, end - tail);
+  hdr->used = tail - sizeof(DirBlockHeader);
+  hdr->dead = 0;
+}
+
+auto read_dir_block(FileOperation *fs, inode_id_t dir, u32 idx,
+                    std::vector<u8> &block) -> ChfsNullResult {
+  const auto block_size = fs->get_block_size();
+  block.assign(block_size, 0);
+  auto res = fs->read_file_w_off(dir, block.data(), block_size,
+                                 static_cast<u64>(idx) * block_size);
+  if (res.is_err()) {
+    return ChfsNullResult(res.unwrap_error());
+  }
+  if (res.unwrap() != block_size || header_of(block)->magic != KDirMagic) {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+  return KNullOk;
+}
+
+auto write_dir_blocks(FileOperation *fs, inode_id_t dir,
+                      const std::map<u32, std::vector<u8>> &blocks)
+    -> ChfsNullResult {
+  const auto block_size = fs->get_block_size();
+  std::vector<WriteRange> ranges;
+  for (const auto &[idx, block] : blocks) {
+    ranges.push_back(
+        {static_cast<u64>(idx) * block_size, block.data(), block_size});
+  }
+  return fs->write_file_ranges(dir, ranges);
+}
+
+auto read_root(FileOperation *fs, inode_id_t dir, std::vector<u8> &root)
+    -> ChfsResult<DirFormat> {
+  const auto block_size = fs->get_block_size();
+  root.assign(block_size, 0);
+  auto res = fs->read_file_w_off(dir, root.data(), block_size, 0);
+  if (res.is_err()) {
+    return ChfsResult<DirFormat>(res.unwrap_error());
+  }
+  auto sz = res.unwrap();
+  if (sz == 0) {
+    return ChfsResult<DirFormat>(DirFormat::Empty);
+  }
+  if (sz < sizeof(DirBlockHeader) || header_of(root)->magic != KDirMagic) {
+    return ChfsResult<DirFormat>(DirFormat::Text);
+  }
+  if (sz != block_size ||
+      header_of(root)->type != static_cast<u16>(DirBlockType::Root)) {
+    return ChfsResult<DirFormat>(ErrorType::INVALID);
+  }
+  return ChfsResult<DirFormat>(DirFormat::Hashed);
+}
+
+// Read the blocks from the root (already in @path) to the leaf of @hash
+auto walk(FileOperation *fs, inode_id_t dir, u32 hash, DirPath &path)
+    -> ChfsNullResult {
+  path.root_pos = find_index(path.root, hash);
+  auto child = index_of(path.root)[path.root_pos].block;
+  path.index.clear();
+
+  if (header_of(path.root)->levels > 0) {
+    path.index_block = child;
+    auto res = read_dir_block(fs, dir, child, path.index);
+    if (res.is_err()) {
+      return res;
+    }
+    path.index_pos = find_index(path.index, hash);
+    child = index_of(path.index)[path.index_pos].block;
+  }
+
+  path.leaf_block = child;
+  return read_dir_block(fs, dir, child, path.leaf);
+}
+
+// Append the entries of the leaf whose hashes >= @start, sorted by hash
+auto collect_leaf(FileOperation *fs, inode_id_t dir, u32 block, u64 start,
+                  std::vector<ReaddirEntry> &entries) -> ChfsNullResult {
+  std::vector<u8> leaf;
+  auto res = read_dir_block(fs, dir, block, leaf);
+  if (res.is_err()) {
+    return res;
+  }
+
+  auto begin = entries.size();
+  auto end = sizeof(DirBlockHeader) + header_of(leaf)->used;
+  for (usize off = sizeof(DirBlockHeader); off < end;) {
+    auto entry = entry_at(leaf, off);
+    if (!is_free_slot(entry) && entry->hash >= start) {
+      auto name = reinterpret_cast<const char *>(entry + 1);
+      entries.push_back({std::string(name, entry->name_len), entry->id,
+                         static_cast<u64>(entry->hash) + 1});
+    }
+    off += entry->rec_len;
+  }
+  std::sort(entries.begin() + begin, entries.end(),
+            [](const ReaddirEntry &a, const ReaddirEntry &b) {
+              return a.cookie != b.cookie ? a.cookie < b.cookie
+                                          : a.name < b.name;
+            });
+  return KNullOk;
+}
+
+// Convert a directory in the text format. The hashed blocks are built in
+// memory and written over the text at once, so a failure leaves the
+// directory as it was.
+auto convert_directory(FileOperation *fs, inode_id_t dir) -> ChfsNullResult {
+  const auto block_size = fs->get_block_size();
+  std::list<DirectoryEntry> list;
+  auto res = read_directory(fs, dir, list);
+  if (res.is_err()) {
+    return res;
+  }
+  if (list.empty()) {
+    auto resize_res = fs->resize(dir, 0);
+    if (resize_res.is_err()) {
+      return ChfsNullResult(resize_res.unwrap_error());
+    }
+    return KNullOk;
+  }
+
+  struct Item {
+    u32 hash;
+    const DirectoryEntry *entry;
+  };
+  std::vector<Item> items;
+  for (const auto &entry : list) {
+    if (entry.name.empty() || entry.name.size() > max_name_len(block_size)) {
+      return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+    items.push_back({dir_hash(entry.name), &entry});
+  }
+  std::stable_sort(items.begin(), items.end(),
+                   [](const Item &a, const Item &b) { return a.hash < b.hash; });
+  for (usize i = 1; i < items.size(); ++i) {
+    if (items[i].hash == items[i - 1].hash &&
+        items[i].entry->name == items[i - 1].entry->name) {
+      return ChfsNullResult(ErrorType::AlreadyExist);
+    }
+  }
+
+  // 1. pack the leaves from block 1 in hash order, the entries of a hash
+  // stay in one leaf
+  std::map<u32, std::vector<u8>> blocks;
+  std::vector<DirIndexEntry> leaves;
+  for (usize begin = 0; begin < items.size();) {
+    auto end = begin;
+    usize group_len = 0;
+    while (end < items.size() && items[end].hash == items[begin].hash) {
+      group_len += sizeof(DirEntryHeader) + items[end].entry->name.size();
+      end++;
+    }
+    if (sizeof(DirBlockHeader) + group_len > block_size) {
+      return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+    }
+
+    if (leaves.empty() || sizeof(DirBlockHeader) +
+                                  header_of(blocks[leaves.back().block])->used +
+                                  group_len >
+                              block_size) {
+      auto idx = static_cast<u32>(leaves.size() + 1);
+      init_block(blocks[idx], block_size, DirBlockType::Leaf);
+      leaves.push_back({leaves.empty() ? 0 : items[begin].hash, idx});
+    }
+    auto &leaf = blocks[leaves.back().block];
+    auto hdr = header_of(leaf);
+    for (auto i = begin; i < end; ++i) {
+      const auto &name = items[i].entry->name;
+      auto off = sizeof(DirBlockHeader) + hdr->used;
+      auto entry = entry_at(leaf, off);
+      entry->id = items[i].entry->id;
+      entry->hash = items[i].hash;
+      entry->rec_len = sizeof(DirEntryHeader) + name.size();
+      entry->name_len = name.size();
+      std::memcpy(leaf.data() + off + sizeof(DirEntryHeader), name.data(),
+                  name.size());
+      hdr->used += entry->rec_len;
+      hdr->count += 1;
+    }
+    begin = end;
+  }
+
+  // 2. index them from the root, with a level of index blocks if needed
+  const auto cap = index_capacity(block_size);
+  std::vector<u8> root;
+  init_block(root, block_size, DirBlockType::Root);
+  auto nblocks = static_cast<u32>(leaves.size() + 1);
+  if (leaves.size() <= cap) {
+    std::memcpy(index_of(root), leaves.data(),
+                leaves.size() * sizeof(DirIndexEntry));
+    header_of(root)->count = leaves.size();
+  } else {
+    if ((leaves.size() + cap - 1) / cap > cap) {
+      return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+    }
+    header_of(root)->levels = 1;
+    for (usize begin = 0; begin < leaves.size(); begin += cap) {
+      auto cnt = std::min<usize>(cap, leaves.size() - begin);
+      auto &index = blocks[nblocks];
+      init_block(index, block_size, DirBlockType::Index);
+      std::memcpy(index_of(index), leaves.data() + begin,
+                  cnt * sizeof(DirIndexEntry));
+      header_of(index)->count = cnt;
+      insert_index(root, header_of(root)->count, leaves[begin].hash, nblocks);
+      nblocks++;
+    }
+  }
+  header_of(root)->nblocks = nblocks;
+  blocks[0] = std::move(root);
+
+  // 3. replace the text, whose tail beyond the blocks is dropped
+  res = write_dir_blocks(fs, dir, blocks);
+  if (res.is_err()) {
+    return res;
+  }
+  auto resize_res =
+      fs->resize(dir, static_cast<u64>(nblocks) * block_size);
+  if (resize_res.is_err()) {
+    return ChfsNullResult(resize_res.unwrap_error());
+  }
+  return KNullOk;
+}
+
+// Insert the index entry of a new block after the one at the path.
+// A full root moves its entries to an index block, and a full index block is
+// split in two.
+auto add_index(DirPath &path, u32 hash, u32 block, usize block_size,
+               std::map<u32, std::vector<u8>> &dirty) -> ChfsNullResult {
+  const auto cap = index_capacity(block_size);
+  auto root_hdr = header_of(path.root);
+
+  if (root_hdr->levels == 0) {
+    if (root_hdr->count < cap) {
+      insert_index(path.root, path.root_pos + 1, hash, block);
+      return KNullOk;
+    }
+    // grow a level
+    path.index_block = root_hdr->nblocks++;
+    init_block(path.index, block_size, DirBlockType::Index);
+    std::memcpy(index_of(path.index), index_of(path.root),
+                root_hdr->count * sizeof(DirIndexEntry));
+    header_of(path.index)->count = root_hdr->count;
+    path.index_pos = path.root_pos;
+    root_hdr->count = 1;
+    root_hdr->levels = 1;
+    index_of(path.root)[0] = {0, path.index_block};
+    path.root_pos = 0;
+  }
+
+  auto index_hdr = header_of(path.index);
+  if (index_hdr->count < cap) {
+    insert_index(path.index, path.index_pos + 1, hash, block);
+    return KNullOk;
+  }
+  if (root_hdr->count >= cap) {
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  // split the index block, the upper half goes to a new one
+  auto half = index_hdr->count / 2;
+  auto new_idx = root_hdr->nblocks++;
+  std::vector<u8> upper;
+  init_block(upper, block_size, DirBlockType::Index);
+  std::memcpy(index_of(upper), index_of(path.index) + half,
+              (index_hdr->count - half) * sizeof(DirIndexEntry));
+  header_of(upper)->count = index_hdr->count - half;
+  index_hdr->count = half;
+  insert_index(path.root, path.root_pos + 1, index_of(upper)[0].hash, new_idx);
+
+  if (path.index_pos < half) {
+    insert_index(path.index, path.index_pos + 1, hash, block);
+  } else {
+    insert_index(upper, path.index_pos - half + 1, hash, block);
+  }
+  dirty[new_idx] = std::move(upper);
+  return KNullOk;
+}
+
+// Split the leaf at the path by hash, the upper half goes to a new leaf
+auto split_leaf(FileOperation *fs, inode_id_t dir, DirPath &path)
+    -> ChfsNullResult {
+  const auto block_size = fs->get_block_size();
+  struct Item {
+    u32 hash;
+    usize off;
+    usize len;
+  };
+
+  // the free slots are dropped
+  std::vector<Item> items;
+  usize total = 0;
+  auto end = sizeof(DirBlockHeader) + header_of(path.leaf)->used;
+  for (usize off = sizeof(DirBlockHeader); off < end;) {
+    auto entry = entry_at(path.leaf, off);
+    if (!is_free_slot(entry)) {
+      items.push_back({entry->hash, off, entry_size(entry)});
+      total += entry_size(entry);
+    }
+    off += entry->rec_len;
+  }
+  std::stable_sort(items.begin(), items.end(),
+                   [](const Item &a, const Item &b) { return a.hash < b.hash; });
+
+  // split near the middle by bytes, and keep the same hashes together
+  usize split = 0;
+  usize bytes = 0;
+  while (split < items.size() && bytes * 2 < total) {
+    bytes += items[split].len;
+    split++;
+  }
+  auto is_boundary = [&](usize i) {
+    return i > 0 && i < items.size() && items[i - 1].hash != items[i].hash;
+  };
+  auto lower = split;
+  while (lower > 0 && !is_boundary(lower)) {
+    lower--;
+  }
+  auto upper = split;
+  while (upper < items.size() && !is_boundary(upper)) {
+    upper++;
+  }
+  if (lower != 0 && (upper == items.size() || split - lower <= upper - split)) {
+    split = lower;
+  } else if (upper != items.size()) {
+    split = upper;
+  } else {
+    // all the entries have the same hash
+    return ChfsNullResult(ErrorType::OUT_OF_RESOURCE);
+  }
+
+  std::vector<u8> low_leaf;
+  std::vector<u8> high_leaf;
+  init_block(low_leaf, block_size, DirBlockType::Leaf);
+  init_block(high_leaf, block_size, DirBlockType::Leaf);
+  for (usize i = 0; i < items.size(); ++i) {
+    auto &leaf = i < split ? low_leaf : high_leaf;
+    auto hdr = header_of(leaf);
+    auto off = sizeof(DirBlockHeader) + hdr->used;
+    std::memcpy(leaf.data() + off, path.leaf.data() + items[i].off,
+                items[i].len);
+    entry_at(leaf, off)->rec_len = items[i].len;
+    hdr->used += items[i].len;
+    hdr->count += 1;
+  }
+
+  std::map<u32, std::vector<u8>> dirty;
+  auto new_leaf = header_of(path.root)->nblocks++;
+  auto res = add_index(path, items[split].hash, new_leaf, block_size, dirty);
+  if (res.is_err()) {
+    return res;
+  }
+  dirty[0] = path.root;
+  if (!path.index.empty()) {
+    dirty[path.index_block] = path.index;
+  }
+  dirty[path.leaf_block] = std::move(low_leaf);
+  dirty[new_leaf] = std::move(high_leaf);
+  return write_dir_blocks(fs, dir, dirty);
+}
+
+} // namespace
+
+auto dir_lookup(FileOperation *fs, inode_id_t dir, const std::string &name)
+    -> ChfsResult<inode_id_t> {
+  DirPath path;
+  auto format_res = read_root(fs, dir, path.root);
+  if (format_res.is_err()) {
+    return ChfsResult<inode_id_t>(format_res.unwrap_error());
+  }
+
+  switch (format_res.unwrap()) {
+  case DirFormat::Empty:
+    return ChfsResult<inode_id_t>(ErrorType::NotExist);
+  case DirFormat::Text: {
+    std::list<DirectoryEntry> list;
+    auto res = read_directory(fs, dir, list);
+    if (res.is_err()) {
+      return ChfsResult<inode_id_t>(res.unwrap_error());
+    }
+    for (const auto &entry : list) {
+      if (entry.name == name) {
+        return ChfsResult<inode_id_t>(entry.id);
+      }
+    }
+    return ChfsResult<inode_id_t>(ErrorType::NotExist);
+  }
+  case DirFormat::Hashed:
+    break;
+  }
+
+  auto hash = dir_hash(name);
+  auto res = walk(fs, dir, hash, path);
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  auto off = find_in_leaf(path.leaf, name, hash);
+  if (off == 0) {
+    return ChfsResult<inode_id_t>(ErrorType::NotExist);
+  }
+  return ChfsResult<inode_id_t>(entry_at(path.leaf, off)->id);
+}
+
+auto dir_read_entries(FileOperation *fs, inode_id_t dir, u64 cookie,
+                      usize max_entries)
+    -> ChfsResult<std::vector<ReaddirEntry>> {
+  using ResType = ChfsResult<std::vector<ReaddirEntry>>;
+  std::vector<ReaddirEntry> entries;
+  std::vector<u8> root;
+  auto format_res = read_root(fs, dir, root);
+  if (format_res.is_err()) {
+    return ResType(format_res.unwrap_error());
+  }
+
+  switch (format_res.unwrap()) {
+  case DirFormat::Empty:
+    return ResType(entries);
+  case DirFormat::Text: {
+    std::list<DirectoryEntry> list;
+    auto res = read_directory(fs, dir, list);
+    if (res.is_err()) {
+      return ResType(res.unwrap_error());
+    }
+    u64 pos = 0;
+    for (const auto &entry : list) {
+      pos += 1;
+      if (pos > cookie && entries.size() < max_entries) {
+        entries.push_back({entry.name, entry.id, pos});
+      }
+    }
+    return ResType(entries);
+  }
+  case DirFormat::Hashed:
+    break;
+  }
+
+  // the hashes are u32, so the cookie after the last one is 2^32
+  if (cookie > std::numeric_limits<u32>::max() || max_entries == 0) {
+    return ResType(entries);
+  }
+  const auto start = static_cast<u32>(cookie);
+
+  // visit the leaves in the order of hashes, from the one covering the cookie
+  auto root_hdr = header_of(root);
+  std::vector<u8> index;
+  for (auto i = find_index(root, start);
+       i < root_hdr->count && entries.size() < max_entries; ++i) {
+    auto child = index_of(root)[i].block;
+    if (root_hdr->levels == 0) {
+      auto res = collect_leaf(fs, dir, child, cookie, entries);
+      if (res.is_err()) {
+        return ResType(res.unwrap_error());
+      }
+      continue;
+    }
+
+    auto res = read_dir_block(fs, dir, child, index);
+    if (res.is_err()) {
+      return ResType(res.unwrap_error());
+    }
+    for (auto j = find_index(index, start);
+         j < header_of(index)->count && entries.size() < max_entries; ++j) {
+      res = collect_leaf(fs, dir, index_of(index)[j].block, cookie, entries);
+      if (res.is_err()) {
+        return ResType(res.unwrap_error());
+      }
+    }
+  }
+
+  // keep the entries sharing the cookie of the last one
+  auto cut = std::min<usize>(max_entries, entries.size());
+  while (cut < entries.size() &&
+         entries[cut].cookie == entries[cut - 1].cookie) {
+    cut++;
+  }
+  entries.resize(cut);
+  return ResType(entries);
+}
+
+auto dir_add_entry(FileOperation *fs, inode_id_t dir, const std::string &name,
+                   inode_id_t id) -> ChfsNullResult {
+  const auto block_size = fs->get_block_size();
+  if (name.empty() || name.size() > max_name_len(block_size)) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  DirPath path;
+  auto format_res = read_root(fs, dir, path.root);
+  if (format_res.is_err()) {
+    return ChfsNullResult(format_res.unwrap_error());
+  }
+
+  switch (format_res.unwrap()) {
+  case DirFormat::Text: {
+    auto res = convert_directory(fs, dir);
+    if (res.is_err()) {
+      return res;
+    }
+    return dir_add_entry(fs, dir, name, id);
+  }
+  case DirFormat::Empty: {
+    // a root pointing to an empty leaf
+    std::map<u32, std::vector<u8>> blocks;
+    init_block(path.root, block_size, DirBlockType::Root);
+    header_of(path.root)->count = 1;
+    header_of(path.root)->nblocks = 2;
+    index_of(path.root)[0] = {0, 1};
+    init_block(blocks[1], block_size, DirBlockType::Leaf);
+    blocks[0] = path.root;
+    auto res = write_dir_blocks(fs, dir, blocks);
+    if (res.is_err()) {
+      return res;
+    }
+    break;
+  }
+  case DirFormat::Hashed:
+    break;
+  }
+
+  auto hash = dir_hash(name);
+  const auto rec_len = sizeof(DirEntryHeader) + name.size();
+  while (true) {
+    auto res = walk(fs, dir, hash, path);
+    if (res.is_err()) {
+      return res;
+    }
+    if (find_in_leaf(path.leaf, name, hash) != 0) {
+      return ChfsNullResult(ErrorType::AlreadyExist);
+    }
+
+    // reuse a free slot, or append at the end of the leaf
+    auto hdr = header_of(path.leaf);
+    auto off = find_free_slot(path.leaf, rec_len);
+    if (off != 0) {
+      hdr->dead -= entry_at(path.leaf, off)->rec_len;
+    } else {
+      if (sizeof(DirBlockHeader) + hdr->used + rec_len > block_size) {
+        compact_leaf(path.leaf);
+      }
+      if (sizeof(DirBlockHeader) + hdr->used + rec_len > block_size) {
+        // the root is changed by the split, so walk again from it
+        res = split_leaf(fs, dir, path);
+        if (res.is_err()) {
+          return res;
+        }
+        continue;
+      }
+      off = sizeof(DirBlockHeader) + hdr->used;
+      entry_at(path.leaf, off)->rec_len = rec_len;
+      hdr->used += rec_len;
+    }
+
+    auto entry = entry_at(path.leaf, off);
+    entry->id = id;
+    entry->hash = hash;
+    entry->name_len = name.size();
+    std::memcpy(path.leaf.data() + off + sizeof(DirEntryHeader), name.data(),
+                name.size());
+    hdr->count += 1;
+    res = write_dir_blocks(fs, dir, {{path.leaf_block, path.leaf}});
+    if (res.is_err()) {
+      return res;
+    }
+    fs->cache_dentry(dir, name, id);
+    return KNullOk;
+  }
+}
+
+auto dir_remove_entry(FileOperation *fs, inode_id_t dir,
+                      const std::string &name) -> ChfsResult<inode_id_t> {
+  DirPath path;
+  auto format_res = read_root(fs, dir, path.root);
+  if (format_res.is_err()) {
+    return ChfsResult<inode_id_t>(format_res.unwrap_error());
+  }
+
+  switch (format_res.unwrap()) {
+  case DirFormat::Empty:
+    return ChfsResult<inode_id_t>(ErrorType::NotExist);
+  case DirFormat::Text: {
+    auto res = convert_directory(fs, dir);
+    if (res.is_err()) {
+      return ChfsResult<inode_id_t>(res.unwrap_error());
+    }
+    return dir_remove_entry(fs, dir, name);
+  }
+  case DirFormat::Hashed:
+    break;
+  }
+
+  auto hash = dir_hash(name);
+  auto res = walk(fs, dir, hash, path);
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  auto off = find_in_leaf(path.leaf, name, hash);
+  if (off == 0) {
+    return ChfsResult<inode_id_t>(ErrorType::NotExist);
+  }
+
+  // leave a free slot, or give the last slot back to the end of the leaf.
+  // The leaves are never merged.
+  auto hdr = header_of(path.leaf);
+  auto entry = entry_at(path.leaf, off);
+  inode_id_t id = entry->id;
+  entry->id = KInvalidInodeID;
+  if (off + entry->rec_len == sizeof(DirBlockHeader) + hdr->used) {
+    hdr->used -= entry->rec_len;
+  } else {
+    hdr->dead += entry->rec_len;
+  }
+  hdr->count -= 1;
+
+  res = write_dir_blocks(fs, dir, {{path.leaf_block, path.leaf}});
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  fs->cache_dentry(dir, name, KInvalidInodeID);
+  return ChfsResult<inode_id_t>(id);
+}
+
+auto dir_replace_entry(FileOperation *fs, inode_id_t dir,
+                       const std::string &name, inode_id_t id)
+    -> ChfsResult<inode_id_t> {
+  DirPath path;
+  auto format_res = read_root(fs, dir, path.root);
+  if (format_res.is_err()) {
+    return ChfsResult<inode_id_t>(format_res.unwrap_error());
+  }
+
+  switch (format_res.unwrap()) {
+  case DirFormat::Empty:
+    return ChfsResult<inode_id_t>(ErrorType::NotExist);
+  case DirFormat::Text: {
+    auto res = convert_directory(fs, dir);
+    if (res.is_err()) {
+      return ChfsResult<inode_id_t>(res.unwrap_error());
+    }
+    return dir_replace_entry(fs, dir, name, id);
+  }
+  case DirFormat::Hashed:
+    break;
+  }
+
+  auto hash = dir_hash(name);
+  auto res = walk(fs, dir, hash, path);
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  auto off = find_in_leaf(path.leaf, name, hash);
+  if (off == 0) {
+    return ChfsResult<inode_id_t>(ErrorType::NotExist);
+  }
+
+  auto entry = entry_at(path.leaf, off);
+  inode_id_t old_id = entry->id;
+  entry->id = id;
+  res = write_dir_blocks(fs, dir, {{path.leaf_block, path.leaf}});
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  fs->cache_dentry(dir, name, id);
+  return ChfsResult<inode_id_t>(old_id);
+}
+
+} // namespace chfs
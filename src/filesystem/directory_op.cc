@@ -71,15 +71,25 @@ auto rm_from_directory(std::string src, std::string filename) -> std::string {
 
   auto res = std::string("");
 
-  // Remove the directory entry from `src`.
-  std::list<DirectoryEntry> list;
-  parse_directory(src, list);
-
-  list.remove_if([filename](const DirectoryEntry &entry) {
-    return entry.name == filename;
-  });
-
-  res = dir_list_to_string(list);
+  // Remove the directory entry from `src` in one pass,
+  // the other entries are copied as they are.
+  usize begin = 0;
+  while (begin < src.size()) {
+    auto end = src.find('/', begin);
+    if (end == std::string::npos) {
+      end = src.size();
+    }
+    auto pos = src.rfind(':', end - 1);
+    CHFS_ASSERT(pos != std::string::npos && pos >= begin,
+                "Invalid directory entry");
+    if (src.compare(begin, pos - begin, filename) != 0) {
+      if (!res.empty()) {
+        res += '/';
+      }
+      res.append(src, begin, end - begin);
+    }
+    begin = end + 1;
+  }
 
   return res;
 }
@@ -96,8 +106,32 @@ auto read_directory(FileOperation *fs, inode_id_t id,
   }
 
   auto dir_u8v = res.unwrap();
-  std::string dir_str(dir_u8v.begin(), dir_u8v.end());
-  parse_directory(dir_str, list);
+  const auto block_size = fs->get_block_size();
+  auto root = reinterpret_cast<DirBlockHeader *>(dir_u8v.data());
+  if (dir_u8v.size() < sizeof(DirBlockHeader) || root->magic != KDirMagic) {
+    std::string dir_str(dir_u8v.begin(), dir_u8v.end());
+    parse_directory(dir_str, list);
+    return KNullOk;
+  }
+
+  // the entries of the leaves, in the order of the blocks
+  for (usize begin = 0; begin + block_size <= dir_u8v.size();
+       begin += block_size) {
+    auto hdr = reinterpret_cast<DirBlockHeader *>(dir_u8v.data() + begin);
+    if (hdr->magic != KDirMagic ||
+        hdr->type != static_cast<u16>(DirBlockType::Leaf)) {
+      continue;
+    }
+    auto end = begin + sizeof(DirBlockHeader) + hdr->used;
+    for (auto off = begin + sizeof(DirBlockHeader); off < end;) {
+      auto entry = reinterpret_cast<DirEntryHeader *>(dir_u8v.data() + off);
+      auto name = reinterpret_cast<const char *>(entry + 1);
+      if (entry->id != KInvalidInodeID) {
+        list.push_back({std::string(name, entry->name_len), entry->id});
+      }
+      off += entry->rec_len;
+    }
+  }
 
   return KNullOk;
 }
@@ -105,20 +139,26 @@ auto read_directory(FileOperation *fs, inode_id_t id,
 // {Your code here}
 auto FileOperation::lookup(inode_id_t id, const char *name)
     -> ChfsResult<inode_id_t> {
-  std::list<DirectoryEntry> list;
-
-  auto res = read_directory(this, id, list);
-  if (res.is_err()) {
-    return ChfsResult<inode_id_t>(res.unwrap_error());
+  auto cached = dentries_.get(id, name);
+  if (cached.has_value()) {
+    if (cached.value() == KInvalidInodeID) {
+      return ChfsResult<inode_id_t>(ErrorType::NotExist);
+    }
+    return ChfsResult<inode_id_t>(cached.value());
   }
 
-  for (const auto &entry : list) {
-    if (entry.name == name) {
-      return ChfsResult<inode_id_t>(entry.id);
-    }
+  auto res = dir_lookup(this, id, name);
+  if (res.is_ok()) {
+    cache_dentry(id, name, res.unwrap());
+  } else if (res.unwrap_error() == ErrorType::NotExist) {
+    cache_dentry(id, name, KInvalidInodeID);
   }
+  return res;
+}
 
-  return ChfsResult<inode_id_t>(ErrorType::NotExist);
+auto FileOperation::readdir(inode_id_t id, u64 cookie, usize max_entries)
+    -> ChfsResult<std::vector<ReaddirEntry>> {
+  return dir_read_entries(this, id, cookie, max_entries);
 }
 
 // {Your code here}
@@ -139,19 +179,11 @@ auto FileOperation::mk_helper(inode_id_t id, const char *name, InodeType type)
   }
   auto inode_id = inode_res.unwrap();
   
-  // Append the new entry to the parent directory.
-  std::list<DirectoryEntry> list;
-  auto read_res = read_directory(this, id, list);
-  if (read_res.is_err()) {
-    return ChfsResult<inode_id_t>(read_res.unwrap_error());
-  }
-  auto dir_str = dir_list_to_string(list);
-  auto new_dir_str = append_to_directory(dir_str, name, inode_id);
-
-  std::vector<u8> content(new_dir_str.begin(), new_dir_str.end());
-  auto write_res = write_file(id, content);
-  if (write_res.is_err()) {
-    return ChfsResult<inode_id_t>(write_res.unwrap_error());
+  // Add the new entry to the parent directory.
+  auto add_res = dir_add_entry(this, id, name, inode_id);
+  if (add_res.is_err()) {
+    remove_file(inode_id);
+    return ChfsResult<inode_id_t>(add_res.unwrap_error());
   }
 
   return ChfsResult<inode_id_t>(static_cast<inode_id_t>(inode_id));
@@ -174,20 +206,133 @@ auto FileOperation::unlink(inode_id_t parent, const char *name)
   }
   
   // Remove the entry from the directory.
-  std::list<DirectoryEntry> list;
-  auto read_res = read_directory(this, parent, list);
-  if (read_res.is_err()) {
-    return ChfsNullResult(read_res.unwrap_error());
+  auto rm_res = dir_remove_entry(this, parent, name);
+  if (rm_res.is_err()) {
+    return ChfsNullResult(rm_res.unwrap_error());
   }
-  auto dir_str = dir_list_to_string(list);
-  auto new_dir_str = rm_from_directory(dir_str, name);
+  
+  return KNullOk;
+}
 
-  std::vector<u8> content(new_dir_str.begin(), new_dir_str.end());
-  auto write_res = write_file(parent, content);
-  if (write_res.is_err()) {
-    return ChfsNullResult(write_res.unwrap_error());
+auto FileOperation::check_replace(inode_id_t src, inode_id_t target)
+    -> ChfsNullResult {
+  auto src_type = gettype(src);
+  if (src_type.is_err()) {
+    return ChfsNullResult(src_type.unwrap_error());
+  }
+  auto target_type = gettype(target);
+  if (target_type.is_err()) {
+    return ChfsNullResult(target_type.unwrap_error());
+  }
+  if (src_type.unwrap() != target_type.unwrap()) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  if (target_type.unwrap() == InodeType::Directory) {
+    auto entries = readdir(target, 0, 1);
+    if (entries.is_err()) {
+      return ChfsNullResult(entries.unwrap_error());
+    }
+    if (!entries.unwrap().empty()) {
+      return ChfsNullResult(ErrorType::NotEmpty);
+    }
+  }
+  return KNullOk;
+}
+
+auto FileOperation::check_move(inode_id_t src, inode_id_t newparent)
+    -> ChfsNullResult {
+  auto src_type = gettype(src);
+  if (src_type.is_err()) {
+    return ChfsNullResult(src_type.unwrap_error());
+  }
+  if (src_type.unwrap() != InodeType::Directory) {
+    return KNullOk;
+  }
+
+  // there is no link to the parent, so search the subtree of @src
+  std::vector<inode_id_t> dirs{src};
+  while (!dirs.empty()) {
+    auto dir = dirs.back();
+    dirs.pop_back();
+    if (dir == newparent) {
+      return ChfsNullResult(ErrorType::INVALID_ARG);
+    }
+
+    std::list<DirectoryEntry> list;
+    auto read_res = read_directory(this, dir, list);
+    if (read_res.is_err()) {
+      return read_res;
+    }
+    for (const auto &entry : list) {
+      auto type_res = gettype(entry.id);
+      if (type_res.is_err()) {
+        return ChfsNullResult(type_res.unwrap_error());
+      }
+      if (type_res.unwrap() == InodeType::Directory) {
+        dirs.push_back(entry.id);
+      }
+    }
+  }
+  return KNullOk;
+}
+
+auto FileOperation::rename(inode_id_t parent, const char *name,
+                           inode_id_t newparent, const char *newname)
+    -> ChfsNullResult {
+  auto lookup_res = lookup(parent, name);
+  if (lookup_res.is_err()) {
+    return ChfsNullResult(lookup_res.unwrap_error());
+  }
+  auto inode_id = lookup_res.unwrap();
+  if (newparent != parent) {
+    auto move_res = check_move(inode_id, newparent);
+    if (move_res.is_err()) {
+      return move_res;
+    }
+  }
+
+  // The replaced entry is pointed to the inode in place, so running out of
+  // space can't lose the target name.
+  auto target = KInvalidInodeID;
+  auto target_res = lookup(newparent, newname);
+  if (target_res.is_ok()) {
+    target = target_res.unwrap();
+    // both names refer to the same inode, nothing to do
+    if (target == inode_id) {
+      return KNullOk;
+    }
+    auto check_res = check_replace(inode_id, target);
+    if (check_res.is_err()) {
+      return check_res;
+    }
+    auto replace_res = dir_replace_entry(this, newparent, newname, inode_id);
+    if (replace_res.is_err()) {
+      return ChfsNullResult(replace_res.unwrap_error());
+    }
+  } else if (target_res.unwrap_error() != ErrorType::NotExist) {
+    return ChfsNullResult(target_res.unwrap_error());
+  } else {
+    auto add_res = dir_add_entry(this, newparent, newname, inode_id);
+    if (add_res.is_err()) {
+      return add_res;
+    }
+  }
+
+  // Remove the old name, or restore the new one if we can't.
+  auto rm_res = dir_remove_entry(this, parent, name);
+  if (rm_res.is_err()) {
+    if (target != KInvalidInodeID) {
+      dir_replace_entry(this, newparent, newname, target);
+    } else {
+      dir_remove_entry(this, newparent, newname);
+    }
+    return ChfsNullResult(rm_res.unwrap_error());
+  }
+
+  if (target != KInvalidInodeID) {
+    return remove_file(target);
   }
-  
   return KNullOk;
 }
 
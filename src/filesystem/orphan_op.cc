@@ -0,0 +1,114 @@
+#include <algorithm>
+
+#include "filesystem/operations.h"
+
+namespace chfs {
+
+auto FileOperation::get_orphan_inode(bool create) -> ChfsResult<inode_id_t> {
+  inode_id_t id = super_block_->get_orphan_inode();
+  if (id != KInvalidInodeID || !create) {
+    return ChfsResult<inode_id_t>(id);
+  }
+
+  // The list may grow large after removing many files,
+  // so map it with an extent tree regardless of the inode flags
+  auto block_res = this->block_allocator_->allocate();
+  if (block_res.is_err()) {
+    return ChfsResult<inode_id_t>(block_res.unwrap_error());
+  }
+  auto inode_res = this->inode_manager_->allocate_inode(
+      InodeType::FILE, block_res.unwrap(), KInodeExtentFlag);
+  if (inode_res.is_err()) {
+    return ChfsResult<inode_id_t>(inode_res.unwrap_error());
+  }
+
+  super_block_->set_orphan_inode(inode_res.unwrap());
+  auto res = super_block_->flush(0);
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  res = this->flush_usage();
+  if (res.is_err()) {
+    return ChfsResult<inode_id_t>(res.unwrap_error());
+  }
+  return inode_res;
+}
+
+auto FileOperation::push_orphans(const std::vector<OrphanBlock> &blocks)
+    -> ChfsNullResult {
+  if (blocks.empty()) {
+    return KNullOk;
+  }
+  auto orphan_res = this->get_orphan_inode(true);
+  if (orphan_res.is_err()) {
+    return ChfsNullResult(orphan_res.unwrap_error());
+  }
+  auto orphan = orphan_res.unwrap();
+
+  auto attr_res = this->getattr(orphan);
+  if (attr_res.is_err()) {
+    return ChfsNullResult(attr_res.unwrap_error());
+  }
+  WriteRange range = {attr_res.unwrap().size,
+                      reinterpret_cast<const u8 *>(blocks.data()),
+                      blocks.size() * sizeof(OrphanBlock)};
+  return this->write_file_ranges(orphan, {range});
+}
+
+auto FileOperation::get_orphan_num() -> ChfsResult<usize> {
+  auto orphan = super_block_->get_orphan_inode();
+  if (orphan == KInvalidInodeID) {
+    return ChfsResult<usize>(0);
+  }
+  auto attr_res = this->getattr(orphan);
+  if (attr_res.is_err()) {
+    return ChfsResult<usize>(attr_res.unwrap_error());
+  }
+  return ChfsResult<usize>(attr_res.unwrap().size / sizeof(OrphanBlock));
+}
+
+auto FileOperation::peek_orphans(usize cnt)
+    -> ChfsResult<std::vector<OrphanBlock>> {
+  auto num_res = this->get_orphan_num();
+  if (num_res.is_err()) {
+    return ChfsResult<std::vector<OrphanBlock>>(num_res.unwrap_error());
+  }
+  auto num = num_res.unwrap();
+  cnt = std::min(cnt, num);
+
+  std::vector<OrphanBlock> blocks(cnt);
+  if (cnt == 0) {
+    return ChfsResult<std::vector<OrphanBlock>>(blocks);
+  }
+  auto res = this->read_file_w_off(super_block_->get_orphan_inode(),
+                                   reinterpret_cast<u8 *>(blocks.data()),
+                                   cnt * sizeof(OrphanBlock),
+                                   (num - cnt) * sizeof(OrphanBlock));
+  if (res.is_err()) {
+    return ChfsResult<std::vector<OrphanBlock>>(res.unwrap_error());
+  }
+  return ChfsResult<std::vector<OrphanBlock>>(blocks);
+}
+
+auto FileOperation::pop_orphans(usize cnt) -> ChfsNullResult {
+  auto num_res = this->get_orphan_num();
+  if (num_res.is_err()) {
+    return ChfsNullResult(num_res.unwrap_error());
+  }
+  auto num = num_res.unwrap();
+  if (cnt > num) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+  if (cnt == 0) {
+    return KNullOk;
+  }
+
+  auto res = this->resize(super_block_->get_orphan_inode(),
+                          (num - cnt) * sizeof(OrphanBlock));
+  if (res.is_err()) {
+    return ChfsNullResult(res.unwrap_error());
+  }
+  return KNullOk;
+}
+
+} // namespace chfs
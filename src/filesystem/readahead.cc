@@ -0,0 +1,55 @@
+#include <algorithm>
+
+#include "filesystem/readahead.h"
+
+namespace chfs {
+
+auto Readahead::on_read(u64 offset, u64 sz, u64 file_sz)
+    -> std::pair<u64, u64> {
+  if (sz == 0 || offset >= file_sz) {
+    return {0, 0};
+  }
+
+  auto first = offset / block_size;
+  auto last = (std::min(offset + sz, file_sz) - 1) / block_size;
+  auto file_blocks = (file_sz + block_size - 1) / block_size;
+
+  stats.reads += 1;
+  if (start <= first && last < end) {
+    stats.hits += 1;
+  }
+
+  auto sequential = offset == next_offset;
+  next_offset = offset + sz;
+  if (!sequential) {
+    window = 0;
+    start = end = 0;
+    return {0, 0};
+  }
+
+  if (window == 0) {
+    // a new stream, prefetch from the block after this read
+    window = KReadaheadInitBlocks;
+    start = end = last + 1;
+  } else if (last >= end) {
+    // the reader is ahead of the prefetched range
+    start = end = last + 1;
+  }
+
+  // still far from the end of the prefetched range
+  if (end - last > window / 2 + 1) {
+    return {0, 0};
+  }
+
+  auto prefetch_end = std::min(end + window, file_blocks);
+  if (prefetch_end <= end) {
+    return {0, 0};
+  }
+  std::pair<u64, u64> res = {end, prefetch_end - end};
+  stats.prefetched_blocks += res.second;
+  end = prefetch_end;
+  window = std::min(window * 2, KReadaheadMaxBlocks);
+  return res;
+}
+
+} // namespace chfs
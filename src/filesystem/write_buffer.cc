@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <ctime>
+#include <iterator>
+
+#include "filesystem/write_buffer.h"
+
+namespace chfs {
+
+auto WriteBuffer::write(inode_id_t id, const u8 *data, u64 sz, u64 offset)
+    -> ChfsResult<u64> {
+  if (sz == 0) {
+    return ChfsResult<u64>(0);
+  }
+
+  auto now = static_cast<u64>(time(0));
+  auto &file = files[id];
+  if (file.ranges.empty()) {
+    file.dirtied_at = now;
+  }
+
+  // find the ranges overlapping or adjacent to [offset, offset + sz)
+  auto begin = offset;
+  auto end = offset + sz;
+  auto first = file.ranges.upper_bound(offset);
+  if (first != file.ranges.begin()) {
+    auto prev = std::prev(first);
+    if (prev->first + prev->second.size() >= offset) {
+      first = prev;
+    }
+  }
+  auto last = first;
+  while (last != file.ranges.end() && last->first <= end) {
+    begin = std::min(begin, last->first);
+    end = std::max(end, last->first + last->second.size());
+    ++last;
+  }
+
+  // merge them into one range, the new content goes on top
+  std::vector<u8> merged(end - begin);
+  for (auto iter = first; iter != last; ++iter) {
+    std::copy(iter->second.begin(), iter->second.end(),
+              merged.begin() + (iter->first - begin));
+    file.bytes -= iter->second.size();
+  }
+  std::copy(data, data + sz, merged.begin() + (offset - begin));
+  file.ranges.erase(first, last);
+  file.bytes += merged.size();
+  file.ranges.emplace(begin, std::move(merged));
+
+  // the write is buffered already, so the write-backs can't fail it
+  if (file.bytes >= KWriteBackMaxBytes) {
+    this->write_back_keep_error(id);
+  }
+  this->flush_expired();
+  return ChfsResult<u64>(sz);
+}
+
+auto WriteBuffer::flush(inode_id_t id) -> ChfsNullResult {
+  auto res = this->write_back(id);
+  auto error = errors.find(id);
+  if (error != errors.end()) {
+    if (res.is_ok()) {
+      res = ChfsNullResult(error->second);
+    }
+    errors.erase(error);
+  }
+  return res;
+}
+
+auto WriteBuffer::write_back_keep_error(inode_id_t id) -> void {
+  auto res = this->write_back(id);
+  if (res.is_err()) {
+    // the first error is reported
+    errors.emplace(id, res.unwrap_error());
+  }
+}
+
+auto WriteBuffer::write_back(inode_id_t id) -> ChfsNullResult {
+  auto iter = files.find(id);
+  if (iter == files.end()) {
+    return KNullOk;
+  }
+
+  std::vector<WriteRange> ranges;
+  for (const auto &[offset, content] : iter->second.ranges) {
+    ranges.push_back({offset, content.data(), content.size()});
+  }
+  auto res = fs->write_file_ranges(id, ranges);
+
+  // the content is dropped even if the write fails, like the page cache
+  // of a failed write-back
+  files.erase(iter);
+  return res;
+}
+
+auto WriteBuffer::flush_all() -> ChfsNullResult {
+  auto res = KNullOk;
+  while (!files.empty()) {
+    auto flush_res = this->flush(files.begin()->first);
+    if (flush_res.is_err()) {
+      res = flush_res;
+    }
+  }
+  // the files written back with errors and clean since
+  if (!errors.empty()) {
+    res = ChfsNullResult(errors.begin()->second);
+    errors.clear();
+  }
+  return res;
+}
+
+auto WriteBuffer::flush_expired() -> void {
+  auto now = static_cast<u64>(time(0));
+  std::vector<inode_id_t> expired;
+  for (const auto &[id, file] : files) {
+    if (now >= file.dirtied_at + KWriteBackExpireSec) {
+      expired.push_back(id);
+    }
+  }
+
+  for (auto id : expired) {
+    this->write_back_keep_error(id);
+  }
+}
+
+auto WriteBuffer::buffered_end(inode_id_t id) const -> u64 {
+  auto iter = files.find(id);
+  if (iter == files.end() || iter->second.ranges.empty()) {
+    return 0;
+  }
+  const auto &last = *iter->second.ranges.rbegin();
+  return last.first + last.second.size();
+}
+
+auto WriteBuffer::buffered_bytes(inode_id_t id) const -> usize {
+  auto iter = files.find(id);
+  return iter == files.end() ? 0 : iter->second.bytes;
+}
+
+} // namespace chfs
@@ -0,0 +1,121 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// alloc_group.h
+//
+// Identification: src/include/block/alloc_group.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "common/config.h"
+
+namespace chfs {
+
+/**
+ * The allocation groups of a bitmap, in the style of XFS and ext4.
+ * A group is a block of the bitmap, and each group has its own lock, so
+ * allocations and frees in different groups don't serialize.
+ *
+ * Allocators search from the first group that may have free entries (the
+ * hint). If the lock of a group is held by another thread, they move on to
+ * the next group instead of waiting, so concurrent allocators spread across
+ * the groups while a single allocator still allocates in order.
+ *
+ * It also keeps the number of free entries of the bitmap. Once counted, the
+ * number is updated under the group locks; counting takes all of them.
+ */
+class AllocGroups {
+  usize ngroups;
+  std::unique_ptr<std::mutex[]> locks;
+
+  // the first group that may have free entries
+  std::atomic<usize> hint;
+
+  // the number of free entries, valid if `counted`
+  std::atomic<u64> nfree;
+  std::atomic<bool> counted;
+
+public:
+  explicit AllocGroups(usize ngroups)
+      : ngroups(ngroups), locks(new std::mutex[ngroups]), hint(0), nfree(0),
+        counted(false) {}
+
+  auto size() const -> usize { return ngroups; }
+
+  auto lock(usize group) -> std::unique_lock<std::mutex> {
+    return std::unique_lock<std::mutex>(locks[group]);
+  }
+
+  /**
+   * Lock the group if no one holds it, check `owns_lock` of the result
+   */
+  auto try_lock(usize group) -> std::unique_lock<std::mutex> {
+    return std::unique_lock<std::mutex>(locks[group], std::try_to_lock);
+  }
+
+  /**
+   * Lock all the groups in order, e.g., to scan the whole bitmap
+   */
+  auto lock_all() -> std::vector<std::unique_lock<std::mutex>> {
+    std::vector<std::unique_lock<std::mutex>> res;
+    for (usize i = 0; i < ngroups; ++i) {
+      res.emplace_back(locks[i]);
+    }
+    return res;
+  }
+
+  auto get_hint() const -> usize { return hint.load(); }
+
+  /**
+   * The group has no free entries, move the hint forward if it points to it
+   */
+  auto mark_full(usize group) -> void {
+    auto expected = group;
+    hint.compare_exchange_strong(expected, group + 1);
+  }
+
+  /**
+   * An entry of the group is freed, move the hint backward if necessary
+   */
+  auto mark_free(usize group) -> void {
+    auto cur = hint.load();
+    while (group < cur && !hint.compare_exchange_weak(cur, group)) {
+    }
+  }
+
+  /**
+   * Get the number of free entries, std::nullopt if not counted yet
+   */
+  auto get_free_cnt() const -> std::optional<u64> {
+    if (!counted.load()) {
+      return std::nullopt;
+    }
+    return nfree.load();
+  }
+
+  auto set_free_cnt(u64 cnt) -> void {
+    nfree.store(cnt);
+    counted.store(true);
+  }
+
+  /**
+   * Update the number of free entries. The group lock should be held.
+   */
+  auto add_free_cnt(i32 delta) -> void {
+    if (counted.load()) {
+      nfree.fetch_add(static_cast<u64>(delta));
+    }
+  }
+};
+
+} // namespace chfs
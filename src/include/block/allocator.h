@@ -12,19 +12,24 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 
+#include "block/alloc_group.h"
+#include "block/group_init.h"
 #include "block/manager.h"
 
 namespace chfs {
 
 class SuperBlock;
 class InodeManager;
+class FileOperation;
 
 /**
  * BlockManager implements a block allocator to manage blocks of the manager
  * It internally uses bitmap for the management.
- * Note that the block allocator is **not** thread-safe. In lab2, you should make
- * it thread-safe.
+ * Each bitmap block is an allocation group with its own lock, so allocations
+ * and deallocations from multiple threads are safe and mostly run in
+ * parallel. Note that the initialization is **not** thread-safe.
  *
  * # Example
  *
@@ -33,6 +38,7 @@ class InodeManager;
 class BlockAllocator {
   friend class SuperBlock;
   friend class nodeManager;
+  friend class FileOperation;
 
 public:
   std::shared_ptr<BlockManager> bm;
@@ -46,6 +52,14 @@ protected:
   // number of bits needed in the last bitmap block
   usize last_block_num;
 
+  // one allocation group per bitmap block, which also maintains the number
+  // of free blocks on allocation and deallocation
+  std::shared_ptr<AllocGroups> groups;
+
+  // which bitmap blocks are uninitialized, nullptr if all of them are
+  // initialized when the allocator is created
+  std::shared_ptr<GroupInitFlags> init_flags;
+
 public:
   /**
    * Creates a new block allocator with a block manager.
@@ -61,23 +75,36 @@ public:
    * @param bm the block manager
    * @param bitmap_block_id the block id of the bitmap
    * @param will_initialize whether to initialize the bitmap
+   * @param init_flags if provided, the bitmap blocks are initialized lazily:
+   * only the ones covering the reserved blocks are written when the bitmap is
+   * initialized, others are zeroed on the first allocation
    *
    * # Note!!!!
    * We assume that the blocks before the `bitmap_block_id` is reserved,
    * so they cannot be allocated.
    */
   BlockAllocator(std::shared_ptr<BlockManager> bm, usize bitmap_block_id,
-                 bool will_initialize = true);
+                 bool will_initialize = true,
+                 std::shared_ptr<GroupInitFlags> init_flags = nullptr);
 
   auto total_bitmap_block() -> usize { return this->bitmap_block_cnt; }
 
   /**
    * Count the number of free blocks.
+   * Only the first call scans the bitmap, the count is maintained afterwards.
    *
    * @return the number of free blocks
    */
   auto free_block_cnt() const -> usize;
 
+  /**
+   * Set the number of free blocks, e.g., the one recorded in the super block,
+   * so the bitmap needn't be scanned.
+   */
+  auto set_free_block_cnt(usize cnt) -> void {
+    this->groups->set_free_cnt(cnt);
+  }
+
   /**
    * Allocate a block.
    *
@@ -87,6 +114,17 @@ public:
    */
   auto allocate() -> ChfsResult<block_id_t>;
 
+  /**
+   * Allocate a run of contiguous blocks, e.g., to preallocate a file.
+   * The run never crosses a bitmap block. If no group has `cnt` free blocks
+   * in a row, the longest run found is allocated.
+   *
+   * @return the first block and the length of the run, which is in [1, cnt].
+   *         OUT_OF_RESOURCE if there is no free block.
+   */
+  auto allocate_contiguous(usize cnt)
+      -> ChfsResult<std::pair<block_id_t, usize>>;
+
   /**
    * Deallocate a block.
    * @param block_id the block id to be deallocated.
@@ -95,6 +133,40 @@ public:
    *         other error code if there is other error.
    */
   auto deallocate(block_id_t block_id) -> ChfsNullResult;
+
+  /**
+   * Deallocate a batch of blocks.
+   * The bitmap block of each group is read and written once, no matter how
+   * many blocks of the group are freed.
+   *
+   * @return INVALID_ARG if any of the blocks is freed or given twice, in
+   *         which case none of the blocks is freed.
+   */
+  auto deallocate(std::vector<block_id_t> block_ids) -> ChfsNullResult;
+
+private:
+  /**
+   * Try to allocate a block in the bitmap block `idx`.
+   * The lock of the group should be held.
+   *
+   * @return std::nullopt if the group is full.
+   */
+  auto allocate_in_group(usize idx) -> ChfsResult<std::optional<block_id_t>>;
+
+  /**
+   * Find the longest free run (at most `cnt` blocks) in the bitmap block
+   * `idx`, and allocate it if it has at least `min_len` blocks.
+   * The lock of the group should be held.
+   *
+   * @return the first block and the length of the run found
+   */
+  auto allocate_run_in_group(usize idx, usize cnt, usize min_len)
+      -> ChfsResult<std::pair<block_id_t, usize>>;
+
+  auto is_group_initialized(usize idx) const -> bool {
+    return this->init_flags == nullptr ||
+           this->init_flags->is_initialized(idx);
+  }
 };
 
 } // namespace chfs
\ No newline at end of file
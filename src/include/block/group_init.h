@@ -0,0 +1,86 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// group_init.h
+//
+// Identification: src/include/block/group_init.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "block/manager.h"
+#include "common/bitmap.h"
+
+namespace chfs {
+
+/**
+ * Record which groups of a bitmap are uninitialized, like the `uninit_bg`
+ * flags of ext4. A group is a block of the bitmap (and, for inodes, the part
+ * of the inode table it covers).
+ *
+ * The blocks of an uninitialized group have never been written, so their
+ * content is undefined. The group is treated as all-free and the owner
+ * zeroes it on the first use. This way formatting doesn't touch every bitmap
+ * and table block of the device.
+ *
+ * The flags are stored at [offset, offset + capacity) of block `block_id`,
+ * one bit per group, and a **set** bit means the group is uninitialized.
+ * So a region that was zeroed by older formats means everything has been
+ * initialized. Writes go through the block manager, so they're logged
+ * together with the bitmap when the log is enabled.
+ *
+ * `is_initialized` and `set_initialized` are thread-safe, since groups of
+ * different allocation groups share a byte of the flags.
+ */
+class GroupInitFlags {
+  std::shared_ptr<BlockManager> bm;
+  block_id_t block_id;
+  usize offset;
+  usize capacity;
+
+  // cached flags
+  std::vector<u8> flags;
+  mutable std::mutex mutex;
+
+public:
+  /**
+   * @param bm the block manager
+   * @param block_id the block that stores the flags
+   * @param offset the offset of the flags in the block
+   * @param capacity the maximum number of bytes of the flags
+   */
+  GroupInitFlags(std::shared_ptr<BlockManager> bm, block_id_t block_id,
+                 usize offset, usize capacity);
+
+  /**
+   * Mark the first `ngroups` groups as uninitialized and write the flags.
+   * It's called when the bitmap is created.
+   */
+  auto format(usize ngroups) -> ChfsNullResult;
+
+  /**
+   * Read the flags from the block manager
+   */
+  auto load() -> ChfsNullResult;
+
+  auto is_initialized(usize group) const -> bool;
+
+  /**
+   * Mark the group as initialized. The owner should zero the group first.
+   */
+  auto set_initialized(usize group) -> ChfsNullResult;
+
+  /**
+   * The maximum number of groups can be recorded
+   */
+  auto max_groups() const -> usize { return capacity * KBitsPerByte; }
+};
+
+} // namespace chfs
@@ -11,8 +11,11 @@
 
 #pragma once
 
-#include <vector>
+#include <atomic>
+#include <deque>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "common/config.h"
 #include "common/macros.h"
@@ -40,9 +43,35 @@ protected:
   usize block_cnt;
   bool in_memory; // whether we use in-memory to emulate the block manager
   bool maybe_failed;
-  usize write_fail_cnt;
+  // atomic, as the recovery writes blocks from several threads
+  std::atomic<usize> write_fail_cnt;
   bool write_to_log;
   std::vector<std::shared_ptr<BlockOperation>> log_ops;
+  // the transactions logged but not written in place, see `stage_log`
+  std::deque<std::pair<txn_id_t, std::vector<std::shared_ptr<BlockOperation>>>>
+      staged_txns;
+  // the latest staged state of each block
+  std::unordered_map<block_id_t, std::shared_ptr<BlockOperation>>
+      staged_blocks;
+
+  /**
+   * The current content of a block, in the current log transaction, staged,
+   * or in place
+   */
+  auto current_block(block_id_t block_id) const -> const u8 *;
+
+  /**
+   * Write the bytes in place, which may fail if `maybe_failed` is set
+   */
+  auto write_in_place(block_id_t block_id, const u8 *data, usize offset,
+                      usize len) -> ChfsNullResult;
+
+  /**
+   * Write the bytes outside a transaction, to the staged content if the
+   * block is staged, or in place
+   */
+  auto write_staged(block_id_t block_id, const u8 *data, usize offset,
+                    usize len) -> ChfsNullResult;
 
  public:
   /**
@@ -130,6 +159,23 @@ protected:
    */
   auto unsafe_get_block_ptr() const -> u8 * { return this->block_data; }
 
+  /**
+   * Get the pointer to the content of a block, so it can be read without
+   * copying. If the block has been written in the current log transaction,
+   * or is staged, the pointer is to the logged content.
+   *
+   * The pointer is valid until the block is written or the log is flushed.
+   */
+  auto unsafe_get_block_ptr(block_id_t block_id) const
+      -> ChfsResult<const u8 *>;
+
+  /**
+   * Hint that the blocks [block_id, block_id + cnt) will be read soon.
+   * For a file-backed device, the kernel starts reading them into the page
+   * cache asynchronously. It's a no-op for an in-memory device.
+   */
+  auto prefetch(block_id_t block_id, usize cnt) -> ChfsNullResult;
+
   /**
    * flush the data of a block into disk
    */
@@ -151,6 +197,33 @@ protected:
   auto set_write_to_log(bool is_write_to_log)
       -> std::vector<std::shared_ptr<BlockOperation>>;
 
+  /**
+   * Whether the writes are buffered in the log, i.e., in a transaction
+   */
+  auto is_write_to_log() const -> bool { return this->write_to_log; }
+
+  /**
+   * Keep the blocks of a transaction in memory after it's appended to the
+   * log, until `apply_log` writes them in place once the log is durable.
+   * The reads see them meanwhile, and a write outside a transaction updates
+   * the staged content instead, so no block reaches the device before its
+   * log.
+   */
+  auto stage_log(txn_id_t txn_id,
+                 std::vector<std::shared_ptr<BlockOperation>> ops) -> void;
+
+  /**
+   * Write the blocks of the staged transactions up to @txn_id in place, in
+   * the order of the transactions. The caller makes their log durable first.
+   */
+  auto apply_log(txn_id_t txn_id) -> ChfsNullResult;
+
+  /**
+   * Drop the staged transactions, e.g., after `apply_log` fails. Their log
+   * is durable, so the recovery redoes them.
+   */
+  auto discard_staged() -> void;
+
   /**
    * Mark the block manager as may fail state
    */
@@ -13,6 +13,7 @@
 
 #include <optional>
 #include <string.h>
+#include <utility>
 
 #include "./config.h"
 #include "./macros.h"
@@ -155,6 +156,50 @@ public:
 
     return std::nullopt; // No free bit found
   }
+
+  /**
+   * Find the longest run of free bits with an up bound, a run of `max_len`
+   * bits is good enough
+   * @param bits the upper bound of the search (in bits!)
+   * @param max_len the maximum length of the run
+   *
+   * @return the index of the first bit and the length of the run,
+   * the length is 0 if no free bit is found
+   */
+  auto find_free_run_w_bound(usize bits, usize max_len)
+      -> std::pair<usize, usize> {
+    auto refined_bits = std::min(this->payload * KBitsPerByte, bits);
+    const auto word_bits = KBytesPerWord * KBitsPerByte;
+    u64 *words = reinterpret_cast<u64 *>(data);
+
+    std::pair<usize, usize> best = {0, 0};
+    usize run_start = 0, run_len = 0;
+    for (usize i = 0; i < refined_bits;) {
+      // skip the full words
+      if (run_len == 0 && i % word_bits == 0 && i + word_bits <= refined_bits &&
+          words[i / word_bits] == ~u64(0)) {
+        i += word_bits;
+        continue;
+      }
+
+      if (this->check(i)) {
+        run_len = 0;
+      } else {
+        if (run_len == 0) {
+          run_start = i;
+        }
+        run_len += 1;
+        if (run_len > best.second) {
+          best = {run_start, run_len};
+          if (run_len >= max_len) {
+            break;
+          }
+        }
+      }
+      ++i;
+    }
+    return best;
+  }
 };
 
 } // namespace chfs
\ No newline at end of file
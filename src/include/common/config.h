@@ -25,5 +25,7 @@ const usize DistributedMaxInodeSupported = 4096;
 const usize kMaxLogBlockSize = 10 * 1024; // 40MB, 10 * 1K * 4K/per block = 40M
 const usize kMaxLogSize = 128; // when this reaches, trigger checkpoint
 const usize kLogBlockCnt = 1024; // use 4MB for log
+const usize kGroupCommitMaxBatch = 64;  // the most transactions of a flush
+const usize kGroupCommitMaxDelayUs = 200; // how long a flush waits for more
 
 } // namespace chfs
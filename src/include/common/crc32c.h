@@ -0,0 +1,42 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// crc32c.h
+//
+// Identification: src/include/common/crc32c.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <array>
+
+#include "./config.h"
+
+namespace chfs {
+
+/**
+ * The CRC32C (Castagnoli) checksum of the bytes, computed with a table
+ * of 256 entries. Pass the previous result as @crc to continue it.
+ */
+inline auto crc32c(const u8 *data, usize len, u32 crc = 0) -> u32 {
+  static const auto table = []() {
+    std::array<u32, 256> table{};
+    for (u32 i = 0; i < 256; i++) {
+      u32 value = i;
+      for (int j = 0; j < 8; j++)
+        value = (value & 1) ? (value >> 1) ^ 0x82F63B78 : value >> 1;
+      table[i] = value;
+    }
+    return table;
+  }();
+
+  crc = ~crc;
+  for (usize i = 0; i < len; i++)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+} // namespace chfs
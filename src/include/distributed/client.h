@@ -74,6 +74,16 @@ public:
    */
   auto unlink(inode_id_t parent, const std::string &name) -> ChfsNullResult;
 
+  /**
+   * It renames a file or directory atomically, replacing the existing one
+   * at the new name. No data is copied.
+   *
+   * @return: The error of the metadata server, e.g. NotExist, NotEmpty or
+   * INVALID_ARG, like `FileOperation::rename`.
+   */
+  auto rename(inode_id_t parent, const std::string &name, inode_id_t newparent,
+              const std::string &newname) -> ChfsNullResult;
+
   /**
    * It looks up the directory and search for the inode number
    * of the given name.
@@ -96,6 +106,17 @@ public:
   auto readdir(inode_id_t id)
       -> ChfsResult<std::vector<std::pair<std::string, inode_id_t>>>;
 
+  /**
+   * It lists a directory from a cookie, one batch at a time.
+   *
+   * @param id: The inode id of the directory.
+   * @param cookie: 0 at the beginning, or the cookie of the last entry listed.
+   *
+   * @return: a list of <name, inode id, cookie>, empty at the end.
+   */
+  auto readdir(inode_id_t id, u64 cookie, usize max_entries)
+      -> ChfsResult<std::vector<std::tuple<std::string, inode_id_t, u64>>>;
+
   /**
    * It returns the type and attribute of a file.
    *
@@ -137,6 +158,14 @@ public:
   auto free_file_block(inode_id_t id, block_id_t block_id, mac_id_t mac_id)
       -> ChfsNullResult;
 
+  /**
+   * It returns the usage of the filesystem.
+   *
+   * @return: a tuple of <block size, total blocks, free blocks, total inodes,
+   * free inodes>
+   */
+  auto statfs() -> ChfsResult<std::tuple<u64, u64, u64, u64, u64>>;
+
 private:
   std::map<mac_id_t, std::shared_ptr<RpcClient>> data_servers_;
   std::shared_ptr<RpcClient>
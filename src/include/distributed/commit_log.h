@@ -15,11 +15,16 @@
 #include "common/macros.h"
 #include "filesystem/operations.h"
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -28,6 +33,10 @@ namespace chfs {
  * `BlockOperation` is an entry indicates an old block state and
  * a new block state. It's used to redo the operation when
  * the system is crashed.
+ *
+ * The old state is the block when the transaction first writes it, so the
+ * log only records the bytes changed. Without it, the whole new state is
+ * logged.
  */
 class BlockOperation {
 public:
@@ -36,36 +45,165 @@ public:
     CHFS_ASSERT(new_block_state.size() == DiskBlockSize, "invalid block state");
   }
 
+  BlockOperation(block_id_t block_id, std::vector<u8> new_block_state,
+                 const u8 *old_block_state)
+      : BlockOperation(block_id, std::move(new_block_state)) {
+    old_block_state_.assign(old_block_state, old_block_state + DiskBlockSize);
+  }
+
   block_id_t block_id_;
   std::vector<u8> new_block_state_;
+  std::vector<u8> old_block_state_; // empty if unknown
 };
 
-class LogEntry {
+/**
+ * A log record sets `len` bytes at `offset` of the block to the bytes
+ * following it. A full block image is a record of the whole block.
+ */
+class LogRecord {
 public:
-  txn_id_t txn_id;
   block_id_t block_id;
-  u8 block_state[DiskBlockSize];
+  u16 offset;
+  u16 len;
+} __attribute__((packed));
+
+// A block is logged as a full image if its delta records are larger
+const usize kLogDeltaLimit = DiskBlockSize / 2;
+
+const u32 kLogMagic = 0x474f4c43;
+const usize kRecoverThreadNum = 4; // the threads writing blocks in recovery
+const u32 kTxnCommitMagic = 0x54584e43;
+
+/**
+ * A transaction is logged as one frame: the header, its records and the
+ * commit marker.
+ */
+class TxnHeader {
+public:
+  txn_id_t txn_id;
+  u64 lsn; // where the frame is, to tell the frames of an earlier lap
+  u32 len; // the bytes of the records
+} __attribute__((packed));
+
+class TxnCommit {
+public:
+  u32 magic;
+  u32 crc; // the CRC32C of the header and the records
+} __attribute__((packed));
 
+/**
+ * The first block of the log region. The rest is a circular buffer of
+ * transaction frames, addressed by LSNs, i.e., the byte offsets since the
+ * log is created.
+ *
+ * The frames from the tail are needed by recovery. The head isn't stored,
+ * recovery takes the frames from the tail until one is torn or stale.
+ */
+class LogHeader {
+public:
+  u32 magic;
+  u64 tail; // the LSN of the first frame not checkpointed
 } __attribute__((packed));
 
+struct RecoveryStats {
+  usize txn_num = 0;   // the transactions redone
+  usize block_num = 0; // the blocks written
+  u64 log_bytes = 0;   // the bytes of the log read
+  u64 bytes = 0;       // the bytes of the blocks written
+  std::chrono::microseconds time{0};
+};
+
 /**
  * `CommitLog` is a class that records the block edits into the
  * commit log. It's used to redo the operation when the system
  * is crashed.
+ *
+ * A block edited is logged as records of the byte ranges changed, or a full
+ * image if the ranges are large, see `LogRecord`. The records of a
+ * transaction are written together in a frame checksummed by its commit
+ * marker, so a transaction is committed once the frame is flushed.
+ *
+ * Recovery builds the final image of each block from the frames after the
+ * tail, writes them with a few threads and flushes them once.
+ *
+ * The log is kept in the region reserved after the data blocks by default,
+ * flushed with msync. Or it's kept in a journal file of its own, opened
+ * with O_DSYNC, so a flush is a pwrite of the new frames and doesn't sync
+ * the shared mapping. The journal is read into memory when opened.
+ *
+ * The log is a circular buffer. A background checkpointer flushes the data
+ * blocks and then advances the tail past the applied transactions, once
+ * `kMaxLogSize` transactions are in the log or an append finds it full.
+ * So an append only waits when the log is full, and a checkpoint never
+ * runs in a commit.
+ *
+ * The log is made durable by group commit: `append_log` and `commit_log`
+ * only change the log in memory, and `sync` waits until a flush covers the
+ * transaction. The caller applies the blocks only after `sync`, keeping
+ * them staged in the block manager meanwhile, and then calls `commit_log`,
+ * so no block reaches the device before its log.
+ *
+ * The first waiter leads a flush for all the transactions appended so far,
+ * and waits a little for the ones appended but not yet waiting, up to
+ * `max_batch` waiters or `max_delay`. Others arriving during the flush form
+ * the next batch, so the flushes are shared under load.
  */
 class CommitLog {
 public:
+  /**
+   * @param journal_path: The file of the log, or empty to keep the log in
+   * the region reserved by `bm`.
+   */
   explicit CommitLog(std::shared_ptr<BlockManager> bm,
-                     bool is_checkpoint_enabled);
+                     bool is_checkpoint_enabled,
+                     const std::string &journal_path = "");
   ~CommitLog();
   auto append_log(txn_id_t txn_id,
                   std::vector<std::shared_ptr<BlockOperation>> ops) -> void;
   auto commit_log(txn_id_t txn_id) -> void;
   auto checkpoint() -> void;
-  auto recover() -> void;
+  auto recover() -> RecoveryStats;
   auto get_log_entry_num() -> usize;
   auto gen_txn_id() -> txn_id_t;
 
+  /**
+   * Wait until the log of the transaction is flushed to disk.
+   * The transactions must be appended and committed in the order of their
+   * ids, e.g., under the lock of the metadata server, but `sync` is called
+   * without the lock.
+   */
+  auto sync(txn_id_t txn_id) -> void;
+
+  /**
+   * Configure the group commit
+   *
+   * @param max_batch: A flush starts at once when so many are waiting.
+   * @param max_delay: The longest time a flush waits for more transactions.
+   */
+  auto set_group_commit(usize max_batch, std::chrono::microseconds max_delay)
+      -> void;
+
+  /**
+   * Set a function called by `sync` right before each flush, for testing.
+   * It's called without the lock.
+   */
+  auto set_flush_hook(std::function<void()> hook) -> void;
+
+  /**
+   * Get the number of flushes made by `sync`
+   */
+  auto get_flush_num() -> usize;
+
+  /**
+   * Get the bytes of the log records appended
+   */
+  auto get_log_bytes() -> u64;
+
+  /**
+   * Get the number of checkpoints made
+   */
+  auto get_checkpoint_num() -> usize;
+
   bool is_checkpoint_enabled_;
   std::shared_ptr<BlockManager> bm_;
   /**
@@ -74,12 +212,73 @@ public:
 
 
 private:
-  LogEntry *log_data;
-  usize max_log_entry_num;
-  usize log_entry_num;
+  /**
+   * Copy the bytes from/to the LSN of the circular buffer, wrapping around
+   */
+  auto write_bytes(u64 lsn, const u8 *src, usize len) -> void;
+  auto read_bytes(u64 lsn, u8 *dst, usize len) -> void;
+
+  /**
+   * Make the bytes of [@from, @to) durable
+   */
+  auto flush_bytes(u64 from, u64 to) -> void;
+
+  /**
+   * Make the header durable
+   */
+  auto flush_header() -> void;
+
+  /**
+   * Read the frame at @lsn, which must end before @limit.
+   *
+   * @return whether the frame is complete and valid
+   */
+  auto read_txn(u64 lsn, u64 limit, TxnHeader &header, std::vector<u8> &records)
+      -> bool;
+
+  auto need_checkpoint() -> bool;
+
+  /**
+   * The loop of the background checkpointer
+   */
+  auto run_checkpointer() -> void;
+
+  LogHeader *header_;
+  u8 *log_data;
+  u64 log_capacity; // in bytes
+  int journal_fd_ = -1;      // -1 if the log is in the block manager
+  std::vector<u8> journal_;  // the journal file in memory
+  u64 head_;
+  u64 tail_;
   txn_id_t begin_txn_id;
   txn_id_t last_txn_id;
   std::mutex mutex_;
+
+  // Checkpoint related
+  // txn id -> the LSN after it, for the ones appended but not committed
+  std::map<txn_id_t, u64> pending_txns_;
+  u64 applied_lsn_;          // the txns before it are applied to the blocks
+  txn_id_t applied_txn_id_;
+  bool waiting_space_ = false;
+  bool checkpointing_ = false;
+  bool stopping_ = false;
+  usize checkpoint_num_ = 0;
+  u64 log_bytes_ = 0;
+  std::condition_variable checkpoint_cv_;
+  std::condition_variable space_cv_;
+  std::thread checkpointer_;
+
+  // Group commit related
+  std::condition_variable sync_cv_;
+  usize max_batch_ = kGroupCommitMaxBatch;
+  std::chrono::microseconds max_delay_{kGroupCommitMaxDelayUs};
+  txn_id_t durable_txn_id_ = 0; // all the txns up to it are flushed
+  u64 durable_lsn_ = 0;
+  txn_id_t last_waiting_txn_id_ = 0;
+  usize waiting_num_ = 0; // the txns waiting for the next flush
+  bool flushing_ = false;
+  usize flush_num_ = 0;
+  std::function<void()> flush_hook_;
 };
 
 } // namespace chfs
\ No newline at end of file
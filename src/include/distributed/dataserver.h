@@ -107,6 +107,17 @@ public:
    */
   auto alloc_block() -> std::pair<block_id_t, version_t>;
 
+  /**
+   * A RPC handler for metadata server. Allocate a batch of blocks on this
+   * server, in contiguous runs if possible.
+   *
+   * @param cnt: The number of blocks wanted.
+   *
+   * @return: The block ids and versions, there may be fewer than `cnt` blocks
+   * if the server runs out of space
+   */
+  auto alloc_blocks(usize cnt) -> std::vector<std::pair<block_id_t, version_t>>;
+
   /**
    * A RPC handler for metadata server. Delete an allocated block on the server.
    *
@@ -116,6 +127,24 @@ public:
    */
   auto free_block(block_id_t block_id) -> bool;
 
+  /**
+   * A RPC handler for metadata server. Delete a batch of allocated blocks,
+   * e.g., the blocks of removed files.
+   *
+   * @param block_ids: The block ids.
+   *
+   * @return: Whether the delete request is valid or not
+   */
+  auto free_blocks(std::vector<block_id_t> block_ids) -> bool;
+
+  /**
+   * A RPC handler for metadata server. Get the block usage of the server.
+   * The free blocks are maintained by the allocator, so no bitmap scan.
+   *
+   * @return: a pair of <total blocks, free blocks>
+   */
+  auto usage() -> std::pair<u64, u64>;
+
 private:
   std::unique_ptr<RpcServer> server_;
   std::shared_ptr<BlockAllocator> block_allocator_;
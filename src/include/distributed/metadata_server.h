@@ -18,6 +18,8 @@
 #include "metadata/manager.h"
 #include "filesystem/operations.h"
 #include "distributed/commit_log.h"
+#include <condition_variable>
+#include <thread>
 
 namespace chfs {
 
@@ -55,6 +57,14 @@ namespace chfs {
 const u8 RegularFileType = 1;
 const u8 DirectoryType = 2;
 
+// A readdir rpc returns at most this many entries, so the message is bounded
+const usize KReaddirMaxEntries = 1024;
+
+// The reclaimer frees at most this many orphan blocks at a time
+const usize KReclaimBatch = 256;
+// ... and checks the orphan list this often when it's idle
+const u64 KReclaimIntervalMs = 100;
+
 using BlockInfo = std::tuple<block_id_t, mac_id_t, version_t>;
 
 class MetadataServer {
@@ -71,10 +81,13 @@ public:
    * @param is_log_enabled: Whether to enable the commit log.
    * @param is_checkpoint_enabled: Whether to enable the checkpoint.
    * @param may_failed: Whether the metadata server persist data may fail.
+   * @param log_path: The journal file of the commit log. If empty, the log
+   * is kept at the end of the data file.
    */
   MetadataServer(u16 port, const std::string &data_path = "/tmp/inode_data",
                  bool is_log_enabled = false,
-                 bool is_checkpoint_enabled = false, bool may_failed = false);
+                 bool is_checkpoint_enabled = false, bool may_failed = false,
+                 const std::string &log_path = "");
 
   /**
    * Start a metadata server listens on `address:port`.
@@ -85,11 +98,19 @@ public:
    * @param is_log_enabled: Whether to enable the commit log.
    * @param is_checkpoint_enabled: Whether to enable the checkpoint.
    * @param may_failed: Whether the metadata server persist data may fail.
+   * @param log_path: The journal file of the commit log. If empty, the log
+   * is kept at the end of the data file.
    */
   MetadataServer(std::string const &address, u16 port,
                  const std::string &data_path = "/tmp/inode_data",
                  bool is_log_enabled = false,
-                 bool is_checkpoint_enabled = false, bool may_failed = false);
+                 bool is_checkpoint_enabled = false, bool may_failed = false,
+                 const std::string &log_path = "");
+
+  /**
+   * Stop the reclaimer before the filesystem is gone
+   */
+  ~MetadataServer();
 
   /**
    * A RPC handler for client. It create a regular file or directory on metadata
@@ -112,11 +133,36 @@ public:
    * A RPC handler for client. It deletes an file on metadata server from its
    * parent.
    *
+   * The inode of a regular file is freed at once, while its blocks are pushed
+   * to the orphan list and freed by the reclaimer later, so it doesn't wait
+   * for the data servers.
+   *
    * @param parent: The inode id of the parent directory.
    * @param name: The name of the file to be deleted.
    */
   auto unlink(inode_id_t parent, const std::string &name) -> bool;
 
+  /**
+   * A RPC handler for client. It renames a file or directory atomically,
+   * replacing the existing one at the new name like rename(2).
+   *
+   * The directories and the replaced inode are updated in one transaction
+   * of the commit log, and the data of the file isn't touched, so a job can
+   * publish its output by renaming it.
+   *
+   * @param parent: The directory of the node to be renamed.
+   * @param name: The name of the node to be renamed.
+   * @param newparent: The new directory, which may be the same as `parent`.
+   * @param newname: The new name.
+   *
+   * @return the `ErrorType` as an integer, DONE(0) if it succeeds. It's
+   * NotExist if `name` doesn't exist, NotEmpty if `newname` is a non-empty
+   * directory, and INVALID_ARG if the types don't match or a directory is
+   * moved into its own subtree.
+   */
+  auto rename(inode_id_t parent, const std::string &name,
+              inode_id_t newparent, const std::string &newname) -> u8;
+
   /**
    * A RPC handler for client. It looks up the dir and return the inode id of
    * the given name.
@@ -142,6 +188,19 @@ public:
    */
   auto allocate_block(inode_id_t id) -> BlockInfo;
 
+  /**
+   * A RPC handler for client. Like `allocate_block`, but it allocates a batch
+   * of blocks on one data server, in contiguous runs if possible, so a writer
+   * that knows the size of its output needs one rpc.
+   *
+   * @param id: The inode id of the file.
+   * @param cnt: The number of blocks wanted.
+   *
+   * @return: The blocks appended to the file, there may be fewer than `cnt`
+   * if the inode or the data server is full
+   */
+  auto allocate_blocks(inode_id_t id, usize cnt) -> std::vector<BlockInfo>;
+
   /**
    * A RPC handler for client. It removes a block from a file on data server
    * and delete its record on metadata server.
@@ -160,6 +219,19 @@ public:
   auto readdir(inode_id_t node)
       -> std::vector<std::pair<std::string, inode_id_t>>;
 
+  /**
+   * A RPC handler for client. It lists a directory from a cookie, see
+   * `FileOperation::readdir`.
+   *
+   * @param node: The inode id of the directory
+   * @param cookie: 0 at the beginning, or the cookie of the last entry listed
+   * @param max_entries: capped by KReaddirMaxEntries
+   *
+   * @return: a list of <name, inode id, cookie>, empty at the end
+   */
+  auto readdir(inode_id_t node, u64 cookie, usize max_entries)
+      -> std::vector<std::tuple<std::string, inode_id_t, u64>>;
+
   /**
    * A RPC handler for client. It returns the type and attribute of a file
    *
@@ -169,6 +241,27 @@ public:
    */
   auto get_type_attr(inode_id_t id) -> std::tuple<u64, u64, u64, u64, u8>;
 
+  /**
+   * A RPC handler for client. It returns the usage of the filesystem.
+   * The inodes are counted on the metadata server, while the blocks are
+   * counted on the data servers.
+   *
+   * @return: a tuple of <block size, total blocks, free blocks, total inodes,
+   * free inodes>
+   */
+  auto statfs() -> std::tuple<u64, u64, u64, u64, u64>;
+
+  /**
+   * Free a batch of the orphan blocks, i.e., the blocks of the unlinked files,
+   * on the data servers. It's called by the background reclaimer.
+   *
+   * The blocks are removed from the orphan list before they're freed, so a
+   * crash in between leaks them rather than frees them twice.
+   *
+   * @return: The number of blocks reclaimed, 0 if there is none
+   */
+  auto reclaim_orphans() -> usize;
+
   /**
    * Register a data server to the metadata server. It'll create a RPC
    * connection between the data server and metadata server. It should be called
@@ -191,15 +284,74 @@ public:
 
   /**
    * Recover the system from log
+   *
+   * @return: What is redone, see `CommitLog::recover`
    */
-  auto recover() -> void {
+  auto recover() -> RecoveryStats {
     if (!is_log_enabled_) {
       std::cerr << "Log not enabled\n";
-      return;
+      return {};
     }
     operation_->block_manager_->set_may_fail(false);
-    commit_log->recover();
+    auto stats = commit_log->recover();
+    operation_->reload_super_block();
+    operation_->dentries_.clear();
     operation_->block_manager_->set_may_fail(true);
+    return stats;
+  }
+
+  /**
+   * Configure the group commit of the log, see `CommitLog::set_group_commit`
+   */
+  auto set_group_commit(usize max_batch, std::chrono::microseconds max_delay)
+      -> void {
+    if (is_log_enabled_)
+      commit_log->set_group_commit(max_batch, max_delay);
+  }
+
+  /**
+   * Set a function called before each flush of the log, for testing, see
+   * `CommitLog::set_flush_hook`
+   */
+  auto set_log_flush_hook(std::function<void()> hook) -> void {
+    if (is_log_enabled_)
+      commit_log->set_flush_hook(std::move(hook));
+  }
+
+  /**
+   * Get the number of the log flushes made by group commit
+   */
+  auto get_log_flush_num() -> usize {
+    if (is_log_enabled_) {
+      return commit_log->get_flush_num();
+    } else {
+      std::cerr << "Log not enabled\n";
+      return 0;
+    }
+  }
+
+  /**
+   * Get the bytes appended to the log
+   */
+  auto get_log_bytes() -> u64 {
+    if (is_log_enabled_) {
+      return commit_log->get_log_bytes();
+    } else {
+      std::cerr << "Log not enabled\n";
+      return 0;
+    }
+  }
+
+  /**
+   * Get the number of the checkpoints of the log
+   */
+  auto get_checkpoint_num() -> usize {
+    if (is_log_enabled_) {
+      return commit_log->get_checkpoint_num();
+    } else {
+      std::cerr << "Log not enabled\n";
+      return 0;
+    }
   }
 
   /**
@@ -227,6 +379,28 @@ private:
    */
   inline auto init_fs(const std::string &data_path);
 
+  /**
+   * Commit the block operations buffered since `set_write_to_log(true)` as
+   * one transaction: append them to the log, wait until the log is flushed
+   * by group commit, and then apply them. The lock is released while
+   * waiting, so others join the flush, and they read the blocks staged in
+   * the block manager meanwhile. It's held again when this returns.
+   */
+  auto commit_txn(std::unique_lock<std::mutex> &lock) -> bool;
+
+  /**
+   * Discard the block operations buffered since `set_write_to_log(true)`
+   * after an error, and reload the in-memory states they have changed.
+   */
+  auto abort_txn() -> void;
+
+  /**
+   * Free the inode of a regular file and push its blocks to the orphan list.
+   * The caller holds the lock and removes the directory entry, and wakes up
+   * the reclaimer once the transaction is committed.
+   */
+  auto free_file(inode_id_t id) -> bool;
+
   std::unique_ptr<RpcServer> server_; // Receiving requests from the client
   std::shared_ptr<FileOperation> operation_; // Real metadata handler
   std::map<mac_id_t, std::shared_ptr<RpcClient>>
@@ -241,11 +415,17 @@ private:
   bool is_log_enabled_;
   bool may_failed_;
   [[maybe_unused]] bool is_checkpoint_enabled_;
+  std::string log_path_; // the journal file, empty if in the data file
 
   /**
    * {You can add anything you want here}
    */
   std::mutex mutex_;
+
+  // The background reclaimer of the orphan blocks, started by `run`
+  std::thread reclaimer_;
+  std::condition_variable reclaim_cv_;
+  bool stopping_ = false;
 };
 
 } // namespace chfs
\ No newline at end of file
@@ -0,0 +1,114 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// dentry_cache.h
+//
+// Identification: src/include/filesystem/dentry_cache.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/config.h"
+
+namespace chfs {
+
+// The number of (parent, name) pairs cached
+const usize KDentryCacheSize = 16384;
+
+struct DentryCacheStats {
+  u64 hits = 0;
+  u64 misses = 0;
+};
+
+/**
+ * Cache the results of directory lookups, like the dcache of Linux.
+ *
+ * It maps (parent, name) to the inode id, and a missing name is cached as a
+ * negative entry whose id is KInvalidInodeID. The least recently used entry
+ * is evicted once the cache is full.
+ *
+ * The owner must update the cache when a directory changes, and drop the
+ * entries of a removed inode, since its id may be reused.
+ *
+ * The API is thread-safe.
+ */
+class DentryCache {
+  struct Entry {
+    inode_id_t parent;
+    std::string name;
+    inode_id_t id;
+  };
+  using EntryIter = std::list<Entry>::iterator;
+
+  usize capacity;
+  // the most recently used at the front
+  std::list<Entry> lru;
+  // parent -> name -> entry, so the entries of a directory can be dropped
+  std::unordered_map<inode_id_t, std::unordered_map<std::string, EntryIter>>
+      dirs;
+  DentryCacheStats stats;
+  // the updates of the current transaction, see `stage`
+  std::vector<Entry> staged;
+  std::mutex mutex;
+
+  void erase_entry(EntryIter it);
+  void put_entry(inode_id_t parent, const std::string &name, inode_id_t id);
+  void erase_name(inode_id_t parent, const std::string &name);
+
+public:
+  explicit DentryCache(usize capacity = KDentryCacheSize)
+      : capacity(capacity) {}
+
+  /**
+   * @return the cached inode id, KInvalidInodeID for a negative entry,
+   * or std::nullopt if not cached
+   */
+  auto get(inode_id_t parent, const std::string &name)
+      -> std::optional<inode_id_t>;
+
+  /**
+   * Cache the result of a lookup, KInvalidInodeID if the name doesn't exist
+   */
+  void put(inode_id_t parent, const std::string &name, inode_id_t id);
+
+  void erase(inode_id_t parent, const std::string &name);
+
+  /**
+   * Cache the result of a transaction not committed yet. The old entry is
+   * dropped at once, and the new one is only visible after `publish`.
+   */
+  void stage(inode_id_t parent, const std::string &name, inode_id_t id);
+
+  /**
+   * Cache the staged entries, once their transaction is committed
+   */
+  void publish();
+
+  /**
+   * Drop the staged entries, once their transaction is aborted
+   */
+  void discard();
+
+  /**
+   * Drop the entries under the directory, including the staged ones
+   */
+  void erase_dir(inode_id_t parent);
+
+  void clear();
+
+  auto size() -> usize;
+
+  auto get_stats() -> DentryCacheStats;
+};
+
+} // namespace chfs
@@ -13,6 +13,59 @@ struct DirectoryEntry {
   inode_id_t id;
 };
 
+/**
+ * The binary directory format.
+ *
+ * The blocks of a directory are indexed by the hash of the names, like the
+ * htree of ext3. Block 0 is the root, holding the (hash, block) index entries
+ * sorted by hash. They point to the leaves, or to a level of index blocks once
+ * the root is full. A leaf holds the entries whose hashes fall in its range,
+ * so a lookup reads the root, at most one index block and one leaf.
+ *
+ * An empty directory has no blocks. A directory in the old text format is
+ * still readable, and it's converted on the first update.
+ */
+// The first byte is 0, which never starts a text directory
+const u32 KDirMagic = 0x48445200;
+
+enum class DirBlockType : u16 { Root = 1, Index = 2, Leaf = 3 };
+
+struct DirBlockHeader {
+  u32 magic;
+  u16 type;
+  // the number of index entries, or the number of entries of a leaf
+  u16 count;
+  // the bytes of the slots of a leaf, including the removed ones
+  u16 used;
+  // the bytes of the removed slots of a leaf
+  u16 dead;
+  // the levels of index blocks below the root, only used by the root
+  u16 levels;
+  // the number of blocks of the directory, only used by the root
+  u32 nblocks;
+} __attribute__((packed));
+
+struct DirIndexEntry {
+  // the smallest hash of the entries in the block
+  u32 hash;
+  u32 block;
+} __attribute__((packed));
+
+/**
+ * The header of a slot in a leaf, followed by the name (not null-terminated).
+ *
+ * A removed entry leaves a slot whose id is KInvalidInodeID, which is reused
+ * by a new entry that fits. A leaf is compacted only when there's no room
+ * left at its end.
+ */
+struct DirEntryHeader {
+  inode_id_t id;
+  u32 hash;
+  // the bytes of the slot, including the header
+  u16 rec_len;
+  u16 name_len;
+} __attribute__((packed));
+
 /**
  * Read the directory information and convert it to a string
  */
@@ -51,8 +104,8 @@ auto rm_from_directory(std::string src, std::string filename) -> std::string;
 
 /**
  * Read the directory information.
- * We assume that the directory information is stored as a
- * "name0:inode0/name1:inode1/ ..." string in the file blocks.
+ * Both the binary format and the old text format
+ * "name0:inode0/name1:inode1/ ..." are supported.
  *
  * @param fs: the pointer to the file system
  * @param inode: the inode number of the directory
@@ -64,4 +117,53 @@ auto rm_from_directory(std::string src, std::string filename) -> std::string;
 auto read_directory(FileOperation *fs, inode_id_t inode,
                     std::list<DirectoryEntry> &list) -> ChfsNullResult;
 
+/**
+ * Find the entry named @name in the directory.
+ * Only the index blocks on the path and one leaf are read.
+ *
+ * @return the inode id, or ErrorType::NotExist
+ */
+auto dir_lookup(FileOperation *fs, inode_id_t dir, const std::string &name)
+    -> ChfsResult<inode_id_t>;
+
+/**
+ * List the entries of the directory from @cookie, see `FileOperation::readdir`.
+ * The cookie of an entry is its hash + 1. The entries sharing a hash are
+ * listed together, and a directory in the text format is listed by position.
+ */
+auto dir_read_entries(FileOperation *fs, inode_id_t dir, u64 cookie,
+                      usize max_entries)
+    -> ChfsResult<std::vector<ReaddirEntry>>;
+
+/**
+ * Add an entry to the directory.
+ * Only the blocks changed are written, the entry goes to a free slot of the
+ * leaf or its end, and a full leaf is split in two.
+ * The dentry cache of @fs is updated as well.
+ *
+ * @return ErrorType::AlreadyExist if the name exists
+ */
+auto dir_add_entry(FileOperation *fs, inode_id_t dir, const std::string &name,
+                   inode_id_t id) -> ChfsNullResult;
+
+/**
+ * Remove the entry named @name from the directory, leaving a free slot.
+ * A negative entry of the name is left in the dentry cache.
+ *
+ * @return the inode id of the removed entry, or ErrorType::NotExist
+ */
+auto dir_remove_entry(FileOperation *fs, inode_id_t dir,
+                      const std::string &name) -> ChfsResult<inode_id_t>;
+
+/**
+ * Point the entry named @name to @id in place. Unlike removing the entry and
+ * adding it again, it never needs more space in the directory.
+ * The dentry cache of @fs is updated as well.
+ *
+ * @return the inode id the entry pointed to, or ErrorType::NotExist
+ */
+auto dir_replace_entry(FileOperation *fs, inode_id_t dir,
+                       const std::string &name, inode_id_t id)
+    -> ChfsResult<inode_id_t>;
+
 } // namespace chfs
\ No newline at end of file
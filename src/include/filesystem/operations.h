@@ -11,11 +11,59 @@
 
 #pragma once
 
+#include "filesystem/dentry_cache.h"
+#include "metadata/block_map.h"
 #include "metadata/manager.h"
+#include "metadata/superblock.h"
+#include <mutex>
 #include <sys/stat.h>
+#include <unordered_map>
 
 namespace chfs {
 
+// In lazytime mode, the deferred timestamps of an inode are written back at
+// most this many seconds after they first become dirty
+const u64 KLazytimeExpireSec = 60;
+// ... or when there are too many inodes with deferred timestamps
+const usize KLazytimeMaxInodes = 1024;
+
+/**
+ * A piece of file content returned by `read_file_segments`, which points to
+ * the memory of the block manager instead of a copy
+ */
+struct ReadSegment {
+  const u8 *data;
+  u64 len;
+};
+
+/**
+ * A range of content to write, see `write_file_ranges`
+ */
+struct WriteRange {
+  u64 offset;
+  const u8 *data;
+  u64 len;
+};
+
+/**
+ * A block of a removed file that hasn't been freed, see `push_orphans`
+ */
+struct OrphanBlock {
+  block_id_t block_id;
+  // where the block lives, e.g., the data server in the distributed mode
+  mac_id_t mac_id;
+} __attribute__((packed));
+
+/**
+ * An entry of a directory listing, see `readdir`
+ */
+struct ReaddirEntry {
+  std::string name;
+  inode_id_t id;
+  // the cookie to resume the listing after this entry
+  u64 cookie;
+};
+
 /**
  * Implement the basic inode filesystem
  */
@@ -28,14 +76,44 @@ protected:
   [[maybe_unused]] std::shared_ptr<InodeManager> inode_manager_;
   [[maybe_unused]] std::shared_ptr<BlockAllocator> block_allocator_;
 
+  // The flags of newly allocated inodes, recorded in the super block
+  u32 inode_flags_;
+
+  // The in-memory copy of the super block, which records the usage counters
+  std::shared_ptr<SuperBlock> super_block_;
+
+  // A block of zeros, which the holes of sparse files point to
+  std::vector<u8> zero_block_;
+
+  // lazytime: the timestamps that haven't been written to the inodes.
+  // The lock protects the map since attributes may be read concurrently.
+  struct LazyTime {
+    u64 time;       // the latest timestamp
+    u64 dirtied_at; // when the timestamp became dirty first
+  };
+  bool lazytime_ = false;
+  std::unordered_map<inode_id_t, LazyTime> lazy_times_;
+  std::mutex lazytime_mutex_;
+
+  // The results of the directory lookups
+  DentryCache dentries_;
+
 public:
   /**
    * Initialize a filesystem from scratch
    * @param bm the block manager to manage the block device
    * @param max_inode_supported the maximum number of inodes supported by the
    * filesystem
+   * @param inode_flags the flags of the inodes allocated by `alloc_inode`,
+   * e.g., KInodeExtentFlag to map the file blocks with extent trees
    */
-  FileOperation(std::shared_ptr<BlockManager> bm, u64 max_inode_supported);
+  FileOperation(std::shared_ptr<BlockManager> bm, u64 max_inode_supported,
+                u32 inode_flags = 0);
+
+  /**
+   * Write the deferred timestamps back on unmount
+   */
+  ~FileOperation();
 
   /**
    * Create a filesystem handler from an initialized filesystem
@@ -47,10 +125,49 @@ public:
 
   /**
    * Get the free inodes of the filesystem.
-   * Will read the inode bitmap of the underlying filesystem
+   * The number is maintained by the inode manager, so it's O(1)
    */
   auto get_free_inode_num() const -> ChfsResult<u64>;
 
+  /**
+   * Get the total inodes of the filesystem
+   */
+  auto get_total_inode_num() const -> u64 {
+    return inode_manager_->get_max_inode_supported();
+  }
+
+  /**
+   * Write the usage counters to the super block if they have changed.
+   * It's called at the end of the operations that allocate or free inodes and
+   * blocks, so the counters go into the same log transaction as the bitmaps.
+   */
+  auto flush_usage() -> ChfsNullResult;
+
+  /**
+   * Reload the states recorded in the super block (the usage counters and the
+   * flags of uninitialized groups), e.g., after the blocks are restored from
+   * the log
+   */
+  auto reload_super_block() -> ChfsNullResult;
+
+  /**
+   * Enable or disable the lazytime mode.
+   * In lazytime mode, a write that only changes the timestamps of an inode
+   * doesn't write the inode block. The timestamps are kept in memory and
+   * written back by `sync_inode`, `sync_all`, or when they expire.
+   */
+  auto set_lazytime(bool enable) -> ChfsNullResult;
+
+  /**
+   * Write the deferred timestamps of the inode back, e.g., on fsync
+   */
+  auto sync_inode(inode_id_t id) -> ChfsNullResult;
+
+  /**
+   * Write all the deferred timestamps back
+   */
+  auto sync_all() -> ChfsNullResult;
+
   // Data path operations
 
   /**
@@ -100,11 +217,25 @@ public:
    *
    * if off > file size, we will fill the gap with 0
    *
+   * Only the blocks covered by the range are touched: the partial blocks at
+   * the edges are read, modified and written back, and the inode is written
+   * once at the end.
+   *
    * @return the number of bytes written
    */
   auto write_file_w_off(inode_id_t id, const char *data, u64 sz, u64 offset)
       -> ChfsResult<u64>;
 
+  /**
+   * Write several ranges of the file, e.g., the coalesced writes of a
+   * write-back buffer. Like `write_file_w_off`, but the inode is written
+   * once for all the ranges.
+   *
+   * @param ranges sorted by offset and not overlapping
+   */
+  auto write_file_ranges(inode_id_t id, const std::vector<WriteRange> &ranges)
+      -> ChfsNullResult;
+
   /**
    * Read the content to the blocks pointed by the inode
    *
@@ -116,11 +247,54 @@ public:
    * Read the content to the blocks pointed by the inode
    *
    * # Note
-   * We assume that the offset + size <= file size
+   * The content is truncated if offset + size > file size
    */
   auto read_file_w_off(inode_id_t id, u64 sz, u64 offset)
       -> ChfsResult<std::vector<u8>>;
 
+  /**
+   * Read [offset, offset + sz) of the file to `buf`.
+   * Only the blocks covering the range are read.
+   *
+   * @return the number of bytes read, which is less than `sz` if the range
+   * exceeds the end of file
+   */
+  auto read_file_w_off(inode_id_t id, u8 *buf, u64 sz, u64 offset)
+      -> ChfsResult<u64>;
+
+  /**
+   * Resolve [offset, offset + sz) of the file to segments of the block
+   * manager's memory (appended to `segments`), so the content can be sent
+   * without being copied.
+   * Physically contiguous blocks are merged into one segment, and holes point
+   * to a block of zeros.
+   *
+   * The segments are valid until the blocks are written, so the caller should
+   * consume them before the next modification of the filesystem.
+   *
+   * @return the number of bytes covered, which is less than `sz` if the range
+   * exceeds the end of file
+   */
+  auto read_file_segments(inode_id_t id, u64 sz, u64 offset,
+                          std::vector<ReadSegment> &segments)
+      -> ChfsResult<u64>;
+
+  /**
+   * Make `dst` a copy of `src` by sharing the data blocks, like a reflink.
+   * The old content of `dst` is dropped. It's defined in clone_op.cc.
+   *
+   * The shared blocks are reference counted, and a shared block is copied on
+   * its first write, so the clone takes no extra data blocks until one of the
+   * files is modified.
+   */
+  auto clone_file(inode_id_t src, inode_id_t dst) -> ChfsNullResult;
+
+  /**
+   * Prefetch the logical blocks [first, first + cnt) of the file,
+   * see `Readahead` for when to call it. Holes are skipped.
+   */
+  auto prefetch(inode_id_t id, u64 first, u64 cnt) -> ChfsNullResult;
+
   /**
    * Remove the file corresponding to an inode.
    * It is defined in contorl_op.cc
@@ -130,17 +304,103 @@ public:
    */
   auto remove_file(inode_id_t) -> ChfsNullResult;
 
+  /**
+   * The orphan list records the blocks of the removed files, so they can be
+   * freed in the background after the inodes are gone. It's a file whose
+   * inode is recorded in the super block, so it survives restarts.
+   * They are defined in orphan_op.cc.
+   *
+   * It's a stack: the blocks are pushed at the end, and the reclaimer takes
+   * them from the end too.
+   */
+  auto push_orphans(const std::vector<OrphanBlock> &blocks) -> ChfsNullResult;
+
+  /**
+   * Get at most `cnt` blocks at the end of the orphan list without
+   * removing them
+   */
+  auto peek_orphans(usize cnt) -> ChfsResult<std::vector<OrphanBlock>>;
+
+  /**
+   * Remove `cnt` blocks from the end of the orphan list
+   */
+  auto pop_orphans(usize cnt) -> ChfsNullResult;
+
+  /**
+   * The number of blocks in the orphan list
+   */
+  auto get_orphan_num() -> ChfsResult<usize>;
+
   /**
    * Get the free blocks of the filesystem.
-   * Will read the block bitmap of the underlying filesystem
+   * The number is maintained by the block allocator, so it's O(1)
    */
   auto get_free_blocks_num() const -> ChfsResult<u64>;
 
   /**
-   * Lookup the directory
+   * Get the size of the blocks of the filesystem
+   */
+  auto get_block_size() const -> usize { return block_manager_->block_size(); }
+
+  /**
+   * Get the total blocks of the filesystem, including the reserved ones
+   */
+  auto get_total_blocks_num() const -> u64 {
+    return block_manager_->total_blocks();
+  }
+
+  /**
+   * Lookup the directory.
+   * The results, including the names not found, are kept in the dentry cache,
+   * so a repeated lookup reads no block.
    */
   auto lookup(inode_id_t, const char *name) -> ChfsResult<inode_id_t>;
 
+  /**
+   * Lookup the dentry cache only
+   *
+   * @return the inode id, KInvalidInodeID if the name is known not to exist,
+   * or std::nullopt if it's not cached
+   */
+  auto lookup_cached(inode_id_t parent, const std::string &name)
+      -> std::optional<inode_id_t> {
+    return dentries_.get(parent, name);
+  }
+
+  /**
+   * List the directory from @cookie, which is 0 at the beginning, or the
+   * cookie of the last entry listed.
+   * The entries are listed in the order of their name hashes, so a cookie
+   * stays valid while the directory changes. At most @max_entries are
+   * returned, unless more share the cookie of the last one.
+   *
+   * @return the entries, empty at the end of the directory
+   */
+  auto readdir(inode_id_t id, u64 cookie, usize max_entries)
+      -> ChfsResult<std::vector<ReaddirEntry>>;
+
+  auto get_dentry_stats() -> DentryCacheStats {
+    return dentries_.get_stats();
+  }
+
+  /**
+   * The dentry cache, which the directory helpers keep up to date
+   */
+  auto dentry_cache() -> DentryCache & { return dentries_; }
+
+  /**
+   * Cache a directory entry. In a transaction, it's staged until the
+   * transaction is committed, see `DentryCache::stage`.
+   */
+  auto cache_dentry(inode_id_t parent, const std::string &name, inode_id_t id)
+      -> void {
+    if (block_manager_->is_write_to_log()) {
+      dentries_.stage(parent, name, id);
+    } else {
+      dentries_.put(parent, name, id);
+    }
+  }
+
   /**
    * Helper function to create directory or file
    *
@@ -174,9 +434,23 @@ public:
    * Resize the content of the inode
    * Assumption: it operates on the file, but not the directory
    *
+   * Only the metadata is changed: shrinking frees the tail blocks, and
+   * extending leaves holes that read as zeros, whose blocks are allocated
+   * on the first write.
    */
   auto resize(inode_id_t id, u64 sz) -> ChfsResult<FileAttr>;
 
+  /**
+   * Allocate the blocks of [offset, offset + len) ahead of the writes,
+   * like fallocate(2). The blocks read as zeros until they are written.
+   * For an inode with extents, they're allocated in contiguous runs, and
+   * writing them needs no more allocation.
+   *
+   * @param keep_size don't extend the file, like FALLOC_FL_KEEP_SIZE
+   */
+  auto preallocate(inode_id_t id, u64 offset, u64 len, bool keep_size = false)
+      -> ChfsNullResult;
+
   /**
    * Remove the file named @name from directory @parent.
    * Free the file's blocks.
@@ -186,11 +460,113 @@ public:
    */
   auto unlink(inode_id_t parent, const char *name) -> ChfsNullResult;
 
+  /**
+   * Rename @name of @parent to @newname of @newparent, like rename(2).
+   * An existing @newname is replaced and freed if it's a file or an empty
+   * directory of the same type.
+   *
+   * The new name is added before the old one is removed, so the inode is
+   * never lost.
+   *
+   * @return NotExist if @name doesn't exist, NotEmpty if @newname is a
+   * non-empty directory, and INVALID_ARG if the types don't match or a
+   * directory is moved into its own subtree
+   */
+  auto rename(inode_id_t parent, const char *name, inode_id_t newparent,
+              const char *newname) -> ChfsNullResult;
+
 private:
+  /**
+   * Check whether the inode @target can be replaced by @src in a rename
+   */
+  auto check_replace(inode_id_t src, inode_id_t target) -> ChfsNullResult;
+
+  /**
+   * Check whether @src can be moved into the directory @newparent, which
+   * can't be @src itself or under it. Only a directory is searched, so moving
+   * a file costs nothing.
+   */
+  auto check_move(inode_id_t src, inode_id_t newparent) -> ChfsNullResult;
+
+  /**
+   * Get the file recording the reference counts of the shared blocks.
+   * It records the number of **extra** references of each block, so it's
+   * sparse and only the blocks of cloned files take space.
+   *
+   * @param create whether to create it if there is none
+   * @return KInvalidInodeID if there is none and `create` isn't set
+   */
+  auto get_refcount_inode(bool create) -> ChfsResult<inode_id_t>;
+
+  /**
+   * Get the orphan file, or create one if there is none and `create` is set
+   */
+  auto get_orphan_inode(bool create) -> ChfsResult<inode_id_t>;
+
+  /**
+   * Whether the block of the file is shared with other files. The reference
+   * count is only looked up if the inode has ever been cloned.
+   */
+  auto is_shared(inode_id_t id, const Inode *inode, block_id_t bid)
+      -> ChfsResult<bool>;
+
+  /**
+   * Add a reference to each of the blocks, or drop one if `inc` is false.
+   * The blocks whose last references are dropped are put into `freed`.
+   */
+  auto adjust_refcounts(std::vector<block_id_t> blocks, bool inc,
+                        std::vector<block_id_t> *freed) -> ChfsNullResult;
+
+  /**
+   * Drop a reference to each of the data blocks, and deallocate the ones that
+   * are no longer shared
+   */
+  auto release_blocks(const std::vector<block_id_t> &blocks) -> ChfsNullResult;
+
+  /**
+   * Replace the shared block mapped at `idx` with a private copy of it
+   *
+   * @param copy whether to copy the content, or the caller overwrites it
+   * @return the new block
+   */
+  auto break_sharing(BlockMap &block_map, u64 idx, block_id_t bid, bool copy)
+      -> ChfsResult<block_id_t>;
+
+  /**
+   * Zero the bytes after `file_sz` in the last block of the file,
+   * which are undefined and become part of the file when it grows.
+   */
+  auto zero_tail(inode_id_t id, const Inode *inode, BlockMap &block_map,
+                 u64 file_sz) -> ChfsNullResult;
+
+  /**
+   * Get a block for the unmapped logical block `idx` before writing it: the
+   * preallocated one if there is, otherwise a newly allocated one
+   */
+  auto map_new_block(BlockMap &block_map, u64 idx) -> ChfsResult<block_id_t>;
+
+  /**
+   * Record the timestamp of an inode in memory instead of writing the inode.
+   */
+  auto defer_time(inode_id_t id, u64 time) -> ChfsNullResult;
+
+  /**
+   * Write the timestamp to the inode. `lazytime_mutex_` should be held.
+   */
+  auto write_back_time(inode_id_t id, u64 time) -> ChfsNullResult;
+
+  /**
+   * Overlay the deferred timestamps on the attribute read from the inode
+   */
+  auto apply_lazy_time(inode_id_t id, FileAttr &attr) -> void;
+
   FileOperation(std::shared_ptr<BlockManager> bm,
                 std::shared_ptr<InodeManager> im,
-                std::shared_ptr<BlockAllocator> ba)
-      : block_manager_(bm), inode_manager_(im), block_allocator_(ba) {}
+                std::shared_ptr<BlockAllocator> ba,
+                std::shared_ptr<SuperBlock> sb)
+      : block_manager_(bm), inode_manager_(im), block_allocator_(ba),
+        inode_flags_(sb->get_inode_flags()), super_block_(sb),
+        zero_block_(bm->block_size(), 0) {}
 };
 
 } // namespace chfs
\ No newline at end of file
@@ -0,0 +1,78 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// readahead.h
+//
+// Identification: src/include/filesystem/readahead.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <utility>
+
+#include "common/config.h"
+
+namespace chfs {
+
+// The readahead window starts with this many blocks once a sequential stream
+// is detected, and doubles on each prefetch up to the maximum
+const u64 KReadaheadInitBlocks = 4;
+const u64 KReadaheadMaxBlocks = 64;
+
+struct ReadaheadStats {
+  u64 reads = 0;
+  u64 hits = 0;              // reads whose blocks were all prefetched
+  u64 prefetched_blocks = 0; // blocks we asked to prefetch
+
+  auto hit_rate() const -> double {
+    return reads == 0 ? 0 : static_cast<double>(hits) / reads;
+  }
+};
+
+/**
+ * Track the access pattern of an open file, in the spirit of the readahead
+ * of Linux.
+ *
+ * A read that starts where the previous one ends is sequential. Once a file
+ * is read sequentially, we keep a window of blocks ahead of the reader
+ * prefetched: when the reader gets within half a window of the end of the
+ * prefetched range, the next window is prefetched and the window doubles.
+ * A random read resets the window.
+ *
+ * Note that the execution of the API is **not** thread-safe, each open file
+ * should have its own state.
+ */
+class Readahead {
+  u64 block_size;
+
+  // where the next read starts if the stream is sequential
+  u64 next_offset;
+
+  // the prefetched blocks, [start, end)
+  u64 start;
+  u64 end;
+
+  // the number of blocks to prefetch next time, 0 if not sequential
+  u64 window;
+
+  ReadaheadStats stats;
+
+public:
+  explicit Readahead(u64 block_size)
+      : block_size(block_size), next_offset(0), start(0), end(0), window(0) {}
+
+  /**
+   * Record a read of [offset, offset + sz) of a file of `file_sz` bytes.
+   *
+   * @return the blocks to prefetch, [first, first + count). The count is 0 if
+   * nothing should be prefetched.
+   */
+  auto on_read(u64 offset, u64 sz, u64 file_sz) -> std::pair<u64, u64>;
+
+  auto get_stats() const -> const ReadaheadStats & { return stats; }
+};
+
+} // namespace chfs
@@ -0,0 +1,117 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// write_buffer.h
+//
+// Identification: src/include/filesystem/write_buffer.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <map>
+#include <unordered_map>
+
+#include "filesystem/operations.h"
+
+namespace chfs {
+
+// The buffered writes of a file are flushed once they exceed this many bytes
+const usize KWriteBackMaxBytes = 4 * 1024 * 1024;
+// ... or this many seconds after the file first becomes dirty
+const u64 KWriteBackExpireSec = 5;
+
+/**
+ * A write-back buffer in front of `FileOperation`.
+ *
+ * Writes are kept in memory per inode, and adjacent or overlapping writes
+ * are coalesced into one range. When a file is flushed, all of its ranges
+ * go to `write_file_ranges`, so the inode is updated once per flush instead
+ * of once per write.
+ *
+ * The owner should flush a file before reading it or changing its size, and
+ * discard the buffer of a removed file. `buffered_end` tells the size of a
+ * file including the buffered writes.
+ *
+ * Errors of the buffered writes (e.g., no space left) are reported by the
+ * flush. If the content is written back by a `write`, e.g., it expires, the
+ * error is kept and reported by the next flush of the file, so an unrelated
+ * write doesn't fail.
+ *
+ * Note that the execution of the API is **not** thread-safe.
+ */
+class WriteBuffer {
+  struct DirtyFile {
+    // offset -> content, neither overlapping nor adjacent
+    std::map<u64, std::vector<u8>> ranges;
+    usize bytes = 0;
+    u64 dirtied_at = 0;
+  };
+
+  // not owned
+  FileOperation *fs;
+  std::unordered_map<inode_id_t, DirtyFile> files;
+  // the errors of the write-backs not reported yet
+  std::unordered_map<inode_id_t, ErrorType> errors;
+
+  /**
+   * Write the buffered content of the file to the filesystem, the content is
+   * dropped even if it fails
+   */
+  auto write_back(inode_id_t id) -> ChfsNullResult;
+
+  /**
+   * Write the file back, and keep the error for its next flush
+   */
+  auto write_back_keep_error(inode_id_t id) -> void;
+
+public:
+  explicit WriteBuffer(FileOperation *fs) : fs(fs) {}
+
+  /**
+   * Buffer a write of the file. It flushes the file if the buffer is too
+   * large, and other files whose buffers expire.
+   *
+   * @return the number of bytes written
+   */
+  auto write(inode_id_t id, const u8 *data, u64 sz, u64 offset)
+      -> ChfsResult<u64>;
+
+  /**
+   * Write the buffered content of the file to the filesystem
+   *
+   * @return the error of this write-back, or of an earlier one made by
+   * `write` since the last flush
+   */
+  auto flush(inode_id_t id) -> ChfsNullResult;
+
+  auto flush_all() -> ChfsNullResult;
+
+  /**
+   * Flush the files that have been dirty for more than KWriteBackExpireSec.
+   * The errors are reported by the next flush of each file.
+   */
+  auto flush_expired() -> void;
+
+  /**
+   * Drop the buffered content of the file, e.g., it's removed
+   */
+  auto discard(inode_id_t id) -> void {
+    files.erase(id);
+    errors.erase(id);
+  }
+
+  /**
+   * The end of the buffered content of the file, 0 if nothing is buffered
+   */
+  auto buffered_end(inode_id_t id) const -> u64;
+
+  /**
+   * The number of bytes buffered for the file
+   */
+  auto buffered_bytes(inode_id_t id) const -> usize;
+};
+
+} // namespace chfs
@@ -57,6 +57,9 @@ namespace mapReduce {
         bool Done();
 
     private:
+        // merge the reduce outputs into the result file
+        bool publishOutput();
+
         std::vector<std::string> files;
         std::mutex mtx;
         bool isFinished;
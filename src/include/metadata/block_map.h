@@ -0,0 +1,102 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// block_map.h
+//
+// Identification: src/include/metadata/block_map.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <optional>
+
+#include "metadata/extent.h"
+#include "metadata/inode.h"
+
+namespace chfs {
+
+/**
+ * Translate the logical blocks of an inode to the blocks on the device.
+ * It hides how the mapping is stored in the inode:
+ * - direct blocks plus a single indirect block (the default)
+ * - an extent tree rooted in the inode (if the inode has KInodeExtentFlag)
+ *
+ * The block map works on an inode buffer owned by the caller, the caller
+ * should write the inode back after modifications. The indirect block is
+ * written back in `flush`.
+ *
+ * Note that the execution of the API is **not** thread-safe.
+ */
+class BlockMap {
+  std::shared_ptr<BlockManager> bm;
+  std::shared_ptr<BlockAllocator> allocator;
+  Inode *inode;
+
+  // cached indirect block
+  std::vector<u8> indirect_block;
+  bool indirect_dirty;
+
+  // the last extent we looked up, most accesses are sequential
+  std::optional<Extent> cached_extent;
+
+public:
+  BlockMap(std::shared_ptr<BlockManager> bm,
+           std::shared_ptr<BlockAllocator> allocator, Inode *inode)
+      : bm(bm), allocator(allocator), inode(inode), indirect_dirty(false) {}
+
+  /**
+   * Get the block that stores the logical block `idx`
+   *
+   * @return KInvalidBlockID if the block is not mapped, or it's preallocated
+   * but not written (see `claim`), both read as zeros
+   */
+  auto lookup(u64 idx) -> ChfsResult<block_id_t>;
+
+  /**
+   * Mark the preallocated block of `idx` as written before writing it.
+   * The caller should write the whole block, since its old content is
+   * undefined.
+   *
+   * @return the block, or KInvalidBlockID if `idx` isn't preallocated
+   */
+  auto claim(u64 idx) -> ChfsResult<block_id_t>;
+
+  /**
+   * Allocate the unmapped blocks in [first, first + cnt) ahead of the writes.
+   * With an extent tree, the blocks are allocated in contiguous runs and
+   * marked unwritten. Otherwise they're zeroed, as there is no room for the
+   * flag.
+   *
+   * @return the number of blocks allocated
+   */
+  auto preallocate(u64 first, u64 cnt) -> ChfsResult<u64>;
+
+  /**
+   * Map the logical block `idx` to `bid`.
+   * The caller is responsible for releasing the block previously mapped.
+   */
+  auto set(u64 idx, block_id_t bid) -> ChfsNullResult;
+
+  /**
+   * Unmap all the logical blocks starting from `nblocks`.
+   * The blocks used by the mapping itself (e.g., the indirect block) are freed
+   * directly.
+   *
+   * @param freed the unmapped data blocks, the caller should free them
+   */
+  auto truncate(u64 nblocks, std::vector<block_id_t> &freed) -> ChfsNullResult;
+
+  /**
+   * Write the dirty indirect block back
+   */
+  auto flush() -> ChfsNullResult;
+
+private:
+  auto extent_tree() -> ExtentTree;
+  auto load_indirect_block(bool create) -> ChfsResult<bool>;
+};
+
+} // namespace chfs
@@ -0,0 +1,162 @@
+//===----------------------------------------------------------------------===//
+//
+//                         Chfs
+//
+// extent.h
+//
+// Identification: src/include/metadata/extent.h
+//
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <limits>
+#include <vector>
+
+#include "block/allocator.h"
+#include "common/config.h"
+
+namespace chfs {
+
+const u16 KExtentMagic = 0xF30A;
+
+// The maximum number of blocks a single extent can describe
+const u32 KMaxExtentLen = std::numeric_limits<u32>::max();
+
+// The maximum number of logical blocks an extent-mapped inode can address
+const u64 KMaxExtentFileBlocks = static_cast<u64>(1) << 32;
+
+// The blocks of the extent are preallocated but not written yet,
+// so they read as zeros
+const u32 KExtentUnwritten = 1;
+
+/**
+ * The header of every extent tree node.
+ * A node is either the root stored inside the inode, or a whole block.
+ */
+struct ExtentHeader {
+  u16 magic;
+  // number of valid entries in the node
+  u16 entries;
+  // capacity of the node
+  u16 max;
+  // 0 for a leaf node (stores `Extent`), otherwise an index node
+  // (stores `ExtentIndex`)
+  u16 depth;
+} __attribute__((packed));
+
+/**
+ * A leaf entry: map [logical, logical + len) to [physical, physical + len)
+ */
+struct Extent {
+  u64 logical;
+  block_id_t physical;
+  u32 len;
+  u32 flags;
+
+  auto end() const -> u64 { return logical + len; }
+} __attribute__((packed));
+
+/**
+ * An index entry: the child node covers the logical blocks starting from
+ * `logical`
+ */
+struct ExtentIndex {
+  u64 logical;
+  block_id_t child;
+} __attribute__((packed));
+
+static_assert(sizeof(ExtentHeader) == 8, "Unexpected ExtentHeader size");
+static_assert(sizeof(Extent) == 24, "Unexpected Extent size");
+static_assert(sizeof(ExtentIndex) == 16, "Unexpected ExtentIndex size");
+
+/**
+ * A B+tree of extents. The root node is stored in a memory region provided by
+ * the caller (i.e., the block area of an inode), other nodes are stored in
+ * blocks allocated from the block allocator.
+ *
+ * The tree maintains the following invariants:
+ * 1. extents never overlap and are sorted by the logical block
+ * 2. all extents of a child end before the logical block of the next index
+ *
+ * Note that modifications of the root are only reflected in the root buffer,
+ * the caller should write the inode back. Other nodes are written to the block
+ * manager immediately.
+ *
+ * The execution of the API is **not** thread-safe.
+ */
+class ExtentTree {
+  std::shared_ptr<BlockManager> bm;
+  std::shared_ptr<BlockAllocator> allocator;
+  u8 *root;
+  usize root_sz;
+
+  struct Node;
+
+public:
+  ExtentTree(std::shared_ptr<BlockManager> bm,
+             std::shared_ptr<BlockAllocator> allocator, u8 *root,
+             usize root_sz)
+      : bm(bm), allocator(allocator), root(root), root_sz(root_sz) {}
+
+  /**
+   * Initialize an empty tree in the root area
+   */
+  static auto init_root(u8 *root, usize root_sz) -> void;
+
+  /**
+   * Find the extent that maps the logical block.
+   *
+   * @return the extent if the block is mapped.
+   *         Otherwise, an extent with KInvalidBlockID (0) as the physical block,
+   *         whose length is the number of blocks until the next mapped one
+   *         (at most KMaxExtentLen).
+   */
+  auto lookup(u64 logical) -> ChfsResult<Extent>;
+
+  /**
+   * Map a new extent. The range must not be mapped before.
+   * It will be merged with its neighbours if they are contiguous.
+   */
+  auto insert(const Extent &ext) -> ChfsNullResult;
+
+  /**
+   * Unmap [logical, logical + len). Extents partially covered are trimmed or
+   * split. Nodes that become empty are freed.
+   *
+   * @param removed the removed (physical) ranges, the caller decides how to
+   * release the data blocks
+   */
+  auto remove(u64 logical, u64 len, std::vector<Extent> &removed)
+      -> ChfsNullResult;
+
+  /**
+   * Collect all extents in logical order
+   */
+  auto collect(std::vector<Extent> &extents) -> ChfsNullResult;
+
+  /**
+   * Get the depth of the tree, 0 if the root is a leaf
+   */
+  auto depth() const -> u16;
+
+private:
+  auto node_capacity(usize sz, u16 depth) const -> u16;
+  auto load(block_id_t bid, Node &node) -> ChfsNullResult;
+  auto write(Node &node) -> ChfsNullResult;
+  auto find_path(u64 logical, std::vector<Node> &path) -> ChfsNullResult;
+  auto seek(u64 logical, std::vector<Node> &path) -> ChfsResult<bool>;
+  auto next_leaf(std::vector<Node> &path) -> ChfsResult<bool>;
+  auto insert_entry(std::vector<Node> &path, usize lvl, u16 pos,
+                    const u8 *entry) -> ChfsNullResult;
+  auto delete_entry(std::vector<Node> &path, usize lvl, u16 pos)
+      -> ChfsNullResult;
+  auto lower_first_key(std::vector<Node> &path, usize lvl, u64 key)
+      -> ChfsNullResult;
+  auto raise_next_key(std::vector<Node> &path, usize lvl, u64 key)
+      -> ChfsNullResult;
+  auto shrink_root() -> ChfsNullResult;
+};
+
+} // namespace chfs
@@ -20,6 +20,7 @@
 
 #include "block/allocator.h"
 #include "block/manager.h"
+#include "metadata/extent.h"
 
 namespace chfs {
 
@@ -27,6 +28,13 @@ namespace chfs {
 // So block IDs should be larger than 0
 const block_id_t KInvalidBlockID = 0;
 
+// The blocks of the inode are mapped by an extent tree rooted in the inode,
+// instead of the direct blocks plus an indirect block
+const u32 KInodeExtentFlag = 0x1;
+// The blocks of the inode may be shared with a clone, so a write must check
+// their reference counts. It's set on both sides of a clone and never cleared.
+const u32 KInodeSharedFlag = 0x2;
+
 enum class InodeType : u32 {
   Unknown = 0,
   FILE = 1,
@@ -74,6 +82,9 @@ class InodeManager;
  * - The last block is an indirect
  * - Others are the direct blocks
  *
+ * If the inode is created with KInodeExtentFlag, the block area instead
+ * stores the root of an extent tree (see `ExtentTree`), and the direct/indirect
+ * block helpers below must not be used.
  */
 class Inode {
   friend class InodeIterator;
@@ -87,7 +98,11 @@ class Inode {
 
   // we stored the number of blocks in the inode to prevent
   // re-calculation during runtime
-  u32 nblocks;
+  u32 nblocks : 24;
+  // How the blocks are mapped, e.g., KInodeExtentFlag. It takes the high bits
+  // of the block number, which are always 0 in the old images, so the layout
+  // of the legacy inodes is unchanged.
+  u32 flags : 8;
   // The actual number of blocks should be larger,
   // which is dynamically calculated based on the block size
 public:
@@ -98,9 +113,10 @@ public:
    * Create a new inode for a file or directory
    * @param type: the inode type
    * @param block_size: the size of the block that stored the inode
+   * @param flags: the flags of the inode, e.g., KInodeExtentFlag
    */
-  Inode(InodeType type, usize block_size)
-      : type(type), inner_attr(), block_size(block_size) {
+  Inode(InodeType type, usize block_size, u32 flags = 0)
+      : type(type), inner_attr(), block_size(block_size), flags(flags) {
     CHFS_VERIFY(block_size > sizeof(Inode), "Block size too small");
     nblocks = (block_size - sizeof(Inode)) / sizeof(block_id_t);
     inner_attr.set_all_time(time(0));
@@ -126,6 +142,23 @@ public:
    */
   auto get_nblocks() const -> u32 { return nblocks; }
 
+  /**
+   * Get the flags of the inode
+   */
+  auto get_flags() const -> u32 { return flags; }
+
+  /**
+   * Whether the blocks are mapped by an extent tree
+   */
+  auto is_extent_mapped() const -> bool { return flags & KInodeExtentFlag; }
+
+  /**
+   * Whether the blocks may be shared with a clone
+   */
+  auto may_share() const -> bool { return flags & KInodeSharedFlag; }
+
+  auto set_may_share() { flags |= KInodeSharedFlag; }
+
   /**
    * Get the number of direct blocks stored in this inode
    */
@@ -141,6 +174,9 @@ public:
    * Get the maximum file size supported by the inode
    */
   auto max_file_sz_supported() const -> u64 {
+    if (this->is_extent_mapped()) {
+      return KMaxExtentFileBlocks * static_cast<u64>(block_size);
+    }
     const auto max_blocks_in_block = block_size / sizeof(block_id_t);
     return static_cast<u64>(max_blocks_in_block) *
                static_cast<u64>(block_size) +
@@ -163,6 +199,10 @@ public:
     for (uint i = 0; i < this->nblocks; ++i) {
       inode_p->blocks[i] = KInvalidBlockID;
     }
+    if (this->is_extent_mapped()) {
+      ExtentTree::init_root(reinterpret_cast<u8 *>(inode_p->blocks),
+                            this->nblocks * sizeof(block_id_t));
+    }
   }
 
   /**
@@ -30,6 +30,10 @@ class FileOperation;
  * N  ...         |
  * | Super block | Inode Table   | Inode allocation bitmap |
  * Block allocation bitmap ... |  Other data blocks   |
+ *
+ * Like the block allocator, each inode bitmap block (with the table blocks it
+ * covers) is an allocation group with its own lock, so inodes can be
+ * allocated and freed from multiple threads.
  */
 class InodeManager {
   friend class FileOperation;
@@ -39,12 +43,25 @@ class InodeManager {
   u64 n_table_blocks;
   u64 n_bitmap_blocks;
 
+  // one allocation group per bitmap block, which also maintains the number
+  // of free inodes on allocation and free. Shared by the copies of the
+  // manager.
+  std::shared_ptr<AllocGroups> groups;
+
+  // which groups (an inode bitmap block and the table blocks it covers) are
+  // uninitialized, nullptr if all of them are initialized
+  std::shared_ptr<GroupInitFlags> init_flags;
+
 public:
   /**
    * Construct an InodeManager from scratch.
    * Note that it will initialize the blocks in the block manager.
+   *
+   * @param init_flags if provided, the bitmap and table blocks are not zeroed
+   * here but on the first use of each group
    */
-  InodeManager(std::shared_ptr<BlockManager> bm, u64 max_inode_supported);
+  InodeManager(std::shared_ptr<BlockManager> bm, u64 max_inode_supported,
+               std::shared_ptr<GroupInitFlags> init_flags = nullptr);
 
   static auto to_shared_ptr(InodeManager m) -> std::shared_ptr<InodeManager> {
     return std::make_shared<InodeManager>(m);
@@ -55,9 +72,11 @@ public:
    * Note that it won't modify any blocks on the block manager.
    *
    * The max_inode_supported can be found in the super block.
+   * The init_flags should be the same one used to create the InodeManager.
    */
-  static auto create_from_block_manager(std::shared_ptr<BlockManager> bm,
-                                        u64 max_inode_supported)
+  static auto create_from_block_manager(
+      std::shared_ptr<BlockManager> bm, u64 max_inode_supported,
+      std::shared_ptr<GroupInitFlags> init_flags = nullptr)
       -> ChfsResult<InodeManager>;
 
   /**
@@ -70,15 +89,26 @@ public:
    * Allocate and initialize an inode with proper type
    * @param type: file type
    * @param bid: inode block ID
+   * @param flags: inode flags, e.g., KInodeExtentFlag
    */
-  auto allocate_inode(InodeType type, block_id_t bid) -> ChfsResult<inode_id_t>;
+  auto allocate_inode(InodeType type, block_id_t bid, u32 flags = 0)
+      -> ChfsResult<inode_id_t>;
 
   /**
    * Get the number of free inodes
+   * Only the first call scans the bitmap, the count is maintained afterwards.
    * @return the number of free inodes if Ok
    */
   auto free_inode_cnt() const -> ChfsResult<u64>;
 
+  /**
+   * Set the number of free inodes, e.g., the one recorded in the super block,
+   * so the bitmap needn't be scanned.
+   */
+  auto set_free_inode_cnt(u64 cnt) -> void {
+    this->groups->set_free_cnt(cnt);
+  }
+
   /**
    * Get the block ID of the inode
    * @param id: **logical** inode ID
@@ -125,9 +155,33 @@ private:
    * Simple constructors
    */
   InodeManager(std::shared_ptr<BlockManager> bm, u64 max_inode_supported,
-               u64 ntables, u64 nbit)
+               u64 ntables, u64 nbit,
+               std::shared_ptr<GroupInitFlags> init_flags)
       : bm(bm), max_inode_supported(max_inode_supported),
-        n_table_blocks(ntables), n_bitmap_blocks(nbit) {}
+        n_table_blocks(ntables), n_bitmap_blocks(nbit),
+        groups(std::make_shared<AllocGroups>(nbit)), init_flags(init_flags) {}
+
+  auto is_group_initialized(u64 group) const -> bool {
+    return this->init_flags == nullptr ||
+           this->init_flags->is_initialized(group);
+  }
+
+  /**
+   * Zero the bitmap block and the table blocks of an uninitialized group
+   */
+  auto init_group(u64 group) -> ChfsNullResult;
+
+  /**
+   * Try to allocate an inode in the group, the lock of which should be held
+   *
+   * @return the **physical** inode ID, std::nullopt if the group is full.
+   */
+  auto allocate_in_group(u64 group) -> ChfsResult<std::optional<inode_id_t>>;
+
+  /**
+   * `set_table` without locking the group
+   */
+  auto write_table(inode_id_t idx, block_id_t bid) -> ChfsNullResult;
 
   /**
    * Read the inode to a buffer
@@ -28,6 +28,18 @@ typedef struct SuperBlockInternal {
   u64 ninodes;
   // The current filesystem size.
   u64 file_system_size;
+  // The flags of newly allocated inodes, e.g., KInodeExtentFlag
+  u32 inode_flags;
+  // The number of free blocks and free inodes. They are updated together with
+  // the bitmaps, so statfs doesn't need to scan the bitmaps.
+  u64 nfree_blocks;
+  u64 nfree_inodes;
+  // The inode of the file that records the reference counts of the data
+  // blocks shared by cloned files, 0 if no file has been cloned.
+  u64 refcount_inode;
+  // The inode of the file that records the blocks of the removed files
+  // waiting to be freed, 0 if there is none.
+  u64 orphan_inode;
 } SuperblockInternal;
 
 /**
@@ -51,9 +63,11 @@ public:
    *
    * @param bm the block manager
    * @param ninodes the number of inodes
+   * @param inode_flags the flags of newly allocated inodes
    *
    */
-  SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes);
+  SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes,
+             u32 inode_flags = 0);
 
   /**
    * Create a superblock from a block manager,
@@ -78,6 +92,43 @@ public:
   u32 get_block_size() const { return inner.block_size; }
   u64 get_nblocks() const { return inner.nblocks; }
   u64 get_ninodes() const { return inner.ninodes; }
+  u32 get_inode_flags() const { return inner.inode_flags; }
+  u64 get_nfree_blocks() const { return inner.nfree_blocks; }
+  u64 get_nfree_inodes() const { return inner.nfree_inodes; }
+  u64 get_refcount_inode() const { return inner.refcount_inode; }
+  u64 get_orphan_inode() const { return inner.orphan_inode; }
+
+  /**
+   * The flags of the uninitialized inode groups and block groups.
+   * They are stored in the super block right after `SuperBlockInternal`,
+   * each takes half of the remaining space.
+   */
+  static auto inode_group_flags(std::shared_ptr<BlockManager> bm,
+                                block_id_t id)
+      -> std::shared_ptr<GroupInitFlags>;
+  static auto block_group_flags(std::shared_ptr<BlockManager> bm,
+                                block_id_t id)
+      -> std::shared_ptr<GroupInitFlags>;
+
+  /**
+   * Update the usage counters. Note that it doesn't write the super block,
+   * the caller should call `flush`.
+   */
+  auto set_usage(u64 nfree_blocks, u64 nfree_inodes) -> void {
+    inner.nfree_blocks = nfree_blocks;
+    inner.nfree_inodes = nfree_inodes;
+  }
+
+  /**
+   * Record the inode of the reference count file. Note that it doesn't write
+   * the super block, the caller should call `flush`.
+   */
+  auto set_refcount_inode(u64 id) -> void { inner.refcount_inode = id; }
+
+  /**
+   * Record the inode of the orphan file, and the caller should `flush` too
+   */
+  auto set_orphan_inode(u64 id) -> void { inner.orphan_inode = id; }
 
 private:
   explicit SuperBlock(std::shared_ptr<BlockManager> bm) : bm(bm) {}
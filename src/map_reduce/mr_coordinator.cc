@@ -37,47 +37,60 @@ namespace mapReduce {
                 isReduceFinished = true;
         }
 
-        if (isReduceFinished) {
-            std::string write_content;
+        if (isReduceFinished && !isFinished) {
+            if (!publishOutput()) {
+                // run the reduce tasks again, the last one publishes the
+                // output once more
+                isReduceFinished = false;
+                reduceIndex = 0;
+                return 0;
+            }
+            isFinished = true;
+            mtx.unlock();
+        }
 
-            auto loopup_res = chfs_client->lookup(1, outPutFile);
-            chfs::inode_id_t inode_id;
-            if (loopup_res.is_err()) {
-                auto mknode_res = chfs_client->mknode(chfs::ChfsClient::FileType::REGULAR, 1, outPutFile);
-                if (mknode_res.is_err()) {
-                    isFinished = true;
-                    mtx.unlock();
-                    return 0;
-                }
-                inode_id = mknode_res.unwrap();
-            } else
-                inode_id = loopup_res.unwrap();
+        return 0;
+    }
 
-            for (int i = 0; i < nReduces; i++) {
-                auto look_res = chfs_client->lookup(1, "r-" + std::to_string(i));
-                if (look_res.is_err())
-                    continue;
-                auto inode_id = look_res.unwrap();
+    bool Coordinator::publishOutput() {
+        // a single output is published by renaming, without copying
+        if (nReduces == 1)
+            return chfs_client->rename(1, "r-0", 1, outPutFile).is_ok();
 
-                auto type_attr_res = chfs_client->get_type_attr(inode_id);
-                if (type_attr_res.is_err())
-                    continue;
-                auto [type, attr] = type_attr_res.unwrap();
+        std::string write_content;
+        for (int i = 0; i < nReduces; i++) {
+            auto look_res = chfs_client->lookup(1, "r-" + std::to_string(i));
+            if (look_res.is_err())
+                continue;
+            auto inode_id = look_res.unwrap();
 
-                auto read_res = chfs_client->read_file(inode_id, 0, attr.size);
-                if (read_res.is_err())
-                    continue;
-                auto content = read_res.unwrap();
+            auto type_attr_res = chfs_client->get_type_attr(inode_id);
+            if (type_attr_res.is_err())
+                continue;
+            auto [type, attr] = type_attr_res.unwrap();
 
-                write_content.insert(write_content.end(), content.begin(), content.end());
-            }
+            auto read_res = chfs_client->read_file(inode_id, 0, attr.size);
+            if (read_res.is_err())
+                continue;
+            auto content = read_res.unwrap();
 
-            chfs_client->write_file(inode_id, 0, {write_content.begin(), write_content.end()});
-            isFinished = true;
-            mtx.unlock();
+            write_content.insert(write_content.end(), content.begin(), content.end());
         }
 
-        return 0;
+        // the outputs are merged into a temporary file, which then replaces
+        // the result file at once. One left by a failed attempt is dropped
+        // first, or mknode fails.
+        const auto tmp_file = outPutFile + ".tmp";
+        if (chfs_client->lookup(1, tmp_file).is_ok() &&
+            chfs_client->unlink(1, tmp_file).is_err())
+            return false;
+        auto mknode_res = chfs_client->mknode(chfs::ChfsClient::FileType::REGULAR, 1, tmp_file);
+        if (mknode_res.is_err())
+            return false;
+        auto write_res = chfs_client->write_file(mknode_res.unwrap(), 0, {write_content.begin(), write_content.end()});
+        if (write_res.is_err())
+            return false;
+        return chfs_client->rename(1, tmp_file, 1, outPutFile).is_ok();
     }
 
     // mr_coordinator calls Done() periodically to find out
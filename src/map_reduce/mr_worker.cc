@@ -109,7 +109,15 @@ namespace mapReduce {
         for (const auto &[key, val] : words)
             content += key + " " + std::to_string(val) + " ";
 
-        auto mknode_res = chfs_client->mknode(chfs::ChfsClient::FileType::REGULAR, 1, "r-" + std::to_string(index));
+        // write to a temporary file and publish it by renaming, so r-i is
+        // either absent or complete
+        const auto output = "r-" + std::to_string(index);
+        const auto tmp_output = output + ".tmp";
+        // a temporary file left by a failed attempt is dropped first
+        if (chfs_client->lookup(1, tmp_output).is_ok() &&
+            chfs_client->unlink(1, tmp_output).is_err())
+            return;
+        auto mknode_res = chfs_client->mknode(chfs::ChfsClient::FileType::REGULAR, 1, tmp_output);
         if (mknode_res.is_err())
             return;
         auto inode_id = mknode_res.unwrap();
@@ -117,7 +125,10 @@ namespace mapReduce {
         auto write_res = chfs_client->write_file(inode_id, 0, {content.begin(), content.end()});
         if (write_res.is_err())
             return;
-        
+        auto rename_res = chfs_client->rename(1, tmp_output, 1, output);
+        if (rename_res.is_err())
+            return;
+
         doSubmit(REDUCE, index);
     }
 
@@ -0,0 +1,288 @@
+#include "metadata/block_map.h"
+
+namespace chfs {
+
+auto BlockMap::extent_tree() -> ExtentTree {
+  return ExtentTree(bm, allocator, reinterpret_cast<u8 *>(inode->blocks),
+                    inode->get_nblocks() * sizeof(block_id_t));
+}
+
+// Load the indirect block. If `create` is set, allocate one if there is none.
+// Return whether the indirect block exists.
+auto BlockMap::load_indirect_block(bool create) -> ChfsResult<bool> {
+  if (!indirect_block.empty()) {
+    return ChfsResult<bool>(true);
+  }
+
+  if (inode->blocks[inode->get_nblocks() - 1] == KInvalidBlockID) {
+    if (!create) {
+      return ChfsResult<bool>(false);
+    }
+    auto bid_res = inode->get_or_insert_indirect_block(allocator);
+    if (bid_res.is_err()) {
+      return ChfsResult<bool>(bid_res.unwrap_error());
+    }
+    indirect_block.assign(bm->block_size(), 0);
+    indirect_dirty = true;
+    return ChfsResult<bool>(true);
+  }
+
+  indirect_block.resize(bm->block_size());
+  auto res =
+      bm->read_block(inode->get_indirect_block_id(), indirect_block.data());
+  if (res.is_err()) {
+    indirect_block.clear();
+    return ChfsResult<bool>(res.unwrap_error());
+  }
+  return ChfsResult<bool>(true);
+}
+
+auto BlockMap::lookup(u64 idx) -> ChfsResult<block_id_t> {
+  if (inode->is_extent_mapped()) {
+    if (!cached_extent || cached_extent->logical > idx ||
+        idx >= cached_extent->end()) {
+      auto res = this->extent_tree().lookup(idx);
+      if (res.is_err()) {
+        return ChfsResult<block_id_t>(res.unwrap_error());
+      }
+      if (res.unwrap().physical == KInvalidBlockID) {
+        return ChfsResult<block_id_t>(KInvalidBlockID);
+      }
+      cached_extent = res.unwrap();
+    }
+
+    if (cached_extent->flags & KExtentUnwritten) {
+      return ChfsResult<block_id_t>(KInvalidBlockID);
+    }
+    return ChfsResult<block_id_t>(cached_extent->physical + idx -
+                                  cached_extent->logical);
+  }
+
+  if (inode->is_direct_block(idx)) {
+    return ChfsResult<block_id_t>(inode->blocks[idx]);
+  }
+
+  auto off = idx - inode->get_direct_block_num();
+  if (off >= bm->block_size() / sizeof(block_id_t)) {
+    return ChfsResult<block_id_t>(ErrorType::INVALID_ARG);
+  }
+
+  auto load_res = this->load_indirect_block(false);
+  if (load_res.is_err()) {
+    return ChfsResult<block_id_t>(load_res.unwrap_error());
+  }
+  if (!load_res.unwrap()) {
+    return ChfsResult<block_id_t>(KInvalidBlockID);
+  }
+  return ChfsResult<block_id_t>(
+      reinterpret_cast<block_id_t *>(indirect_block.data())[off]);
+}
+
+auto BlockMap::set(u64 idx, block_id_t bid) -> ChfsNullResult {
+  if (inode->is_extent_mapped()) {
+    cached_extent.reset();
+    auto tree = this->extent_tree();
+
+    auto cur = tree.lookup(idx);
+    if (cur.is_err()) {
+      return ChfsNullResult(cur.unwrap_error());
+    }
+    if (cur.unwrap().physical != KInvalidBlockID) {
+      std::vector<Extent> removed;
+      auto res = tree.remove(idx, 1, removed);
+      if (res.is_err()) {
+        return res;
+      }
+    }
+    return tree.insert({idx, bid, 1, 0});
+  }
+
+  if (inode->is_direct_block(idx)) {
+    inode->set_block_direct(idx, bid);
+    return KNullOk;
+  }
+
+  auto off = idx - inode->get_direct_block_num();
+  if (off >= bm->block_size() / sizeof(block_id_t)) {
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
+  auto load_res = this->load_indirect_block(true);
+  if (load_res.is_err()) {
+    return ChfsNullResult(load_res.unwrap_error());
+  }
+  reinterpret_cast<block_id_t *>(indirect_block.data())[off] = bid;
+  indirect_dirty = true;
+  return KNullOk;
+}
+
+auto BlockMap::claim(u64 idx) -> ChfsResult<block_id_t> {
+  if (!inode->is_extent_mapped()) {
+    // the preallocated blocks are zeroed and look written
+    return ChfsResult<block_id_t>(KInvalidBlockID);
+  }
+
+  cached_extent.reset();
+  auto tree = this->extent_tree();
+  auto res = tree.lookup(idx);
+  if (res.is_err()) {
+    return ChfsResult<block_id_t>(res.unwrap_error());
+  }
+  auto ext = res.unwrap();
+  if (ext.physical == KInvalidBlockID || !(ext.flags & KExtentUnwritten)) {
+    return ChfsResult<block_id_t>(KInvalidBlockID);
+  }
+
+  // Split the block out of the unwritten extent, it's merged with the
+  // written one before it, so a sequential writer leaves one extent behind
+  auto bid = ext.physical + idx - ext.logical;
+  std::vector<Extent> removed;
+  auto remove_res = tree.remove(idx, 1, removed);
+  if (remove_res.is_err()) {
+    return ChfsResult<block_id_t>(remove_res.unwrap_error());
+  }
+  auto insert_res = tree.insert({idx, bid, 1, 0});
+  if (insert_res.is_err()) {
+    return ChfsResult<block_id_t>(insert_res.unwrap_error());
+  }
+  return ChfsResult<block_id_t>(bid);
+}
+
+auto BlockMap::preallocate(u64 first, u64 cnt) -> ChfsResult<u64> {
+  u64 allocated = 0;
+
+  if (!inode->is_extent_mapped()) {
+    for (u64 idx = first; idx < first + cnt; ++idx) {
+      auto bid_res = this->lookup(idx);
+      if (bid_res.is_err()) {
+        return ChfsResult<u64>(bid_res.unwrap_error());
+      }
+      if (bid_res.unwrap() != KInvalidBlockID) {
+        continue;
+      }
+      auto block_res = allocator->allocate();
+      if (block_res.is_err()) {
+        return ChfsResult<u64>(block_res.unwrap_error());
+      }
+      auto res = bm->zero_block(block_res.unwrap());
+      if (res.is_ok()) {
+        res = this->set(idx, block_res.unwrap());
+      }
+      if (res.is_err()) {
+        allocator->deallocate(block_res.unwrap());
+        return ChfsResult<u64>(res.unwrap_error());
+      }
+      allocated += 1;
+    }
+    return ChfsResult<u64>(allocated);
+  }
+
+  cached_extent.reset();
+  auto tree = this->extent_tree();
+  for (u64 idx = first; idx < first + cnt;) {
+    auto res = tree.lookup(idx);
+    if (res.is_err()) {
+      return ChfsResult<u64>(res.unwrap_error());
+    }
+    auto ext = res.unwrap();
+    if (ext.physical != KInvalidBlockID) {
+      idx = ext.end();
+      continue;
+    }
+
+    // fill the hole with as few runs as possible
+    auto want = std::min<u64>(ext.len, first + cnt - idx);
+    auto run_res = allocator->allocate_contiguous(want);
+    if (run_res.is_err()) {
+      return ChfsResult<u64>(run_res.unwrap_error());
+    }
+    auto [bid, len] = run_res.unwrap();
+    auto insert_res =
+        tree.insert({idx, bid, static_cast<u32>(len), KExtentUnwritten});
+    if (insert_res.is_err()) {
+      // the run isn't mapped, e.g., no block is left for a new tree node
+      std::vector<block_id_t> run;
+      for (usize i = 0; i < len; ++i) {
+        run.push_back(bid + i);
+      }
+      allocator->deallocate(run);
+      return ChfsResult<u64>(insert_res.unwrap_error());
+    }
+    idx += len;
+    allocated += len;
+  }
+  return ChfsResult<u64>(allocated);
+}
+
+auto BlockMap::truncate(u64 nblocks, std::vector<block_id_t> &freed)
+    -> ChfsNullResult {
+  if (inode->is_extent_mapped()) {
+    cached_extent.reset();
+    std::vector<Extent> removed;
+    auto res = this->extent_tree().remove(
+        nblocks, std::numeric_limits<u64>::max(), removed);
+    if (res.is_err()) {
+      return res;
+    }
+    for (const auto &ext : removed) {
+      for (u32 i = 0; i < ext.len; ++i) {
+        freed.push_back(ext.physical + i);
+      }
+    }
+    return KNullOk;
+  }
+
+  const u64 direct_num = inode->get_direct_block_num();
+  for (u64 i = nblocks; i < direct_num; ++i) {
+    if (inode->blocks[i] != KInvalidBlockID) {
+      freed.push_back(inode->blocks[i]);
+      inode->blocks[i] = KInvalidBlockID;
+    }
+  }
+
+  if (inode->blocks[direct_num] == KInvalidBlockID) {
+    return KNullOk;
+  }
+
+  auto load_res = this->load_indirect_block(false);
+  if (load_res.is_err()) {
+    return ChfsNullResult(load_res.unwrap_error());
+  }
+
+  auto indirect_p = reinterpret_cast<block_id_t *>(indirect_block.data());
+  const u64 per_block = bm->block_size() / sizeof(block_id_t);
+  for (u64 i = nblocks > direct_num ? nblocks - direct_num : 0; i < per_block;
+       ++i) {
+    if (indirect_p[i] != KInvalidBlockID) {
+      freed.push_back(indirect_p[i]);
+      indirect_p[i] = KInvalidBlockID;
+      indirect_dirty = true;
+    }
+  }
+
+  if (nblocks <= direct_num) {
+    // the indirect block is no longer needed
+    auto res = allocator->deallocate(inode->get_indirect_block_id());
+    if (res.is_err()) {
+      return res;
+    }
+    inode->invalid_indirect_block_id();
+    indirect_block.clear();
+    indirect_dirty = false;
+  }
+  return KNullOk;
+}
+
+auto BlockMap::flush() -> ChfsNullResult {
+  if (!indirect_dirty || indirect_block.empty()) {
+    return KNullOk;
+  }
+  auto res = inode->write_indirect_block(bm, indirect_block);
+  if (res.is_err()) {
+    return res;
+  }
+  indirect_dirty = false;
+  return KNullOk;
+}
+
+} // namespace chfs
@@ -0,0 +1,539 @@
+#include <algorithm>
+#include <cstring>
+
+#include "metadata/extent.h"
+#include "metadata/inode.h"
+
+namespace chfs {
+
+/**
+ * An in-memory copy of a tree node, together with the position we have
+ * visited during the search.
+ */
+struct ExtentTree::Node {
+  // KInvalidBlockID if the node is the root stored in the inode
+  block_id_t bid = KInvalidBlockID;
+  u8 *root = nullptr;
+  std::vector<u8> buffer;
+  int pos = 0;
+
+  auto data() -> u8 * { return root != nullptr ? root : buffer.data(); }
+
+  auto header() -> ExtentHeader * {
+    return reinterpret_cast<ExtentHeader *>(data());
+  }
+
+  auto extents() -> Extent * {
+    return reinterpret_cast<Extent *>(data() + sizeof(ExtentHeader));
+  }
+
+  auto indexes() -> ExtentIndex * {
+    return reinterpret_cast<ExtentIndex *>(data() + sizeof(ExtentHeader));
+  }
+
+  auto entry_sz() -> usize {
+    return header()->depth == 0 ? sizeof(Extent) : sizeof(ExtentIndex);
+  }
+
+  auto entry(int i) -> u8 * {
+    return data() + sizeof(ExtentHeader) + i * entry_sz();
+  }
+
+  // Both Extent and ExtentIndex start with the logical block
+  auto key(int i) -> u64 {
+    u64 res;
+    memcpy(&res, entry(i), sizeof(u64));
+    return res;
+  }
+
+  /**
+   * Insert an entry to a node that still has room
+   */
+  auto place(int i, const u8 *e) -> void {
+    auto hdr = header();
+    memmove(entry(i + 1), entry(i), (hdr->entries - i) * entry_sz());
+    memcpy(entry(i), e, entry_sz());
+    hdr->entries += 1;
+  }
+};
+
+auto ExtentTree::init_root(u8 *root, usize root_sz) -> void {
+  auto hdr = reinterpret_cast<ExtentHeader *>(root);
+  hdr->magic = KExtentMagic;
+  hdr->entries = 0;
+  hdr->max = (root_sz - sizeof(ExtentHeader)) / sizeof(Extent);
+  hdr->depth = 0;
+}
+
+auto ExtentTree::depth() const -> u16 {
+  return reinterpret_cast<ExtentHeader *>(root)->depth;
+}
+
+auto ExtentTree::node_capacity(usize sz, u16 depth) const -> u16 {
+  auto entry_sz = depth == 0 ? sizeof(Extent) : sizeof(ExtentIndex);
+  auto cap = (sz - sizeof(ExtentHeader)) / entry_sz;
+  return static_cast<u16>(std::min<usize>(cap, 0xffff));
+}
+
+auto ExtentTree::load(block_id_t bid, Node &node) -> ChfsNullResult {
+  node.bid = bid;
+  node.root = nullptr;
+  node.buffer.resize(bm->block_size());
+  auto res = bm->read_block(bid, node.buffer.data());
+  if (res.is_err()) {
+    return res;
+  }
+  if (node.header()->magic != KExtentMagic) {
+    return ChfsNullResult(ErrorType::INVALID);
+  }
+  return KNullOk;
+}
+
+auto ExtentTree::write(Node &node) -> ChfsNullResult {
+  if (node.root != nullptr) {
+    // the root is written back together with the inode
+    return KNullOk;
+  }
+  return bm->write_block(node.bid, node.buffer.data());
+}
+
+auto ExtentTree::find_path(u64 logical, std::vector<Node> &path)
+    -> ChfsNullResult {
+  path.clear();
+  Node root_node;
+  root_node.root = this->root;
+  path.push_back(std::move(root_node));
+
+  while (true) {
+    auto &node = path.back();
+    auto hdr = node.header();
+
+    // find the last entry whose key <= logical
+    int lo = 0, hi = hdr->entries;
+    while (lo < hi) {
+      auto mid = (lo + hi) / 2;
+      if (node.key(mid) <= logical) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    node.pos = lo - 1;
+
+    if (hdr->depth == 0) {
+      return KNullOk;
+    }
+    if (hdr->entries == 0) {
+      return ChfsNullResult(ErrorType::INVALID);
+    }
+    if (node.pos < 0) {
+      node.pos = 0;
+    }
+
+    Node child;
+    auto res = this->load(node.indexes()[node.pos].child, child);
+    if (res.is_err()) {
+      return res;
+    }
+    path.push_back(std::move(child));
+  }
+}
+
+auto ExtentTree::next_leaf(std::vector<Node> &path) -> ChfsResult<bool> {
+  while (path.size() > 1) {
+    path.pop_back();
+    auto &node = path.back();
+    if (node.pos + 1 >= node.header()->entries) {
+      continue;
+    }
+
+    // move to the next child and descend to its leftmost leaf
+    node.pos += 1;
+    while (path.back().header()->depth > 0) {
+      auto &cur = path.back();
+      Node child;
+      auto res = this->load(cur.indexes()[cur.pos].child, child);
+      if (res.is_err()) {
+        return ChfsResult<bool>(res.unwrap_error());
+      }
+      child.pos = 0;
+      path.push_back(std::move(child));
+    }
+    return ChfsResult<bool>(true);
+  }
+  return ChfsResult<bool>(false);
+}
+
+// Position the path at the first extent that ends after `logical`
+auto ExtentTree::seek(u64 logical, std::vector<Node> &path)
+    -> ChfsResult<bool> {
+  auto res = this->find_path(logical, path);
+  if (res.is_err()) {
+    return ChfsResult<bool>(res.unwrap_error());
+  }
+
+  auto &leaf = path.back();
+  if (leaf.pos < 0 || leaf.extents()[leaf.pos].end() <= logical) {
+    leaf.pos += 1;
+  }
+  if (leaf.pos < leaf.header()->entries) {
+    return ChfsResult<bool>(true);
+  }
+  return this->next_leaf(path);
+}
+
+auto ExtentTree::lookup(u64 logical) -> ChfsResult<Extent> {
+  std::vector<Node> path;
+  auto res = this->find_path(logical, path);
+  if (res.is_err()) {
+    return ChfsResult<Extent>(res.unwrap_error());
+  }
+
+  auto &leaf = path.back();
+  auto pos = leaf.pos;
+  if (pos >= 0 && leaf.extents()[pos].end() > logical) {
+    Extent ext = leaf.extents()[pos];
+    return ChfsResult<Extent>(ext);
+  }
+
+  // a hole, which ends at the next extent
+  Extent hole = {logical, KInvalidBlockID, KMaxExtentLen, 0};
+  u64 next = std::numeric_limits<u64>::max();
+  if (pos + 1 < leaf.header()->entries) {
+    next = leaf.extents()[pos + 1].logical;
+  } else {
+    auto found = this->next_leaf(path);
+    if (found.is_err()) {
+      return ChfsResult<Extent>(found.unwrap_error());
+    }
+    if (found.unwrap()) {
+      next = path.back().extents()[0].logical;
+    }
+  }
+  hole.len = static_cast<u32>(std::min<u64>(next - logical, KMaxExtentLen));
+  return ChfsResult<Extent>(hole);
+}
+
+// The first key of the node at `lvl` becomes `key`, fix the parents
+auto ExtentTree::lower_first_key(std::vector<Node> &path, usize lvl, u64 key)
+    -> ChfsNullResult {
+  for (auto l = lvl; l > 0; --l) {
+    auto &parent = path[l - 1];
+    auto idx = &parent.indexes()[parent.pos];
+    if (idx->logical <= key) {
+      return KNullOk;
+    }
+    idx->logical = key;
+    auto res = this->write(parent);
+    if (res.is_err()) {
+      return res;
+    }
+    if (parent.pos != 0) {
+      return KNullOk;
+    }
+  }
+  return KNullOk;
+}
+
+// The node at `lvl` now covers blocks up to `key`, make sure the next index
+// doesn't steal them
+auto ExtentTree::raise_next_key(std::vector<Node> &path, usize lvl, u64 key)
+    -> ChfsNullResult {
+  for (auto l = lvl; l > 0; --l) {
+    auto &parent = path[l - 1];
+    if (parent.pos + 1 >= parent.header()->entries) {
+      continue;
+    }
+    auto idx = &parent.indexes()[parent.pos + 1];
+    if (idx->logical < key) {
+      idx->logical = key;
+      return this->write(parent);
+    }
+    return KNullOk;
+  }
+  return KNullOk;
+}
+
+auto ExtentTree::insert_entry(std::vector<Node> &path, usize lvl, u16 pos,
+                              const u8 *entry) -> ChfsNullResult {
+  u64 key;
+  memcpy(&key, entry, sizeof(u64));
+
+  auto &node = path[lvl];
+  auto hdr = node.header();
+  const auto block_sz = bm->block_size();
+
+  if (hdr->entries < hdr->max) {
+    node.place(pos, entry);
+    auto res = this->write(node);
+    if (res.is_err()) {
+      return res;
+    }
+    return pos == 0 ? this->lower_first_key(path, lvl, key) : KNullOk;
+  }
+
+  auto bid_res = allocator->allocate();
+  if (bid_res.is_err()) {
+    return ChfsNullResult(bid_res.unwrap_error());
+  }
+
+  if (lvl == 0) {
+    // The root is full: move its entries to a new block and
+    // let the root index the block. The tree grows by one level.
+    Node child;
+    child.bid = bid_res.unwrap();
+    child.buffer.assign(block_sz, 0);
+    *child.header() = *hdr;
+    child.header()->max = this->node_capacity(block_sz, hdr->depth);
+    memcpy(child.entry(0), node.entry(0), hdr->entries * node.entry_sz());
+    child.pos = node.pos;
+
+    auto res = this->write(child);
+    if (res.is_err()) {
+      return res;
+    }
+
+    ExtentIndex idx = {child.key(0), child.bid};
+    hdr->depth += 1;
+    hdr->entries = 1;
+    hdr->max = this->node_capacity(root_sz, hdr->depth);
+    memcpy(node.entry(0), &idx, sizeof(ExtentIndex));
+    node.pos = 0;
+
+    path.insert(path.begin() + 1, std::move(child));
+    return this->insert_entry(path, 1, pos, entry);
+  }
+
+  // Split the node: move the upper half to a new node
+  Node right;
+  right.bid = bid_res.unwrap();
+  right.buffer.assign(block_sz, 0);
+  const u16 half = hdr->entries / 2;
+  *right.header() = *hdr;
+  right.header()->entries = hdr->entries - half;
+  memcpy(right.entry(0), node.entry(half),
+         right.header()->entries * node.entry_sz());
+  hdr->entries = half;
+
+  if (pos <= half) {
+    node.place(pos, entry);
+  } else {
+    right.place(pos - half, entry);
+  }
+
+  auto res = this->write(node);
+  if (res.is_err()) {
+    return res;
+  }
+  res = this->write(right);
+  if (res.is_err()) {
+    return res;
+  }
+  if (pos == 0) {
+    res = this->lower_first_key(path, lvl, key);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+
+  ExtentIndex idx = {right.key(0), right.bid};
+  return this->insert_entry(path, lvl - 1, path[lvl - 1].pos + 1,
+                            reinterpret_cast<u8 *>(&idx));
+}
+
+auto ExtentTree::delete_entry(std::vector<Node> &path, usize lvl, u16 pos)
+    -> ChfsNullResult {
+  auto &node = path[lvl];
+  auto hdr = node.header();
+  memmove(node.entry(pos), node.entry(pos + 1),
+          (hdr->entries - pos - 1) * node.entry_sz());
+  hdr->entries -= 1;
+
+  if (hdr->entries > 0) {
+    return this->write(node);
+  }
+
+  if (lvl == 0) {
+    // the whole tree is empty
+    init_root(root, root_sz);
+    return KNullOk;
+  }
+
+  auto res = allocator->deallocate(node.bid);
+  if (res.is_err()) {
+    return res;
+  }
+  return this->delete_entry(path, lvl - 1, path[lvl - 1].pos);
+}
+
+auto ExtentTree::shrink_root() -> ChfsNullResult {
+  Node root_node;
+  root_node.root = this->root;
+  auto hdr = root_node.header();
+
+  while (hdr->depth > 0 && hdr->entries == 1) {
+    Node child;
+    auto res = this->load(root_node.indexes()[0].child, child);
+    if (res.is_err()) {
+      return res;
+    }
+
+    auto cap = this->node_capacity(root_sz, child.header()->depth);
+    if (child.header()->entries > cap) {
+      break;
+    }
+
+    memcpy(root_node.entry(0), child.entry(0),
+           child.header()->entries * child.entry_sz());
+    hdr->depth = child.header()->depth;
+    hdr->entries = child.header()->entries;
+    hdr->max = cap;
+
+    res = allocator->deallocate(child.bid);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  return KNullOk;
+}
+
+auto ExtentTree::insert(const Extent &ext) -> ChfsNullResult {
+  CHFS_ASSERT(ext.len > 0, "Empty extent");
+
+  std::vector<Node> path;
+  auto res = this->find_path(ext.logical, path);
+  if (res.is_err()) {
+    return res;
+  }
+
+  const usize lvl = path.size() - 1;
+  auto &leaf = path.back();
+  auto extents = leaf.extents();
+  auto pos = leaf.pos;
+  auto entries = leaf.header()->entries;
+
+  auto contiguous = [](const Extent &a, const Extent &b) {
+    return a.end() == b.logical && a.physical + a.len == b.physical &&
+           a.flags == b.flags &&
+           static_cast<u64>(a.len) + b.len <= KMaxExtentLen;
+  };
+
+  // 1. try to merge with the left neighbour
+  if (pos >= 0 && contiguous(extents[pos], ext)) {
+    Extent merged = extents[pos];
+    merged.len += ext.len;
+    if (pos + 1 < entries && contiguous(merged, extents[pos + 1])) {
+      merged.len += extents[pos + 1].len;
+      extents[pos] = merged;
+      res = this->delete_entry(path, lvl, pos + 1);
+    } else {
+      extents[pos] = merged;
+      res = this->write(leaf);
+    }
+    if (res.is_err()) {
+      return res;
+    }
+    return this->raise_next_key(path, lvl, merged.end());
+  }
+
+  // 2. try to merge with the right neighbour
+  if (pos + 1 < entries && contiguous(ext, extents[pos + 1])) {
+    Extent merged = ext;
+    merged.len += extents[pos + 1].len;
+    extents[pos + 1] = merged;
+    res = this->write(leaf);
+    if (res.is_err()) {
+      return res;
+    }
+    return pos + 1 == 0 ? this->lower_first_key(path, lvl, merged.logical)
+                        : KNullOk;
+  }
+
+  // 3. insert a new entry
+  res = this->raise_next_key(path, lvl, ext.end());
+  if (res.is_err()) {
+    return res;
+  }
+  return this->insert_entry(path, lvl, pos + 1,
+                            reinterpret_cast<const u8 *>(&ext));
+}
+
+auto ExtentTree::remove(u64 logical, u64 len, std::vector<Extent> &removed)
+    -> ChfsNullResult {
+  const u64 end = (len > std::numeric_limits<u64>::max() - logical)
+                      ? std::numeric_limits<u64>::max()
+                      : logical + len;
+  std::vector<Node> path;
+
+  while (logical < end) {
+    auto seek_res = this->seek(logical, path);
+    if (seek_res.is_err()) {
+      return ChfsNullResult(seek_res.unwrap_error());
+    }
+    if (!seek_res.unwrap()) {
+      break;
+    }
+
+    const usize lvl = path.size() - 1;
+    auto &leaf = path.back();
+    auto pos = leaf.pos;
+    Extent ext = leaf.extents()[pos];
+    if (ext.logical >= end) {
+      break;
+    }
+
+    // the overlapped range
+    auto start = std::max(ext.logical, logical);
+    auto stop = std::min(ext.end(), end);
+    removed.push_back({start, ext.physical + (start - ext.logical),
+                       static_cast<u32>(stop - start), ext.flags});
+
+    Extent tail = {stop, ext.physical + (stop - ext.logical),
+                   static_cast<u32>(ext.end() - stop), ext.flags};
+    ChfsNullResult res = KNullOk;
+    if (start > ext.logical) {
+      // keep the head
+      leaf.extents()[pos].len = static_cast<u32>(start - ext.logical);
+      res = this->write(leaf);
+      if (res.is_ok() && tail.len > 0) {
+        // punch a hole in the middle of the extent
+        res = this->insert(tail);
+      }
+    } else if (tail.len > 0) {
+      // keep the tail
+      leaf.extents()[pos] = tail;
+      res = this->write(leaf);
+    } else {
+      res = this->delete_entry(path, lvl, pos);
+    }
+    if (res.is_err()) {
+      return res;
+    }
+    logical = stop;
+  }
+
+  return this->shrink_root();
+}
+
+auto ExtentTree::collect(std::vector<Extent> &extents) -> ChfsNullResult {
+  std::vector<Node> path;
+  auto found = this->seek(0, path);
+
+  while (true) {
+    if (found.is_err()) {
+      return ChfsNullResult(found.unwrap_error());
+    }
+    if (!found.unwrap()) {
+      break;
+    }
+
+    auto &leaf = path.back();
+    for (int i = leaf.pos; i < leaf.header()->entries; ++i) {
+      extents.push_back(leaf.extents()[i]);
+    }
+    found = this->next_leaf(path);
+  }
+  return KNullOk;
+}
+
+} // namespace chfs
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <vector>
 
 #include "common/bitmap.h"
@@ -14,8 +15,9 @@ namespace chfs {
 #define LOGIC_2_RAW(i) (i - 1)
 
 InodeManager::InodeManager(std::shared_ptr<BlockManager> bm,
-                           u64 max_inode_supported)
-    : bm(bm) {
+                           u64 max_inode_supported,
+                           std::shared_ptr<GroupInitFlags> init_flags)
+    : bm(bm), init_flags(init_flags) {
   // 1. calculate the number of bitmap blocks for the inodes
   auto inode_bits_per_block = bm->block_size() * KBitsPerByte;
   auto blocks_needed = max_inode_supported / inode_bits_per_block;
@@ -25,6 +27,7 @@ InodeManager::InodeManager(std::shared_ptr<BlockManager> bm,
     blocks_needed += 1;
   }
   this->n_bitmap_blocks = blocks_needed;
+  this->groups = std::make_shared<AllocGroups>(this->n_bitmap_blocks);
 
   // we may enlarge the max inode supported
   this->max_inode_supported = blocks_needed * KBitsPerByte * bm->block_size();
@@ -37,19 +40,25 @@ InodeManager::InodeManager(std::shared_ptr<BlockManager> bm,
   }
   this->n_table_blocks = table_blocks;
 
-  // 3. clear the bitmap blocks and table blocks
-  for (u64 i = 0; i < this->n_table_blocks; ++i) {
-    bm->zero_block(i + 1); // 1: the super block
-  }
+  // 3. clear the bitmap blocks and table blocks,
+  // or defer it to the first use of each group
+  if (this->init_flags) {
+    this->init_flags->format(this->n_bitmap_blocks).unwrap();
+  } else {
+    for (u64 i = 0; i < this->n_table_blocks; ++i) {
+      bm->zero_block(i + 1); // 1: the super block
+    }
 
-  for (u64 i = 0; i < this->n_bitmap_blocks; ++i) {
-    bm->zero_block(i + 1 + this->n_table_blocks);
+    for (u64 i = 0; i < this->n_bitmap_blocks; ++i) {
+      bm->zero_block(i + 1 + this->n_table_blocks);
+    }
   }
+  this->groups->set_free_cnt(this->max_inode_supported);
 }
 
-auto InodeManager::create_from_block_manager(std::shared_ptr<BlockManager> bm,
-                                             u64 max_inode_supported)
-    -> ChfsResult<InodeManager> {
+auto InodeManager::create_from_block_manager(
+    std::shared_ptr<BlockManager> bm, u64 max_inode_supported,
+    std::shared_ptr<GroupInitFlags> init_flags) -> ChfsResult<InodeManager> {
   auto inode_bits_per_block = bm->block_size() * KBitsPerByte;
   auto n_bitmap_blocks = max_inode_supported / inode_bits_per_block;
 
@@ -62,51 +71,125 @@ auto InodeManager::create_from_block_manager(std::shared_ptr<BlockManager> bm,
     table_blocks += 1;
   }
 
-  InodeManager res = {bm, max_inode_supported, table_blocks, n_bitmap_blocks};
+  if (init_flags) {
+    auto load_res = init_flags->load();
+    if (load_res.is_err()) {
+      return ChfsResult<InodeManager>(load_res.unwrap_error());
+    }
+  }
+
+  InodeManager res = {bm, max_inode_supported, table_blocks, n_bitmap_blocks,
+                      init_flags};
   return ChfsResult<InodeManager>(res);
 }
 
-// { Your code here }
-auto InodeManager::allocate_inode(InodeType type, block_id_t bid)
-    -> ChfsResult<inode_id_t> {
-  auto iter_res = BlockIterator::create(this->bm.get(), 1 + n_table_blocks,
-                                        1 + n_table_blocks + n_bitmap_blocks);
-  if (iter_res.is_err()) {
-    return ChfsResult<inode_id_t>(iter_res.unwrap_error());
+auto InodeManager::init_group(u64 group) -> ChfsNullResult {
+  if (this->is_group_initialized(group)) {
+    return KNullOk;
   }
 
-  inode_id_t count = 0;
+  // a bitmap block covers `inode_bits_per_block` inodes,
+  // whose table entries are stored in `tables_per_group` table blocks
+  auto inode_bits_per_block = bm->block_size() * KBitsPerByte;
+  auto inode_per_block = bm->block_size() / sizeof(block_id_t);
+  auto tables_per_group = inode_bits_per_block / inode_per_block;
+  auto table_begin = group * tables_per_group;
+  auto table_end =
+      std::min(table_begin + tables_per_group, this->n_table_blocks);
+
+  for (auto i = table_begin; i < table_end; ++i) {
+    auto res = bm->zero_block(i + 1);
+    if (res.is_err()) {
+      return res;
+    }
+  }
+  auto res = bm->zero_block(1 + this->n_table_blocks + group);
+  if (res.is_err()) {
+    return res;
+  }
+  return this->init_flags->set_initialized(group);
+}
 
-  // Find an available inode ID.
-  for (auto iter = iter_res.unwrap(); iter.has_next();
-       iter.next(bm->block_size()).unwrap(), count++) {
-    auto data = iter.unsafe_get_value_ptr<u8>();
-    auto bitmap = Bitmap(data, bm->block_size());
-    auto free_idx = bitmap.find_first_free();
+auto InodeManager::allocate_in_group(u64 group)
+    -> ChfsResult<std::optional<inode_id_t>> {
+  std::vector<u8> buffer(bm->block_size());
+  auto bitmap = Bitmap(buffer.data(), bm->block_size());
+  auto bitmap_bid = 1 + n_table_blocks + group;
 
-    if (free_idx) {
-      // If there is an available inode ID.
+  if (this->is_group_initialized(group)) {
+    auto res = bm->read_block(bitmap_bid, buffer.data());
+    if (res.is_err()) {
+      return ChfsResult<std::optional<inode_id_t>>(res.unwrap_error());
+    }
+  } else {
+    auto res = this->init_group(group);
+    if (res.is_err()) {
+      return ChfsResult<std::optional<inode_id_t>>(res.unwrap_error());
+    }
+    bitmap.zeroed();
+  }
 
-      // Setup the bitmap.
-      bitmap.set(free_idx.value());
-      auto res = iter.flush_cur_block();
-      if (res.is_err()) {
-        return ChfsResult<inode_id_t>(res.unwrap_error());
+  auto free_idx = bitmap.find_first_free();
+  if (!free_idx) {
+    return ChfsResult<std::optional<inode_id_t>>(std::nullopt);
+  }
+
+  // Setup the bitmap.
+  bitmap.set(free_idx.value());
+  auto res = bm->write_block(bitmap_bid, buffer.data());
+  if (res.is_err()) {
+    return ChfsResult<std::optional<inode_id_t>>(res.unwrap_error());
+  }
+  this->groups->add_free_cnt(-1);
+
+  auto inode_bits_per_block = bm->block_size() * KBitsPerByte;
+  return ChfsResult<std::optional<inode_id_t>>(free_idx.value() +
+                                               group * inode_bits_per_block);
+}
+
+// { Your code here }
+auto InodeManager::allocate_inode(InodeType type, block_id_t bid, u32 flags)
+    -> ChfsResult<inode_id_t> {
+  const auto ngroups = this->groups->size();
+  const auto start = this->groups->get_hint();
+
+  // Find an available inode ID. Skip the groups locked by others first,
+  // then wait for them.
+  bool skipped = false;
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1 && !skipped) {
+      break;
+    }
+    for (u64 k = 0; k < ngroups; ++k) {
+      auto group = (start + k) % ngroups;
+      auto lock =
+          pass == 0 ? this->groups->try_lock(group) : this->groups->lock(group);
+      if (!lock.owns_lock()) {
+        skipped = true;
+        continue;
+      }
+
+      auto idx_res = this->allocate_in_group(group);
+      if (idx_res.is_err()) {
+        return ChfsResult<inode_id_t>(idx_res.unwrap_error());
+      }
+      auto inode_idx = idx_res.unwrap();
+      if (!inode_idx) {
+        this->groups->mark_full(group);
+        continue;
       }
 
       // Initialize the inode with the given type.
       std::vector<u8> buffer(bm->block_size());
-      auto inode = Inode(type, bm->block_size());
+      auto inode = Inode(type, bm->block_size(), flags);
       inode.flush_to_buffer(buffer.data());
-      res = bm->write_block(bid, buffer.data());
+      auto res = bm->write_block(bid, buffer.data());
       if (res.is_err()) {
         return ChfsResult<inode_id_t>(res.unwrap_error());
       }
 
       // Setup the inode table.
-      auto inode_bits_per_block = bm->block_size() * KBitsPerByte;
-      auto inode_idx = free_idx.value() + count * inode_bits_per_block;
-      res = set_table(inode_idx, bid);
+      res = this->write_table(inode_idx.value(), bid);
       if (res.is_err()) {
         return ChfsResult<inode_id_t>(res.unwrap_error());
       }
@@ -114,7 +197,7 @@ auto InodeManager::allocate_inode(InodeType type, block_id_t bid)
       // Return the id of the allocated inode.
       // You may have to use the `RAW_2_LOGIC` macro
       // to get the result inode id.
-      return ChfsResult<inode_id_t>(RAW_2_LOGIC(inode_idx));
+      return ChfsResult<inode_id_t>(RAW_2_LOGIC(inode_idx.value()));
     }
   }
 
@@ -123,12 +206,23 @@ auto InodeManager::allocate_inode(InodeType type, block_id_t bid)
 
 // { Your code here }
 auto InodeManager::set_table(inode_id_t idx, block_id_t bid) -> ChfsNullResult {
+  auto lock = this->groups->lock(idx / (bm->block_size() * KBitsPerByte));
+  return this->write_table(idx, bid);
+}
+
+auto InodeManager::write_table(inode_id_t idx, block_id_t bid)
+    -> ChfsNullResult {
   // Fill `bid` into the inode table entry
   // whose index is `idx`.
   auto inode_per_block = bm->block_size() / sizeof(block_id_t);
   auto table_block_idx = idx / inode_per_block;
   auto table_block_offset = idx % inode_per_block;
 
+  auto init_res = this->init_group(idx / (bm->block_size() * KBitsPerByte));
+  if (init_res.is_err()) {
+    return init_res;
+  }
+
   auto res = bm->write_partial_block(1 + table_block_idx,
       reinterpret_cast<u8 *>(&bid), table_block_offset * sizeof(block_id_t),
       sizeof(block_id_t));
@@ -152,6 +246,12 @@ auto InodeManager::get(inode_id_t id) -> ChfsResult<block_id_t> {
   auto table_block_idx = inode_idx / inode_per_block;
   auto table_block_offset = inode_idx % inode_per_block;
 
+  // the table of an uninitialized group is undefined, and no inode is there
+  if (!this->is_group_initialized(inode_idx /
+                                  (bm->block_size() * KBitsPerByte))) {
+    return ChfsResult<block_id_t>(KInvalidBlockID);
+  }
+
   auto res = bm->read_block(table_block_idx + 1, buffer.data());
   if (res.is_err()) {
     return ChfsResult<block_id_t>(res.unwrap_error());
@@ -162,6 +262,16 @@ auto InodeManager::get(inode_id_t id) -> ChfsResult<block_id_t> {
 }
 
 auto InodeManager::free_inode_cnt() const -> ChfsResult<u64> {
+  if (auto cnt = this->groups->get_free_cnt(); cnt) {
+    return ChfsResult<u64>(cnt.value());
+  }
+
+  // No one can allocate or free while we are counting
+  auto locks = this->groups->lock_all();
+  if (auto cnt = this->groups->get_free_cnt(); cnt) {
+    return ChfsResult<u64>(cnt.value());
+  }
+
   auto iter_res = BlockIterator::create(this->bm.get(), 1 + n_table_blocks,
                                         1 + n_table_blocks + n_bitmap_blocks);
 
@@ -170,17 +280,23 @@ auto InodeManager::free_inode_cnt() const -> ChfsResult<u64> {
   }
 
   u64 count = 0;
-  for (auto iter = iter_res.unwrap(); iter.has_next();) {
+  u64 group = 0;
+  for (auto iter = iter_res.unwrap(); iter.has_next(); group++) {
     auto data = iter.unsafe_get_value_ptr<u8>();
     auto bitmap = Bitmap(data, bm->block_size());
 
-    count += bitmap.count_zeros();
+    if (this->is_group_initialized(group)) {
+      count += bitmap.count_zeros();
+    } else {
+      count += bm->block_size() * KBitsPerByte;
+    }
 
     auto iter_res = iter.next(bm->block_size());
     if (iter_res.is_err()) {
       return ChfsResult<u64>(iter_res.unwrap_error());
     }
   }
+  this->groups->set_free_cnt(count);
   return ChfsResult<u64>(count);
 }
 
@@ -256,6 +372,13 @@ auto InodeManager::free_inode(inode_id_t id) -> ChfsNullResult {
   auto table_block_offset = inode_idx % inode_per_block;
   auto valid_bid = KInvalidBlockID;
 
+  auto group = inode_idx / (bm->block_size() * KBitsPerByte);
+  auto lock = this->groups->lock(group);
+  if (!this->is_group_initialized(group)) {
+    // never allocated
+    return ChfsNullResult(ErrorType::INVALID_ARG);
+  }
+
   auto res = bm->write_partial_block(
       1 + table_block_idx, reinterpret_cast<u8 *>(&valid_bid),
       table_block_offset * sizeof(block_id_t), sizeof(block_id_t));
@@ -277,12 +400,17 @@ auto InodeManager::free_inode(inode_id_t id) -> ChfsNullResult {
   }
   
   auto bitmap = Bitmap(buffer.data(), bm->block_size());
+  auto was_allocated = bitmap.check(bitmap_block_offset);
   bitmap.clear(bitmap_block_offset);
   res = bm->write_block(1 + n_table_blocks + bitmap_block_idx,
       buffer.data());
   if (res.is_err()) {
     return ChfsNullResult(res.unwrap_error());
   }
+  if (was_allocated) {
+    this->groups->add_free_cnt(1);
+    this->groups->mark_free(group);
+  }
 
   return KNullOk;
 }
@@ -4,10 +4,17 @@
 
 namespace chfs {
 
-SuperBlock::SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes) : bm(bm) {
+SuperBlock::SuperBlock(std::shared_ptr<BlockManager> bm, u64 ninodes,
+                       u32 inode_flags)
+    : bm(bm) {
   this->inner.block_size = bm->block_size();
   this->inner.nblocks = bm->total_blocks();
   this->inner.ninodes = ninodes;
+  this->inner.inode_flags = inode_flags;
+  this->inner.nfree_blocks = 0;
+  this->inner.nfree_inodes = 0;
+  this->inner.refcount_inode = 0;
+  this->inner.orphan_inode = 0;
 
   CHFS_VERIFY(this->inner.block_size >= sizeof(SuperBlockInternal),
               "Block size too small");
@@ -26,4 +33,20 @@ auto SuperBlock::create_from_existing(std::shared_ptr<BlockManager> bm,
   return ChfsResult<std::shared_ptr<SuperBlock>>(res);
 }
 
+auto SuperBlock::inode_group_flags(std::shared_ptr<BlockManager> bm,
+                                   block_id_t id)
+    -> std::shared_ptr<GroupInitFlags> {
+  auto capacity = (bm->block_size() - sizeof(SuperBlockInternal)) / 2;
+  return std::make_shared<GroupInitFlags>(bm, id, sizeof(SuperBlockInternal),
+                                          capacity);
+}
+
+auto SuperBlock::block_group_flags(std::shared_ptr<BlockManager> bm,
+                                   block_id_t id)
+    -> std::shared_ptr<GroupInitFlags> {
+  auto capacity = (bm->block_size() - sizeof(SuperBlockInternal)) / 2;
+  return std::make_shared<GroupInitFlags>(
+      bm, id, sizeof(SuperBlockInternal) + capacity, capacity);
+}
+
 } // namespace chfs
\ No newline at end of file
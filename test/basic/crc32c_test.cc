@@ -0,0 +1,18 @@
+#include "gtest/gtest.h"
+
+#include "common/crc32c.h"
+
+namespace chfs {
+
+TEST(BasicTest, Crc32c) {
+  std::string data = "123456789";
+  auto ptr = reinterpret_cast<const u8 *>(data.data());
+  EXPECT_EQ(crc32c(ptr, data.size()), 0xE3069283);
+  EXPECT_EQ(crc32c(ptr, 0), 0);
+
+  // it can be computed in parts
+  auto part = crc32c(ptr, 4);
+  EXPECT_EQ(crc32c(ptr + 4, data.size() - 4, part), 0xE3069283);
+}
+
+} // namespace chfs
@@ -1,4 +1,8 @@
+#include <set>
+#include <thread>
+
 #include "block/allocator.h"
+#include "common/bitmap.h"
 #include "common/macros.h"
 #include "gtest/gtest.h"
 
@@ -66,4 +70,186 @@ TEST_F(BlockAllocatorTest, Allocation) {
   }
 }
 
+TEST_F(BlockAllocatorTest, LazyInit) {
+  const usize block_sz = 512;
+  const usize block_cnt = block_sz * KBitsPerByte * 8;
+
+  // the device is full of garbage
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  std::vector<u8> garbage(block_sz, 0xab);
+  for (usize i = 0; i < block_cnt; i++) {
+    bm->write_block(i, garbage.data());
+  }
+
+  // the first block records the uninitialized bitmap blocks
+  usize reserved_block = 1;
+  auto flags = std::make_shared<GroupInitFlags>(bm, 0, 0, block_sz);
+  auto allocator = BlockAllocator(bm, reserved_block, true, flags);
+  auto bitmap_block_cnt = allocator.total_bitmap_block();
+  ASSERT_EQ(bitmap_block_cnt, 8);
+  ASSERT_TRUE(flags->is_initialized(0));
+  ASSERT_FALSE(flags->is_initialized(1));
+
+  auto free_block_cnt = allocator.free_block_cnt();
+  ASSERT_EQ(free_block_cnt, block_cnt - bitmap_block_cnt - reserved_block);
+  ASSERT_TRUE(allocator.deallocate(block_cnt - 1).is_err());
+
+  // allocate across the bitmap blocks
+  for (usize i = 0; i < block_sz * KBitsPerByte * 2; i++) {
+    auto block = allocator.allocate();
+    ASSERT_TRUE(block.is_ok());
+    ASSERT_EQ(block.unwrap(), i + bitmap_block_cnt + reserved_block);
+  }
+  ASSERT_TRUE(flags->is_initialized(1));
+  ASSERT_TRUE(flags->is_initialized(2));
+  ASSERT_FALSE(flags->is_initialized(3));
+
+  // the flags are persisted, and the bitmap is scanned correctly
+  auto flags_1 = std::make_shared<GroupInitFlags>(bm, 0, 0, block_sz);
+  auto allocator_1 = BlockAllocator(bm, reserved_block, false, flags_1);
+  ASSERT_TRUE(flags_1->is_initialized(2));
+  ASSERT_FALSE(flags_1->is_initialized(3));
+  ASSERT_EQ(allocator_1.free_block_cnt(),
+            free_block_cnt - block_sz * KBitsPerByte * 2);
+  ASSERT_TRUE(allocator_1.deallocate(bitmap_block_cnt + reserved_block).is_ok());
+}
+
+TEST_F(BlockAllocatorTest, ContiguousAllocation) {
+  const usize block_sz = 512;
+  const usize bits_per_block = block_sz * KBitsPerByte;
+  const usize block_cnt = bits_per_block * 4;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BlockAllocator(bm);
+  auto free_block_cnt = allocator.free_block_cnt();
+
+  // a run in the first group
+  auto [first, len] = allocator.allocate_contiguous(100).unwrap();
+  ASSERT_EQ(len, 100);
+  ASSERT_EQ(allocator.free_block_cnt(), free_block_cnt - 100);
+
+  // fragment the rest of the first group, the run goes to the next one
+  std::vector<block_id_t> singles;
+  while (true) {
+    auto bid = allocator.allocate().unwrap();
+    if (bid >= bits_per_block) {
+      ASSERT_TRUE(allocator.deallocate(bid).is_ok());
+      break;
+    }
+    singles.push_back(bid);
+  }
+  for (usize i = 0; i < singles.size(); i += 2) {
+    ASSERT_TRUE(allocator.deallocate(singles[i]).is_ok());
+  }
+  auto [first_1, len_1] = allocator.allocate_contiguous(200).unwrap();
+  ASSERT_EQ(len_1, 200);
+  ASSERT_GE(first_1, bits_per_block);
+
+  // a run never crosses a group, so the longest one is taken
+  auto [first_2, len_2] =
+      allocator.allocate_contiguous(bits_per_block * 2).unwrap();
+  ASSERT_EQ(len_2, bits_per_block);
+  ASSERT_EQ(first_2 % bits_per_block, 0);
+
+  for (usize i = 0; i < len; ++i) {
+    ASSERT_TRUE(allocator.deallocate(first + i).is_ok());
+  }
+  ASSERT_TRUE(allocator.allocate_contiguous(0).is_err());
+}
+
+TEST_F(BlockAllocatorTest, BatchDeallocation) {
+  const usize block_sz = 512;
+  const usize bits_per_block = block_sz * KBitsPerByte;
+  const usize block_cnt = bits_per_block * 4;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto allocator = BlockAllocator(bm);
+
+  // blocks of two groups
+  auto [first, len] = allocator.allocate_contiguous(10).unwrap();
+  auto [first_1, len_1] =
+      allocator.allocate_contiguous(bits_per_block).unwrap();
+  ASSERT_NE(first / bits_per_block, first_1 / bits_per_block);
+  std::vector<block_id_t> blocks;
+  for (usize i = 0; i < len; ++i) {
+    blocks.push_back(first + i);
+  }
+  for (usize i = 0; i < len_1; ++i) {
+    blocks.push_back(first_1 + i);
+  }
+  auto free_block_cnt = allocator.free_block_cnt();
+
+  // an invalid block in the later group frees nothing
+  auto dup = blocks;
+  dup.push_back(first_1);
+  ASSERT_TRUE(allocator.deallocate(dup).is_err());
+  ASSERT_EQ(allocator.free_block_cnt(), free_block_cnt);
+  ASSERT_TRUE(allocator.deallocate(first_1).is_ok());
+  ASSERT_TRUE(allocator.deallocate(blocks).is_err());
+  ASSERT_EQ(allocator.free_block_cnt(), free_block_cnt + 1);
+  ASSERT_TRUE(allocator.deallocate(first).is_ok());
+
+  blocks.erase(blocks.begin());
+  blocks.erase(blocks.begin() + len - 1);
+  ASSERT_TRUE(allocator.deallocate(blocks).is_ok());
+  ASSERT_EQ(allocator.free_block_cnt(), free_block_cnt + len + len_1);
+}
+
+TEST_F(BlockAllocatorTest, ConcurrentAllocation) {
+  const usize block_sz = 512;
+  const usize block_cnt = block_sz * KBitsPerByte * 8;
+  const usize thread_cnt = 8;
+  const usize per_thread = 1000;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(block_cnt, block_sz));
+  auto flags = std::make_shared<GroupInitFlags>(bm, 0, 0, block_sz);
+  auto allocator = BlockAllocator(bm, 1, true, flags);
+  auto free_block_cnt = allocator.free_block_cnt();
+
+  // each thread allocates blocks and frees half of them
+  std::vector<std::vector<block_id_t>> allocated(thread_cnt);
+  std::vector<std::thread> threads;
+  for (usize t = 0; t < thread_cnt; t++) {
+    threads.emplace_back([&, t]() {
+      for (usize i = 0; i < per_thread; i++) {
+        auto block = allocator.allocate();
+        if (block.is_err()) {
+          return;
+        }
+        allocated[t].push_back(block.unwrap());
+        if (i % 2 == 1) {
+          if (allocator.deallocate(allocated[t].back()).is_err()) {
+            return;
+          }
+          allocated[t].pop_back();
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  std::set<block_id_t> blocks;
+  for (auto &v : allocated) {
+    ASSERT_EQ(v.size(), per_thread / 2);
+    blocks.insert(v.begin(), v.end());
+  }
+  ASSERT_EQ(blocks.size(), thread_cnt * per_thread / 2);
+  ASSERT_EQ(allocator.free_block_cnt(), free_block_cnt - blocks.size());
+
+  // the bitmap agrees with the maintained count
+  auto flags_1 = std::make_shared<GroupInitFlags>(bm, 0, 0, block_sz);
+  auto allocator_1 = BlockAllocator(bm, 1, false, flags_1);
+  ASSERT_EQ(allocator_1.free_block_cnt(), free_block_cnt - blocks.size());
+  for (auto bid : blocks) {
+    ASSERT_TRUE(allocator_1.deallocate(bid).is_ok());
+  }
+  ASSERT_EQ(allocator_1.free_block_cnt(), free_block_cnt);
+}
+
 } // namespace chfs
\ No newline at end of file
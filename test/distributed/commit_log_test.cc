@@ -108,6 +108,285 @@ TEST_F(CommitLogTest, CheckConcurrentUnlink) {
   std::remove(inode_path.c_str());
 }
 
+TEST_F(CommitLogTest, CheckAbortedRename) {
+  auto meta_srv = std::make_shared<MetadataServer>(meta_port, inode_path, true);
+
+  auto dir_id = meta_srv->mknode(DirectoryType, 1, "out");
+  auto part_id = meta_srv->mknode(RegularFileType, dir_id, "part");
+  auto file_id = meta_srv->mknode(RegularFileType, 1, "file");
+  auto log_bytes = meta_srv->get_log_bytes();
+
+  // the failed operations log nothing and leave the tree as it is
+  EXPECT_EQ(meta_srv->rename(1, "file", 1, "out"),
+            static_cast<u8>(ErrorType::INVALID_ARG));
+  EXPECT_EQ(meta_srv->rename(1, "missing", 1, "file"),
+            static_cast<u8>(ErrorType::NotExist));
+  EXPECT_EQ(meta_srv->rename(1, "out", dir_id, "self"),
+            static_cast<u8>(ErrorType::INVALID_ARG));
+  EXPECT_EQ(meta_srv->unlink(1, "missing"), false);
+  EXPECT_EQ(meta_srv->get_log_bytes(), log_bytes);
+  EXPECT_EQ(meta_srv->lookup(1, "file"), file_id);
+  EXPECT_EQ(meta_srv->lookup(dir_id, "part"), part_id);
+
+  // the next transaction holds only its own blocks
+  EXPECT_EQ(meta_srv->rename(1, "file", dir_id, "part"),
+            static_cast<u8>(ErrorType::DONE));
+  meta_srv->recover();
+  EXPECT_EQ(meta_srv->lookup(1, "file"), 0);
+  EXPECT_EQ(meta_srv->lookup(dir_id, "part"), file_id);
+  EXPECT_EQ(meta_srv->readdir(1).size(), 1);
+
+  std::remove(inode_path.c_str());
+}
+
+TEST_F(CommitLogTest, CheckGroupCommit) {
+  auto meta_srv =
+      std::make_shared<MetadataServer>(meta_port, inode_path, true, true);
+  meta_srv->set_group_commit(8, std::chrono::milliseconds(1));
+
+  const int thread_num = 8;
+  const int op_num = 50;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < op_num; i++) {
+        auto name = "dir-" + std::to_string(t) + "-" + std::to_string(i);
+        auto mk_res = meta_srv->mknode(DirectoryType, 1, name);
+        EXPECT_GT(mk_res, 1);
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+
+  // the flushes are shared by the concurrent operations
+  EXPECT_LT(meta_srv->get_log_flush_num(), thread_num * op_num);
+
+  meta_srv->recover();
+  auto dir_content = meta_srv->readdir(1);
+  EXPECT_EQ(dir_content.size(), thread_num * op_num);
+
+  std::remove(inode_path.c_str());
+}
+
+TEST_F(CommitLogTest, CheckCircularLog) {
+  // the log wraps around a few times with full block images
+  auto bm = std::make_shared<BlockManager>(inode_path, KDefaultBlockCnt, true);
+  auto commit_log = std::make_shared<CommitLog>(bm, false);
+
+  const txn_id_t txn_num = 3000;
+  const block_id_t block_num = 16;
+  std::vector<u8> state(DiskBlockSize);
+  for (txn_id_t txn_id = 1; txn_id <= txn_num; txn_id++) {
+    std::fill(state.begin(), state.end(), static_cast<u8>(txn_id));
+    auto op = std::make_shared<BlockOperation>(txn_id % block_num, state);
+    commit_log->append_log(txn_id, {op});
+    EXPECT_TRUE(bm->write_block(op->block_id_, state.data()).is_ok());
+    commit_log->commit_log(txn_id);
+    commit_log->sync(txn_id);
+  }
+  EXPECT_GT(commit_log->get_checkpoint_num(), 0);
+
+  // the latest images are still in the log
+  for (block_id_t i = 0; i < block_num; i++)
+    EXPECT_TRUE(bm->zero_block(i).is_ok());
+  commit_log->recover();
+  for (block_id_t i = 0; i < block_num; i++) {
+    EXPECT_TRUE(bm->read_block(i, state.data()).is_ok());
+    auto last_txn_id = txn_num - (txn_num + block_num - i) % block_num;
+    EXPECT_EQ(state[0], static_cast<u8>(last_txn_id));
+    EXPECT_EQ(state[DiskBlockSize - 1], static_cast<u8>(last_txn_id));
+  }
+
+  commit_log.reset();
+  bm.reset();
+  std::remove(inode_path.c_str());
+}
+
+TEST_F(CommitLogTest, CheckRecoverDedup) {
+  auto bm = std::make_shared<BlockManager>(inode_path, KDefaultBlockCnt, true);
+  auto commit_log = std::make_shared<CommitLog>(bm, false);
+
+  // many transactions edit a few blocks
+  const txn_id_t txn_num = 100;
+  const block_id_t block_num = 4;
+  std::vector<u8> state(DiskBlockSize);
+  for (txn_id_t txn_id = 1; txn_id <= txn_num; txn_id++) {
+    auto block_id = txn_id % block_num;
+    EXPECT_TRUE(bm->read_block(block_id, state.data()).is_ok());
+    auto op = std::make_shared<BlockOperation>(block_id, state, state.data());
+    op->new_block_state_[txn_id] = static_cast<u8>(txn_id);
+    commit_log->append_log(txn_id, {op});
+    EXPECT_TRUE(
+        bm->write_block(block_id, op->new_block_state_.data()).is_ok());
+    commit_log->commit_log(txn_id);
+  }
+  commit_log->sync(txn_num);
+
+  for (block_id_t i = 0; i < block_num; i++)
+    EXPECT_TRUE(bm->zero_block(i).is_ok());
+  auto stats = commit_log->recover();
+  EXPECT_EQ(stats.txn_num, txn_num);
+  EXPECT_EQ(stats.block_num, block_num);
+  EXPECT_EQ(stats.bytes, block_num * DiskBlockSize);
+
+  // each block has the bytes of all its transactions
+  for (block_id_t i = 0; i < block_num; i++) {
+    EXPECT_TRUE(bm->read_block(i, state.data()).is_ok());
+    for (txn_id_t txn_id = 1; txn_id <= txn_num; txn_id++) {
+      u8 expected = txn_id % block_num == i ? txn_id : 0;
+      EXPECT_EQ(state[txn_id], expected);
+    }
+  }
+
+  // the log is checkpointed by the recovery
+  EXPECT_EQ(commit_log->recover().txn_num, 0);
+
+  commit_log.reset();
+  bm.reset();
+  std::remove(inode_path.c_str());
+}
+
+TEST_F(CommitLogTest, CheckTornTxn) {
+  auto bm = std::make_shared<BlockManager>(inode_path, KDefaultBlockCnt, true);
+  auto commit_log = std::make_shared<CommitLog>(bm, false);
+
+  std::vector<u8> state(DiskBlockSize);
+  for (txn_id_t txn_id = 1; txn_id <= 3; txn_id++) {
+    std::fill(state.begin(), state.end(), static_cast<u8>(txn_id));
+    auto op = std::make_shared<BlockOperation>(txn_id, state);
+    commit_log->append_log(txn_id, {op});
+    commit_log->commit_log(txn_id);
+    commit_log->sync(txn_id);
+  }
+  commit_log.reset();
+
+  // a byte of the last frame is lost in a crash
+  const auto frame_size = sizeof(TxnHeader) + sizeof(LogRecord) +
+                          DiskBlockSize + sizeof(TxnCommit);
+  auto log_ptr = bm->unsafe_get_block_ptr() +
+                 (bm->total_blocks() + 1) * DiskBlockSize;
+  log_ptr[frame_size * 2 + 100] ^= 0xff;
+
+  // only the complete transactions are redone after a restart
+  commit_log = std::make_shared<CommitLog>(bm, false);
+  commit_log->recover();
+  for (block_id_t i = 1; i <= 3; i++) {
+    EXPECT_TRUE(bm->read_block(i, state.data()).is_ok());
+    EXPECT_EQ(state[0], i < 3 ? i : 0);
+  }
+
+  commit_log.reset();
+  bm.reset();
+  std::remove(inode_path.c_str());
+}
+
+TEST_F(CommitLogTest, CheckJournalFile) {
+  const std::string journal_path = "/tmp/journal_file";
+  std::remove(journal_path.c_str());
+
+  {
+    auto meta_srv = std::make_shared<MetadataServer>(
+        meta_port, inode_path, true, false, false, journal_path);
+    for (int i = 0; i < 10; i++) {
+      auto mk_res =
+          meta_srv->mknode(DirectoryType, 1, "dir-" + std::to_string(i));
+      EXPECT_GT(mk_res, 1);
+    }
+    meta_srv->recover();
+    EXPECT_EQ(meta_srv->readdir(1).size(), 10);
+  }
+  std::remove(inode_path.c_str());
+
+  // the frames survive a restart in the journal
+  auto bm = std::make_shared<BlockManager>(inode_path, KDefaultBlockCnt);
+  auto commit_log = std::make_shared<CommitLog>(bm, false, journal_path);
+  std::vector<u8> state(DiskBlockSize, 42);
+  auto op = std::make_shared<BlockOperation>(7, state);
+  commit_log->append_log(1, {op});
+  commit_log->commit_log(1);
+  commit_log->sync(1);
+  commit_log.reset();
+
+  commit_log = std::make_shared<CommitLog>(bm, false, journal_path);
+  EXPECT_EQ(commit_log->recover().txn_num, 1);
+  EXPECT_TRUE(bm->read_block(7, state.data()).is_ok());
+  EXPECT_EQ(state[0], 42);
+
+  commit_log.reset();
+  bm.reset();
+  std::remove(inode_path.c_str());
+  std::remove(journal_path.c_str());
+}
+
+TEST_F(CommitLogTest, CheckWriteAhead) {
+  const std::string journal_path = "/tmp/journal_file";
+  // the data blocks are before the log region in the data file
+  const auto data_size = (KDefaultBlockCnt - kLogBlockCnt) * DiskBlockSize;
+
+  // the log in the data file and in a journal of its own
+  for (auto log_path : {std::string(), journal_path}) {
+    std::remove(inode_path.c_str());
+    std::remove(journal_path.c_str());
+    auto meta_srv = std::make_shared<MetadataServer>(
+        meta_port, inode_path, true, false, false, log_path);
+
+    // no entry reaches the device before the flush of its log
+    std::string name;
+    usize flush_num = 0;
+    bool is_early = false;
+    meta_srv->set_log_flush_hook([&]() {
+      std::ifstream file(inode_path, std::ios::binary);
+      std::string content(data_size, '\0');
+      file.read(content.data(), data_size);
+      flush_num += 1;
+      if (content.find(name) != std::string::npos)
+        is_early = true;
+    });
+
+    for (int i = 0; i < 10; i++) {
+      name = "write-ahead-" + std::to_string(i);
+      EXPECT_GT(meta_srv->mknode(DirectoryType, 1, name), 1);
+    }
+    EXPECT_EQ(flush_num, 10);
+    EXPECT_FALSE(is_early);
+
+    // and it's applied once the log is durable
+    std::ifstream file(inode_path, std::ios::binary);
+    std::string content(data_size, '\0');
+    file.read(content.data(), data_size);
+    EXPECT_NE(content.find(name), std::string::npos);
+  }
+
+  std::remove(inode_path.c_str());
+  std::remove(journal_path.c_str());
+}
+
+TEST_F(CommitLogTest, CheckDeltaRecords) {
+  auto meta_srv = std::make_shared<MetadataServer>(meta_port, inode_path, true);
+
+  const int num = 100;
+  for (int i = 0; i < num; i++) {
+    auto mk_res =
+        meta_srv->mknode(RegularFileType, 1, "file-" + std::to_string(i));
+    EXPECT_GT(mk_res, 1);
+  }
+
+  // a mknode changes a few bytes of each block, far less than the images
+  auto log_bytes = meta_srv->get_log_bytes();
+  std::cerr << "log bytes per mknode: " << log_bytes / num << "\n";
+  EXPECT_LT(log_bytes / num, DiskBlockSize / 2);
+
+  auto stats = meta_srv->recover();
+  EXPECT_GE(stats.txn_num, num);
+  auto dir_content = meta_srv->readdir(1);
+  EXPECT_EQ(dir_content.size(), num);
+  for (int i = 0; i < num; i++)
+    EXPECT_GT(meta_srv->lookup(1, "file-" + std::to_string(i)), 1);
+
+  std::remove(inode_path.c_str());
+}
+
 TEST_F(CommitLogTest, CheckRecoverFromFailure) {
   auto meta_srv =
       std::make_shared<MetadataServer>(meta_port, inode_path, true, true, true);
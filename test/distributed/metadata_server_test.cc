@@ -232,6 +232,37 @@ TEST_F(MetadataServerTest, CheckUnlink) {
   clean_data();
 }
 
+TEST_F(MetadataServerTest, CheckRename) {
+  auto dir_id = meta_srv->mknode(DirectoryType, 1, "out");
+  auto file_id = meta_srv->mknode(RegularFileType, 1, "part.tmp");
+  auto old_id = meta_srv->mknode(RegularFileType, dir_id, "part");
+
+  // publish the file over the old one in another directory
+  auto rename_res = meta_srv->rename(1, "part.tmp", dir_id, "part");
+  EXPECT_EQ(rename_res, static_cast<u8>(ErrorType::DONE));
+  EXPECT_EQ(meta_srv->lookup(1, "part.tmp"), 0);
+  EXPECT_EQ(meta_srv->lookup(dir_id, "part"), file_id);
+
+  // the replaced inode is freed
+  auto new_id = meta_srv->mknode(RegularFileType, 1, "next");
+  EXPECT_EQ(new_id, old_id);
+
+  // a non-empty directory can't be replaced
+  auto empty_id = meta_srv->mknode(DirectoryType, 1, "empty");
+  EXPECT_EQ(meta_srv->rename(1, "empty", 1, "out"),
+            static_cast<u8>(ErrorType::NotEmpty));
+  EXPECT_NE(meta_srv->lookup(1, "empty"), 0);
+
+  // nor can a directory be moved into its own subtree
+  auto sub_id = meta_srv->mknode(DirectoryType, empty_id, "sub");
+  EXPECT_EQ(meta_srv->rename(1, "empty", sub_id, "loop"),
+            static_cast<u8>(ErrorType::INVALID_ARG));
+  EXPECT_EQ(meta_srv->lookup(1, "empty"), empty_id);
+  EXPECT_EQ(meta_srv->lookup(sub_id, "loop"), 0);
+
+  clean_data();
+}
+
 TEST_F(MetadataServerTest, CheckInvariant1) {
   auto file_id_1 = meta_srv->mknode(RegularFileType, 1, "fileA");
   EXPECT_EQ(file_id_1, 2);
@@ -0,0 +1,100 @@
+#include "./common.h"
+#include "filesystem/operations.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+TEST(FileSystemTest, Clone) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto base = fs.get_free_blocks_num().unwrap();
+
+  std::vector<u8> content(kBlockSize * 10, 'a');
+  auto a = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto b = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto c = fs.alloc_inode(InodeType::FILE).unwrap();
+  fs.write_file(a, content).unwrap();
+  fs.write_file(c, std::vector<u8>(kBlockSize * 3, 'c')).unwrap();
+  auto free_0 = fs.get_free_blocks_num().unwrap();
+
+  // the first clone only allocates the refcount file
+  ASSERT_TRUE(fs.clone_file(a, b).is_ok());
+  auto free_1 = fs.get_free_blocks_num().unwrap();
+  auto refcount_cost = free_0 - free_1;
+  ASSERT_LT(refcount_cost, 5);
+  ASSERT_EQ(fs.read_file(b).unwrap(), content);
+
+  // the old blocks of c are freed, and no data block is copied
+  ASSERT_TRUE(fs.clone_file(a, c).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_1 + 3);
+  ASSERT_EQ(fs.read_file(c).unwrap(), content);
+
+  // writing a clone copies only the block written
+  std::string data = "hello";
+  fs.write_file_w_off(c, data.c_str(), data.size(), kBlockSize * 4 + 10)
+      .unwrap();
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_1 + 2);
+  std::copy(data.begin(), data.end(), content.begin() + kBlockSize * 4 + 10);
+  ASSERT_EQ(fs.read_file(c).unwrap(), content);
+  ASSERT_EQ(fs.read_file(a).unwrap(),
+            std::vector<u8>(kBlockSize * 10, 'a'));
+  ASSERT_EQ(fs.read_file(b).unwrap(),
+            std::vector<u8>(kBlockSize * 10, 'a'));
+
+  // the shared blocks are freed with their last reference
+  ASSERT_TRUE(fs.remove_file(a).is_ok());
+  ASSERT_TRUE(fs.remove_file(b).is_ok());
+  ASSERT_EQ(fs.read_file(c).unwrap(), content);
+  ASSERT_TRUE(fs.remove_file(c).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), base - refcount_cost);
+}
+
+TEST(FileSystemTest, CloneShrinkThenGrow) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+
+  std::vector<u8> content(100, 'a');
+  auto a = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto b = fs.alloc_inode(InodeType::FILE).unwrap();
+  fs.write_file(a, content).unwrap();
+  ASSERT_TRUE(fs.clone_file(a, b).is_ok());
+
+  // growing the clone again zeroes its stale tail, not the source's bytes
+  ASSERT_TRUE(fs.resize(b, 50).is_ok());
+  ASSERT_TRUE(fs.resize(b, kBlockSize).is_ok());
+  ASSERT_EQ(fs.read_file(a).unwrap(), content);
+  auto expected = std::vector<u8>(kBlockSize, 0);
+  std::fill(expected.begin(), expected.begin() + 50, 'a');
+  ASSERT_EQ(fs.read_file(b).unwrap(), expected);
+}
+
+TEST(FileSystemTest, CloneWriteSource) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+
+  std::vector<u8> content(kBlockSize * 4, 'a');
+  auto a = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto b = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto c = fs.alloc_inode(InodeType::FILE).unwrap();
+  fs.write_file(a, content).unwrap();
+  fs.write_file(c, content).unwrap();
+  ASSERT_TRUE(fs.clone_file(a, b).is_ok());
+
+  // both sides of the clone copy a shared block on write
+  std::string data = "hello";
+  fs.write_file_w_off(a, data.c_str(), data.size(), kBlockSize + 10).unwrap();
+  ASSERT_EQ(fs.read_file(b).unwrap(), content);
+
+  // a file never cloned is written in place
+  auto free_cnt = fs.get_free_blocks_num().unwrap();
+  fs.write_file_w_off(c, data.c_str(), data.size(), kBlockSize + 10).unwrap();
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_cnt);
+  std::copy(data.begin(), data.end(), content.begin() + kBlockSize + 10);
+  ASSERT_EQ(fs.read_file(a).unwrap(), content);
+  ASSERT_EQ(fs.read_file(c).unwrap(), content);
+}
+
+} // namespace chfs
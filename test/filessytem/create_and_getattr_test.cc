@@ -2,6 +2,7 @@
 
 #include "./common.h"
 #include "filesystem/operations.h"
+#include "metadata/superblock.h"
 #include "gtest/gtest.h"
 
 namespace chfs {
@@ -37,4 +38,72 @@ TEST(FileSystemTest, CreateAndGetAttr) {
   }
 }
 
+// Count the writes to a block
+class WriteCountBlockManager : public BlockManager {
+public:
+  block_id_t watched = KInvalidBlockID;
+  usize write_cnt = 0;
+
+  WriteCountBlockManager(usize block_count, usize block_size)
+      : BlockManager(block_count, block_size) {}
+
+  auto write_block(block_id_t block_id, const u8 *data)
+      -> ChfsNullResult override {
+    write_cnt += block_id == watched;
+    return BlockManager::write_block(block_id, data);
+  }
+
+  auto write_partial_block(block_id_t block_id, const u8 *data, usize offset,
+                           usize len) -> ChfsNullResult override {
+    write_cnt += block_id == watched;
+    return BlockManager::write_partial_block(block_id, data, offset, len);
+  }
+};
+
+TEST(FileSystemTest, Lazytime) {
+  auto bm = std::make_shared<WriteCountBlockManager>(kBlockNum, kBlockSize);
+  auto fs = FileOperation(bm, kTestInodeNum);
+  ASSERT_TRUE(fs.set_lazytime(true).is_ok());
+
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto im = InodeManager::create_from_block_manager(
+                bm, fs.get_total_inode_num(),
+                SuperBlock::inode_group_flags(bm, 0))
+                .unwrap();
+  bm->watched = im.get(id).unwrap();
+  bm->write_cnt = 0;
+
+  // the size changes, so the inode is written
+  std::vector<u8> content(kBlockSize * 3, 'a');
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+  ASSERT_EQ(bm->write_cnt, 1);
+
+  // overwrites only change the timestamps
+  for (int i = 0; i < 10; i++) {
+    content[i] = 'b';
+    ASSERT_TRUE(fs.write_file(id, content).is_ok());
+  }
+  ASSERT_EQ(bm->write_cnt, 1);
+  auto attr = fs.getattr(id).unwrap();
+  u64 size = attr.size;
+  ASSERT_EQ(size, content.size());
+
+  // fsync writes them back
+  ASSERT_TRUE(fs.sync_inode(id).is_ok());
+  ASSERT_EQ(bm->write_cnt, 2);
+  ASSERT_TRUE(fs.sync_inode(id).is_ok());
+  ASSERT_EQ(bm->write_cnt, 2);
+  auto stored_attr = im.get_attr(id).unwrap();
+  u64 stored_mtime = stored_attr.mtime, mtime = attr.mtime;
+  ASSERT_EQ(stored_mtime, mtime);
+
+  // so does disabling lazytime
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+  ASSERT_EQ(bm->write_cnt, 2);
+  ASSERT_TRUE(fs.set_lazytime(false).is_ok());
+  ASSERT_EQ(bm->write_cnt, 3);
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+  ASSERT_EQ(bm->write_cnt, 4);
+}
+
 } // namespace chfs
\ No newline at end of file
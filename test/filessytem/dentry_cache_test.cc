@@ -0,0 +1,88 @@
+#include "./common.h"
+#include "filesystem/directory_op.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+TEST(DentryCacheTest, LRU) {
+  auto cache = DentryCache(3);
+  cache.put(1, "a", 2);
+  cache.put(1, "b", 3);
+  cache.put(1, "c", KInvalidInodeID);
+  ASSERT_EQ(cache.get(1, "c").value(), KInvalidInodeID);
+  ASSERT_FALSE(cache.get(2, "a").has_value());
+
+  // "b" is the least recently used
+  ASSERT_EQ(cache.get(1, "a").value(), 2);
+  cache.put(4, "d", 5);
+  ASSERT_EQ(cache.size(), 3);
+  ASSERT_FALSE(cache.get(1, "b").has_value());
+  ASSERT_EQ(cache.get(4, "d").value(), 5);
+
+  cache.put(1, "c", 6);
+  ASSERT_EQ(cache.get(1, "c").value(), 6);
+  cache.erase_dir(1);
+  ASSERT_EQ(cache.size(), 1);
+  ASSERT_FALSE(cache.get(1, "a").has_value());
+}
+
+TEST(DentryCacheTest, Staging) {
+  auto cache = DentryCache(8);
+  cache.put(1, "a", 2);
+  cache.put(1, "b", 3);
+
+  // the staged entries are hidden until published
+  cache.stage(1, "a", KInvalidInodeID);
+  cache.stage(1, "c", 4);
+  ASSERT_FALSE(cache.get(1, "a").has_value());
+  ASSERT_FALSE(cache.get(1, "c").has_value());
+  cache.publish();
+  ASSERT_EQ(cache.get(1, "a").value(), KInvalidInodeID);
+  ASSERT_EQ(cache.get(1, "c").value(), 4);
+
+  // an aborted transaction leaves no entry
+  cache.stage(1, "b", KInvalidInodeID);
+  cache.stage(1, "d", 5);
+  cache.discard();
+  cache.publish();
+  ASSERT_FALSE(cache.get(1, "b").has_value());
+  ASSERT_FALSE(cache.get(1, "d").has_value());
+}
+
+TEST(FileSystemTest, DentryCache) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  auto dir = fs.mkdir(root, "dir").unwrap();
+  auto file = fs.mkfile(dir, "file").unwrap();
+
+  // the first walk fills the cache, the next ones hit
+  ASSERT_EQ(fs.lookup(root, "dir").unwrap(), dir);
+  ASSERT_EQ(fs.lookup(dir, "file").unwrap(), file);
+  ASSERT_TRUE(fs.lookup(dir, "none").is_err());
+  auto stats = fs.get_dentry_stats();
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(fs.lookup(root, "dir").unwrap(), dir);
+    ASSERT_EQ(fs.lookup(dir, "file").unwrap(), file);
+    ASSERT_TRUE(fs.lookup(dir, "none").is_err());
+  }
+  ASSERT_EQ(fs.get_dentry_stats().hits, stats.hits + 30);
+  ASSERT_EQ(fs.get_dentry_stats().misses, stats.misses);
+
+  // the negative entry is replaced on creation
+  auto none = fs.mkfile(dir, "none").unwrap();
+  ASSERT_EQ(fs.lookup(dir, "none").unwrap(), none);
+
+  ASSERT_TRUE(fs.unlink(dir, "file").is_ok());
+  ASSERT_TRUE(fs.lookup(dir, "file").is_err());
+  ASSERT_EQ(fs.lookup_cached(dir, "file").value(), KInvalidInodeID);
+
+  // the entries under a removed directory are dropped
+  ASSERT_TRUE(fs.unlink(dir, "none").is_ok());
+  ASSERT_TRUE(fs.unlink(root, "dir").is_ok());
+  ASSERT_FALSE(fs.lookup_cached(dir, "none").has_value());
+  ASSERT_EQ(fs.lookup_cached(root, "dir").value(), KInvalidInodeID);
+}
+
+} // namespace chfs
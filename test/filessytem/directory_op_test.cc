@@ -1,3 +1,4 @@
+#include <map>
 #include <random>
 
 #include "./common.h"
@@ -95,4 +96,245 @@ TEST(FileSystemTest, mkdir) {
   ASSERT_EQ(list.size(), 100);
 }
 
-} // namespace chfs
\ No newline at end of file
+TEST(FileSystemTest, LargeDirectory) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum, KInodeExtentFlag);
+  auto dir = fs.alloc_inode(InodeType::Directory).unwrap();
+
+  // more entries than inodes, so the ids are made up
+  const usize num = 20000;
+  for (usize i = 0; i < num; i++) {
+    auto res = dir_add_entry(&fs, dir, "file-" + std::to_string(i), i + 100);
+    ASSERT_TRUE(res.is_ok());
+  }
+  ASSERT_EQ(dir_add_entry(&fs, dir, "file-42", 1).unwrap_error(),
+            ErrorType::AlreadyExist);
+
+  std::list<DirectoryEntry> list;
+  ASSERT_TRUE(read_directory(&fs, dir, list).is_ok());
+  ASSERT_EQ(list.size(), num);
+
+  for (usize i = 0; i < num; i += 2) {
+    auto res = dir_remove_entry(&fs, dir, "file-" + std::to_string(i));
+    ASSERT_EQ(res.unwrap(), i + 100);
+  }
+  for (usize i = 0; i < num; i++) {
+    auto res = dir_lookup(&fs, dir, "file-" + std::to_string(i));
+    if (i % 2 == 0) {
+      ASSERT_EQ(res.unwrap_error(), ErrorType::NotExist);
+    } else {
+      ASSERT_EQ(res.unwrap(), i + 100);
+    }
+  }
+}
+
+TEST(FileSystemTest, DirectoryChurn) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto dir = fs.alloc_inode(InodeType::Directory).unwrap();
+
+  const usize num = 200;
+  for (usize i = 0; i < num; i++) {
+    dir_add_entry(&fs, dir, "file-" + std::to_string(i), i + 100).unwrap();
+  }
+  auto dir_sz = fs.getattr(dir).unwrap().size;
+
+  // the removed slots are reused, so the directory doesn't grow
+  for (uint round = 0; round < 5; round++) {
+    for (usize i = round; i < num; i += 5) {
+      auto name = "file-" + std::to_string(i);
+      ASSERT_EQ(dir_remove_entry(&fs, dir, name).unwrap(), i + 100);
+      dir_add_entry(&fs, dir, name, i + 1000).unwrap();
+    }
+  }
+  ASSERT_EQ(fs.getattr(dir).unwrap().size, dir_sz);
+
+  for (usize i = 0; i < num; i++) {
+    auto name = "file-" + std::to_string(i);
+    ASSERT_EQ(dir_lookup(&fs, dir, name).unwrap(), i + 1000);
+  }
+
+  // a leaf is compacted when a new entry fits in none of its free slots
+  auto small = fs.alloc_inode(InodeType::Directory).unwrap();
+  for (char ch = 'A'; ch <= 'Z'; ch++) {
+    dir_add_entry(&fs, small, std::string("a") + ch, ch).unwrap();
+  }
+  for (char ch = 'A'; ch < 'Z'; ch += 5) {
+    dir_remove_entry(&fs, small, std::string("a") + ch).unwrap();
+  }
+  auto small_sz = fs.getattr(small).unwrap().size;
+  auto long_name = std::string(40, 'x');
+  dir_add_entry(&fs, small, long_name, 1).unwrap();
+  ASSERT_EQ(fs.getattr(small).unwrap().size, small_sz);
+
+  std::list<DirectoryEntry> list;
+  ASSERT_TRUE(read_directory(&fs, small, list).is_ok());
+  ASSERT_EQ(list.size(), 22);
+  ASSERT_EQ(dir_lookup(&fs, small, long_name).unwrap(), 1);
+  for (char ch = 'A'; ch <= 'Z'; ch++) {
+    auto res = dir_lookup(&fs, small, std::string("a") + ch);
+    if ((ch - 'A') % 5 == 0 && ch < 'Z') {
+      ASSERT_TRUE(res.is_err());
+    } else {
+      ASSERT_EQ(res.unwrap(), static_cast<inode_id_t>(ch));
+    }
+  }
+}
+
+TEST(FileSystemTest, ReaddirCookie) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum, KInodeExtentFlag);
+  auto dir = fs.alloc_inode(InodeType::Directory).unwrap();
+
+  const usize num = 3000;
+  for (usize i = 0; i < num; i++) {
+    dir_add_entry(&fs, dir, "file-" + std::to_string(i), i + 100).unwrap();
+  }
+
+  // list in small batches while the directory changes
+  std::map<std::string, usize> seen;
+  u64 cookie = 0;
+  usize batches = 0;
+  while (true) {
+    auto entries = fs.readdir(dir, cookie, 7).unwrap();
+    if (entries.empty()) {
+      break;
+    }
+    ASSERT_LE(entries.size(), 8);
+    for (const auto &entry : entries) {
+      ASSERT_GT(entry.cookie, cookie);
+      seen[entry.name] += 1;
+    }
+    cookie = entries.back().cookie;
+
+    auto name = "new-" + std::to_string(batches);
+    dir_add_entry(&fs, dir, name, 1).unwrap();
+    dir_remove_entry(&fs, dir, entries.front().name).unwrap();
+    batches++;
+  }
+
+  // every entry there all the time is listed once
+  for (usize i = 0; i < num; i++) {
+    ASSERT_EQ(seen["file-" + std::to_string(i)], 1);
+  }
+  for (const auto &[name, cnt] : seen) {
+    ASSERT_EQ(cnt, 1);
+  }
+}
+
+TEST(FileSystemTest, TextDirectory) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto dir = fs.alloc_inode(InodeType::Directory).unwrap();
+
+  // a directory in the old format
+  std::string input = "";
+  for (uint i = 0; i < 10; i++) {
+    input = append_to_directory(input, "test" + std::to_string(i), i + 2);
+  }
+  fs.write_file(dir, std::vector<u8>(input.begin(), input.end())).unwrap();
+  ASSERT_EQ(fs.lookup(dir, "test3").unwrap(), 5);
+
+  // it's converted on update
+  ASSERT_TRUE(dir_remove_entry(&fs, dir, "test3").is_ok());
+  ASSERT_TRUE(dir_add_entry(&fs, dir, "test10", 12).is_ok());
+  ASSERT_EQ(fs.read_file_w_off(dir, 4, 0).unwrap()[0], 0);
+
+  std::list<DirectoryEntry> list;
+  ASSERT_TRUE(read_directory(&fs, dir, list).is_ok());
+  ASSERT_EQ(list.size(), 10);
+  ASSERT_EQ(fs.lookup(dir, "test10").unwrap(), 12);
+  ASSERT_TRUE(fs.lookup(dir, "test3").is_err());
+}
+
+TEST(FileSystemTest, TextDirectoryConversion) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto dir = fs.alloc_inode(InodeType::Directory).unwrap();
+
+  // more leaves than the root can index
+  const uint num = 1600;
+  std::string input = "";
+  for (uint i = 0; i < num; i++) {
+    input = append_to_directory(input, "entry-" + std::to_string(i), i + 2);
+  }
+  fs.write_file(dir, std::vector<u8>(input.begin(), input.end())).unwrap();
+  ASSERT_TRUE(dir_add_entry(&fs, dir, "new", num + 2).is_ok());
+  for (uint i = 0; i < num; i++) {
+    ASSERT_EQ(dir_lookup(&fs, dir, "entry-" + std::to_string(i)).unwrap(),
+              i + 2);
+  }
+  ASSERT_EQ(dir_read_entries(&fs, dir, 0, num * 2).unwrap().size(), num + 1);
+
+  // a name the new format can't hold fails the conversion, which changes
+  // nothing
+  auto dir_2 = fs.alloc_inode(InodeType::Directory).unwrap();
+  input = append_to_directory("", "short", 2);
+  input = append_to_directory(input, std::string(kBlockSize, 'x'), 3);
+  fs.write_file(dir_2, std::vector<u8>(input.begin(), input.end())).unwrap();
+  ASSERT_TRUE(dir_add_entry(&fs, dir_2, "new", 4).is_err());
+  ASSERT_EQ(fs.read_file(dir_2).unwrap(),
+            std::vector<u8>(input.begin(), input.end()));
+}
+
+TEST(FileSystemTest, Rename) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto root = fs.alloc_inode(InodeType::Directory).unwrap();
+  auto dir = fs.mkdir(root, "dir").unwrap();
+  auto file = fs.mkfile(root, "file").unwrap();
+  fs.write_file(file, std::vector<u8>(100, 'a')).unwrap();
+
+  // in the same directory
+  ASSERT_TRUE(fs.rename(root, "file", root, "tmp").is_ok());
+  ASSERT_TRUE(fs.lookup(root, "file").is_err());
+  ASSERT_EQ(fs.lookup(root, "tmp").unwrap(), file);
+
+  // across directories, the content isn't copied
+  ASSERT_TRUE(fs.rename(root, "tmp", dir, "out").is_ok());
+  ASSERT_TRUE(fs.lookup(root, "tmp").is_err());
+  ASSERT_EQ(fs.lookup(dir, "out").unwrap(), file);
+  ASSERT_EQ(fs.read_file(file).unwrap(), std::vector<u8>(100, 'a'));
+
+  // an existing file is replaced and freed
+  auto old = fs.mkfile(root, "old").unwrap();
+  auto free_num = fs.get_free_inode_num().unwrap();
+  ASSERT_TRUE(fs.rename(dir, "out", root, "old").is_ok());
+  ASSERT_EQ(fs.lookup(root, "old").unwrap(), file);
+  ASSERT_EQ(fs.get_free_inode_num().unwrap(), free_num + 1);
+  ASSERT_NE(old, file);
+
+  // the names of one inode
+  ASSERT_TRUE(fs.rename(root, "old", root, "old").is_ok());
+  ASSERT_EQ(fs.lookup(root, "old").unwrap(), file);
+
+  // a non-empty directory or another type can't be replaced
+  auto sub = fs.mkdir(root, "sub").unwrap();
+  fs.mkfile(sub, "x").unwrap();
+  ASSERT_EQ(fs.rename(root, "dir", root, "sub").unwrap_error(),
+            ErrorType::NotEmpty);
+  ASSERT_EQ(fs.rename(root, "old", root, "dir").unwrap_error(),
+            ErrorType::INVALID_ARG);
+  ASSERT_EQ(fs.rename(root, "none", root, "x").unwrap_error(),
+            ErrorType::NotExist);
+  // nor can a directory be moved into itself
+  ASSERT_EQ(fs.rename(root, "sub", sub, "loop").unwrap_error(),
+            ErrorType::INVALID_ARG);
+  auto nested = fs.mkdir(sub, "nested").unwrap();
+  ASSERT_EQ(fs.rename(root, "sub", nested, "loop").unwrap_error(),
+            ErrorType::INVALID_ARG);
+
+  // an empty directory can
+  ASSERT_TRUE(fs.rename(root, "sub", root, "dir").is_ok());
+  ASSERT_EQ(fs.lookup(root, "dir").unwrap(), sub);
+  ASSERT_TRUE(fs.lookup(sub, "x").is_ok());
+  ASSERT_TRUE(fs.lookup(root, "sub").is_err());
+}
+
+} // namespace chfs
@@ -109,4 +109,248 @@ TEST(FileSystemTest, SetAttr) {
   ASSERT_EQ(final_free_block_num, second_free_block_num);
 }
 
-} // namespace chfs
\ No newline at end of file
+TEST(FileSystemTest, WriteExtentMappedFile) {
+  std::mt19937 rng(get_test_seed());
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum, KInodeExtentFlag);
+  auto free_block_num = fs.get_free_blocks_num().unwrap();
+
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+
+  // Larger than what the direct blocks and the indirect block can hold
+  std::uniform_int_distribution<u8> uni_char(0, 26);
+  std::vector<u8> content(KLargeFileMax * 40);
+  for (auto &c : content) {
+    c = uni_char(rng) + 97;
+  }
+
+  auto res = fs.write_file(id, content);
+  ASSERT_TRUE(res.is_ok());
+  auto read_res = fs.read_file(id);
+  ASSERT_TRUE(read_res.is_ok());
+  auto data = read_res.unwrap();
+  ASSERT_TRUE(vec_equal(data, content));
+
+  // Shrink it
+  content.resize(KLargeFileMin + 7);
+  ASSERT_TRUE(fs.write_file(id, content).is_ok());
+  data = fs.read_file(id).unwrap();
+  ASSERT_TRUE(vec_equal(data, content));
+
+  ASSERT_TRUE(fs.remove_file(id).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num);
+}
+
+TEST(FileSystemTest, WriteWithOffset) {
+  std::mt19937 rng(get_test_seed());
+
+  for (auto flags : {0u, KInodeExtentFlag}) {
+    auto bm =
+        std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, flags);
+    auto free_block_num = fs.get_free_blocks_num().unwrap();
+    auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+
+    // The tail of the last block is stale after shrinking,
+    // it should read as zeros once the file grows again
+    std::vector<u8> content(kBlockSize * 2, 'x');
+    fs.write_file(id, content).unwrap();
+    content.resize(10);
+    fs.write_file(id, content).unwrap();
+
+    std::uniform_int_distribution<u64> uni_off(0, KLargeFileMax);
+    std::uniform_int_distribution<u64> uni_sz(1, kBlockSize * 3);
+    std::uniform_int_distribution<u8> uni_char(0, 26);
+    for (uint i = 0; i < 100; ++i) {
+      auto offset = uni_off(rng);
+      std::vector<u8> data(uni_sz(rng));
+      for (auto &c : data) {
+        c = uni_char(rng) + 97;
+      }
+
+      auto res = fs.write_file_w_off(id, reinterpret_cast<char *>(data.data()),
+                                     data.size(), offset);
+      ASSERT_TRUE(res.is_ok());
+      ASSERT_EQ(res.unwrap(), data.size());
+
+      if (offset + data.size() > content.size()) {
+        content.resize(offset + data.size(), 0);
+      }
+      std::copy(data.begin(), data.end(), content.begin() + offset);
+
+      auto read_res = fs.read_file(id);
+      ASSERT_TRUE(read_res.is_ok());
+      auto read_data = read_res.unwrap();
+      ASSERT_TRUE(vec_equal(read_data, content));
+    }
+
+    ASSERT_TRUE(fs.remove_file(id).is_ok());
+    ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num);
+  }
+}
+
+TEST(FileSystemTest, ReadWithOffset) {
+  std::mt19937 rng(get_test_seed());
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto content = generate_random_string(rng);
+  fs.write_file(id, content).unwrap();
+
+  std::uniform_int_distribution<u64> uni_off(0, content.size() + kBlockSize);
+  std::uniform_int_distribution<u64> uni_sz(0, kBlockSize * 3);
+  for (uint i = 0; i < 200; ++i) {
+    auto offset = uni_off(rng);
+    auto sz = uni_sz(rng);
+    std::vector<u8> buf(sz);
+    auto res = fs.read_file_w_off(id, buf.data(), sz, offset);
+    ASSERT_TRUE(res.is_ok());
+
+    u64 expected_sz = 0;
+    if (offset < content.size()) {
+      expected_sz = std::min<u64>(sz, content.size() - offset);
+    }
+    ASSERT_EQ(res.unwrap(), expected_sz);
+    buf.resize(expected_sz);
+    auto begin = content.begin() + std::min<u64>(offset, content.size());
+    std::vector<u8> expected(begin, begin + expected_sz);
+    ASSERT_TRUE(vec_equal(buf, expected));
+
+    // the segments cover the same content without copying
+    std::vector<ReadSegment> segments;
+    ASSERT_EQ(fs.read_file_segments(id, sz, offset, segments).unwrap(),
+              expected_sz);
+    std::vector<u8> joined;
+    for (auto &seg : segments) {
+      joined.insert(joined.end(), seg.data, seg.data + seg.len);
+    }
+    ASSERT_TRUE(vec_equal(joined, expected));
+  }
+}
+
+TEST(FileSystemTest, SparseResize) {
+  for (auto flags : {0u, KInodeExtentFlag}) {
+    auto bm =
+        std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, flags);
+    auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+
+    std::vector<u8> content(kBlockSize * 3 / 2, 'x');
+    fs.write_file(id, content).unwrap();
+    fs.resize(id, kBlockSize + 10).unwrap();
+    content.resize(kBlockSize + 10);
+    auto free_block_num = fs.get_free_blocks_num().unwrap();
+
+    // extending allocates nothing, and the new range reads as zeros
+    auto attr = fs.resize(id, KLargeFileMax).unwrap();
+    ASSERT_EQ(attr.size, KLargeFileMax);
+    ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num);
+    content.resize(KLargeFileMax, 0);
+    auto data = fs.read_file(id).unwrap();
+    ASSERT_TRUE(vec_equal(data, content));
+
+    // writing into a hole allocates only the blocks written
+    const char *msg = "hello";
+    auto offset = KLargeFileMax / 2;
+    fs.write_file_w_off(id, msg, 5, offset).unwrap();
+    std::copy(msg, msg + 5, content.begin() + offset);
+    ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num - 1);
+    std::vector<u8> buf(kBlockSize * 2);
+    auto read_sz =
+        fs.read_file_w_off(id, buf.data(), buf.size(), offset - kBlockSize)
+            .unwrap();
+    ASSERT_EQ(read_sz, buf.size());
+    ASSERT_TRUE(std::equal(buf.begin(), buf.end(),
+                           content.begin() + offset - kBlockSize));
+
+    // shrinking frees the blocks after the new end of file
+    fs.resize(id, kBlockSize).unwrap();
+    ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num + 1);
+    content.resize(kBlockSize);
+    data = fs.read_file(id).unwrap();
+    ASSERT_TRUE(vec_equal(data, content));
+  }
+}
+
+TEST(FileSystemTest, Preallocate) {
+  for (auto flags : {0u, KInodeExtentFlag}) {
+    auto bm =
+        std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+    auto fs = FileOperation(bm, kTestInodeNum, flags);
+    auto base_free_num = fs.get_free_blocks_num().unwrap();
+    auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+
+    std::vector<u8> content(kBlockSize * 3 / 2, 'x');
+    fs.write_file(id, content).unwrap();
+    auto free_block_num = fs.get_free_blocks_num().unwrap();
+
+    // preallocating after the end of file keeps the size
+    ASSERT_TRUE(fs.preallocate(id, kBlockSize * 10, kBlockSize * 20, true)
+                    .is_ok());
+    ASSERT_EQ(fs.getattr(id).unwrap().size, content.size());
+    // the indirect block may be allocated too
+    auto used = free_block_num - fs.get_free_blocks_num().unwrap();
+    ASSERT_GE(used, 20);
+    ASSERT_LE(used, 21);
+    free_block_num -= used;
+
+    // the preallocated blocks read as zeros
+    fs.resize(id, kBlockSize * 30).unwrap();
+    content.resize(kBlockSize * 30, 0);
+    ASSERT_EQ(fs.read_file(id).unwrap(), content);
+
+    // writing them allocates nothing
+    const char *msg = "hello";
+    for (u64 idx = 10; idx < 30; ++idx) {
+      auto offset = idx * kBlockSize + 3;
+      fs.write_file_w_off(id, msg, 5, offset).unwrap();
+      std::copy(msg, msg + 5, content.begin() + offset);
+    }
+    ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num);
+    ASSERT_EQ(fs.read_file(id).unwrap(), content);
+
+    // only the holes are allocated, and the file grows
+    ASSERT_TRUE(fs.preallocate(id, 0, kBlockSize * 40).is_ok());
+    ASSERT_EQ(fs.getattr(id).unwrap().size, kBlockSize * 40);
+    ASSERT_EQ(fs.get_free_blocks_num().unwrap(), free_block_num - 18);
+    content.resize(kBlockSize * 40, 0);
+    ASSERT_EQ(fs.read_file(id).unwrap(), content);
+
+    ASSERT_TRUE(fs.preallocate(id, 0, 0).is_err());
+    ASSERT_TRUE(fs.remove_file(id).is_ok());
+    ASSERT_EQ(fs.get_free_blocks_num().unwrap(), base_free_num);
+  }
+}
+
+TEST(FileSystemTest, PreallocateNoSpaceForExtent) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum, KInodeExtentFlag);
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto filler = fs.alloc_inode(InodeType::FILE).unwrap();
+
+  // fill the extent root in the inode with runs apart from each other
+  const u64 root_capacity =
+      (kBlockSize - sizeof(Inode) - sizeof(ExtentHeader)) / sizeof(Extent);
+  for (u64 idx = 0; idx < root_capacity * 2; idx += 2) {
+    ASSERT_TRUE(fs.preallocate(id, idx * kBlockSize, kBlockSize, true).is_ok());
+  }
+
+  // leave only one block, which the run takes, so the tree can't grow
+  auto free_num = fs.get_free_blocks_num().unwrap();
+  ASSERT_TRUE(
+      fs.preallocate(filler, 0, (free_num - 1) * kBlockSize, true).is_ok());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), 1);
+
+  // the run is given back when it can't be mapped
+  ASSERT_TRUE(
+      fs.preallocate(id, root_capacity * 2 * kBlockSize, kBlockSize, true)
+          .is_err());
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), 1);
+}
+
+} // namespace chfs
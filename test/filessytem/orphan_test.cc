@@ -0,0 +1,45 @@
+#include "./common.h"
+#include "filesystem/operations.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+TEST(FileSystemTest, OrphanList) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  ASSERT_EQ(fs.get_orphan_num().unwrap(), 0);
+  ASSERT_TRUE(fs.peek_orphans(10).unwrap().empty());
+
+  // enough blocks to span a few blocks of the list
+  std::vector<OrphanBlock> blocks;
+  for (u64 i = 0; i < 1000; ++i) {
+    blocks.push_back({i + 100, static_cast<mac_id_t>(i % 3 + 1)});
+  }
+  ASSERT_TRUE(fs.push_orphans(blocks).is_ok());
+  ASSERT_EQ(fs.get_orphan_num().unwrap(), 1000);
+
+  // the list survives a restart
+  auto fs2 = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_EQ(fs2->get_orphan_num().unwrap(), 1000);
+
+  // the blocks are taken from the end
+  usize left = 1000;
+  while (left > 0) {
+    auto batch = fs2->peek_orphans(256).unwrap();
+    ASSERT_EQ(batch.size(), std::min<usize>(left, 256));
+    for (usize i = 0; i < batch.size(); ++i) {
+      const auto &expected = blocks[left - batch.size() + i];
+      block_id_t block_id = batch[i].block_id;
+      mac_id_t mac_id = batch[i].mac_id;
+      ASSERT_EQ(block_id, expected.block_id);
+      ASSERT_EQ(mac_id, expected.mac_id);
+    }
+    ASSERT_TRUE(fs2->pop_orphans(batch.size()).is_ok());
+    left -= batch.size();
+    ASSERT_EQ(fs2->get_orphan_num().unwrap(), left);
+  }
+  ASSERT_TRUE(fs2->pop_orphans(1).is_err());
+}
+
+} // namespace chfs
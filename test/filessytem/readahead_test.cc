@@ -0,0 +1,78 @@
+#include "./common.h"
+#include "filesystem/operations.h"
+#include "filesystem/readahead.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+TEST(ReadaheadTest, SequentialStream) {
+  const u64 file_sz = kBlockSize * 1000;
+  auto ra = Readahead(kBlockSize);
+
+  // the first read starts a stream
+  auto [first, cnt] = ra.on_read(0, kBlockSize, file_sz);
+  ASSERT_EQ(first, 1);
+  ASSERT_EQ(cnt, KReadaheadInitBlocks);
+
+  // the prefetched range always covers the next block, and the window grows
+  u64 max_cnt = cnt;
+  u64 end = first + cnt;
+  for (u64 i = 1; i < 1000; ++i) {
+    auto [first, cnt] = ra.on_read(i * kBlockSize, kBlockSize, file_sz);
+    if (cnt != 0) {
+      ASSERT_EQ(first, end);
+      end = first + cnt;
+      max_cnt = std::max(max_cnt, cnt);
+    }
+    ASSERT_TRUE(i + 1 >= 1000 || i + 1 < end);
+  }
+  ASSERT_EQ(end, 1000);
+  ASSERT_EQ(max_cnt, KReadaheadMaxBlocks);
+
+  const auto &stats = ra.get_stats();
+  ASSERT_EQ(stats.reads, 1000);
+  ASSERT_EQ(stats.hits, 999);
+  ASSERT_EQ(stats.prefetched_blocks, 999);
+}
+
+TEST(ReadaheadTest, RandomAccess) {
+  const u64 file_sz = kBlockSize * 1000;
+  auto ra = Readahead(kBlockSize);
+
+  ra.on_read(0, kBlockSize, file_sz);
+  ra.on_read(kBlockSize, kBlockSize, file_sz);
+
+  // a random read stops the readahead
+  auto [first, cnt] = ra.on_read(kBlockSize * 500, 100, file_sz);
+  ASSERT_EQ(cnt, 0);
+  std::tie(first, cnt) = ra.on_read(kBlockSize * 20, 100, file_sz);
+  ASSERT_EQ(cnt, 0);
+  ASSERT_EQ(ra.get_stats().hits, 1);
+
+  // and a new stream starts with the initial window
+  std::tie(first, cnt) = ra.on_read(kBlockSize * 20 + 100, 100, file_sz);
+  ASSERT_EQ(first, 21);
+  ASSERT_EQ(cnt, KReadaheadInitBlocks);
+
+  // reading the last block prefetches nothing
+  ra.on_read(file_sz - kBlockSize, kBlockSize, file_sz);
+  std::tie(first, cnt) = ra.on_read(file_sz, kBlockSize, file_sz);
+  ASSERT_EQ(cnt, 0);
+}
+
+TEST(ReadaheadTest, PrefetchFile) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+
+  std::vector<u8> content(kBlockSize * 10, 'x');
+  fs.write_file(id, content).unwrap();
+  fs.resize(id, kBlockSize * 20).unwrap();
+
+  // the holes and the blocks after the end of file are skipped
+  ASSERT_TRUE(fs.prefetch(id, 0, 30).is_ok());
+  ASSERT_TRUE(bm->prefetch(kBlockNum - 1, 2).is_err());
+}
+
+} // namespace chfs
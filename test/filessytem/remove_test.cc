@@ -60,4 +60,39 @@ TEST(FileSystemTest, Remove) {
   ASSERT_EQ(free_block_cnt_after_2, free_block_cnt);
 }
 
+TEST(FileSystemTest, UsageCounters) {
+  std::mt19937 rng(get_test_seed());
+  std::uniform_int_distribution<usize> uni_sz(0, KLargeFileMax);
+  std::vector<inode_id_t> id_list;
+
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum, KInodeExtentFlag);
+
+  for (usize i = 0; i < kFileNum; i++) {
+    auto res = fs.alloc_inode(InodeType::FILE);
+    ASSERT_TRUE(res.is_ok());
+    id_list.push_back(res.unwrap());
+
+    std::vector<u8> content(uni_sz(rng), 'a');
+    ASSERT_TRUE(fs.write_file(res.unwrap(), content).is_ok());
+  }
+  for (usize i = 0; i < id_list.size(); i += 3) {
+    ASSERT_TRUE(fs.remove_file(id_list[i]).is_ok());
+  }
+
+  // The maintained counters should match a full scan of the bitmaps
+  auto im = InodeManager::create_from_block_manager(bm,
+                                                    fs.get_total_inode_num())
+                .unwrap();
+  auto allocator = BlockAllocator(bm, im.get_reserved_blocks(), false);
+  ASSERT_EQ(fs.get_free_blocks_num().unwrap(), allocator.free_block_cnt());
+  ASSERT_EQ(fs.get_free_inode_num().unwrap(), im.free_inode_cnt().unwrap());
+
+  // ... and they are persisted in the super block
+  auto fs2 = FileOperation::create_from_raw(bm).unwrap();
+  ASSERT_EQ(fs2->get_free_blocks_num().unwrap(), allocator.free_block_cnt());
+  ASSERT_EQ(fs2->get_free_inode_num().unwrap(), im.free_inode_cnt().unwrap());
+}
+
 } // namespace chfs
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include <random>
+
+#include "./common.h"
+#include "filesystem/write_buffer.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+TEST(WriteBufferTest, Coalesce) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto wb = WriteBuffer(&fs);
+
+  std::vector<u8> a(100, 'a'), b(100, 'b'), c(50, 'c');
+  wb.write(id, a.data(), a.size(), 0).unwrap();
+  // adjacent
+  wb.write(id, b.data(), b.size(), 100).unwrap();
+  ASSERT_EQ(wb.buffered_bytes(id), 200);
+  // overlapping both
+  wb.write(id, c.data(), c.size(), 75).unwrap();
+  ASSERT_EQ(wb.buffered_bytes(id), 200);
+  // apart
+  wb.write(id, c.data(), c.size(), 1000).unwrap();
+  ASSERT_EQ(wb.buffered_bytes(id), 250);
+  ASSERT_EQ(wb.buffered_end(id), 1050);
+
+  // nothing reaches the filesystem before the flush
+  ASSERT_EQ(fs.getattr(id).unwrap().size, 0);
+  wb.flush(id).unwrap();
+  ASSERT_EQ(wb.buffered_end(id), 0);
+
+  std::vector<u8> expected(1050, 0);
+  std::fill(expected.begin(), expected.begin() + 100, 'a');
+  std::fill(expected.begin() + 100, expected.begin() + 200, 'b');
+  std::fill(expected.begin() + 75, expected.begin() + 125, 'c');
+  std::fill(expected.begin() + 1000, expected.end(), 'c');
+  ASSERT_EQ(fs.read_file(id).unwrap(), expected);
+}
+
+TEST(WriteBufferTest, RandomWrites) {
+  std::mt19937 rng(get_test_seed());
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto id = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto wb = WriteBuffer(&fs);
+
+  std::vector<u8> content;
+  std::uniform_int_distribution<u64> uni_off(0, KLargeFileMax);
+  std::uniform_int_distribution<u64> uni_sz(1, kBlockSize * 2);
+  std::uniform_int_distribution<u8> uni_char(0, 26);
+  for (uint i = 0; i < 200; ++i) {
+    auto offset = uni_off(rng);
+    std::vector<u8> data(uni_sz(rng));
+    for (auto &ch : data) {
+      ch = uni_char(rng) + 97;
+    }
+    ASSERT_EQ(wb.write(id, data.data(), data.size(), offset).unwrap(),
+              data.size());
+
+    if (offset + data.size() > content.size()) {
+      content.resize(offset + data.size(), 0);
+    }
+    std::copy(data.begin(), data.end(), content.begin() + offset);
+
+    // flush now and then
+    if (i % 50 == 49) {
+      wb.flush(id).unwrap();
+      ASSERT_EQ(fs.read_file(id).unwrap(), content);
+    }
+  }
+  ASSERT_TRUE(wb.flush_all().is_ok());
+  ASSERT_EQ(fs.read_file(id).unwrap(), content);
+}
+
+TEST(WriteBufferTest, DeferredError) {
+  auto bm =
+      std::shared_ptr<BlockManager>(new BlockManager(kBlockNum, kBlockSize));
+  auto fs = FileOperation(bm, kTestInodeNum);
+  auto big = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto other = fs.alloc_inode(InodeType::FILE).unwrap();
+  auto wb = WriteBuffer(&fs);
+
+  // the write-back exceeds the size limit of the file, but the write that
+  // triggers it is buffered already
+  std::vector<u8> data(KWriteBackMaxBytes, 'a');
+  ASSERT_EQ(wb.write(big, data.data(), data.size(), 0).unwrap(), data.size());
+  ASSERT_EQ(wb.buffered_bytes(big), 0);
+
+  // the error belongs to the file only, and is reported once
+  ASSERT_TRUE(wb.write(other, data.data(), 100, 0).is_ok());
+  ASSERT_TRUE(wb.flush(other).is_ok());
+  ASSERT_TRUE(wb.flush(big).is_err());
+  ASSERT_TRUE(wb.flush(big).is_ok());
+}
+
+} // namespace chfs
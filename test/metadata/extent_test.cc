@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <map>
+#include <random>
+
+#include "common/macros.h"
+#include "metadata/extent.h"
+#include "metadata/inode.h"
+#include "gtest/gtest.h"
+
+namespace chfs {
+
+const usize kExtentTestBlockSz = 512;
+const usize kExtentTestBlockCnt = 16384;
+
+class ExtentTreeTest : public ::testing::Test {
+protected:
+  std::shared_ptr<BlockManager> bm;
+  std::shared_ptr<BlockAllocator> allocator;
+  std::vector<u8> inode_block;
+  Inode *inode_p;
+
+  // This function is called before every test.
+  void SetUp() override {
+    bm = std::shared_ptr<BlockManager>(
+        new BlockManager(kExtentTestBlockCnt, kExtentTestBlockSz));
+    allocator = std::make_shared<BlockAllocator>(bm, 1);
+    inode_block.resize(kExtentTestBlockSz);
+    Inode(InodeType::FILE, kExtentTestBlockSz, KInodeExtentFlag)
+        .flush_to_buffer(inode_block.data());
+    inode_p = reinterpret_cast<Inode *>(inode_block.data());
+  }
+
+  auto tree() -> ExtentTree {
+    return ExtentTree(bm, allocator, reinterpret_cast<u8 *>(inode_p->blocks),
+                      inode_p->get_nblocks() * sizeof(block_id_t));
+  }
+
+  // This function is called after every test.
+  void TearDown() override{};
+};
+
+// Expected mapping: logical block -> physical block
+auto check_mapping(ExtentTree tree, std::map<u64, block_id_t> &expected,
+                   u64 max_logical) -> void {
+  for (u64 i = 0; i < max_logical; ++i) {
+    auto ext = tree.lookup(i).unwrap();
+    block_id_t physical = ext.physical;
+    auto iter = expected.find(i);
+    if (iter == expected.end()) {
+      ASSERT_EQ(physical, KInvalidBlockID) << "logical " << i;
+    } else {
+      ASSERT_EQ(physical + (i - ext.logical), iter->second)
+          << "logical " << i;
+    }
+  }
+}
+
+TEST_F(ExtentTreeTest, Init) {
+  ASSERT_TRUE(inode_p->is_extent_mapped());
+  ASSERT_EQ(inode_p->max_file_sz_supported(),
+            KMaxExtentFileBlocks * kExtentTestBlockSz);
+  ASSERT_EQ(tree().depth(), 0);
+  block_id_t physical = tree().lookup(0).unwrap().physical;
+  ASSERT_EQ(physical, KInvalidBlockID);
+}
+
+TEST_F(ExtentTreeTest, ContiguousMerge) {
+  auto t = tree();
+  for (u64 i = 0; i < 100000; ++i) {
+    t.insert({i, 1000 + i, 1, 0}).unwrap();
+  }
+
+  std::vector<Extent> extents;
+  t.collect(extents).unwrap();
+  ASSERT_EQ(extents.size(), 1);
+  u32 len = extents[0].len;
+  ASSERT_EQ(len, 100000);
+  ASSERT_EQ(t.depth(), 0);
+  block_id_t physical = t.lookup(99999).unwrap().physical;
+  ASSERT_EQ(physical, 1000);
+}
+
+TEST_F(ExtentTreeTest, InsertLookupRemove) {
+  std::mt19937 rng(0xdeadbeaf);
+  std::map<u64, block_id_t> expected;
+  const u64 n = 3000;
+  const auto free_cnt = allocator->free_block_cnt();
+
+  // Non-contiguous extents, so the tree must grow
+  std::vector<u64> order(n);
+  for (u64 i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), rng);
+
+  auto t = tree();
+  for (auto i : order) {
+    t.insert({i * 3, 1000000 + i * 7, 2, 0}).unwrap();
+    expected[i * 3] = 1000000 + i * 7;
+    expected[i * 3 + 1] = 1000000 + i * 7 + 1;
+  }
+  ASSERT_GE(t.depth(), 2);
+  check_mapping(t, expected, n * 3 + 10);
+
+  std::vector<Extent> extents;
+  t.collect(extents).unwrap();
+  ASSERT_EQ(extents.size(), n);
+  for (usize i = 1; i < extents.size(); ++i) {
+    ASSERT_LT(extents[i - 1].end(), extents[i].logical + 1);
+  }
+
+  // Punch random holes, which trims and splits extents
+  std::uniform_int_distribution<u64> uni(0, n * 3);
+  for (int round = 0; round < 200; ++round) {
+    auto start = uni(rng);
+    auto len = uni(rng) % 20 + 1;
+    std::vector<Extent> removed;
+    t.remove(start, len, removed).unwrap();
+
+    u64 removed_cnt = 0;
+    for (auto &ext : removed) {
+      removed_cnt += ext.len;
+    }
+    u64 expected_cnt = 0;
+    for (auto i = start; i < start + len; ++i) {
+      expected_cnt += expected.erase(i);
+    }
+    ASSERT_EQ(removed_cnt, expected_cnt);
+  }
+  check_mapping(t, expected, n * 3 + 10);
+
+  // Re-insert into the holes
+  for (u64 i = 0; i < n * 3; ++i) {
+    if (expected.find(i) == expected.end()) {
+      t.insert({i, 5000000 + i, 1, 0}).unwrap();
+      expected[i] = 5000000 + i;
+    }
+  }
+  check_mapping(t, expected, n * 3 + 10);
+
+  // Truncate everything, the tree blocks should be released
+  std::vector<Extent> removed;
+  block_id_t physical;
+  t.remove(0, std::numeric_limits<u64>::max(), removed).unwrap();
+  ASSERT_EQ(t.depth(), 0);
+  physical = t.lookup(0).unwrap().physical;
+  ASSERT_EQ(physical, KInvalidBlockID);
+  ASSERT_EQ(allocator->free_block_cnt(), free_cnt);
+}
+
+} // namespace chfs
@@ -69,4 +69,39 @@ TEST_F(InodeManagerTest, Allocation) {
   }
 }
 
+TEST_F(InodeManagerTest, LazyInit) {
+  // the device is full of garbage
+  std::vector<u8> garbage(test_block_sz, 0xab);
+  for (usize i = 0; i < test_block_cnt; i++) {
+    bm->write_block(i, garbage.data());
+  }
+
+  auto flags = SuperBlock::inode_group_flags(bm, 0);
+  auto inode_num = test_block_sz * KBitsPerByte * 2;
+  auto inode_manager1 = InodeManager(bm, inode_num, flags);
+  ASSERT_EQ(inode_manager1.free_inode_cnt().unwrap(), inode_num);
+  ASSERT_EQ(inode_manager1.get(1).unwrap(), KInvalidBlockID);
+  ASSERT_TRUE(inode_manager1.free_inode(1).is_err());
+
+  auto allocator = BlockAllocator(bm, inode_manager1.get_reserved_blocks(),
+                                  true, SuperBlock::block_group_flags(bm, 0));
+  auto bid = allocator.allocate().unwrap();
+  ASSERT_EQ(inode_manager1.allocate_inode(InodeType::FILE, bid).unwrap(), 1);
+  ASSERT_TRUE(flags->is_initialized(0));
+  ASSERT_FALSE(flags->is_initialized(1));
+
+  // the rest of the group has been zeroed
+  ASSERT_EQ(inode_manager1.get(1).unwrap(), bid);
+  ASSERT_EQ(inode_manager1.get(2).unwrap(), KInvalidBlockID);
+
+  auto inode_manager2 =
+      InodeManager::create_from_block_manager(
+          bm, inode_num, SuperBlock::inode_group_flags(bm, 0))
+          .unwrap();
+  ASSERT_EQ(inode_manager2.free_inode_cnt().unwrap(), inode_num - 1);
+  ASSERT_EQ(inode_manager2.get(1).unwrap(), bid);
+  ASSERT_EQ(inode_manager2.get(test_block_sz * KBitsPerByte + 1).unwrap(),
+            KInvalidBlockID);
+}
+
 } // namespace chfs
\ No newline at end of file
@@ -45,6 +45,29 @@ TEST_F(InodeTest, Init) {
             file_sz_supported_by_one_block + file_in_inode);
 }
 
+// An inode written before the extents keeps its meaning
+TEST_F(InodeTest, LegacyLayout) {
+  u32 type = static_cast<u32>(InodeType::FILE);
+  u32 block_size = TEST_BLOCK_SZ;
+  u32 nblocks = (TEST_BLOCK_SZ - 44) / sizeof(block_id_t);
+  block_id_t first_block = 42;
+  memcpy(test_inode_block, &type, sizeof(type));
+  memcpy(test_inode_block + 36, &block_size, sizeof(block_size));
+  memcpy(test_inode_block + 40, &nblocks, sizeof(nblocks));
+  memcpy(test_inode_block + 44, &first_block, sizeof(first_block));
+
+  auto inode_p = reinterpret_cast<Inode *>(test_inode_block);
+  ASSERT_EQ(inode_p->get_type(), InodeType::FILE);
+  ASSERT_EQ(inode_p->get_nblocks(), nblocks);
+  ASSERT_FALSE(inode_p->is_extent_mapped());
+  ASSERT_EQ(inode_p->blocks[0], first_block);
+
+  // the flags of a new inode don't move the blocks
+  auto inode = Inode(InodeType::FILE, TEST_BLOCK_SZ, KInodeExtentFlag);
+  ASSERT_EQ(inode.get_nblocks(), nblocks);
+  ASSERT_TRUE(inode.is_extent_mapped());
+}
+
 TEST_F(InodeTest, Iteration) {
   auto inode_p = reinterpret_cast<Inode *>(test_inode_block);
 